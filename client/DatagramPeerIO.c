@@ -35,6 +35,9 @@
 #define DATAGRAMPEERIO_MODE_CONNECT 1
 #define DATAGRAMPEERIO_MODE_BIND 2
 
+#define DATAGRAMPEERIO_RECV_BATCH_SIZE 65536
+#define DATAGRAMPEERIO_RECV_BATCH_PACKETS 32
+
 #define PeerLog(_o, ...) BLog_LogViaFunc((_o)->logfunc, (_o)->user, BLOG_CURRENT_CHANNEL, __VA_ARGS__)
 
 static void init_io (DatagramPeerIO *o);
@@ -46,7 +49,7 @@ static void recv_decoder_notifier_handler (DatagramPeerIO *o, uint8_t *data, int
 void init_io (DatagramPeerIO *o)
 {
     // init dgram recv interface
-    BDatagram_RecvAsync_Init(&o->dgram, o->effective_socket_mtu);
+    BDatagram_RecvAsync_InitBatch(&o->dgram, o->effective_socket_mtu, DATAGRAMPEERIO_RECV_BATCH_SIZE, DATAGRAMPEERIO_RECV_BATCH_PACKETS);
     
     // connect source
     PacketRecvConnector_ConnectInput(&o->recv_connector, BDatagram_RecvAsync_GetIf(&o->dgram));
@@ -367,13 +370,17 @@ fail0:
 void DatagramPeerIO_SetEncryptionKey (DatagramPeerIO *o, uint8_t *encryption_key)
 {
     ASSERT(SPPROTO_HAVE_ENCRYPTION(o->sp_params))
+    ASSERT(o->mode == DATAGRAMPEERIO_MODE_CONNECT || o->mode == DATAGRAMPEERIO_MODE_BIND)
     DebugObject_Access(&o->d_obj);
     
+    // both ends use the same key; tell their packets apart by which end bound
+    int direction = (o->mode == DATAGRAMPEERIO_MODE_BIND);
+    
     // set sending key
-    SPProtoEncoder_SetEncryptionKey(&o->send_encoder, encryption_key);
+    SPProtoEncoder_SetEncryptionKey(&o->send_encoder, encryption_key, direction);
     
     // set receiving key
-    SPProtoDecoder_SetEncryptionKey(&o->recv_decoder, encryption_key);
+    SPProtoDecoder_SetEncryptionKey(&o->recv_decoder, encryption_key, direction);
 }
 
 void DatagramPeerIO_RemoveEncryptionKey (DatagramPeerIO *o)
@@ -216,6 +216,7 @@ int DatagramPeerIO_Bind (DatagramPeerIO *o, BAddr addr) WARN_UNUSED;
 /**
  * Sets the encryption key to use for sending and receiving.
  * Encryption must be enabled.
+ * The object must be in connecting or binding mode.
  *
  * @param o the object
  * @param encryption_key key to use
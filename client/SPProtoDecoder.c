@@ -31,6 +31,8 @@
 
 #include <misc/balign.h>
 #include <misc/byteorder.h>
+#include <misc/minmax.h>
+#include <misc/balloc.h>
 #include <security/BHash.h>
 
 #include "SPProtoDecoder.h"
@@ -39,15 +41,36 @@
 
 #define PeerLog(_o, ...) BLog_LogViaFunc((_o)->logfunc, (_o)->user, BLOG_CURRENT_CHANNEL, __VA_ARGS__)
 
-static void decode_work_func (SPProtoDecoder *o)
+static void maybe_output (SPProtoDecoder *o);
+
+static struct SPProtoDecoder_work * get_work (SPProtoDecoder *o, int i)
+{
+    ASSERT(i >= 0)
+    ASSERT(i < o->num_works)
+    
+    return &o->works[(o->works_first + i) % o->num_works];
+}
+
+static void free_encryptors (SPProtoDecoder *o)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->in_len <= o->input_mtu)
+    ASSERT(SPPROTO_HAVE_ENCRYPTION(o->sp_params))
+    ASSERT(o->have_encryption_key)
     
-    uint8_t *in = o->in;
-    int in_len = o->in_len;
+    for (int i = 0; i < o->num_works; i++) {
+        BEncryption_Free(&o->works[i].encryptor);
+    }
+}
+
+static void decode_work_func (struct SPProtoDecoder_work *w)
+{
+    SPProtoDecoder *o = w->o;
+    ASSERT(w->in_len >= 0)
+    ASSERT(w->in_len <= o->input_mtu)
     
-    o->tw_out_len = -1;
+    uint8_t *in = w->in;
+    int in_len = w->in_len;
+    
+    w->out_len = -1;
     
     uint8_t *plaintext;
     int plaintext_len;
@@ -56,6 +79,37 @@ static void decode_work_func (SPProtoDecoder *o)
     if (!SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
         plaintext = in;
         plaintext_len = in_len;
+    } else if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+        // input must have a nonce and a tag
+        if (in_len < SPPROTO_AEAD_OVERHEAD) {
+            PeerLog(o, BLOG_WARNING, "packet too short for nonce and tag");
+            return;
+        }
+        
+        // check if we have encryption key
+        if (!o->have_encryption_key) {
+            PeerLog(o, BLOG_WARNING, "have no encryption key");
+            return;
+        }
+        
+        // drop packets sent in our own direction
+        uint8_t *nonce = in;
+        struct spproto_aead_nonce nonce_data;
+        memcpy(&nonce_data, nonce, sizeof(nonce_data));
+        if (ltoh32(nonce_data.direction) == o->direction) {
+            PeerLog(o, BLOG_WARNING, "packet has our own direction");
+            return;
+        }
+        
+        // decrypt and verify
+        uint8_t *ciphertext = in + BENCRYPTION_AEAD_NONCE_SIZE;
+        int ciphertext_len = in_len - SPPROTO_AEAD_OVERHEAD;
+        plaintext = w->buf;
+        if (!BEncryption_AeadDecrypt(&w->encryptor, nonce, ciphertext, plaintext, ciphertext_len, ciphertext + ciphertext_len)) {
+            PeerLog(o, BLOG_WARNING, "packet has wrong authentication tag");
+            return;
+        }
+        plaintext_len = ciphertext_len;
     } else {
         // input must be a multiple of blocks size
         if (in_len % o->enc_block_size != 0) {
@@ -82,8 +136,8 @@ static void decode_work_func (SPProtoDecoder *o)
         // decrypt
         uint8_t *ciphertext = in + o->enc_block_size;
         int ciphertext_len = in_len - o->enc_block_size;
-        plaintext = o->buf;
-        BEncryption_Decrypt(&o->encryptor, ciphertext, plaintext, ciphertext_len, iv);
+        plaintext = w->buf;
+        BEncryption_Decrypt(&w->encryptor, ciphertext, plaintext, ciphertext_len, iv);
         
         // read padding
         if (ciphertext_len < o->enc_block_size) {
@@ -125,8 +179,8 @@ static void decode_work_func (SPProtoDecoder *o)
         // remember seed and OTP (can't check from here)
         struct spproto_otpdata header_otpd;
         memcpy(&header_otpd, header + SPPROTO_HEADER_OTPDATA_OFF(o->sp_params), sizeof(header_otpd));
-        o->tw_out_seed_id = ltoh16(header_otpd.seed_id);
-        o->tw_out_otp = header_otpd.otp;
+        w->out_seed_id = ltoh16(header_otpd.seed_id);
+        w->out_otp = header_otpd.otp;
     }
     
     // check hash
@@ -150,35 +204,75 @@ static void decode_work_func (SPProtoDecoder *o)
     }
     
     // return packet
-    o->tw_out = plaintext + SPPROTO_HEADER_LEN(o->sp_params);
-    o->tw_out_len = plaintext_len - SPPROTO_HEADER_LEN(o->sp_params);
+    w->out = plaintext + SPPROTO_HEADER_LEN(o->sp_params);
+    w->out_len = plaintext_len - SPPROTO_HEADER_LEN(o->sp_params);
 }
 
-static void decode_work_handler (SPProtoDecoder *o)
+static void decode_work_handler (struct SPProtoDecoder_work *w)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->tw_have)
+    SPProtoDecoder *o = w->o;
+    ASSERT(w->in_len >= 0)
+    ASSERT(w->tw_have)
+    ASSERT(!w->finished)
     DebugObject_Access(&o->d_obj);
     
     // free work
-    BThreadWork_Free(&o->tw);
-    o->tw_have = 0;
+    BThreadWork_Free(&w->tw);
+    w->tw_have = 0;
     
-    // check OTP
-    if (SPPROTO_HAVE_OTP(o->sp_params) && o->tw_out_len >= 0) {
-        if (!OTPChecker_CheckOTP(&o->otpchecker, o->tw_out_seed_id, o->tw_out_otp)) {
-            PeerLog(o, BLOG_WARNING, "packet has wrong OTP");
-            o->tw_out_len = -1;
-        }
-    }
+    // set finished
+    w->finished = 1;
     
-    if (o->tw_out_len < 0) {
-        // cannot decode, finish input packet
+    // output packet if it's next
+    maybe_output(o);
+}
+
+static void release_first_work (SPProtoDecoder *o)
+{
+    ASSERT(o->works_used > 0)
+    ASSERT(!o->out_busy)
+    
+    struct SPProtoDecoder_work *w = get_work(o, 0);
+    ASSERT(w->finished)
+    
+    // release work
+    w->in_len = -1;
+    w->finished = 0;
+    o->works_first = (o->works_first + 1) % o->num_works;
+    o->works_used--;
+    
+    // accept the input packet we were holding back
+    if (o->in_blocked) {
         PacketPassInterface_Done(&o->input);
-        o->in_len = -1;
-    } else {
+        o->in_blocked = 0;
+    }
+}
+
+static void maybe_output (SPProtoDecoder *o)
+{
+    while (!o->out_busy && o->works_used > 0) {
+        struct SPProtoDecoder_work *w = get_work(o, 0);
+        if (!w->finished) {
+            return;
+        }
+        
+        // check OTP
+        if (SPPROTO_HAVE_OTP(o->sp_params) && w->out_len >= 0) {
+            if (!OTPChecker_CheckOTP(&o->otpchecker, w->out_seed_id, w->out_otp)) {
+                PeerLog(o, BLOG_WARNING, "packet has wrong OTP");
+                w->out_len = -1;
+            }
+        }
+        
+        if (w->out_len < 0) {
+            // cannot decode, drop packet
+            release_first_work(o);
+            continue;
+        }
+        
         // submit decoded packet to output
-        PacketPassInterface_Sender_Send(o->output, o->tw_out, o->tw_out_len);
+        PacketPassInterface_Sender_Send(o->output, w->out, w->out_len);
+        o->out_busy = 1;
     }
 }
 
@@ -186,43 +280,66 @@ static void input_handler_send (SPProtoDecoder *o, uint8_t *data, int data_len)
 {
     ASSERT(data_len >= 0)
     ASSERT(data_len <= o->input_mtu)
-    ASSERT(o->in_len == -1)
-    ASSERT(!o->tw_have)
+    ASSERT(!o->in_blocked)
+    ASSERT(o->works_used < o->num_works)
     DebugObject_Access(&o->d_obj);
     
-    // remember input
-    o->in = data;
-    o->in_len = data_len;
+    struct SPProtoDecoder_work *w = get_work(o, o->works_used);
+    ASSERT(w->in_len == -1)
+    ASSERT(!w->tw_have)
+    ASSERT(!w->finished)
+    
+    // remember input; with a single work it's decoded in place, otherwise it's
+    // copied so that the next packet can be accepted while this one is decoded
+    if (o->num_works > 1) {
+        memcpy(w->own_in, data, data_len);
+        w->in = w->own_in;
+    } else {
+        w->in = data;
+    }
+    w->in_len = data_len;
+    o->works_used++;
     
     // start decoding
-    BThreadWork_Init(&o->tw, o->twd, (BThreadWork_handler_done)decode_work_handler, o, (BThreadWork_work_func)decode_work_func, o);
-    o->tw_have = 1;
+    BThreadWork_Init(&w->tw, o->twd, (BThreadWork_handler_done)decode_work_handler, w, (BThreadWork_work_func)decode_work_func, w);
+    w->tw_have = 1;
+    
+    // accept the next packet if there is room for it
+    if (o->works_used < o->num_works) {
+        PacketPassInterface_Done(&o->input);
+    } else {
+        o->in_blocked = 1;
+    }
 }
 
 static void output_handler_done (SPProtoDecoder *o)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(!o->tw_have)
+    ASSERT(o->out_busy)
     DebugObject_Access(&o->d_obj);
     
-    // finish input packet
-    PacketPassInterface_Done(&o->input);
-    o->in_len = -1;
+    // release the output packet
+    o->out_busy = 0;
+    release_first_work(o);
+    
+    // output the next packet if it's ready
+    maybe_output(o);
 }
 
 static void maybe_stop_work_and_ignore (SPProtoDecoder *o)
 {
-    ASSERT(!(o->tw_have) || o->in_len >= 0)
-    
-    if (o->tw_have) {
-        // free work
-        BThreadWork_Free(&o->tw);
-        o->tw_have = 0;
-        
-        // ignore packet, receive next one
-        PacketPassInterface_Done(&o->input);
-        o->in_len = -1;
+    // stop existing works, ignoring their packets
+    for (int i = 0; i < o->works_used; i++) {
+        struct SPProtoDecoder_work *w = get_work(o, i);
+        if (w->tw_have) {
+            BThreadWork_Free(&w->tw);
+            w->tw_have = 0;
+            w->finished = 1;
+            w->out_len = -1;
+        }
     }
+    
+    // drop ignored packets, receive next ones
+    maybe_output(o);
 }
 
 int SPProtoDecoder_Init (SPProtoDecoder *o, PacketPassInterface *output, struct spproto_security_params sp_params, int num_otp_seeds, BPendingGroup *pg, BThreadWorkDispatcher *twd, void *user, BLog_logfunc logfunc)
@@ -258,13 +375,42 @@ int SPProtoDecoder_Init (SPProtoDecoder *o, PacketPassInterface *output, struct
     // calculate input MTU
     o->input_mtu = spproto_carrier_mtu_for_payload_mtu(o->sp_params, o->output_mtu);
     
-    // allocate plaintext buffer
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
-        int buf_size = balign_up((SPPROTO_HEADER_LEN(o->sp_params) + o->output_mtu + 1), o->enc_block_size);
-        if (!(o->buf = (uint8_t *)malloc(buf_size))) {
-            goto fail0;
+    // decode one packet per thread, plus one being received or output
+    o->num_works = 1;
+    if (BThreadWorkDispatcher_UsingThreads(o->twd)) {
+        o->num_works = bmin_int(BThreadWorkDispatcher_NumThreads(o->twd) + 1, SPPROTODECODER_MAX_WORKS);
+    }
+    
+    // allocate works
+    if (!(o->works = (struct SPProtoDecoder_work *)BAllocArray(o->num_works, sizeof(o->works[0])))) {
+        goto fail0;
+    }
+    
+    // calculate work buffer sizes
+    int in_size = (o->num_works > 1 ? o->input_mtu : 0);
+    int plaintext_size = (SPPROTO_HAVE_ENCRYPTION(o->sp_params) ? balign_up((SPPROTO_HEADER_LEN(o->sp_params) + o->output_mtu + 1), o->enc_block_size) : 0);
+    int work_buf_size = in_size + plaintext_size;
+    
+    // allocate work buffers
+    o->works_buf = NULL;
+    if (work_buf_size > 0 && !(o->works_buf = (uint8_t *)BAllocArray(o->num_works, work_buf_size))) {
+        goto fail0a;
+    }
+    
+    // init works
+    for (int i = 0; i < o->num_works; i++) {
+        struct SPProtoDecoder_work *w = &o->works[i];
+        w->o = o;
+        if (o->works_buf) {
+            w->own_in = o->works_buf + (size_t)i * work_buf_size;
+            w->buf = w->own_in + in_size;
         }
+        w->in_len = -1;
+        w->tw_have = 0;
+        w->finished = 0;
     }
+    o->works_first = 0;
+    o->works_used = 0;
     
     // init input
     PacketPassInterface_Init(&o->input, o->input_mtu, (PacketPassInterface_handler_send)input_handler_send, o, pg);
@@ -281,11 +427,11 @@ int SPProtoDecoder_Init (SPProtoDecoder *o, PacketPassInterface *output, struct
         o->have_encryption_key = 0;
     }
     
-    // have no input packet
-    o->in_len = -1;
+    // not holding back an input packet
+    o->in_blocked = 0;
     
-    // have no work
-    o->tw_have = 0;
+    // output not busy
+    o->out_busy = 0;
     
     DebugObject_Init(&o->d_obj);
     
@@ -293,9 +439,9 @@ int SPProtoDecoder_Init (SPProtoDecoder *o, PacketPassInterface *output, struct
     
 fail1:
     PacketPassInterface_Free(&o->input);
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
-        free(o->buf);
-    }
+    BFree(o->works_buf);
+fail0a:
+    BFree(o->works);
 fail0:
     return 0;
 }
@@ -304,14 +450,16 @@ void SPProtoDecoder_Free (SPProtoDecoder *o)
 {
     DebugObject_Free(&o->d_obj);
     
-    // free work
-    if (o->tw_have) {
-        BThreadWork_Free(&o->tw);
+    // free works
+    for (int i = 0; i < o->num_works; i++) {
+        if (o->works[i].tw_have) {
+            BThreadWork_Free(&o->works[i].tw);
+        }
     }
     
-    // free encryptor
+    // free encryptors
     if (SPPROTO_HAVE_ENCRYPTION(o->sp_params) && o->have_encryption_key) {
-        BEncryption_Free(&o->encryptor);
+        free_encryptors(o);
     }
     
     // free OTP checker
@@ -322,10 +470,9 @@ void SPProtoDecoder_Free (SPProtoDecoder *o)
     // free input
     PacketPassInterface_Free(&o->input);
     
-    // free plaintext buffer
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
-        free(o->buf);
-    }
+    // free work buffers
+    BFree(o->works_buf);
+    BFree(o->works);
 }
 
 PacketPassInterface * SPProtoDecoder_GetInput (SPProtoDecoder *o)
@@ -335,24 +482,28 @@ PacketPassInterface * SPProtoDecoder_GetInput (SPProtoDecoder *o)
     return &o->input;
 }
 
-void SPProtoDecoder_SetEncryptionKey (SPProtoDecoder *o, uint8_t *encryption_key)
+void SPProtoDecoder_SetEncryptionKey (SPProtoDecoder *o, uint8_t *encryption_key, int direction)
 {
     ASSERT(SPPROTO_HAVE_ENCRYPTION(o->sp_params))
+    ASSERT(direction == 0 || direction == 1)
     DebugObject_Access(&o->d_obj);
     
     // stop existing work
     maybe_stop_work_and_ignore(o);
     
-    // free encryptor
+    // free encryptors
     if (o->have_encryption_key) {
-        BEncryption_Free(&o->encryptor);
+        free_encryptors(o);
     }
     
-    // init encryptor
-    BEncryption_Init(&o->encryptor, BENCRYPTION_MODE_DECRYPT, o->sp_params.encryption_mode, encryption_key);
+    // init encryptors, one per work so that works can decrypt in parallel
+    for (int i = 0; i < o->num_works; i++) {
+        BEncryption_Init(&o->works[i].encryptor, BENCRYPTION_MODE_DECRYPT, o->sp_params.encryption_mode, encryption_key);
+    }
     
     // have encryption key
     o->have_encryption_key = 1;
+    o->direction = direction;
 }
 
 void SPProtoDecoder_RemoveEncryptionKey (SPProtoDecoder *o)
@@ -364,8 +515,8 @@ void SPProtoDecoder_RemoveEncryptionKey (SPProtoDecoder *o)
     maybe_stop_work_and_ignore(o);
     
     if (o->have_encryption_key) {
-        // free encryptor
-        BEncryption_Free(&o->encryptor);
+        // free encryptors
+        free_encryptors(o);
         
         // have no encryption key
         o->have_encryption_key = 0;
@@ -43,6 +43,10 @@
 #include <security/BEncryption.h>
 #include <security/OTPChecker.h>
 #include <flow/PacketPassInterface.h>
+#include <threadwork/BThreadWork.h>
+
+// maximum number of packets being decoded at once
+#define SPPROTODECODER_MAX_WORKS 16
 
 /**
  * Handler called when OTP generation for a new seed is finished.
@@ -51,12 +55,32 @@
  */
 typedef void (*SPProtoDecoder_otp_handler) (void *user);
 
+struct SPProtoDecoder_s;
+
+struct SPProtoDecoder_work {
+    struct SPProtoDecoder_s *o;
+    uint8_t *own_in;
+    uint8_t *buf;
+    uint8_t *in;
+    int in_len;
+    int tw_have;
+    int finished;
+    BThreadWork tw;
+    BEncryption encryptor;
+    uint16_t out_seed_id;
+    otp_t out_otp;
+    uint8_t *out;
+    int out_len;
+};
+
 /**
  * Object which decodes packets according to SPProto.
+ * If the thread work dispatcher uses threads, several packets are decoded
+ * in parallel, and are output in the order they were received.
  * Input is with {@link PacketPassInterface}.
  * Output is with {@link PacketPassInterface}.
  */
-typedef struct {
+typedef struct SPProtoDecoder_s {
     PacketPassInterface *output;
     struct spproto_security_params sp_params;
     BThreadWorkDispatcher *twd;
@@ -67,19 +91,17 @@ typedef struct {
     int enc_block_size;
     int enc_key_size;
     int input_mtu;
-    uint8_t *buf;
     PacketPassInterface input;
     OTPChecker otpchecker;
     int have_encryption_key;
-    BEncryption encryptor;
-    uint8_t *in;
-    int in_len;
-    int tw_have;
-    BThreadWork tw;
-    uint16_t tw_out_seed_id;
-    otp_t tw_out_otp;
-    uint8_t *tw_out;
-    int tw_out_len;
+    int direction;
+    int in_blocked;
+    int out_busy;
+    int num_works;
+    struct SPProtoDecoder_work *works;
+    uint8_t *works_buf;
+    int works_first;
+    int works_used;
     DebugObject d_obj;
 } SPProtoDecoder;
 
@@ -123,11 +145,14 @@ PacketPassInterface * SPProtoDecoder_GetInput (SPProtoDecoder *o);
 /**
  * Sets an encryption key for decrypting packets.
  * Encryption must be enabled.
+ * With an AEAD cipher, packets whose nonces carry the given direction are
+ * dropped, as they would have been sent with the same key from this end.
  *
  * @param o the object
  * @param encryption_key key to use
+ * @param direction direction of the packets sent from this end, 0 or 1
  */
-void SPProtoDecoder_SetEncryptionKey (SPProtoDecoder *o, uint8_t *encryption_key);
+void SPProtoDecoder_SetEncryptionKey (SPProtoDecoder *o, uint8_t *encryption_key, int direction);
 
 /**
  * Removes an encryption key if one is configured.
@@ -33,6 +33,8 @@
 #include <misc/balign.h>
 #include <misc/offset.h>
 #include <misc/byteorder.h>
+#include <misc/minmax.h>
+#include <misc/balloc.h>
 #include <security/BRandom.h>
 #include <security/BHash.h>
 
@@ -40,43 +42,91 @@
 
 static int can_encode (SPProtoEncoder *o);
 static void encode_packet (SPProtoEncoder *o);
-static void encode_work_func (SPProtoEncoder *o);
-static void encode_work_handler (SPProtoEncoder *o);
+static void encode_work_func (struct SPProtoEncoder_work *w);
+static void encode_work_handler (struct SPProtoEncoder_work *w);
 static void maybe_encode (SPProtoEncoder *o);
+static void maybe_output (SPProtoEncoder *o);
+static void maybe_receive (SPProtoEncoder *o);
 static void output_handler_recv (SPProtoEncoder *o, uint8_t *data);
 static void input_handler_done (SPProtoEncoder *o, int data_len);
 static void handler_job_hander (SPProtoEncoder *o);
 static void otpgenerator_handler (SPProtoEncoder *o);
 static void maybe_stop_work (SPProtoEncoder *o);
 
+static struct SPProtoEncoder_work * get_work (SPProtoEncoder *o, int i)
+{
+    ASSERT(i >= 0)
+    ASSERT(i < o->num_works)
+    
+    return &o->works[(o->works_first + i) % o->num_works];
+}
+
+static uint8_t * get_plaintext (SPProtoEncoder *o, struct SPProtoEncoder_work *w)
+{
+    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
+        return w->buf;
+    }
+    
+    // without prefetching, the packet is received directly into the output packet
+    return (o->num_works == 1 ? o->out : w->own_out);
+}
+
+static void free_encryptors (SPProtoEncoder *o)
+{
+    ASSERT(SPPROTO_HAVE_ENCRYPTION(o->sp_params))
+    ASSERT(o->have_encryption_key)
+    
+    for (int i = 0; i < o->num_works; i++) {
+        BEncryption_Free(&o->works[i].encryptor);
+    }
+}
+
 static int can_encode (SPProtoEncoder *o)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->out_have)
-    ASSERT(!o->tw_have)
+    ASSERT(o->works_started < o->works_received)
     
     return (
         (!SPPROTO_HAVE_OTP(o->sp_params) || OTPGenerator_GetPosition(&o->otpgen) < o->sp_params.otp_num) &&
-        (!SPPROTO_HAVE_ENCRYPTION(o->sp_params) || o->have_encryption_key)
+        (!SPPROTO_HAVE_ENCRYPTION(o->sp_params) || o->have_encryption_key) &&
+        (!SPPROTO_HAVE_AEAD(o->sp_params) || o->aead_counter < UINT64_MAX)
     );
 }
 
 static void encode_packet (SPProtoEncoder *o)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->out_have)
-    ASSERT(!o->tw_have)
+    ASSERT(o->works_started < o->works_received)
     ASSERT(can_encode(o))
     
+    struct SPProtoEncoder_work *w = get_work(o, o->works_started);
+    ASSERT(w->in_len >= 0)
+    ASSERT(!w->tw_have)
+    ASSERT(!w->finished)
+    
     // generate OTP, remember seed ID
     if (SPPROTO_HAVE_OTP(o->sp_params)) {
-        o->tw_seed_id = o->otpgen_seed_id;
-        o->tw_otp = OTPGenerator_GetOTP(&o->otpgen);
+        w->seed_id = o->otpgen_seed_id;
+        w->otp = OTPGenerator_GetOTP(&o->otpgen);
+    }
+    
+    // take the next nonce counter
+    if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+        w->counter = o->aead_counter++;
+    }
+    
+    // if this is the next packet to be output and the output buffer is available,
+    // encode directly into it; without prefetching, this is always the case
+    ASSERT(o->num_works > 1 || (o->out_have && !o->out_claimed))
+    if (o->works_started == 0 && o->out_have && !o->out_claimed && (SPPROTO_HAVE_ENCRYPTION(o->sp_params) || o->num_works == 1)) {
+        w->out = o->out;
+        o->out_claimed = 1;
+    } else {
+        w->out = w->own_out;
     }
     
     // start work
-    BThreadWork_Init(&o->tw, o->twd, (BThreadWork_handler_done)encode_work_handler, o, (BThreadWork_work_func)encode_work_func, o);
-    o->tw_have = 1;
+    BThreadWork_Init(&w->tw, o->twd, (BThreadWork_handler_done)encode_work_handler, w, (BThreadWork_work_func)encode_work_func, w);
+    w->tw_have = 1;
+    o->works_started++;
     
     // schedule OTP warning handler
     if (SPPROTO_HAVE_OTP(o->sp_params) && OTPGenerator_GetPosition(&o->otpgen) == o->otp_warning_count) {
@@ -84,28 +134,28 @@ static void encode_packet (SPProtoEncoder *o)
     }
 }
 
-static void encode_work_func (SPProtoEncoder *o)
+static void encode_work_func (struct SPProtoEncoder_work *w)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->out_have)
+    SPProtoEncoder *o = w->o;
+    ASSERT(w->in_len >= 0)
     ASSERT(!SPPROTO_HAVE_ENCRYPTION(o->sp_params) || o->have_encryption_key)
     
-    ASSERT(o->in_len <= o->input_mtu)
+    ASSERT(w->in_len <= o->input_mtu)
     
     // determine plaintext location
-    uint8_t *plaintext = (SPPROTO_HAVE_ENCRYPTION(o->sp_params) ? o->buf : o->out);
+    uint8_t *plaintext = get_plaintext(o, w);
     
     // plaintext begins with header
     uint8_t *header = plaintext;
     
     // plaintext is header + payload
-    int plaintext_len = SPPROTO_HEADER_LEN(o->sp_params) + o->in_len;
+    int plaintext_len = SPPROTO_HEADER_LEN(o->sp_params) + w->in_len;
     
     // write OTP
     if (SPPROTO_HAVE_OTP(o->sp_params)) {
         struct spproto_otpdata header_otpd;
-        header_otpd.seed_id = htol16(o->tw_seed_id);
-        header_otpd.otp = o->tw_otp;
+        header_otpd.seed_id = htol16(w->seed_id);
+        header_otpd.otp = w->otp;
         memcpy(header + SPPROTO_HEADER_OTPDATA_OFF(o->sp_params), &header_otpd, sizeof(header_otpd));
     }
     
@@ -123,7 +173,19 @@ static void encode_work_func (SPProtoEncoder *o)
     
     int out_len;
     
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
+    if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+        // write nonce
+        uint8_t *nonce = w->out;
+        struct spproto_aead_nonce nonce_data;
+        nonce_data.direction = htol32(o->direction);
+        nonce_data.counter = htol64(w->counter);
+        memcpy(nonce, &nonce_data, sizeof(nonce_data));
+        
+        // encrypt header + payload, append tag
+        uint8_t *ciphertext = nonce + BENCRYPTION_AEAD_NONCE_SIZE;
+        BEncryption_AeadEncrypt(&w->encryptor, nonce, plaintext, ciphertext, plaintext_len, ciphertext + plaintext_len);
+        out_len = SPPROTO_AEAD_OVERHEAD + plaintext_len;
+    } else if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
         // encrypting pad(header + payload)
         int cyphertext_len = balign_up((plaintext_len + 1), o->enc_block_size);
         
@@ -134,80 +196,137 @@ static void encode_work_func (SPProtoEncoder *o)
         }
         
         // generate IV
-        BRandom_randomize(o->out, o->enc_block_size);
+        BRandom_randomize(w->out, o->enc_block_size);
         
         // copy IV because BEncryption_Encrypt changes the IV
         uint8_t iv[BENCRYPTION_MAX_BLOCK_SIZE];
-        memcpy(iv, o->out, o->enc_block_size);
+        memcpy(iv, w->out, o->enc_block_size);
         
         // encrypt
-        BEncryption_Encrypt(&o->encryptor, plaintext, o->out + o->enc_block_size, cyphertext_len, iv);
+        BEncryption_Encrypt(&w->encryptor, plaintext, w->out + o->enc_block_size, cyphertext_len, iv);
         out_len = o->enc_block_size + cyphertext_len;
     } else {
         out_len = plaintext_len;
     }
     
     // remember length
-    o->tw_out_len = out_len;
+    w->out_len = out_len;
 }
 
-static void encode_work_handler (SPProtoEncoder *o)
+static void encode_work_handler (struct SPProtoEncoder_work *w)
 {
-    ASSERT(o->in_len >= 0)
-    ASSERT(o->out_have)
-    ASSERT(o->tw_have)
+    SPProtoEncoder *o = w->o;
+    ASSERT(w->in_len >= 0)
+    ASSERT(w->tw_have)
+    ASSERT(!w->finished)
+    DebugObject_Access(&o->d_obj);
     
     // free work
-    BThreadWork_Free(&o->tw);
-    o->tw_have = 0;
+    BThreadWork_Free(&w->tw);
+    w->tw_have = 0;
     
-    // finish packet
-    o->in_len = -1;
-    o->out_have = 0;
-    PacketRecvInterface_Done(&o->output, o->tw_out_len);
+    // set finished
+    w->finished = 1;
+    
+    // output packet if it's next
+    maybe_output(o);
 }
 
 static void maybe_encode (SPProtoEncoder *o)
 {
-    if (o->in_len >= 0 && o->out_have && !o->tw_have && can_encode(o)) {
+    while (o->works_started < o->works_received && can_encode(o)) {
         encode_packet(o);
     }
 }
 
+static void maybe_output (SPProtoEncoder *o)
+{
+    if (!o->out_have || o->works_started == 0) {
+        return;
+    }
+    
+    struct SPProtoEncoder_work *w = get_work(o, 0);
+    if (!w->finished) {
+        return;
+    }
+    
+    // copy packet to output, unless it was encoded there
+    if (w->out != o->out) {
+        memcpy(o->out, w->out, w->out_len);
+    }
+    int out_len = w->out_len;
+    
+    // release work
+    w->in_len = -1;
+    w->finished = 0;
+    o->works_first = (o->works_first + 1) % o->num_works;
+    o->works_received--;
+    o->works_started--;
+    
+    // finish packet
+    o->out_have = 0;
+    o->out_claimed = 0;
+    PacketRecvInterface_Done(&o->output, out_len);
+    
+    // receive into the released work
+    maybe_receive(o);
+}
+
+static void maybe_receive (SPProtoEncoder *o)
+{
+    if (o->receiving || o->works_received == o->num_works) {
+        return;
+    }
+    
+    // without prefetching, only receive when there is an output packet to encode into
+    if (o->num_works == 1 && !o->out_have) {
+        return;
+    }
+    
+    struct SPProtoEncoder_work *w = get_work(o, o->works_received);
+    ASSERT(w->in_len == -1)
+    
+    // schedule receive
+    PacketRecvInterface_Receiver_Recv(o->input, get_plaintext(o, w) + SPPROTO_HEADER_LEN(o->sp_params));
+    o->receiving = 1;
+}
+
 static void output_handler_recv (SPProtoEncoder *o, uint8_t *data)
 {
-    ASSERT(o->in_len == -1)
     ASSERT(!o->out_have)
-    ASSERT(!o->tw_have)
     DebugObject_Access(&o->d_obj);
     
     // remember output packet
     o->out_have = 1;
     o->out = data;
+    o->out_claimed = 0;
     
-    // determine plaintext location
-    uint8_t *plaintext = (SPPROTO_HAVE_ENCRYPTION(o->sp_params) ? o->buf : o->out);
+    // output a packet if one is ready
+    maybe_output(o);
     
-    // schedule receive
-    PacketRecvInterface_Receiver_Recv(o->input, plaintext + SPPROTO_HEADER_LEN(o->sp_params));
+    // otherwise receive one, if not already
+    maybe_receive(o);
 }
 
 static void input_handler_done (SPProtoEncoder *o, int data_len)
 {
     ASSERT(data_len >= 0)
     ASSERT(data_len <= o->input_mtu)
-    ASSERT(o->in_len == -1)
-    ASSERT(o->out_have)
-    ASSERT(!o->tw_have)
+    ASSERT(o->receiving)
+    ASSERT(o->works_received < o->num_works)
     DebugObject_Access(&o->d_obj);
     
     // remember input packet
-    o->in_len = data_len;
+    struct SPProtoEncoder_work *w = get_work(o, o->works_received);
+    w->in_len = data_len;
+    o->works_received++;
+    o->receiving = 0;
     
     // encode if possible
-    if (can_encode(o)) {
-        encode_packet(o);
-    }
+    maybe_encode(o);
+    
+    // receive the next packet if there's room
+    maybe_receive(o);
 }
 
 static void handler_job_hander (SPProtoEncoder *o)
@@ -235,11 +354,17 @@ static void otpgenerator_handler (SPProtoEncoder *o)
 
 static void maybe_stop_work (SPProtoEncoder *o)
 {
-    // stop existing work
-    if (o->tw_have) {
-        BThreadWork_Free(&o->tw);
-        o->tw_have = 0;
+    // stop existing works; their packets will be encoded again
+    for (int i = 0; i < o->works_started; i++) {
+        struct SPProtoEncoder_work *w = get_work(o, i);
+        if (w->tw_have) {
+            BThreadWork_Free(&w->tw);
+            w->tw_have = 0;
+        }
+        w->finished = 0;
     }
+    o->works_started = 0;
+    o->out_claimed = 0;
 }
 
 int SPProtoEncoder_Init (SPProtoEncoder *o, PacketRecvInterface *input, struct spproto_security_params sp_params, int otp_warning_count, BPendingGroup *pg, BThreadWorkDispatcher *twd)
@@ -283,6 +408,12 @@ int SPProtoEncoder_Init (SPProtoEncoder *o, PacketRecvInterface *input, struct s
         o->have_encryption_key = 0;
     }
     
+    // start nonce counter
+    if (SPPROTO_HAVE_AEAD(o->sp_params)) {
+        ASSERT(sizeof(struct spproto_aead_nonce) == BENCRYPTION_AEAD_NONCE_SIZE)
+        o->aead_counter = 0;
+    }
+    
     // remember input MTU
     o->input_mtu = PacketRecvInterface_GetMTU(o->input);
     
@@ -292,33 +423,61 @@ int SPProtoEncoder_Init (SPProtoEncoder *o, PacketRecvInterface *input, struct s
     // init input
     PacketRecvInterface_Receiver_Init(o->input, (PacketRecvInterface_handler_done)input_handler_done, o);
     
-    // have no input in buffer
-    o->in_len = -1;
-    
     // init output
     PacketRecvInterface_Init(&o->output, o->output_mtu, (PacketRecvInterface_handler_recv)output_handler_recv, o, pg);
     
     // have no output available
     o->out_have = 0;
     
-    // allocate plaintext buffer
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
-        int buf_size = balign_up((SPPROTO_HEADER_LEN(o->sp_params) + o->input_mtu + 1), o->enc_block_size);
-        if (!(o->buf = (uint8_t *)malloc(buf_size))) {
-            goto fail1;
-        }
+    // encode one packet per thread, plus one being received or output;
+    // without threads, don't prefetch, but receive when the output asks for a packet
+    o->num_works = 1;
+    if (BThreadWorkDispatcher_UsingThreads(o->twd)) {
+        o->num_works = bmin_int(BThreadWorkDispatcher_NumThreads(o->twd) + 1, SPPROTOENCODER_MAX_WORKS);
     }
     
+    // allocate works
+    if (!(o->works = (struct SPProtoEncoder_work *)BAllocArray(o->num_works, sizeof(o->works[0])))) {
+        goto fail1;
+    }
+    
+    // calculate work buffer sizes
+    int plaintext_size = (SPPROTO_HAVE_ENCRYPTION(o->sp_params) ? balign_up((SPPROTO_HEADER_LEN(o->sp_params) + o->input_mtu + 1), o->enc_block_size) : 0);
+    int own_out_size = (o->num_works > 1 ? o->output_mtu : 0);
+    int work_buf_size = plaintext_size + own_out_size;
+    
+    // allocate work buffers
+    if (!(o->works_buf = (uint8_t *)BAllocArray(o->num_works, work_buf_size))) {
+        goto fail2;
+    }
+    
+    // init works
+    for (int i = 0; i < o->num_works; i++) {
+        struct SPProtoEncoder_work *w = &o->works[i];
+        w->o = o;
+        w->buf = o->works_buf + (size_t)i * work_buf_size;
+        w->own_out = w->buf + plaintext_size;
+        w->in_len = -1;
+        w->tw_have = 0;
+        w->finished = 0;
+    }
+    o->works_first = 0;
+    o->works_received = 0;
+    o->works_started = 0;
+    
     // init handler job
     BPending_Init(&o->handler_job, pg, (BPending_handler)handler_job_hander, o);
     
-    // have no work
-    o->tw_have = 0;
+    // start receiving if prefetching
+    o->receiving = 0;
+    maybe_receive(o);
     
     DebugObject_Init(&o->d_obj);
     
     return 1;
     
+fail2:
+    BFree(o->works);
 fail1:
     PacketRecvInterface_Free(&o->output);
     if (SPPROTO_HAVE_OTP(o->sp_params)) {
@@ -332,27 +491,28 @@ void SPProtoEncoder_Free (SPProtoEncoder *o)
 {
     DebugObject_Free(&o->d_obj);
     
-    // free work
-    if (o->tw_have) {
-        BThreadWork_Free(&o->tw);
+    // free works
+    for (int i = 0; i < o->num_works; i++) {
+        if (o->works[i].tw_have) {
+            BThreadWork_Free(&o->works[i].tw);
+        }
+    }
+    
+    // free encryptors
+    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params) && o->have_encryption_key) {
+        free_encryptors(o);
     }
     
     // free handler job
     BPending_Free(&o->handler_job);
     
-    // free plaintext buffer
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params)) {
-        free(o->buf);
-    }
+    // free work buffers
+    BFree(o->works_buf);
+    BFree(o->works);
     
     // free output
     PacketRecvInterface_Free(&o->output);
     
-    // free encryptor
-    if (SPPROTO_HAVE_ENCRYPTION(o->sp_params) && o->have_encryption_key) {
-        BEncryption_Free(&o->encryptor);
-    }
-    
     // free otp generator
     if (SPPROTO_HAVE_OTP(o->sp_params)) {
         OTPGenerator_Free(&o->otpgen);
@@ -366,24 +526,28 @@ PacketRecvInterface * SPProtoEncoder_GetOutput (SPProtoEncoder *o)
     return &o->output;
 }
 
-void SPProtoEncoder_SetEncryptionKey (SPProtoEncoder *o, uint8_t *encryption_key)
+void SPProtoEncoder_SetEncryptionKey (SPProtoEncoder *o, uint8_t *encryption_key, int direction)
 {
     ASSERT(SPPROTO_HAVE_ENCRYPTION(o->sp_params))
+    ASSERT(direction == 0 || direction == 1)
     DebugObject_Access(&o->d_obj);
     
     // stop existing work
     maybe_stop_work(o);
     
-    // free encryptor
+    // free encryptors
     if (o->have_encryption_key) {
-        BEncryption_Free(&o->encryptor);
+        free_encryptors(o);
     }
     
-    // init encryptor
-    BEncryption_Init(&o->encryptor, BENCRYPTION_MODE_ENCRYPT, o->sp_params.encryption_mode, encryption_key);
+    // init encryptors, one per work so that works can encrypt in parallel
+    for (int i = 0; i < o->num_works; i++) {
+        BEncryption_Init(&o->works[i].encryptor, BENCRYPTION_MODE_ENCRYPT, o->sp_params.encryption_mode, encryption_key);
+    }
     
     // have encryption key
     o->have_encryption_key = 1;
+    o->direction = direction;
     
     // possibly continue I/O
     maybe_encode(o);
@@ -398,8 +562,8 @@ void SPProtoEncoder_RemoveEncryptionKey (SPProtoEncoder *o)
     maybe_stop_work(o);
     
     if (o->have_encryption_key) {
-        // free encryptor
-        BEncryption_Free(&o->encryptor);
+        // free encryptors
+        free_encryptors(o);
         
         // have no encryption key
         o->have_encryption_key = 0;
@@ -44,6 +44,9 @@
 #include <flow/PacketRecvInterface.h>
 #include <threadwork/BThreadWork.h>
 
+// maximum number of packets being encoded at once
+#define SPPROTOENCODER_MAX_WORKS 16
+
 /**
  * Event context handler called when the remaining number of
  * OTPs equals the warning number after having encoded a packet.
@@ -52,13 +55,35 @@
  */
 typedef void (*SPProtoEncoder_handler) (void *user);
 
+struct SPProtoEncoder_s;
+
+struct SPProtoEncoder_work {
+    struct SPProtoEncoder_s *o;
+    uint8_t *buf;
+    uint8_t *own_out;
+    uint8_t *out;
+    int in_len;
+    int tw_have;
+    int finished;
+    BThreadWork tw;
+    BEncryption encryptor;
+    uint16_t seed_id;
+    otp_t otp;
+    uint64_t counter;
+    int out_len;
+};
+
 /**
  * Object which encodes packets according to SPProto.
+ * If the thread work dispatcher uses threads, several packets are encoded
+ * in parallel, and are output in the order they were received.
+ * Otherwise, an input packet is only received when an output packet is
+ * requested, and is encoded in place.
  *
  * Input is with {@link PacketRecvInterface}.
  * Output is with {@link PacketRecvInterface}.
  */
-typedef struct {
+typedef struct SPProtoEncoder_s {
     PacketRecvInterface *input;
     struct spproto_security_params sp_params;
     int otp_warning_count;
@@ -72,20 +97,22 @@ typedef struct {
     uint16_t otpgen_seed_id;
     uint16_t otpgen_pending_seed_id;
     int have_encryption_key;
-    BEncryption encryptor;
+    int direction;
+    uint64_t aead_counter;
     int input_mtu;
     int output_mtu;
-    int in_len;
     PacketRecvInterface output;
     int out_have;
     uint8_t *out;
-    uint8_t *buf;
+    int out_claimed;
     BPending handler_job;
-    int tw_have;
-    BThreadWork tw;
-    uint16_t tw_seed_id;
-    otp_t tw_otp;
-    int tw_out_len;
+    int num_works;
+    struct SPProtoEncoder_work *works;
+    uint8_t *works_buf;
+    int works_first;
+    int works_received;
+    int works_started;
+    int receiving;
     DebugObject d_obj;
 } SPProtoEncoder;
 
@@ -127,11 +154,16 @@ PacketRecvInterface * SPProtoEncoder_GetOutput (SPProtoEncoder *o);
 /**
  * Sets an encryption key to use.
  * Encryption must be enabled.
+ * With an AEAD cipher, packets carry the given direction and a counter in their
+ * nonces. The counter is not reset when the key changes, and once it runs out,
+ * no more packets are encoded.
  *
  * @param o the object
  * @param encryption_key key to use
+ * @param direction direction of the packets, 0 or 1. The decoder at the other end
+ *                  must be given the same key and the other direction.
  */
-void SPProtoEncoder_SetEncryptionKey (SPProtoEncoder *o, uint8_t *encryption_key);
+void SPProtoEncoder_SetEncryptionKey (SPProtoEncoder *o, uint8_t *encryption_key, int direction);
 
 /**
  * Removes an encryption key if one is configured.
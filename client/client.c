@@ -682,7 +682,7 @@ void print_help (const char *name)
         "        ] ...\n"
         "        --transport-mode <udp/tcp>\n"
         "        (transport-mode=udp?\n"
-        "            --encryption-mode <blowfish/aes/none>\n"
+        "            --encryption-mode <blowfish/aes/aes-gcm/chacha20-poly1305/none>\n"
         "            --hash-mode <md5/sha1/none>\n"
         "            [--otp <blowfish/aes> <num> <num-warn>]\n"
         "            [--fragmentation-latency <milliseconds>]\n"
@@ -986,6 +986,12 @@ int parse_arguments (int argc, char *argv[])
             else if (!strcmp(arg2, "aes")) {
                 options.encryption_mode = BENCRYPTION_CIPHER_AES;
             }
+            else if (!strcmp(arg2, "aes-gcm")) {
+                options.encryption_mode = BENCRYPTION_CIPHER_AES_GCM;
+            }
+            else if (!strcmp(arg2, "chacha20-poly1305")) {
+                options.encryption_mode = BENCRYPTION_CIPHER_CHACHA20_POLY1305;
+            }
             else {
                 fprintf(stderr, "%s: wrong argument\n", arg);
                 return 0;
@@ -1185,6 +1191,11 @@ int parse_arguments (int argc, char *argv[])
         return 0;
     }
     
+    if (options.encryption_mode > 0 && BEncryption_cipher_is_aead(options.encryption_mode) && options.hash_mode != SPPROTO_HASH_MODE_NONE) {
+        fprintf(stderr, "False: AEAD --encryption-mode => --hash-mode none\n");
+        return 0;
+    }
+    
     if (!(!(options.otp_mode != SPPROTO_OTP_MODE_NONE) || (options.transport_mode == TRANSPORT_MODE_UDP))) {
         fprintf(stderr, "False: --otp => UDP\n");
         return 0;
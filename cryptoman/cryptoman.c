@@ -30,14 +30,89 @@
 #include <system/BReactor.h>
 #include <base/BLog.h>
 #include <openssl/rand.h>
+#include <openssl/kdf.h>
 
 #include "cryptoman.h"
 
+struct socks_crypto_info_t ss_crypto_info;
+
+// freed cipher contexts, kept for reuse by new connections
+static EVP_CIPHER_CTX *cryptor_pool[CRYPTOMAN_CRYPTOR_POOL_SIZE];
+static int cryptor_pool_count;
+
+// AEAD methods, by the names Shadowsocks servers know them
+static const struct {
+	const char *name;
+	const EVP_CIPHER * (*cipher)(void);
+} aead_methods[] = {
+	{"aes-128-gcm", EVP_aes_128_gcm},
+	{"aes-192-gcm", EVP_aes_192_gcm},
+	{"aes-256-gcm", EVP_aes_256_gcm},
+#ifndef OPENSSL_NO_CHACHA
+	{"chacha20-ietf-poly1305", EVP_chacha20_poly1305},
+#endif
+};
+
+static void increment_nonce(uint8_t *nonce)
+{
+	// the nonce is a little endian counter
+	for (int i = 0; i < SS_AEAD_NONCE_SIZE; i++)
+	{
+		if (++nonce[i] != 0)
+		{
+			break;
+		}
+	}
+}
+
+static int derive_subkey(const char *salt, uint8_t *subkey)
+{
+	// subkey = HKDF-SHA1(master key, salt, "ss-subkey")
+	EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+	if (!pctx)
+	{
+		BLog(BLOG_ERROR, "EVP_PKEY_CTX_new_id failed");
+		return 0;
+	}
+
+	size_t subkey_len = ss_crypto_info.key_len;
+	int res = EVP_PKEY_derive_init(pctx) == 1 &&
+		EVP_PKEY_CTX_set_hkdf_md(pctx, EVP_sha1()) == 1 &&
+		EVP_PKEY_CTX_set1_hkdf_salt(pctx, (const unsigned char *)salt, ss_crypto_info.iv_size) == 1 &&
+		EVP_PKEY_CTX_set1_hkdf_key(pctx, (const unsigned char *)ss_crypto_info.key, ss_crypto_info.key_len) == 1 &&
+		EVP_PKEY_CTX_add1_hkdf_info(pctx, (const unsigned char *)"ss-subkey", 9) == 1 &&
+		EVP_PKEY_derive(pctx, subkey, &subkey_len) == 1;
+
+	EVP_PKEY_CTX_free(pctx);
+
+	if (!res)
+	{
+		BLog(BLOG_ERROR, "HKDF failed");
+	}
+
+	return res;
+}
+
 int cryptoman_Init(char  *crypto_method_name, char *password)
 {
 	OpenSSL_add_all_algorithms();
 
-	ss_crypto_info.cipher = EVP_get_cipherbyname(crypto_method_name);
+	ss_crypto_info.is_aead = 0;
+	ss_crypto_info.cipher = NULL;
+	for (size_t i = 0; i < sizeof(aead_methods) / sizeof(aead_methods[0]); i++)
+	{
+		if (!strcmp(crypto_method_name, aead_methods[i].name))
+		{
+			ss_crypto_info.cipher = aead_methods[i].cipher();
+			ss_crypto_info.is_aead = 1;
+			break;
+		}
+	}
+
+	if (!ss_crypto_info.cipher)
+	{
+		ss_crypto_info.cipher = EVP_get_cipherbyname(crypto_method_name);
+	}
 	if (!ss_crypto_info.cipher)
 	{
 		BLog(BLOG_ERROR, "Unsupoorted crypto method %s", crypto_method_name);
@@ -58,15 +133,31 @@ int cryptoman_Init(char  *crypto_method_name, char *password)
 		return 0;
 	}
 	
-	// TO-DO: some cipher iv may less than 16
-	ss_crypto_info.iv_size = EVP_MAX_IV_LENGTH;
+	// AEAD ciphers send a salt as long as the key, stream ciphers their IV
+	ss_crypto_info.iv_size = (ss_crypto_info.is_aead ? ss_crypto_info.key_len : EVP_CIPHER_iv_length(ss_crypto_info.cipher));
+	if (ss_crypto_info.iv_size > SS_MAX_IV_SIZE)
+	{
+		BLog(BLOG_ERROR, "IV of crypto method %s is too long", crypto_method_name);
+		return 0;
+	}
 
 	ss_crypto_info.password = password;
 
+	cryptor_pool_count = 0;
+
 	BLog(BLOG_INFO, "Using method: %s", crypto_method_name);
 	return 1;
 }
 
+void cryptoman_Free(void)
+{
+	// free pooled cipher contexts
+	while (cryptor_pool_count > 0)
+	{
+		EVP_CIPHER_CTX_free(cryptor_pool[--cryptor_pool_count]);
+	}
+}
+
 int random_iv(char *iv, int size)
 {
 	return RAND_bytes(iv, size);
@@ -74,6 +165,22 @@ int random_iv(char *iv, int size)
 
 int encryptor_Init(EVP_CIPHER_CTX *octx, const char *iv)
 {
+	// AEAD ciphers are keyed per session, the nonce is set for each chunk
+	if (ss_crypto_info.is_aead)
+	{
+		uint8_t subkey[EVP_MAX_KEY_LENGTH];
+		if (!derive_subkey(iv, subkey))
+		{
+			return 0;
+		}
+		if (1 != EVP_EncryptInit_ex(octx, ss_crypto_info.cipher, NULL, subkey, NULL))
+		{
+			BLog(BLOG_ERROR, "EVP_EncryptInit_ex failed");
+			return 0;
+		}
+		return 1;
+	}
+
 	// initialise the context 
 	if (1 != EVP_EncryptInit_ex(octx, ss_crypto_info.cipher, NULL, ss_crypto_info.key, iv))
 	{
@@ -95,6 +202,22 @@ int encryptor_Init(EVP_CIPHER_CTX *octx, const char *iv)
 
 int decryptor_Init(EVP_CIPHER_CTX *octx, const char *iv)
 {
+	// AEAD ciphers are keyed per session, the nonce is set for each chunk
+	if (ss_crypto_info.is_aead)
+	{
+		uint8_t subkey[EVP_MAX_KEY_LENGTH];
+		if (!derive_subkey(iv, subkey))
+		{
+			return 0;
+		}
+		if (1 != EVP_DecryptInit_ex(octx, ss_crypto_info.cipher, NULL, subkey, NULL))
+		{
+			BLog(BLOG_ERROR, "EVP_DecryptInit_ex failed");
+			return 0;
+		}
+		return 1;
+	}
+
 	// initialise the context 
 	if (1 != EVP_DecryptInit_ex(octx, ss_crypto_info.cipher, NULL, ss_crypto_info.key, iv))
 	{
@@ -140,7 +263,69 @@ int decrypt(EVP_CIPHER_CTX *ctx, uint8_t *buf, int buf_len, uint8_t *plaintext)
 	return plaintext_len;
 }
 
+int aead_encrypt(EVP_CIPHER_CTX *ctx, uint8_t *nonce, const uint8_t *buf, int buf_len, uint8_t *ciphertext)
+{
+	int len;
+	int final_len;
+
+	// encrypt under the next nonce and append the tag
+	if (1 != EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, nonce) ||
+		1 != EVP_EncryptUpdate(ctx, ciphertext, &len, buf, buf_len) ||
+		1 != EVP_EncryptFinal_ex(ctx, ciphertext + len, &final_len) ||
+		1 != EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, SS_AEAD_TAG_SIZE, ciphertext + len + final_len))
+	{
+		BLog(BLOG_ERROR, "AEAD encryption failed");
+		return -1;
+	}
+
+	increment_nonce(nonce);
+
+	return len + final_len + SS_AEAD_TAG_SIZE;
+}
+
+int aead_decrypt(EVP_CIPHER_CTX *ctx, uint8_t *nonce, const uint8_t *buf, int buf_len, uint8_t *plaintext)
+{
+	ASSERT(buf_len >= SS_AEAD_TAG_SIZE)
+
+	int len;
+	int final_len;
+	int data_len = buf_len - SS_AEAD_TAG_SIZE;
+
+	// decrypt under the next nonce and verify the tag following the data
+	if (1 != EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, nonce) ||
+		1 != EVP_DecryptUpdate(ctx, plaintext, &len, buf, data_len) ||
+		1 != EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, SS_AEAD_TAG_SIZE, (void *)(buf + data_len)) ||
+		1 != EVP_DecryptFinal_ex(ctx, plaintext + len, &final_len))
+	{
+		BLog(BLOG_ERROR, "AEAD decryption failed");
+		return -1;
+	}
+
+	increment_nonce(nonce);
+
+	return len + final_len;
+}
+
+EVP_CIPHER_CTX * cryptor_new(void)
+{
+	// reuse a pooled context if there is one
+	if (cryptor_pool_count > 0)
+	{
+		return cryptor_pool[--cryptor_pool_count];
+	}
+
+	return EVP_CIPHER_CTX_new();
+}
+
 void cryptor_free(EVP_CIPHER_CTX *ctx)
 {
+	// keep the context for reuse unless the pool is full
+	if (cryptor_pool_count < CRYPTOMAN_CRYPTOR_POOL_SIZE)
+	{
+		EVP_CIPHER_CTX_reset(ctx);
+		cryptor_pool[cryptor_pool_count++] = ctx;
+		return;
+	}
+
 	EVP_CIPHER_CTX_free(ctx);
 }
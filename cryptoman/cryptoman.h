@@ -27,23 +27,50 @@
 * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#ifndef BADVPN_CRYPTOMAN_CRYPTOMAN_H
+#define BADVPN_CRYPTOMAN_CRYPTOMAN_H
+
 #include <openssl/conf.h>
 #include <openssl/evp.h>
 #include <openssl/err.h>
 
+// AEAD framing: each chunk is the encrypted 2-byte payload length and
+// the encrypted payload, each followed by its tag
+#define SS_AEAD_TAG_SIZE 16
+#define SS_AEAD_NONCE_SIZE 12
+#define SS_AEAD_MAX_PAYLOAD_SIZE 0x3FFF
+#define SS_AEAD_CHUNK_OVERHEAD (2 + 2 * SS_AEAD_TAG_SIZE)
+#define SS_AEAD_MAX_CHUNK_SIZE (SS_AEAD_MAX_PAYLOAD_SIZE + SS_AEAD_CHUNK_OVERHEAD)
+
+// largest IV (stream ciphers) or salt (AEAD ciphers) sent ahead of the data
+#define SS_MAX_IV_SIZE 32
+
 struct socks_crypto_info_t {
 	const char key[EVP_MAX_KEY_LENGTH];
 	size_t key_len;
+	// size of the IV, or of the salt for AEAD ciphers
 	int iv_size;
+	int is_aead;
 	const EVP_CIPHER *cipher;
 	const EVP_MD *dgst;
-	const *password;
-} ss_crypto_info;
+	const char *password;
+};
+
+// number of freed cipher contexts kept for reuse
+#define CRYPTOMAN_CRYPTOR_POOL_SIZE 128
+
+extern struct socks_crypto_info_t ss_crypto_info;
 
 int cryptoman_Init(char  *crypto_method_name, char *password);
+void cryptoman_Free(void);
 int random_iv(char *iv, int size);
 int encryptor_Init(EVP_CIPHER_CTX *octx, const char *iv);
 int decryptor_Init(EVP_CIPHER_CTX *octx, const char *iv);
 int encrypt(EVP_CIPHER_CTX *ctx, uint8_t *buf, int buf_len, uint8_t *ciphertext);
 int decrypt(EVP_CIPHER_CTX *ctx, uint8_t *buf, int buf_len, uint8_t *plaintext);
+int aead_encrypt(EVP_CIPHER_CTX *ctx, uint8_t *nonce, const uint8_t *buf, int buf_len, uint8_t *ciphertext);
+int aead_decrypt(EVP_CIPHER_CTX *ctx, uint8_t *nonce, const uint8_t *buf, int buf_len, uint8_t *plaintext);
+EVP_CIPHER_CTX * cryptor_new(void);
 void cryptor_free(EVP_CIPHER_CTX *ctx);
+
+#endif
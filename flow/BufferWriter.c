@@ -110,3 +110,16 @@ void BufferWriter_EndPacket (BufferWriter *o, int len)
     o->d_writing = 0;
     #endif
 }
+
+void BufferWriter_CancelPacket (BufferWriter *o)
+{
+    ASSERT(o->out_have)
+    ASSERT(o->d_writing)
+    DebugObject_Access(&o->d_obj);
+    
+    // keep the output packet for the next packet
+    
+    #ifndef NDEBUG
+    o->d_writing = 0;
+    #endif
+}
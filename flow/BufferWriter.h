@@ -104,4 +104,14 @@ int BufferWriter_StartPacket (BufferWriter *o, uint8_t **buf) WARN_UNUSED;
  */
 void BufferWriter_EndPacket (BufferWriter *o, int len);
 
+/**
+ * Abandons a packet being written, without submitting anything.
+ * The memory location stays available to the next {@link BufferWriter_StartPacket}.
+ * The object must be in writing state.
+ * The object enters not writing state.
+ * 
+ * @param o the object
+ */
+void BufferWriter_CancelPacket (BufferWriter *o);
+
 #endif
@@ -36,6 +36,28 @@
 
 static void input_handler_done (PacketBuffer *buf, int in_len);
 static void output_handler_done (PacketBuffer *buf);
+static void send_packets (PacketBuffer *buf);
+
+void send_packets (PacketBuffer *buf)
+{
+    ASSERT(buf->buf.output_avail >= 0)
+    
+    // pass a single packet if the output can't take more
+    if (!PacketPassInterface_HasBatch(buf->output)) {
+        buf->sending_num = 1;
+        PacketPassInterface_Sender_Send(buf->output, buf->buf.output_dest, buf->buf.output_avail);
+        return;
+    }
+    
+    // pass all packets in the buffer
+    struct ChunkBuffer2_packet packets[PACKETBUFFER_MAX_BATCH];
+    buf->sending_num = ChunkBuffer2_PeekPackets(&buf->buf, packets, PACKETBUFFER_MAX_BATCH);
+    for (int i = 0; i < buf->sending_num; i++) {
+        buf->batch[i].data = packets[i].data;
+        buf->batch[i].len = packets[i].len;
+    }
+    PacketPassInterface_Sender_SendBatch(buf->output, buf->batch, buf->sending_num);
+}
 
 void input_handler_done (PacketBuffer *buf, int in_len)
 {
@@ -56,7 +78,7 @@ void input_handler_done (PacketBuffer *buf, int in_len)
     
     // if buffer was empty, schedule send
     if (was_empty) {
-        PacketPassInterface_Sender_Send(buf->output, buf->buf.output_dest, buf->buf.output_avail);
+        send_packets(buf);
     }
 }
 
@@ -67,8 +89,10 @@ void output_handler_done (PacketBuffer *buf)
     // remember if buffer is full
     int was_full = (buf->buf.input_avail < buf->input_mtu);
     
-    // remove packet from buffer
-    ChunkBuffer2_ConsumePacket(&buf->buf);
+    // remove sent packets from buffer
+    for (int i = 0; i < buf->sending_num; i++) {
+        ChunkBuffer2_ConsumePacket(&buf->buf);
+    }
     
     // if buffer was full and there is space, schedule receive
     if (was_full && buf->buf.input_avail >= buf->input_mtu) {
@@ -77,7 +101,7 @@ void output_handler_done (PacketBuffer *buf)
     
     // if there is more data, schedule send
     if (buf->buf.output_avail >= 0) {
-        PacketPassInterface_Sender_Send(buf->output, buf->buf.output_dest, buf->buf.output_avail);
+        send_packets(buf);
     }
 }
 
@@ -42,6 +42,9 @@
 #include <flow/PacketRecvInterface.h>
 #include <flow/PacketPassInterface.h>
 
+// maximum number of packets passed to an output supporting batches at once
+#define PACKETBUFFER_MAX_BATCH 16
+
 /**
  * Packet buffer with {@link PacketRecvInterface} input and {@link PacketPassInterface} output.
  */
@@ -52,11 +55,15 @@ typedef struct {
     PacketPassInterface *output;
     struct ChunkBuffer2_block *buf_data;
     ChunkBuffer2 buf;
+    int sending_num;
+    struct PacketPassInterface_packet batch[PACKETBUFFER_MAX_BATCH];
 } PacketBuffer;
 
 /**
  * Initializes the buffer.
  * Output MTU must be >= input MTU.
+ * If the output supports batches, all buffered packets (up to PACKETBUFFER_MAX_BATCH)
+ * are passed to it in one operation.
  *
  * @param buf the object
  * @param input input interface
@@ -76,6 +76,15 @@ static uint64_t get_current_time (PacketPassFairQueue *m)
     return (have ? time : 0);
 }
 
+static int flow_is_busy (PacketPassFairQueueFlow *flow)
+{
+    PacketPassFairQueue *m = flow->m;
+    
+    // a flow is busy while its packet is being sent, and between the packets
+    // of a batch once some of them have been sent
+    return (flow == m->sending_flow || flow->batch_pos > 1);
+}
+
 static void increment_sent_flow (PacketPassFairQueueFlow *flow, uint64_t amount)
 {
     PacketPassFairQueue *m = flow->m;
@@ -150,14 +159,13 @@ static void schedule_job_handler (PacketPassFairQueue *m)
     }
 }
 
-static void input_handler_send (PacketPassFairQueueFlow *flow, uint8_t *data, int data_len)
+static void queue_flow (PacketPassFairQueueFlow *flow, uint8_t *data, int data_len)
 {
     PacketPassFairQueue *m = flow->m;
     
     ASSERT(flow != m->sending_flow)
     ASSERT(!flow->is_queued)
     ASSERT(!m->freeing)
-    DebugObject_Access(&flow->d_obj);
     
     if (flow == m->previous_flow) {
         // remove from previous flow
@@ -179,6 +187,30 @@ static void input_handler_send (PacketPassFairQueueFlow *flow, uint8_t *data, in
     }
 }
 
+static void input_handler_send (PacketPassFairQueueFlow *flow, uint8_t *data, int data_len)
+{
+    DebugObject_Access(&flow->d_obj);
+    
+    // not a batch
+    flow->batch_num = 0;
+    flow->batch_pos = 0;
+    
+    queue_flow(flow, data, data_len);
+}
+
+static void input_handler_send_batch (PacketPassFairQueueFlow *flow, struct PacketPassInterface_packet *packets, int num_packets)
+{
+    ASSERT(num_packets > 0)
+    DebugObject_Access(&flow->d_obj);
+    
+    // remember the batch and queue its first packet
+    flow->batch_packets = packets;
+    flow->batch_num = num_packets;
+    flow->batch_pos = 1;
+    
+    queue_flow(flow, packets[0].data, packets[0].len);
+}
+
 static void output_handler_done (PacketPassFairQueue *m)
 {
     ASSERT(m->sending_flow)
@@ -201,6 +233,18 @@ static void output_handler_done (PacketPassFairQueue *m)
     // schedule schedule
     BPending_Set(&m->schedule_job);
     
+    if (flow->batch_pos < flow->batch_num) {
+        // queue the next packet of the batch; it waits for its turn as if
+        // the input had just passed it
+        struct PacketPassInterface_packet *p = &flow->batch_packets[flow->batch_pos++];
+        queue_flow(flow, p->data, p->len);
+        return;
+    }
+    
+    // batch is finished, if there was one
+    flow->batch_num = 0;
+    flow->batch_pos = 0;
+    
     // finish flow packet
     PacketPassInterface_Done(&flow->input);
     
@@ -307,6 +351,15 @@ void PacketPassFairQueueFlow_Init (PacketPassFairQueueFlow *flow, PacketPassFair
     // init input
     PacketPassInterface_Init(&flow->input, PacketPassInterface_GetMTU(flow->m->output), (PacketPassInterface_handler_send)input_handler_send, flow, m->pg);
     
+    // accept batches, unless packets may be cancelled
+    if (!m->use_cancel) {
+        PacketPassInterface_EnableBatch(&flow->input, (PacketPassInterface_handler_send_batch)input_handler_send_batch);
+    }
+    
+    // not a batch
+    flow->batch_num = 0;
+    flow->batch_pos = 0;
+    
     // set time
     flow->time = 0;
     
@@ -366,7 +419,7 @@ int PacketPassFairQueueFlow_IsBusy (PacketPassFairQueueFlow *flow)
     ASSERT(!m->freeing)
     DebugObject_Access(&flow->d_obj);
     
-    return (flow == m->sending_flow);
+    return flow_is_busy(flow);
 }
 
 void PacketPassFairQueueFlow_RequestCancel (PacketPassFairQueueFlow *flow)
@@ -388,7 +441,7 @@ void PacketPassFairQueueFlow_SetBusyHandler (PacketPassFairQueueFlow *flow, Pack
     PacketPassFairQueue *m = flow->m;
     B_USE(m)
     
-    ASSERT(flow == m->sending_flow)
+    ASSERT(flow_is_busy(flow))
     ASSERT(!m->freeing)
     DebugObject_Access(&flow->d_obj);
     
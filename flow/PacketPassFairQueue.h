@@ -67,6 +67,9 @@ typedef struct PacketPassFairQueueFlow_s {
         uint8_t *data;
         int data_len;
     } queued;
+    struct PacketPassInterface_packet *batch_packets;
+    int batch_num;
+    int batch_pos;
     DebugObject d_obj;
 } PacketPassFairQueueFlow;
 
@@ -97,6 +100,8 @@ typedef struct PacketPassFairQueue_s {
  * @param pg pending group
  * @param use_cancel whether cancel functionality is required. Must be 0 or 1.
  *                   If 1, output must support cancel functionality.
+ *                   If 0, flow inputs accept batches of packets, which are
+ *                   queued one packet at a time like any other.
  * @param packet_weight additional weight a packet bears. Must be >0, to keep
  *                      the queue fair for zero size packets.
  * @return 1 on success, 0 on failure (because output MTU is too large)
@@ -160,7 +165,9 @@ void PacketPassFairQueueFlow_AssertFree (PacketPassFairQueueFlow *flow);
 
 /**
  * Determines if the flow is busy. If the flow is considered busy, it must not
- * be freed. At any given time, at most one flow will be indicated as busy.
+ * be freed. A flow is busy while its packet is being sent, which is the case for
+ * at most one flow at any given time, and in the middle of a batch, from when
+ * the first packet of the batch has been sent until the last one has.
  * Queue must not be in freeing state.
  * Must not be called from queue calls to output.
  *
@@ -52,11 +52,23 @@ typedef void (*PacketPassInterface_handler_requestcancel) (void *user);
 
 typedef void (*PacketPassInterface_handler_done) (void *user);
 
+// A provider may additionally accept a batch of packets in a single operation,
+// which saves the operation and done jobs for all but one of the packets.
+// The packets are passed on in order, and Done is called once for the whole
+// batch. The data of all packets must remain valid until then.
+struct PacketPassInterface_packet {
+    uint8_t *data;
+    int len;
+};
+
+typedef void (*PacketPassInterface_handler_send_batch) (void *user, struct PacketPassInterface_packet *packets, int num_packets);
+
 typedef struct {
     // provider data
     int mtu;
     PacketPassInterface_handler_send handler_operation;
     PacketPassInterface_handler_requestcancel handler_requestcancel;
+    PacketPassInterface_handler_send_batch handler_operation_batch;
     void *user_provider;
     
     // user data
@@ -67,6 +79,8 @@ typedef struct {
     BPending job_operation;
     uint8_t *job_operation_data;
     int job_operation_len;
+    struct PacketPassInterface_packet *job_operation_packets;
+    int job_operation_num_packets;
     
     // requestcancel job
     BPending job_requestcancel;
@@ -87,6 +101,8 @@ static void PacketPassInterface_Free (PacketPassInterface *i);
 
 static void PacketPassInterface_EnableCancel (PacketPassInterface *i, PacketPassInterface_handler_requestcancel handler_requestcancel);
 
+static void PacketPassInterface_EnableBatch (PacketPassInterface *i, PacketPassInterface_handler_send_batch handler_operation_batch);
+
 static void PacketPassInterface_Done (PacketPassInterface *i);
 
 static int PacketPassInterface_GetMTU (PacketPassInterface *i);
@@ -95,10 +111,14 @@ static void PacketPassInterface_Sender_Init (PacketPassInterface *i, PacketPassI
 
 static void PacketPassInterface_Sender_Send (PacketPassInterface *i, uint8_t *data, int data_len);
 
+static void PacketPassInterface_Sender_SendBatch (PacketPassInterface *i, struct PacketPassInterface_packet *packets, int num_packets);
+
 static void PacketPassInterface_Sender_RequestCancel (PacketPassInterface *i);
 
 static int PacketPassInterface_HasCancel (PacketPassInterface *i);
 
+static int PacketPassInterface_HasBatch (PacketPassInterface *i);
+
 void _PacketPassInterface_job_operation (PacketPassInterface *i);
 void _PacketPassInterface_job_requestcancel (PacketPassInterface *i);
 void _PacketPassInterface_job_done (PacketPassInterface *i);
@@ -111,6 +131,7 @@ void PacketPassInterface_Init (PacketPassInterface *i, int mtu, PacketPassInterf
     i->mtu = mtu;
     i->handler_operation = handler_operation;
     i->handler_requestcancel = NULL;
+    i->handler_operation_batch = NULL;
     i->user_provider = user;
     
     // set no user
@@ -146,6 +167,15 @@ void PacketPassInterface_EnableCancel (PacketPassInterface *i, PacketPassInterfa
     i->handler_requestcancel = handler_requestcancel;
 }
 
+void PacketPassInterface_EnableBatch (PacketPassInterface *i, PacketPassInterface_handler_send_batch handler_operation_batch)
+{
+    ASSERT(!i->handler_operation_batch)
+    ASSERT(!i->handler_done)
+    ASSERT(handler_operation_batch)
+    
+    i->handler_operation_batch = handler_operation_batch;
+}
+
 void PacketPassInterface_Done (PacketPassInterface *i)
 {
     ASSERT(i->state == PPI_STATE_BUSY)
@@ -190,6 +220,34 @@ void PacketPassInterface_Sender_Send (PacketPassInterface *i, uint8_t *data, int
     // schedule operation
     i->job_operation_data = data;
     i->job_operation_len = data_len;
+    i->job_operation_num_packets = 0;
+    BPending_Set(&i->job_operation);
+    
+    // set state
+    i->state = PPI_STATE_OPERATION_PENDING;
+    i->cancel_requested = 0;
+}
+
+void PacketPassInterface_Sender_SendBatch (PacketPassInterface *i, struct PacketPassInterface_packet *packets, int num_packets)
+{
+    ASSERT(num_packets > 0)
+    ASSERT(packets)
+    ASSERT(i->state == PPI_STATE_NONE)
+    ASSERT(i->handler_done)
+    ASSERT(i->handler_operation_batch)
+    DebugObject_Access(&i->d_obj);
+    
+#ifndef NDEBUG
+    for (int j = 0; j < num_packets; j++) {
+        ASSERT(packets[j].len >= 0)
+        ASSERT(packets[j].len <= i->mtu)
+        ASSERT(!(packets[j].len > 0) || packets[j].data)
+    }
+#endif
+    
+    // schedule operation
+    i->job_operation_packets = packets;
+    i->job_operation_num_packets = num_packets;
     BPending_Set(&i->job_operation);
     
     // set state
@@ -233,4 +291,11 @@ int PacketPassInterface_HasCancel (PacketPassInterface *i)
     return !!i->handler_requestcancel;
 }
 
+int PacketPassInterface_HasBatch (PacketPassInterface *i)
+{
+    DebugObject_Access(&i->d_obj);
+    
+    return !!i->handler_operation_batch;
+}
+
 #endif
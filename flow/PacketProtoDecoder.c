@@ -46,8 +46,10 @@ static void output_handler_done (PacketProtoDecoder *enc);
 void process_data (PacketProtoDecoder *enc)
 {
     int was_error = 0;
+    int num_packets = 0;
+    int max_packets = (PacketPassInterface_HasBatch(enc->output) ? PACKETPROTODECODER_MAX_BATCH : 1);
     
-    do {
+    while (num_packets < max_packets) {
         uint8_t *data = enc->buf + enc->buf_start;
         int left = enc->buf_used;
         
@@ -63,7 +65,6 @@ void process_data (PacketProtoDecoder *enc)
         
         // check data length
         if (data_len > enc->output_mtu) {
-            BLog(BLOG_NOTICE, "error: packet too large");
             was_error = 1;
             break;
         }
@@ -77,18 +78,43 @@ void process_data (PacketProtoDecoder *enc)
         enc->buf_start += sizeof(struct packetproto_header) + data_len;
         enc->buf_used -= sizeof(struct packetproto_header) + data_len;
         
-        // submit packet
-        PacketPassInterface_Sender_Send(enc->output, data, data_len);
+        // add packet
+        enc->batch[num_packets].data = data;
+        enc->batch[num_packets].len = data_len;
+        num_packets++;
+    }
+    
+    // submit packets; an error after them is found again when they're done
+    if (num_packets > 0) {
+        if (max_packets > 1) {
+            PacketPassInterface_Sender_SendBatch(enc->output, enc->batch, num_packets);
+        } else {
+            PacketPassInterface_Sender_Send(enc->output, enc->batch[0].data, enc->batch[0].len);
+        }
         return;
-    } while (0);
+    }
     
     if (was_error) {
+        BLog(BLOG_NOTICE, "error: packet too large");
+        
         // reset buffer
         enc->buf_start = 0;
         enc->buf_used = 0;
+    } else if (enc->buf_used == 0) {
+        // buffer is empty, receive from the beginning
+        enc->buf_start = 0;
     } else {
-        // if we reached the end of the buffer, wrap around to allow more data to be received
-        if (enc->buf_start + enc->buf_used == enc->buf_size) {
+        // determine how far the partial packet at the start can extend
+        int frame_len = PACKETPROTO_ENCLEN(enc->output_mtu);
+        if (enc->buf_used >= sizeof(struct packetproto_header)) {
+            struct packetproto_header header;
+            memcpy(&header, enc->buf + enc->buf_start, sizeof(header));
+            frame_len = sizeof(struct packetproto_header) + ltoh16(header.len);
+        }
+        
+        // if it wouldn't fit before the end of the buffer, move it to the beginning;
+        // this only ever moves a single incomplete packet
+        if (frame_len > enc->buf_size - enc->buf_start) {
             memmove(enc->buf, enc->buf + enc->buf_start, enc->buf_used);
             enc->buf_start = 0;
         }
@@ -145,7 +171,7 @@ int PacketProtoDecoder_Init (PacketProtoDecoder *enc, StreamRecvInterface *input
     enc->output_mtu = bmin_int(PacketPassInterface_GetMTU(enc->output), PACKETPROTO_MAXPAYLOAD);
     
     // init buffer state
-    enc->buf_size = PACKETPROTO_ENCLEN(enc->output_mtu);
+    enc->buf_size = bmax_int(PACKETPROTO_ENCLEN(enc->output_mtu), PACKETPROTODECODER_MIN_BUF_SIZE);
     enc->buf_start = 0;
     enc->buf_used = 0;
     
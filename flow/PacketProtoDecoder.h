@@ -42,6 +42,12 @@
 #include <flow/StreamRecvInterface.h>
 #include <flow/PacketPassInterface.h>
 
+// maximum number of packets passed to an output supporting batches at once
+#define PACKETPROTODECODER_MAX_BATCH 32
+
+// minimum size of the receive buffer, so that a single receive can bring in many small packets
+#define PACKETPROTODECODER_MIN_BUF_SIZE 16384
+
 /**
  * Handler called when a protocol error occurs.
  * When an error occurs, the decoder is reset to the initial state.
@@ -60,6 +66,7 @@ typedef struct {
     int buf_start;
     int buf_used;
     uint8_t *buf;
+    struct PacketPassInterface_packet batch[PACKETPROTODECODER_MAX_BATCH];
     DebugObject d_obj;
 } PacketProtoDecoder;
 
@@ -69,7 +76,10 @@ typedef struct {
  * @param enc the object
  * @param input input interface. The decoder will accept packets with payload size up to its MTU
  *              (but the payload can never be more than PACKETPROTO_MAXPAYLOAD).
- * @param output output interface
+ *              Receives are made into a buffer of at least PACKETPROTODECODER_MIN_BUF_SIZE bytes,
+ *              and every complete packet in it is decoded before receiving more.
+ * @param output output interface. If it supports batches, the complete packets in the buffer
+ *               (up to PACKETPROTODECODER_MAX_BATCH) are passed to it in one operation.
  * @param pg pending group
  * @param user argument to handlers
  * @param handler_error error handler
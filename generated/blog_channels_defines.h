@@ -145,4 +145,7 @@
 #define BLOG_CHANNEL_ncd_load_module 144
 #define BLOG_CHANNEL_ncd_basic_functions 145
 #define BLOG_CHANNEL_ncd_objref 146
-#define BLOG_NUM_CHANNELS 147
+#define BLOG_CHANNEL_SockTun 147
+#define BLOG_CHANNEL_DnsServers 148
+#define BLOG_CHANNEL_SocksUdpRelay 149
+#define BLOG_NUM_CHANNELS 150
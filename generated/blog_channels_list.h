@@ -145,3 +145,6 @@
 {"ncd_load_module", 4},
 {"ncd_basic_functions", 4},
 {"ncd_objref", 4},
+{"SockTun", 4},
+{"DnsServers", 4},
+{"SocksUdpRelay", 4},
@@ -68,6 +68,9 @@
 #define MEM_LIBC_MALLOC 1
 #define MEMP_MEM_MALLOC 1
 
+// tun2socks passes packets read from the device to lwIP as custom pbufs
+#define LWIP_SUPPORT_CUSTOM_PBUF 1
+
 #define LWIP_PERF 0
 #define SYS_LIGHTWEIGHT_PROT 0
 #define LWIP_DONT_PROVIDE_BYTEORDER_FUNCTIONS
@@ -0,0 +1,278 @@
+/*
+ * Copyright (C) Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Definitions for the DNS protocol.
+ */
+
+#ifndef BADVPN_MISC_DNS_PROTO_H
+#define BADVPN_MISC_DNS_PROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <misc/debug.h>
+#include <misc/packed.h>
+#include <misc/read_write_int.h>
+#include <misc/ascii_utils.h>
+
+#define DNS_FLAG_QR 0x8000
+#define DNS_FLAG_TC 0x0200
+#define DNS_OPCODE_MASK 0x7800
+#define DNS_RCODE_MASK 0x000F
+
+#define DNS_RCODE_NOERROR 0
+#define DNS_RCODE_NXDOMAIN 3
+
+#define DNS_TYPE_OPT 41
+
+#define DNS_MAX_NAME_LEN 255
+
+// largest message a client accepts over UDP unless it says otherwise with EDNS
+#define DNS_MAX_UDP_SIZE 512
+
+// key of a question is the lowercased name followed by the type and class
+#define DNS_QUESTION_KEY_MAX_LEN (DNS_MAX_NAME_LEN + 4)
+
+B_START_PACKED
+struct dns_header {
+    uint16_t id;
+    uint16_t flags;
+    uint16_t qdcount;
+    uint16_t ancount;
+    uint16_t nscount;
+    uint16_t arcount;
+} B_PACKED;
+B_END_PACKED
+
+/**
+ * Parses the question of a message with exactly one question, and builds
+ * its key, which is the name (lowercased) followed by the type and class.
+ * 
+ * @param msg the message
+ * @param len length of the message. Must be >=0.
+ * @param key where to write the key. Must have space for DNS_QUESTION_KEY_MAX_LEN bytes.
+ * @param out_key_len returns the length of the key
+ * @param out_end returns the position just after the question
+ * @return 1 on success, 0 if the message is malformed or doesn't have one question
+ */
+static int dns_parse_question (const uint8_t *msg, int len, uint8_t *key, int *out_key_len, int *out_end)
+{
+    ASSERT(len >= 0)
+    
+    // must have exactly one question
+    if (len < sizeof(struct dns_header) || badvpn_read_be16((const char *)msg + offsetof(struct dns_header, qdcount)) != 1) {
+        return 0;
+    }
+    
+    int pos = sizeof(struct dns_header);
+    int key_len = 0;
+    
+    // copy name, lowercased; names in questions are never compressed
+    while (1) {
+        if (pos >= len) {
+            return 0;
+        }
+        uint8_t label_len = msg[pos++];
+        if ((label_len & 0xC0)) {
+            return 0;
+        }
+        if (label_len > len - pos || key_len + 1 + label_len >= DNS_MAX_NAME_LEN) {
+            return 0;
+        }
+        key[key_len++] = label_len;
+        if (label_len == 0) {
+            break;
+        }
+        for (int i = 0; i < label_len; i++) {
+            key[key_len++] = b_ascii_tolower(msg[pos++]);
+        }
+    }
+    
+    // copy type and class
+    if (len - pos < 4) {
+        return 0;
+    }
+    memcpy(key + key_len, msg + pos, 4);
+    key_len += 4;
+    pos += 4;
+    
+    ASSERT(key_len <= DNS_QUESTION_KEY_MAX_LEN)
+    
+    *out_key_len = key_len;
+    *out_end = pos;
+    return 1;
+}
+
+/**
+ * Skips a possibly compressed name in a message.
+ * 
+ * @param msg the message
+ * @param len length of the message. Must be >=0.
+ * @param pos position of the name
+ * @return position just after the name, or -1 if it is malformed
+ */
+static int dns_skip_name (const uint8_t *msg, int len, int pos)
+{
+    ASSERT(len >= 0)
+    ASSERT(pos >= 0)
+    
+    while (1) {
+        if (pos >= len) {
+            return -1;
+        }
+        uint8_t label_len = msg[pos];
+        
+        // a compression pointer ends the name
+        if ((label_len & 0xC0) == 0xC0) {
+            return (len - pos < 2 ? -1 : pos + 2);
+        }
+        if ((label_len & 0xC0)) {
+            return -1;
+        }
+        pos++;
+        if (label_len == 0) {
+            return pos;
+        }
+        if (label_len > len - pos) {
+            return -1;
+        }
+        pos += label_len;
+    }
+}
+
+/**
+ * Goes through resource records, checking that they are well-formed, finding the
+ * smallest TTL if min_ttl is not NULL, and subtracting age from the TTLs (stopping
+ * at zero) if age is not zero. OPT pseudo-records are skipped, since their TTL field
+ * holds flags.
+ * 
+ * @param msg the message
+ * @param len length of the message. Must be >=0.
+ * @param pos position of the first record
+ * @param num_records number of records
+ * @param min_ttl if not NULL, TTLs smaller than *min_ttl are written here
+ * @param age how much to subtract from the TTLs
+ * @return 1 on success, 0 if the records are malformed
+ */
+static int dns_process_records (uint8_t *msg, int len, int pos, int num_records, uint32_t *min_ttl, uint32_t age)
+{
+    ASSERT(len >= 0)
+    ASSERT(num_records >= 0)
+    
+    for (int i = 0; i < num_records; i++) {
+        if ((pos = dns_skip_name(msg, len, pos)) < 0 || len - pos < 10) {
+            return 0;
+        }
+        
+        uint16_t type = badvpn_read_be16((const char *)msg + pos);
+        uint32_t ttl = badvpn_read_be32((const char *)msg + pos + 4);
+        uint16_t rdlength = badvpn_read_be16((const char *)msg + pos + 8);
+        
+        if (type != DNS_TYPE_OPT) {
+            if (min_ttl && ttl < *min_ttl) {
+                *min_ttl = ttl;
+            }
+            if (age > 0) {
+                badvpn_write_be32((ttl > age ? ttl - age : 0), (char *)msg + pos + 4);
+            }
+        }
+        
+        pos += 10;
+        if (rdlength > len - pos) {
+            return 0;
+        }
+        pos += rdlength;
+    }
+    
+    return 1;
+}
+
+/**
+ * Looks for an OPT pseudo-record (EDNS) among resource records.
+ * 
+ * @param msg the message
+ * @param len length of the message. Must be >=0.
+ * @param pos position of the first record
+ * @param num_records number of records
+ * @param out_opt_pos returns the position of the OPT record, or -1 if there is none
+ * @param out_opt_end returns the position just after the OPT record
+ * @return 1 on success, 0 if the records are malformed or an OPT record has a name
+ *         other than the root
+ */
+static int dns_find_opt (const uint8_t *msg, int len, int pos, int num_records, int *out_opt_pos, int *out_opt_end)
+{
+    ASSERT(len >= 0)
+    ASSERT(num_records >= 0)
+    
+    *out_opt_pos = -1;
+    
+    for (int i = 0; i < num_records; i++) {
+        int record_pos = pos;
+        if ((pos = dns_skip_name(msg, len, pos)) < 0 || len - pos < 10) {
+            return 0;
+        }
+        
+        uint16_t type = badvpn_read_be16((const char *)msg + pos);
+        uint16_t rdlength = badvpn_read_be16((const char *)msg + pos + 8);
+        
+        // the name of an OPT record is the root, a single zero byte
+        int is_opt = (type == DNS_TYPE_OPT);
+        if (is_opt && pos != record_pos + 1) {
+            return 0;
+        }
+        
+        pos += 10;
+        if (rdlength > len - pos) {
+            return 0;
+        }
+        pos += rdlength;
+        
+        if (is_opt && *out_opt_pos < 0) {
+            *out_opt_pos = record_pos;
+            *out_opt_end = pos;
+        }
+    }
+    
+    return 1;
+}
+
+/**
+ * Returns the largest UDP message size advertised in an OPT record found by
+ * {@link dns_find_opt}, which is at least DNS_MAX_UDP_SIZE.
+ */
+static int dns_opt_udp_size (const uint8_t *msg, int opt_pos)
+{
+    ASSERT(opt_pos >= 0)
+    
+    // the class field of the OPT record holds the size; the name is one byte
+    int size = badvpn_read_be16((const char *)msg + opt_pos + 3);
+    
+    return (size > DNS_MAX_UDP_SIZE ? size : DNS_MAX_UDP_SIZE);
+}
+
+#endif
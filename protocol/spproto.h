@@ -31,7 +31,7 @@
  * Protocol for securing datagram communication.
  * 
  * Security features implemented:
- *   - Encryption. Encrypts packets with a block cipher.
+ *   - Encryption. Encrypts packets with a block cipher or an AEAD cipher.
  *     Protects against a third party from seeing the data
  *     being transmitted.
  *   - Hashes. Adds a hash of the packet into the packet.
@@ -47,11 +47,22 @@
  *   - if hashes are used, the hash,
  *   - payload data.
  * 
- * If encryption is used:
+ * If encryption with a block cipher is used:
  *   - the plaintext is padded by appending a 0x01 byte and as many 0x00
  *     bytes as needed to align to block size,
  *   - the padded plaintext is encrypted, and
  *   - the initialization vector (IV) is prepended.
+ * 
+ * If encryption with an AEAD cipher is used, hashes must not be used, as the
+ * authentication tag takes their place. The packet is then:
+ *   - the nonce, a struct {@link spproto_aead_nonce},
+ *   - the encrypted plaintext (not padded), and
+ *   - the authentication tag.
+ * Both directions of a link use the same key, so the nonce holds the
+ * direction of the packet along with a counter of packets sent in that
+ * direction. A nonce is thus never used twice with a key, and the
+ * receiver drops packets sent in its own direction, which would have
+ * been reflected back to it.
  */
 
 #ifndef BADVPN_PROTOCOL_SPPROTO_H
@@ -112,6 +123,17 @@ struct spproto_security_params {
 
 #define SPPROTO_HAVE_ENCRYPTION(_params) ((_params).encryption_mode != SPPROTO_ENCRYPTION_MODE_NONE)
 
+#define SPPROTO_HAVE_AEAD(_params) (SPPROTO_HAVE_ENCRYPTION(_params) && BEncryption_cipher_is_aead((_params).encryption_mode))
+
+#define SPPROTO_AEAD_OVERHEAD (BENCRYPTION_AEAD_NONCE_SIZE + BENCRYPTION_AEAD_TAG_SIZE)
+
+B_START_PACKED
+struct spproto_aead_nonce {
+    uint32_t direction;
+    uint64_t counter;
+} B_PACKED;
+B_END_PACKED
+
 #define SPPROTO_HAVE_OTP(_params) ((_params).otp_mode != SPPROTO_OTP_MODE_NONE)
 
 B_START_PACKED
@@ -137,6 +159,8 @@ static void spproto_assert_security_params (struct spproto_security_params param
     ASSERT(params.hash_mode == SPPROTO_HASH_MODE_NONE || BHash_type_valid(params.hash_mode))
     ASSERT(params.encryption_mode == SPPROTO_ENCRYPTION_MODE_NONE || BEncryption_cipher_valid(params.encryption_mode))
     ASSERT(params.otp_mode == SPPROTO_OTP_MODE_NONE || BEncryption_cipher_valid(params.otp_mode))
+    ASSERT(params.otp_mode == SPPROTO_OTP_MODE_NONE || !BEncryption_cipher_is_aead(params.otp_mode))
+    ASSERT(!SPPROTO_HAVE_AEAD(params) || params.hash_mode == SPPROTO_HASH_MODE_NONE)
     ASSERT(params.otp_mode == SPPROTO_OTP_MODE_NONE || params.otp_num > 0)
 }
 
@@ -156,6 +180,8 @@ static int spproto_payload_mtu_for_carrier_mtu (struct spproto_security_params p
     
     if (params.encryption_mode == SPPROTO_ENCRYPTION_MODE_NONE) {
         return (carrier_mtu - SPPROTO_HEADER_LEN(params));
+    } else if (SPPROTO_HAVE_AEAD(params)) {
+        return (carrier_mtu - SPPROTO_AEAD_OVERHEAD - SPPROTO_HEADER_LEN(params));
     } else {
         int block_size = BEncryption_cipher_block_size(params.encryption_mode);
         return (balign_down(carrier_mtu, block_size) - block_size - SPPROTO_HEADER_LEN(params) - 1);
@@ -181,6 +207,12 @@ static int spproto_carrier_mtu_for_payload_mtu (struct spproto_security_params p
         }
         
         return (SPPROTO_HEADER_LEN(params) + payload_mtu);
+    } else if (SPPROTO_HAVE_AEAD(params)) {
+        if (payload_mtu > INT_MAX - (SPPROTO_AEAD_OVERHEAD + SPPROTO_HEADER_LEN(params))) {
+            return -1;
+        }
+        
+        return (SPPROTO_AEAD_OVERHEAD + SPPROTO_HEADER_LEN(params) + payload_mtu);
     } else {
         int block_size = BEncryption_cipher_block_size(params.encryption_mode);
         
@@ -33,13 +33,89 @@
 
 #include <generated/blog_channel_BEncryption.h>
 
+static const EVP_CIPHER * aead_evp_cipher (int cipher)
+{
+    switch (cipher) {
+        case BENCRYPTION_CIPHER_AES_GCM:
+            return EVP_aes_128_gcm();
+        case BENCRYPTION_CIPHER_CHACHA20_POLY1305:
+            return EVP_chacha20_poly1305();
+        default:
+            ASSERT(0)
+            return NULL;
+    }
+}
+
+static void aead_batch (BEncryption *enc, struct BEncryption_aead_packet *packets, int num_packets, int encrypt)
+{
+    ASSERT(num_packets >= 0)
+    
+    if (num_packets == 0) {
+        return;
+    }
+    
+    // the keyed context is reused for every packet; only the nonce changes
+    EVP_CIPHER_CTX *ctx = enc->aead;
+    
+    for (int i = 0; i < num_packets; i++) {
+        struct BEncryption_aead_packet *p = &packets[i];
+        ASSERT(p->len >= 0)
+        
+        // start packet with its nonce
+        ASSERT_FORCE(EVP_CipherInit_ex(ctx, NULL, NULL, NULL, p->nonce, encrypt) == 1)
+        
+        // give expected tag
+        if (!encrypt) {
+            ASSERT_FORCE(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, BENCRYPTION_AEAD_TAG_SIZE, p->tag) == 1)
+        }
+        
+        // process data
+        int out_len = 0;
+        if (p->len > 0) {
+            ASSERT_FORCE(EVP_CipherUpdate(ctx, p->out, &out_len, p->in, p->len) == 1)
+            ASSERT(out_len == p->len)
+        }
+        
+        // finish packet
+        int final_len;
+        int res = EVP_CipherFinal_ex(ctx, p->out + out_len, &final_len);
+        
+        if (encrypt) {
+            ASSERT_FORCE(res == 1)
+            
+            // get tag
+            ASSERT_FORCE(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, BENCRYPTION_AEAD_TAG_SIZE, p->tag) == 1)
+        } else {
+            // tag matched if finishing succeeded
+            p->valid = (res == 1);
+        }
+    }
+}
+
 int BEncryption_cipher_valid (int cipher)
 {
     switch (cipher) {
         case BENCRYPTION_CIPHER_BLOWFISH:
         case BENCRYPTION_CIPHER_AES:
+        case BENCRYPTION_CIPHER_AES_GCM:
+        case BENCRYPTION_CIPHER_CHACHA20_POLY1305:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+int BEncryption_cipher_is_aead (int cipher)
+{
+    switch (cipher) {
+        case BENCRYPTION_CIPHER_BLOWFISH:
+        case BENCRYPTION_CIPHER_AES:
+            return 0;
+        case BENCRYPTION_CIPHER_AES_GCM:
+        case BENCRYPTION_CIPHER_CHACHA20_POLY1305:
             return 1;
         default:
+            ASSERT(0)
             return 0;
     }
 }
@@ -51,6 +127,10 @@ int BEncryption_cipher_block_size (int cipher)
             return BENCRYPTION_CIPHER_BLOWFISH_BLOCK_SIZE;
         case BENCRYPTION_CIPHER_AES:
             return BENCRYPTION_CIPHER_AES_BLOCK_SIZE;
+        case BENCRYPTION_CIPHER_AES_GCM:
+            return BENCRYPTION_CIPHER_AES_GCM_BLOCK_SIZE;
+        case BENCRYPTION_CIPHER_CHACHA20_POLY1305:
+            return BENCRYPTION_CIPHER_CHACHA20_POLY1305_BLOCK_SIZE;
         default:
             ASSERT(0)
             return 0;
@@ -64,6 +144,10 @@ int BEncryption_cipher_key_size (int cipher)
             return BENCRYPTION_CIPHER_BLOWFISH_KEY_SIZE;
         case BENCRYPTION_CIPHER_AES:
             return BENCRYPTION_CIPHER_AES_KEY_SIZE;
+        case BENCRYPTION_CIPHER_AES_GCM:
+            return BENCRYPTION_CIPHER_AES_GCM_KEY_SIZE;
+        case BENCRYPTION_CIPHER_CHACHA20_POLY1305:
+            return BENCRYPTION_CIPHER_CHACHA20_POLY1305_KEY_SIZE;
         default:
             ASSERT(0)
             return 0;
@@ -139,6 +223,14 @@ fail1:
                 ASSERT_EXECUTE(res >= 0)
             }
             break;
+        case BENCRYPTION_CIPHER_AES_GCM:
+        case BENCRYPTION_CIPHER_CHACHA20_POLY1305:
+            // set up the key once; EVP picks AES-NI, ARMv8 or other accelerated code
+            enc->aead = EVP_CIPHER_CTX_new();
+            ASSERT_FORCE(enc->aead)
+            res = EVP_CipherInit_ex(enc->aead, aead_evp_cipher(enc->cipher), NULL, key, NULL, !!(enc->mode&BENCRYPTION_MODE_ENCRYPT));
+            ASSERT_FORCE(res == 1)
+            break;
         default:
             ASSERT(0)
             ;
@@ -162,14 +254,20 @@ void BEncryption_Free (BEncryption *enc)
         ASSERT_FORCE(ioctl(enc->cryptodev.cfd, CIOCFSESSION, &enc->cryptodev.ses) == 0)
         ASSERT_FORCE(close(enc->cryptodev.cfd) == 0)
         ASSERT_FORCE(close(enc->cryptodev.fd) == 0)
+        return;
     }
     
     #endif
+    
+    if (BEncryption_cipher_is_aead(enc->cipher)) {
+        EVP_CIPHER_CTX_free(enc->aead);
+    }
 }
 
 void BEncryption_Encrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len, uint8_t *iv)
 {
     ASSERT(enc->mode&BENCRYPTION_MODE_ENCRYPT)
+    ASSERT(!BEncryption_cipher_is_aead(enc->cipher))
     ASSERT(len >= 0)
     ASSERT(len % BEncryption_cipher_block_size(enc->cipher) == 0)
     
@@ -206,6 +304,7 @@ void BEncryption_Encrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len,
 void BEncryption_Decrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len, uint8_t *iv)
 {
     ASSERT(enc->mode&BENCRYPTION_MODE_DECRYPT)
+    ASSERT(!BEncryption_cipher_is_aead(enc->cipher))
     ASSERT(len >= 0)
     ASSERT(len % BEncryption_cipher_block_size(enc->cipher) == 0)
     
@@ -238,3 +337,47 @@ void BEncryption_Decrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len,
             ASSERT(0);
     }
 }
+
+void BEncryption_AeadEncryptBatch (BEncryption *enc, struct BEncryption_aead_packet *packets, int num_packets)
+{
+    ASSERT(enc->mode&BENCRYPTION_MODE_ENCRYPT)
+    ASSERT(BEncryption_cipher_is_aead(enc->cipher))
+    ASSERT(num_packets >= 0)
+    
+    aead_batch(enc, packets, num_packets, 1);
+}
+
+void BEncryption_AeadDecryptBatch (BEncryption *enc, struct BEncryption_aead_packet *packets, int num_packets)
+{
+    ASSERT(enc->mode&BENCRYPTION_MODE_DECRYPT)
+    ASSERT(BEncryption_cipher_is_aead(enc->cipher))
+    ASSERT(num_packets >= 0)
+    
+    aead_batch(enc, packets, num_packets, 0);
+}
+
+void BEncryption_AeadEncrypt (BEncryption *enc, uint8_t *nonce, uint8_t *in, uint8_t *out, int len, uint8_t *tag)
+{
+    struct BEncryption_aead_packet packet;
+    packet.nonce = nonce;
+    packet.in = in;
+    packet.out = out;
+    packet.len = len;
+    packet.tag = tag;
+    
+    BEncryption_AeadEncryptBatch(enc, &packet, 1);
+}
+
+int BEncryption_AeadDecrypt (BEncryption *enc, uint8_t *nonce, uint8_t *in, uint8_t *out, int len, uint8_t *tag)
+{
+    struct BEncryption_aead_packet packet;
+    packet.nonce = nonce;
+    packet.in = in;
+    packet.out = out;
+    packet.len = len;
+    packet.tag = tag;
+    
+    BEncryption_AeadDecryptBatch(enc, &packet, 1);
+    
+    return packet.valid;
+}
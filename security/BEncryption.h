@@ -28,7 +28,7 @@
  * 
  * @section DESCRIPTION
  * 
- * Block cipher encryption abstraction.
+ * Block cipher and AEAD encryption abstraction.
  */
 
 #ifndef BADVPN_SECURITY_BENCRYPTION_H
@@ -50,6 +50,7 @@
 
 #include <openssl/blowfish.h>
 #include <openssl/aes.h>
+#include <openssl/evp.h>
 
 #include <misc/debug.h>
 #include <base/DebugObject.h>
@@ -58,7 +59,7 @@
 #define BENCRYPTION_MODE_DECRYPT 2
 
 #define BENCRYPTION_MAX_BLOCK_SIZE 16
-#define BENCRYPTION_MAX_KEY_SIZE 16
+#define BENCRYPTION_MAX_KEY_SIZE 32
 
 #define BENCRYPTION_CIPHER_BLOWFISH 1
 #define BENCRYPTION_CIPHER_BLOWFISH_BLOCK_SIZE 8
@@ -68,8 +69,39 @@
 #define BENCRYPTION_CIPHER_AES_BLOCK_SIZE 16
 #define BENCRYPTION_CIPHER_AES_KEY_SIZE 16
 
+#define BENCRYPTION_CIPHER_AES_GCM 3
+#define BENCRYPTION_CIPHER_AES_GCM_BLOCK_SIZE 1
+#define BENCRYPTION_CIPHER_AES_GCM_KEY_SIZE 16
+
+#define BENCRYPTION_CIPHER_CHACHA20_POLY1305 4
+#define BENCRYPTION_CIPHER_CHACHA20_POLY1305_BLOCK_SIZE 1
+#define BENCRYPTION_CIPHER_CHACHA20_POLY1305_KEY_SIZE 32
+
 // NOTE: update the maximums above when adding a cipher!
 
+// nonce and tag sizes of AEAD ciphers
+#define BENCRYPTION_AEAD_NONCE_SIZE 12
+#define BENCRYPTION_AEAD_TAG_SIZE 16
+
+/**
+ * A packet to be encrypted or decrypted with an AEAD cipher.
+ */
+struct BEncryption_aead_packet {
+    // nonce, BENCRYPTION_AEAD_NONCE_SIZE bytes
+    uint8_t *nonce;
+    // input data
+    uint8_t *in;
+    // output data, may be the same as in
+    uint8_t *out;
+    // length of input and output data
+    int len;
+    // authentication tag, BENCRYPTION_AEAD_TAG_SIZE bytes;
+    // written on encryption, checked on decryption
+    uint8_t *tag;
+    // on decryption, set to 1 if the tag matched, 0 if not
+    int valid;
+};
+
 /**
  * Block cipher encryption abstraction.
  */
@@ -86,6 +118,7 @@ typedef struct {
             AES_KEY encrypt;
             AES_KEY decrypt;
         } aes;
+        EVP_CIPHER_CTX *aead;
         #ifdef BADVPN_USE_CRYPTODEV
         struct {
             int fd;
@@ -105,8 +138,19 @@ typedef struct {
  */
 int BEncryption_cipher_valid (int cipher);
 
+/**
+ * Checks if the given cipher is an AEAD cipher.
+ * AEAD ciphers are used with {@link BEncryption_AeadEncrypt} and {@link BEncryption_AeadDecrypt},
+ * other ciphers with {@link BEncryption_Encrypt} and {@link BEncryption_Decrypt}.
+ * 
+ * @param cipher cipher number. Must be valid.
+ * @return 1 if AEAD, 0 if not
+ */
+int BEncryption_cipher_is_aead (int cipher);
+
 /**
  * Returns the block size of a cipher.
+ * This is 1 for AEAD ciphers, which need no padding.
  * 
  * @param cipher cipher number. Must be valid.
  * @return block size in bytes
@@ -145,7 +189,7 @@ void BEncryption_Free (BEncryption *enc);
 /**
  * Encrypts data.
  * The object must have been initialized with mode including
- * BENCRYPTION_MODE_ENCRYPT.
+ * BENCRYPTION_MODE_ENCRYPT, and with a cipher that is not AEAD.
  * 
  * @param enc the object
  * @param in data to encrypt
@@ -160,7 +204,7 @@ void BEncryption_Encrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len,
 /**
  * Decrypts data.
  * The object must have been initialized with mode including
- * BENCRYPTION_MODE_DECRYPT.
+ * BENCRYPTION_MODE_DECRYPT, and with a cipher that is not AEAD.
  * 
  * @param enc the object
  * @param in data to decrypt
@@ -172,4 +216,60 @@ void BEncryption_Encrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len,
  */
 void BEncryption_Decrypt (BEncryption *enc, uint8_t *in, uint8_t *out, int len, uint8_t *iv);
 
+/**
+ * Encrypts and authenticates a number of packets.
+ * The object must have been initialized with mode including
+ * BENCRYPTION_MODE_ENCRYPT, and with an AEAD cipher.
+ * The key schedule is shared by all the packets. The object keeps
+ * per-packet state, so it must not be used from several threads at once;
+ * use one object per thread instead.
+ * 
+ * @param enc the object
+ * @param packets packets to encrypt. For each one, the nonce must not have been
+ *                used with this key before.
+ * @param num_packets number of packets. Must be >=0.
+ */
+void BEncryption_AeadEncryptBatch (BEncryption *enc, struct BEncryption_aead_packet *packets, int num_packets);
+
+/**
+ * Decrypts and verifies a number of packets.
+ * The object must have been initialized with mode including
+ * BENCRYPTION_MODE_DECRYPT, and with an AEAD cipher.
+ * The object must not be used from several threads at once.
+ * 
+ * @param enc the object
+ * @param packets packets to decrypt. The valid field of each one is set
+ *                to indicate whether its tag matched; if it didn't, its
+ *                output must not be used.
+ * @param num_packets number of packets. Must be >=0.
+ */
+void BEncryption_AeadDecryptBatch (BEncryption *enc, struct BEncryption_aead_packet *packets, int num_packets);
+
+/**
+ * Encrypts and authenticates a single packet.
+ * Like {@link BEncryption_AeadEncryptBatch} with one packet.
+ * 
+ * @param enc the object
+ * @param nonce nonce, BENCRYPTION_AEAD_NONCE_SIZE bytes
+ * @param in data to encrypt
+ * @param out ciphertext output
+ * @param len number of bytes to encrypt. Must be >=0.
+ * @param tag authentication tag output, BENCRYPTION_AEAD_TAG_SIZE bytes
+ */
+void BEncryption_AeadEncrypt (BEncryption *enc, uint8_t *nonce, uint8_t *in, uint8_t *out, int len, uint8_t *tag);
+
+/**
+ * Decrypts and verifies a single packet.
+ * Like {@link BEncryption_AeadDecryptBatch} with one packet.
+ * 
+ * @param enc the object
+ * @param nonce nonce, BENCRYPTION_AEAD_NONCE_SIZE bytes
+ * @param in data to decrypt
+ * @param out plaintext output
+ * @param len number of bytes to decrypt. Must be >=0.
+ * @param tag authentication tag, BENCRYPTION_AEAD_TAG_SIZE bytes
+ * @return 1 if the tag matched, 0 if not
+ */
+int BEncryption_AeadDecrypt (BEncryption *enc, uint8_t *nonce, uint8_t *in, uint8_t *out, int len, uint8_t *tag) WARN_UNUSED;
+
 #endif
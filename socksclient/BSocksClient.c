@@ -31,6 +31,7 @@
 
 #include <misc/byteorder.h>
 #include <misc/balloc.h>
+#include <misc/minmax.h>
 #include <base/BLog.h>
 
 #include <socksclient/BSocksClient.h>
@@ -52,7 +53,6 @@ static void init_crypto_io(BSocksClient *o);
 static void free_crypto_io(BSocksClient *o);
 static void init_up_io (BSocksClient *o);
 static void free_up_io (BSocksClient *o);
-static int reserve_buffer (BSocksClient *o, bsize_t size);
 static void connector_handler (BSocksClient* o, int is_error);
 static void connection_handler (BSocksClient* o, int event);
 static void build_header(BSocksClient *p);
@@ -62,57 +62,344 @@ void report_error (BSocksClient *o, int error)
     DEBUGERROR(&o->d_err, o->handler(o->user, error))
 }
 
-static void encrypt_handler(BSocksClient *o, uint8_t *data, int data_len)
+static int aead_encrypt_chunk(BSocksClient *o, uint8_t *out, const uint8_t *payload, int payload_len)
+{
+	ASSERT(payload_len <= SS_AEAD_MAX_PAYLOAD_SIZE)
+
+	// encrypted big endian length, then the encrypted payload
+	uint8_t len_buf[2] = {payload_len >> 8, payload_len & 0xFF};
+	int len = aead_encrypt(o->encryptor, o->ss_nonce, len_buf, sizeof(len_buf), out);
+	if (len < 0) {
+		return -1;
+	}
+
+	int payload_out_len = aead_encrypt(o->encryptor, o->ss_nonce, payload, payload_len, out + len);
+	if (payload_out_len < 0) {
+		return -1;
+	}
+
+	return len + payload_out_len;
+}
+
+static int aead_encrypt_data(BSocksClient *o, uint8_t *data, int data_len)
 {
-	// allocate cipher buffer
-	if (!(o->cipher_buffer = BAlloc(data_len * 2)))
+	int pos = 0;
+	int plain_len = 0;
+
+	if (!o->first_packet_sent)
 	{
-		BLog(BLOG_ERROR, "BAlloc failed");
-		return;
+		// generate and copy salt
+		random_iv(o->ss_iv, o->ss_iv_len);
+		memcpy(o->cipher_buffer, o->ss_iv, o->ss_iv_len);
+		pos = o->ss_iv_len;
+
+		// init encryptor with the session subkey
+		if (!encryptor_Init(o->encryptor, o->ss_iv)) {
+			return 0;
+		}
+
+		// the header goes in the first chunk along with the first data;
+		// assemble the payload in place and encrypt it there
+		int n = bmin_int(data_len, BSOCKSCLIENT_SEND_BUF_SIZE - pos - SS_AEAD_CHUNK_OVERHEAD - (int)o->header_len);
+		uint8_t *payload = o->cipher_buffer + pos + 2 + SS_AEAD_TAG_SIZE;
+		memcpy(payload, o->header_buffer, o->header_len);
+		memcpy(payload + o->header_len, data, n);
+
+		int len = aead_encrypt_chunk(o, o->cipher_buffer + pos, payload, o->header_len + n);
+		if (len < 0) {
+			return 0;
+		}
+		pos += len;
+		plain_len = n;
+
+		o->first_packet_sent = 1;
 	}
 
-	size_t cipher_buf_len;
-	size_t iv_size = 0;
-	size_t en_header_size = 0;
+	// encrypt chunks until the buffer is full; the rest is passed again
+	// by the sender after we report how much we have taken
+	while (plain_len < data_len && BSOCKSCLIENT_SEND_BUF_SIZE - pos > SS_AEAD_CHUNK_OVERHEAD)
+	{
+		int n = bmin_int(data_len - plain_len, bmin_int(SS_AEAD_MAX_PAYLOAD_SIZE, BSOCKSCLIENT_SEND_BUF_SIZE - pos - SS_AEAD_CHUNK_OVERHEAD));
+
+		int len = aead_encrypt_chunk(o, o->cipher_buffer + pos, data + plain_len, n);
+		if (len < 0) {
+			return 0;
+		}
+		pos += len;
+		plain_len += n;
+	}
+
+	o->plain_len = plain_len;
+	o->cipher_len = pos;
+
+	return 1;
+}
+
+static int encrypt_data(BSocksClient *o, uint8_t *data, int data_len)
+{
+	if (ss_crypto_info.is_aead)
+	{
+		return aead_encrypt_data(o, data, data_len);
+	}
+
+	int prefix_len = 0;
 
 	// IV and header only need in the first packet
 	if (!o->first_packet_sent)
 	{
 		// generate and copy IV
-		iv_size = o->ss_iv_len;
-		random_iv(o->ss_iv, iv_size);
-		memcpy(o->cipher_buffer, o->ss_iv, iv_size);
+		random_iv(o->ss_iv, o->ss_iv_len);
+		memcpy(o->cipher_buffer, o->ss_iv, o->ss_iv_len);
+		prefix_len = o->ss_iv_len;
 
 		// init encryptor
 		encryptor_Init(o->encryptor, o->ss_iv);
 
 		// copy header
-		en_header_size = encrypt(o->encryptor, o->header_buffer, o->header_len, o->cipher_buffer + iv_size);
+		prefix_len += encrypt(o->encryptor, o->header_buffer, o->header_len, o->cipher_buffer + prefix_len);
 
 		o->first_packet_sent = 1;
 	}
 
-	cipher_buf_len = encrypt(o->encryptor, data, data_len, o->cipher_buffer + iv_size + en_header_size);
-	cipher_buf_len += iv_size += en_header_size;
+	// encrypt as much as fits in the buffer; the rest is passed again
+	// by the sender after we report how much we have taken
+	o->plain_len = bmin_int(data_len, BSOCKSCLIENT_SEND_BUF_SIZE - prefix_len);
+	o->cipher_len = prefix_len + encrypt(o->encryptor, data, o->plain_len, o->cipher_buffer + prefix_len);
+
+	return 1;
+}
+
+static void send_encrypted(BSocksClient *o, int result)
+{
+	if (!result) {
+		report_error(o, BSOCKSCLIENT_EVENT_ERROR);
+		return;
+	}
+
+	o->cipher_sent = 0;
+
+	StreamPassInterface_Sender_Send(&o->con.send.iface, o->cipher_buffer, o->cipher_len);
+}
+
+static void encrypt_work_func(BSocksClient *o)
+{
+	o->send_tw_result = encrypt_data(o, o->send_tw_data, o->send_tw_data_len);
+}
+
+static void encrypt_work_handler_done(BSocksClient *o)
+{
+	DebugObject_Access(&o->d_obj);
+	ASSERT(o->send_tw_have)
+
+	// free work
+	BThreadWork_Free(&o->send_tw);
+	o->send_tw_have = 0;
+
+	send_encrypted(o, o->send_tw_result);
+}
+
+static void encrypt_handler(BSocksClient *o, uint8_t *data, int data_len)
+{
+	ASSERT(data_len > 0)
+	ASSERT(!o->send_tw_have)
+
+	// encrypt larger data in a thread, so that the data of many
+	// connections can be encrypted on multiple cores
+	if (o->twd && data_len >= BSOCKSCLIENT_THREADWORK_MIN_LEN)
+	{
+		o->send_tw_data = data;
+		o->send_tw_data_len = data_len;
+		BThreadWork_Init(&o->send_tw, o->twd, (BThreadWork_handler_done)encrypt_work_handler_done, o, (BThreadWork_work_func)encrypt_work_func, o);
+		o->send_tw_have = 1;
+		return;
+	}
+
+	send_encrypted(o, encrypt_data(o, data, data_len));
+}
 
-	o->plain_len = data_len;
+static void aead_recv_consume(BSocksClient *o, int len)
+{
+	o->aead_recv_start += len;
+	o->aead_recv_len -= len;
+}
+
+static void decrypt_start_work(BSocksClient *o, int len);
 
-	StreamPassInterface_Sender_Send(&o->con.send.iface, o->cipher_buffer, cipher_buf_len);
+static void aead_recv_process(BSocksClient *o)
+{
+	while (1)
+	{
+		// hand out decrypted data first
+		if (o->aead_plain_len > 0)
+		{
+			int n = bmin_int(o->aead_plain_len, o->recv_buf_len);
+			memcpy(o->recv_buf, o->aead_plain, n);
+			o->aead_plain += n;
+			o->aead_plain_len -= n;
+
+			StreamRecvInterface_Done(&o->decrypt_if, n);
+			return;
+		}
+
+		uint8_t *cur = o->aead_recv_buf + o->aead_recv_start;
+		int need;
+
+		if (o->ss_remote_iv_recved < o->ss_iv_len)
+		{
+			// salt
+			need = o->ss_iv_len;
+			if (o->aead_recv_len >= need)
+			{
+				memcpy(o->ss_remote_iv, cur, need);
+				o->ss_remote_iv_recved = need;
+				aead_recv_consume(o, need);
+
+				// init decryptor with the session subkey
+				if (!decryptor_Init(o->decryptor, o->ss_remote_iv)) {
+					goto fail;
+				}
+				continue;
+			}
+		}
+		else if (o->aead_chunk_len < 0)
+		{
+			// length of the next chunk
+			need = 2 + SS_AEAD_TAG_SIZE;
+			if (o->aead_recv_len >= need)
+			{
+				uint8_t len_buf[2];
+				if (aead_decrypt(o->decryptor, o->ss_remote_nonce, cur, need, len_buf) < 0) {
+					goto fail;
+				}
+				aead_recv_consume(o, need);
+
+				o->aead_chunk_len = ((int)len_buf[0] << 8) | len_buf[1];
+				if (o->aead_chunk_len > SS_AEAD_MAX_PAYLOAD_SIZE) {
+					BLog(BLOG_ERROR, "AEAD chunk too long");
+					goto fail;
+				}
+				continue;
+			}
+		}
+		else
+		{
+			// chunk payload, decrypted in place
+			need = o->aead_chunk_len + SS_AEAD_TAG_SIZE;
+			if (o->aead_recv_len >= need)
+			{
+				// decrypt larger chunks in a thread; processing continues when it's done
+				if (o->twd && need >= BSOCKSCLIENT_THREADWORK_MIN_LEN)
+				{
+					decrypt_start_work(o, need);
+					return;
+				}
+
+				int len = aead_decrypt(o->decryptor, o->ss_remote_nonce, cur, need, cur);
+				if (len < 0) {
+					goto fail;
+				}
+				aead_recv_consume(o, need);
+
+				o->aead_plain = cur;
+				o->aead_plain_len = len;
+				o->aead_chunk_len = -1;
+				continue;
+			}
+		}
+
+		// not enough data; move what we have to the beginning of the buffer
+		// if what is needed wouldn't fit after it
+		if (o->aead_recv_start + need > BSOCKSCLIENT_AEAD_RECV_BUF_SIZE)
+		{
+			memmove(o->aead_recv_buf, cur, o->aead_recv_len);
+			o->aead_recv_start = 0;
+		}
+
+		// receive as much as fits
+		int end = o->aead_recv_start + o->aead_recv_len;
+		StreamRecvInterface_Receiver_Recv(&o->con.recv.iface, o->aead_recv_buf + end, BSOCKSCLIENT_AEAD_RECV_BUF_SIZE - end);
+		return;
+	}
+
+fail:
+	report_error(o, BSOCKSCLIENT_EVENT_ERROR);
+}
+
+static void decrypt_work_func(BSocksClient *o)
+{
+	if (ss_crypto_info.is_aead)
+	{
+		uint8_t *cur = o->aead_recv_buf + o->aead_recv_start;
+		o->recv_tw_result = aead_decrypt(o->decryptor, o->ss_remote_nonce, cur, o->recv_tw_len, cur);
+		return;
+	}
+
+	o->recv_tw_result = decrypt(o->decryptor, o->recv_buf, o->recv_tw_len, o->recv_buf);
+}
+
+static void decrypt_work_handler_done(BSocksClient *o)
+{
+	DebugObject_Access(&o->d_obj);
+	ASSERT(o->recv_tw_have)
+
+	// free work
+	BThreadWork_Free(&o->recv_tw);
+	o->recv_tw_have = 0;
+
+	if (ss_crypto_info.is_aead)
+	{
+		if (o->recv_tw_result < 0) {
+			report_error(o, BSOCKSCLIENT_EVENT_ERROR);
+			return;
+		}
+
+		uint8_t *cur = o->aead_recv_buf + o->aead_recv_start;
+		aead_recv_consume(o, o->recv_tw_len);
+
+		o->aead_plain = cur;
+		o->aead_plain_len = o->recv_tw_result;
+		o->aead_chunk_len = -1;
+
+		aead_recv_process(o);
+		return;
+	}
+
+	ASSERT(o->recv_tw_result == o->recv_tw_len)
+
+	StreamRecvInterface_Done(&o->decrypt_if, o->recv_tw_result);
+}
+
+static void decrypt_start_work(BSocksClient *o, int len)
+{
+	ASSERT(o->twd)
+	ASSERT(!o->recv_tw_have)
+
+	o->recv_tw_len = len;
+	BThreadWork_Init(&o->recv_tw, o->twd, (BThreadWork_handler_done)decrypt_work_handler_done, o, (BThreadWork_work_func)decrypt_work_func, o);
+	o->recv_tw_have = 1;
 }
 
 static void decrypt_handler(BSocksClient *o, uint8_t *data, int data_len)
 {
-	// allocate recv buffer
-	if (!(o->socks_recv_buf = BAlloc(data_len)))
+	ASSERT(data_len > 0)
+
+	o->recv_buf = data;
+	o->recv_buf_len = data_len;
+
+	if (ss_crypto_info.is_aead)
 	{
-		BLog(BLOG_ERROR, "BAlloc failed");
+		aead_recv_process(o);
 		return;
 	}
 
-	o->decrypted_buf = data;
+	// receive the remote IV first, then data right into the receiver's buffer
+	if (o->ss_remote_iv_recved < o->ss_iv_len)
+	{
+		StreamRecvInterface_Receiver_Recv(&o->con.recv.iface, (uint8_t *)o->ss_remote_iv + o->ss_remote_iv_recved, o->ss_iv_len - o->ss_remote_iv_recved);
+		return;
+	}
 
-	// padding to receive
-	StreamRecvInterface_Receiver_Recv(&o->con.recv.iface, o->socks_recv_buf, data_len);
+	StreamRecvInterface_Receiver_Recv(&o->con.recv.iface, data, data_len);
 }
 
 static void init_crypto_io(BSocksClient *o)
@@ -133,36 +420,65 @@ static void free_crypto_io(BSocksClient *o)
 	StreamRecvInterface_Free(&o->decrypt_if);
 }
 
-static void up_handler_done(BSocksClient *o, int data_len) 
+static void up_handler_done(BSocksClient *o, int data_len)
 {
-	StreamPassInterface_Done(&o->encrypt_if, o->plain_len);
-	o->plain_len = 0;
+	ASSERT(data_len > 0)
+	ASSERT(data_len <= o->cipher_len - o->cipher_sent)
 
-	// free buffer
-	BFree(o->cipher_buffer);
+	o->cipher_sent += data_len;
+
+	// keep sending until all encrypted data is out
+	if (o->cipher_sent < o->cipher_len)
+	{
+		StreamPassInterface_Sender_Send(&o->con.send.iface, o->cipher_buffer + o->cipher_sent, o->cipher_len - o->cipher_sent);
+		return;
+	}
+
+	StreamPassInterface_Done(&o->encrypt_if, o->plain_len);
 }
 
 static void down_handler_done(BSocksClient *o, int data_len)
 {
-	size_t iv_size = 0;
+	ASSERT(data_len > 0)
+
+	if (ss_crypto_info.is_aead)
+	{
+		ASSERT(data_len <= BSOCKSCLIENT_AEAD_RECV_BUF_SIZE - o->aead_recv_start - o->aead_recv_len)
+
+		o->aead_recv_len += data_len;
+		aead_recv_process(o);
+		return;
+	}
 
-	if (!o->first_packet_recved)
+	if (o->ss_remote_iv_recved < o->ss_iv_len)
 	{
-		memcpy(o->ss_remote_iv, o->socks_recv_buf, o->ss_iv_len);
-		iv_size = o->ss_iv_len;
+		o->ss_remote_iv_recved += data_len;
+		if (o->ss_remote_iv_recved < o->ss_iv_len)
+		{
+			StreamRecvInterface_Receiver_Recv(&o->con.recv.iface, (uint8_t *)o->ss_remote_iv + o->ss_remote_iv_recved, o->ss_iv_len - o->ss_remote_iv_recved);
+			return;
+		}
 
 		// init decryptor
 		decryptor_Init(o->decryptor, o->ss_remote_iv);
 
-		o->first_packet_recved = 1;
+		// receive data
+		StreamRecvInterface_Receiver_Recv(&o->con.recv.iface, o->recv_buf, o->recv_buf_len);
+		return;
 	}
 
-	size_t len = decrypt(o->decryptor, o->socks_recv_buf + iv_size, data_len - iv_size, o->decrypted_buf);
+	// decrypt larger data in a thread
+	if (o->twd && data_len >= BSOCKSCLIENT_THREADWORK_MIN_LEN)
+	{
+		decrypt_start_work(o, data_len);
+		return;
+	}
 
-	StreamRecvInterface_Done(&o->decrypt_if, len);
+	// decrypt in place; stream ciphers produce as much as they are given
+	int len = decrypt(o->decryptor, o->recv_buf, data_len, o->recv_buf);
+	ASSERT(len == data_len)
 
-	// free buffer
-	BFree(o->socks_recv_buf);
+	StreamRecvInterface_Done(&o->decrypt_if, len);
 }
 
 void init_up_io (BSocksClient *o)
@@ -185,23 +501,6 @@ void free_up_io (BSocksClient *o)
     BConnection_RecvAsync_Free(&o->con);
 }
 
-int reserve_buffer (BSocksClient *o, bsize_t size)
-{
-    if (size.is_overflow) {
-        BLog(BLOG_ERROR, "size overflow");
-        return 0;
-    }
-    
-    char *buffer = (char *)BRealloc(o->header_buffer, size.value);
-    if (!buffer) {
-        BLog(BLOG_ERROR, "BRealloc failed");
-        return 0;
-    }
-    
-    o->header_buffer = buffer;
-    
-    return 1;
-}
 void connector_handler (BSocksClient* o, int is_error)
 {
     DebugObject_Access(&o->d_obj);
@@ -213,24 +512,53 @@ void connector_handler (BSocksClient* o, int is_error)
         goto fail0;
     }
     
+	// init cryptor
+	if (!(o->encryptor = cryptor_new())) {
+		BLog(BLOG_ERROR, "cryptor_new failed");
+		goto fail0;
+	}
+	if (!(o->decryptor = cryptor_new())) {
+		BLog(BLOG_ERROR, "cryptor_new failed");
+		goto fail1;
+	}
+
+	// allocate send buffer, with space for the IV and header
+	if (!(o->cipher_buffer = (uint8_t *)BAlloc(BSOCKSCLIENT_SEND_BUF_SIZE))) {
+		BLog(BLOG_ERROR, "BAlloc failed");
+		goto fail2;
+	}
+
+	// allocate buffer for received AEAD chunks
+	o->aead_recv_buf = NULL;
+	if (ss_crypto_info.is_aead && !(o->aead_recv_buf = (uint8_t *)BAlloc(BSOCKSCLIENT_AEAD_RECV_BUF_SIZE))) {
+		BLog(BLOG_ERROR, "BAlloc failed");
+		goto fail3;
+	}
+    
     // init connection
     if (!BConnection_Init(&o->con, BConnection_source_connector(&o->connector), o->reactor, o, (BConnection_handler)connection_handler)) {
         BLog(BLOG_ERROR, "BConnection_Init failed");
-        goto fail0;
+        goto fail4;
     }
     
     BLog(BLOG_DEBUG, "connected");
 
 	o->first_packet_sent = 0;
-	o->first_packet_recved = 0;
+	o->ss_remote_iv_recved = 0;
+
+	// AEAD nonces start at zero in each direction
+	memset(o->ss_nonce, 0, sizeof(o->ss_nonce));
+	memset(o->ss_remote_nonce, 0, sizeof(o->ss_remote_nonce));
+	o->aead_recv_start = 0;
+	o->aead_recv_len = 0;
+	o->aead_chunk_len = -1;
+	o->aead_plain_len = 0;
+	o->send_tw_have = 0;
+	o->recv_tw_have = 0;
 
 	// init buffer
 	build_header(o);
 
-	// init cryptor
-	o->encryptor = EVP_CIPHER_CTX_new();
-	o->decryptor = EVP_CIPHER_CTX_new();
-
 	// init crypto io
 	init_crypto_io(o);
 
@@ -245,6 +573,14 @@ void connector_handler (BSocksClient* o, int is_error)
     
     return;
     
+fail4:
+	BFree(o->aead_recv_buf);
+fail3:
+	BFree(o->cipher_buffer);
+fail2:
+	cryptor_free(o->decryptor);
+fail1:
+	cryptor_free(o->encryptor);
 fail0:
     report_error(o, BSOCKSCLIENT_EVENT_ERROR);
     return;
@@ -266,17 +602,12 @@ void connection_handler (BSocksClient* o, int event)
 
 void build_header (BSocksClient *o)
 {
-    // allocate request buffer
-    bsize_t size = bsize_fromsize(sizeof(struct socks_request_header));
+    // compute request length; the buffer is large enough for any address
+    o->header_len = sizeof(struct socks_request_header);
     switch (o->dest_addr.type) {
-        case BADDR_TYPE_IPV4: size = bsize_add(size, bsize_fromsize(sizeof(struct socks_addr_ipv4))); break;
-        case BADDR_TYPE_IPV6: size = bsize_add(size, bsize_fromsize(sizeof(struct socks_addr_ipv6))); break;
-    }
-    if (!reserve_buffer(o, size)) {
-        report_error(o, BSOCKSCLIENT_EVENT_ERROR);
-        return;
+        case BADDR_TYPE_IPV4: o->header_len += sizeof(struct socks_addr_ipv4); break;
+        case BADDR_TYPE_IPV6: o->header_len += sizeof(struct socks_addr_ipv6); break;
     }
-	o->header_len = size.value;
     
     // write request
     struct socks_request_header header;
@@ -303,7 +634,8 @@ void build_header (BSocksClient *o)
 
 int BSocksClient_Init (BSocksClient *o,
                        BAddr server_addr, const struct BSocksClient_auth_info *auth_info, size_t num_auth_info,
-                       BAddr dest_addr, BSocksClient_handler handler, void *user, BReactor *reactor)
+                       BAddr dest_addr, BSocksClient_handler handler, void *user, BReactor *reactor,
+                       BThreadWorkDispatcher *twd)
 {
     ASSERT(!BAddr_IsInvalid(&server_addr))
     ASSERT(dest_addr.type == BADDR_TYPE_IPV4 || dest_addr.type == BADDR_TYPE_IPV6)
@@ -313,9 +645,7 @@ int BSocksClient_Init (BSocksClient *o,
     o->handler = handler;
     o->user = user;
     o->reactor = reactor;
-    
-    // set no buffer
-    o->header_buffer = NULL;
+    o->twd = twd;
     
     // init connector
     if (!BConnector_Init(&o->connector, server_addr, o->reactor, o, (BConnector_handler)connector_handler)) {
@@ -323,18 +653,11 @@ int BSocksClient_Init (BSocksClient *o,
         goto fail0;
     }
 
-	// init iv buffer
+	// set IV length
 	o->ss_iv_len = ss_crypto_info.iv_size;
-	if (!(o->ss_iv = BAlloc(o->ss_iv_len)))
-	{
-		BLog(BLOG_ERROR, "BAlloc failed");
-		return 0;
-	}
-	if (!(o->ss_remote_iv = BAlloc(o->ss_iv_len)))
-	{
-		BLog(BLOG_ERROR, "BAlloc failed");
-		return 0;
-	}
+	ASSERT(o->ss_iv_len <= sizeof(o->ss_iv))
+	ASSERT(o->ss_iv_len + sizeof(o->header_buffer) + SS_AEAD_CHUNK_OVERHEAD < BSOCKSCLIENT_SEND_BUF_SIZE)
+	ASSERT(SS_AEAD_MAX_CHUNK_SIZE <= BSOCKSCLIENT_AEAD_RECV_BUF_SIZE)
     
     // set state
     o->state = STATE_CONNECTING;
@@ -354,10 +677,22 @@ void BSocksClient_Free (BSocksClient *o)
     
     if (o->state != STATE_CONNECTING) {
         if (o->state == STATE_UP) {
+			// wait for encryption and decryption in threads to finish
+			if (o->recv_tw_have) {
+				BThreadWork_Free(&o->recv_tw);
+			}
+			if (o->send_tw_have) {
+				BThreadWork_Free(&o->send_tw);
+			}
+
             // free up I/O
             free_up_io(o);
 			free_crypto_io(o);
 
+			// free buffers
+			BFree(o->aead_recv_buf);
+			BFree(o->cipher_buffer);
+
 			// free cryptor
 			cryptor_free(o->encryptor);
 			cryptor_free(o->decryptor);
@@ -369,19 +704,6 @@ void BSocksClient_Free (BSocksClient *o)
     
     // free connector
     BConnector_Free(&o->connector);
-    
-    // free buffer
-    if (o->header_buffer) {
-        BFree(o->header_buffer);
-    }
-	if (o->ss_iv)
-	{
-		BFree(o->ss_iv);
-	}
-	if (o->ss_remote_iv)
-	{
-		BFree(o->ss_remote_iv);
-	}
 }
 
 StreamPassInterface * BSocksClient_GetSendInterface (BSocksClient *o)
@@ -42,6 +42,7 @@
 #include <misc/packed.h>
 #include <base/DebugObject.h>
 #include <system/BConnection.h>
+#include <threadwork/BThreadWork.h>
 
 #include <cryptoman/cryptoman.h>
 
@@ -49,6 +50,17 @@
 #define BSOCKSCLIENT_EVENT_UP 2
 #define BSOCKSCLIENT_EVENT_ERROR_CLOSED 3
 
+// size of the buffer data is encrypted into before sending
+#define BSOCKSCLIENT_SEND_BUF_SIZE 8192
+
+// size of the buffer AEAD chunks are received and decrypted in;
+// must hold at least one chunk of the largest size
+#define BSOCKSCLIENT_AEAD_RECV_BUF_SIZE 32768
+
+// when a thread work dispatcher is given, data at least this long is
+// encrypted or decrypted in a thread; shorter data is done right away
+#define BSOCKSCLIENT_THREADWORK_MIN_LEN 1024
+
 /**
  * Handler for events generated by the SOCKS client.
  * 
@@ -82,6 +94,7 @@ typedef struct {
     BSocksClient_handler handler;
     void *user;
     BReactor *reactor;
+    BThreadWorkDispatcher *twd;
     int state;
     BConnector connector;
     BConnection con;
@@ -90,28 +103,55 @@ typedef struct {
 	StreamPassInterface encrypt_if;
 	StreamRecvInterface decrypt_if;
 
-	// buffer
+	// buffer for encrypted data being sent
 	uint8_t *cipher_buffer;
-	size_t plain_len;
+	int cipher_len;
+	int cipher_sent;
+	int plain_len;
 
-	uint8_t *socks_recv_buf;
-	uint8_t *decrypted_buf;
+	// buffer of the receiver, which data is decrypted in
+	uint8_t *recv_buf;
+	int recv_buf_len;
 
-	char *header_buffer;
+	char header_buffer[sizeof(struct socks_request_header) + sizeof(struct socks_addr_ipv6)];
 	size_t header_len;
 
 	// encryptor, decryptor
 	EVP_CIPHER_CTX *encryptor;
 	EVP_CIPHER_CTX *decryptor;
 	
-	// IV
-	char *ss_iv;
-	char *ss_remote_iv;
+	// IV, or salt for AEAD ciphers
+	char ss_iv[SS_MAX_IV_SIZE];
+	char ss_remote_iv[SS_MAX_IV_SIZE];
 	size_t ss_iv_len;
+	size_t ss_remote_iv_recved;
+
+	// AEAD nonces
+	uint8_t ss_nonce[SS_AEAD_NONCE_SIZE];
+	uint8_t ss_remote_nonce[SS_AEAD_NONCE_SIZE];
+
+	// buffer AEAD chunks are received in and decrypted in place;
+	// aead_chunk_len is -1 until the length of the next chunk is known
+	uint8_t *aead_recv_buf;
+	int aead_recv_start;
+	int aead_recv_len;
+	int aead_chunk_len;
+	uint8_t *aead_plain;
+	int aead_plain_len;
 
 	// is first packet
 	int first_packet_sent;
-	int first_packet_recved;
+
+	// encryption and decryption in threads
+	BThreadWork send_tw;
+	int send_tw_have;
+	uint8_t *send_tw_data;
+	int send_tw_data_len;
+	int send_tw_result;
+	BThreadWork recv_tw;
+	int recv_tw_have;
+	int recv_tw_len;
+	int recv_tw_result;
 
     DebugError d_err;
     DebugObject d_obj;
@@ -131,11 +171,14 @@ struct BSocksClient_auth_info BSocksClient_auth_password (const char *username,
  * @param handler handler for up and error events
  * @param user value passed to handler
  * @param reactor reactor we live in
+ * @param twd thread work dispatcher to encrypt and decrypt data in threads,
+ *            or NULL to do it in the event loop
  * @return 1 on success, 0 on failure
  */
 int BSocksClient_Init (BSocksClient *o,
                        BAddr server_addr, const struct BSocksClient_auth_info *auth_info, size_t num_auth_info,
-                       BAddr dest_addr, BSocksClient_handler handler, void *user, BReactor *reactor) WARN_UNUSED;
+                       BAddr dest_addr, BSocksClient_handler handler, void *user, BReactor *reactor,
+                       BThreadWorkDispatcher *twd) WARN_UNUSED;
 
 /**
  * Frees the object.
@@ -53,6 +53,11 @@ struct ChunkBuffer2_block {
     int len;
 };
 
+struct ChunkBuffer2_packet {
+    uint8_t *data;
+    int len;
+};
+
 typedef struct {
     struct ChunkBuffer2_block *buffer;
     int size;
@@ -78,6 +83,9 @@ static void ChunkBuffer2_SubmitPacket (ChunkBuffer2 *buf, int len);
 // remove the first packet
 static void ChunkBuffer2_ConsumePacket (ChunkBuffer2 *buf);
 
+// get up to 'max' packets from the front of the buffer without removing them
+static int ChunkBuffer2_PeekPackets (ChunkBuffer2 *buf, struct ChunkBuffer2_packet *packets, int max);
+
 static int _ChunkBuffer2_end (ChunkBuffer2 *buf)
 {
     if (buf->used >= buf->wrap - buf->start) {
@@ -314,4 +322,36 @@ void ChunkBuffer2_ConsumePacket (ChunkBuffer2 *buf)
     CHUNKBUFFER2_ASSERT_IO(buf)
 }
 
+int ChunkBuffer2_PeekPackets (ChunkBuffer2 *buf, struct ChunkBuffer2_packet *packets, int max)
+{
+    ASSERT(max > 0)
+    
+    CHUNKBUFFER2_ASSERT_BUFFER(buf)
+    CHUNKBUFFER2_ASSERT_IO(buf)
+    
+    int num = 0;
+    int pos = buf->start;
+    int left = buf->used;
+    
+    while (num < max && left > 0) {
+        int datalen = buf->buffer[pos].len;
+        int blocklen = bdivide_up(datalen, sizeof(struct ChunkBuffer2_block));
+        
+        ASSERT(blocklen <= left - 1)
+        
+        packets[num].data = (uint8_t *)&buf->buffer[pos + 1];
+        packets[num].len = datalen;
+        num++;
+        
+        // packets continue at the beginning after the wrap point
+        pos += 1 + blocklen;
+        left -= 1 + blocklen;
+        if (pos == buf->wrap) {
+            pos = 0;
+        }
+    }
+    
+    return num;
+}
+
 #endif
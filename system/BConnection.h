@@ -57,6 +57,7 @@ struct BLisCon_from {
     union {
         struct {
             BAddr addr;
+            int reuse_port;
         } from_addr;
 #ifndef BADVPN_USE_WINAPI
         struct {
@@ -71,9 +72,24 @@ static struct BLisCon_from BLisCon_from_addr (BAddr addr)
     struct BLisCon_from res;
     res.type = BLISCON_FROM_ADDR;
     res.u.from_addr.addr = addr;
+    res.u.from_addr.reuse_port = 0;
     return res;
 }
 
+#ifndef BADVPN_USE_WINAPI
+/**
+ * Like {@link BLisCon_from_addr}, but a listener will set SO_REUSEPORT,
+ * so that multiple listeners can share the address, each receiving a
+ * part of the incoming connections.
+ */
+static struct BLisCon_from BLisCon_from_addr_reuse_port (BAddr addr)
+{
+    struct BLisCon_from res = BLisCon_from_addr(addr);
+    res.u.from_addr.reuse_port = 1;
+    return res;
+}
+#endif
+
 #ifndef BADVPN_USE_WINAPI
 static struct BLisCon_from BLisCon_from_unix (char const *socket_path)
 {
@@ -151,6 +151,24 @@ int BDatagram_SetReuseAddr (BDatagram *o, int reuse);
  */
 void BDatagram_SendAsync_Init (BDatagram *o, int mtu);
 
+/**
+ * Initializes the send interface, with batching of outgoing datagrams.
+ * The send interface must not be initialized.
+ * Packets submitted to the interface are copied into a batch buffer and completed
+ * immediately, as long as they fit. The batch is sent once the pending jobs scheduled
+ * after the first packet was added have run, using a single sendmmsg() call, or a single
+ * UDP GSO send if the packets allow it. Errors are reported asynchronously as usual.
+ * Batching is only implemented on Linux; elsewhere this is the same as
+ * {@link BDatagram_SendAsync_Init}.
+ * 
+ * @param o the object
+ * @param mtu maximum transmission unit. Must be >=0.
+ * @param batch_size size of the batch buffer in bytes. Must be >0.
+ * @param batch_max_packets maximum number of packets in a batch. Must be >0.
+ * @return 1 on success, 0 on failure
+ */
+int BDatagram_SendAsync_InitBatch (BDatagram *o, int mtu, int batch_size, int batch_max_packets) WARN_UNUSED;
+
 /**
  * Frees the send interface.
  * The send interface must be initialized.
@@ -180,6 +198,28 @@ PacketPassInterface * BDatagram_SendAsync_GetIf (BDatagram *o);
  */
 void BDatagram_RecvAsync_Init (BDatagram *o, int mtu);
 
+/**
+ * Initializes the receive interface, with batching of incoming datagrams.
+ * The receive interface must not be initialized.
+ * Once datagrams arrive faster than they are received one per operation, a batch buffer
+ * is allocated and each recvmmsg() call receives up to batch_max_packets datagrams. The
+ * first goes directly into the receiver's buffer, the others are held in the batch buffer
+ * and completed by the following receive operations without any system calls.
+ * The batch buffer is divided into slots sized for the largest datagram received so far,
+ * not for the MTU. A larger datagram which arrives into a batch slot is dropped, and the
+ * slots are made larger for the following batches.
+ * {@link BDatagram_GetLastReceiveAddrs} returns the addresses of each datagram as it is
+ * delivered.
+ * Batching is only implemented on Linux; elsewhere this is the same as
+ * {@link BDatagram_RecvAsync_Init}.
+ * 
+ * @param o the object
+ * @param mtu maximum transmission unit. Must be >=0.
+ * @param batch_size maximum size of the batch buffer in bytes. Must be >0.
+ * @param batch_max_packets maximum number of datagrams received at once. Must be >0.
+ */
+void BDatagram_RecvAsync_InitBatch (BDatagram *o, int mtu, int batch_size, int batch_max_packets);
+
 /**
  * Frees the receive interface.
  * The receive interface must be initialized.
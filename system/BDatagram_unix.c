@@ -37,18 +37,25 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #ifdef BADVPN_LINUX
 #    include <netpacket/packet.h>
 #    include <net/ethernet.h>
+#    include <netinet/udp.h>
 #endif
 
 #include <misc/nonblocking.h>
+#include <misc/balloc.h>
+#include <misc/minmax.h>
 #include <base/BLog.h>
 
 #include "BDatagram.h"
 
 #include <generated/blog_channel_BDatagram.h>
 
+// granularity of the batch receive slot size
+#define RECV_BATCH_SLOT_ALIGN 512
+
 struct sys_addr {
     socklen_t len;
     union {
@@ -61,13 +68,60 @@ struct sys_addr {
     } addr;
 };
 
+#ifdef UDP_SEGMENT
+#define GSO_CONTROL_SPACE CMSG_SPACE(sizeof(uint16_t))
+#else
+#define GSO_CONTROL_SPACE 0
+#endif
+
+union send_control {
+    struct cmsghdr hdr;
+#ifdef BADVPN_FREEBSD
+    char in[CMSG_SPACE(sizeof(struct in_addr)) + GSO_CONTROL_SPACE];
+#else
+    char in[CMSG_SPACE(sizeof(struct in_pktinfo)) + GSO_CONTROL_SPACE];
+#endif
+    char in6[CMSG_SPACE(sizeof(struct in6_pktinfo)) + GSO_CONTROL_SPACE];
+};
+
+union recv_control {
+    struct cmsghdr hdr;
+#ifdef BADVPN_FREEBSD
+    char in[CMSG_SPACE(sizeof(struct in_addr))];
+#else
+    char in[CMSG_SPACE(sizeof(struct in_pktinfo))];
+#endif
+    char in6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+};
+
+struct BDatagram_recv_slot {
+    struct sys_addr addr;
+    union recv_control cdata;
+    struct iovec iov;
+};
+
 static int family_socket_to_sys (int family);
 static void addr_socket_to_sys (struct sys_addr *out, BAddr addr);
 static void addr_sys_to_socket (BAddr *out, struct sys_addr addr);
 static void set_pktinfo (int fd, int family);
 static void report_error (BDatagram *o);
+static void add_send_pktinfo (BDatagram *o, struct msghdr *msg);
+static int send_pending (BDatagram *o);
+static void start_recv (BDatagram *o);
 static void do_send (BDatagram *o);
+#ifdef BADVPN_LINUX
+static int do_send_gso (BDatagram *o, struct sys_addr *sysaddr, struct iovec *iovs, int num);
+static void do_send_batch (BDatagram *o);
+#endif
+static void read_recv_addrs (BDatagram *o, struct msghdr *msg, struct sys_addr *sysaddr);
 static void do_recv (BDatagram *o);
+#ifdef BADVPN_LINUX
+static int recv_batch_slot_size (BDatagram *o);
+static void alloc_recv_batch (BDatagram *o);
+static void free_recv_batch (BDatagram *o);
+static void do_recv_batch (BDatagram *o);
+static int deliver_batched (BDatagram *o);
+#endif
 static void fd_handler (BDatagram *o, int events);
 static void send_job_handler (BDatagram *o);
 static void recv_job_handler (BDatagram *o);
@@ -240,50 +294,9 @@ static void report_error (BDatagram *o)
     return;
 }
 
-static void do_send (BDatagram *o)
+static void add_send_pktinfo (BDatagram *o, struct msghdr *msg)
 {
-    DebugError_AssertNoError(&o->d_err);
-    ASSERT(o->send.inited)
-    ASSERT(o->send.busy)
-    ASSERT(o->send.have_addrs)
-    
-    // limit
-    if (!BReactorLimit_Increment(&o->send.limit)) {
-        // wait for fd
-        o->wait_events |= BREACTOR_WRITE;
-        BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
-        return;
-    }
-    
-    // convert destination address
-    struct sys_addr sysaddr;
-    addr_socket_to_sys(&sysaddr, o->send.remote_addr);
-    
-    struct iovec iov;
-    iov.iov_base = (uint8_t *)o->send.busy_data;
-    iov.iov_len = o->send.busy_data_len;
-    
-    union {
-#ifdef BADVPN_FREEBSD
-        char in[CMSG_SPACE(sizeof(struct in_addr))];
-#else
-        char in[CMSG_SPACE(sizeof(struct in_pktinfo))];
-#endif
-        char in6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
-    } cdata;
-    
-    struct msghdr msg;
-    memset(&msg, 0, sizeof(msg));
-    msg.msg_name = &sysaddr.addr.generic;
-    msg.msg_namelen = sysaddr.len;
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
-    msg.msg_control = &cdata;
-    msg.msg_controllen = sizeof(cdata);
-    
-    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-    
-    size_t controllen = 0;
+    struct cmsghdr *cmsg = (struct cmsghdr *)((uint8_t *)msg->msg_control + msg->msg_controllen);
     
     switch (o->send.local_addr.type) {
         case BADDR_TYPE_IPV4: {
@@ -294,7 +307,7 @@ static void do_send (BDatagram *o)
             cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_addr));
             struct in_addr *addrinfo = (struct in_addr *)CMSG_DATA(cmsg);
             addrinfo->s_addr = o->send.local_addr.ipv4;
-            controllen += CMSG_SPACE(sizeof(struct in_addr));
+            msg->msg_controllen += CMSG_SPACE(sizeof(struct in_addr));
 #else
             memset(cmsg, 0, CMSG_SPACE(sizeof(struct in_pktinfo)));
             cmsg->cmsg_level = IPPROTO_IP;
@@ -302,7 +315,7 @@ static void do_send (BDatagram *o)
             cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
             struct in_pktinfo *pktinfo = (struct in_pktinfo *)CMSG_DATA(cmsg);
             pktinfo->ipi_spec_dst.s_addr = o->send.local_addr.ipv4;
-            controllen += CMSG_SPACE(sizeof(struct in_pktinfo));
+            msg->msg_controllen += CMSG_SPACE(sizeof(struct in_pktinfo));
 #endif
         } break;
         
@@ -313,11 +326,74 @@ static void do_send (BDatagram *o)
             cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
             struct in6_pktinfo *pktinfo = (struct in6_pktinfo *)CMSG_DATA(cmsg);
             memcpy(pktinfo->ipi6_addr.s6_addr, o->send.local_addr.ipv6, 16);
-            controllen += CMSG_SPACE(sizeof(struct in6_pktinfo));
+            msg->msg_controllen += CMSG_SPACE(sizeof(struct in6_pktinfo));
         } break;
     }
+}
+
+static int send_pending (BDatagram *o)
+{
+    return (o->send.busy || o->send.batch_count > 0);
+}
+
+static void start_recv (BDatagram *o)
+{
+    // if recv wasn't started yet, start it
+    if (!o->recv.started) {
+        // set recv started
+        o->recv.started = 1;
+        
+        // continue receiving
+        if (o->recv.inited && o->recv.busy) {
+            BPending_Set(&o->recv.job);
+        }
+    }
+}
+
+static void do_send (BDatagram *o)
+{
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(o->send.inited)
+    ASSERT(send_pending(o))
+    ASSERT(o->send.have_addrs)
+    
+    // limit
+    if (!BReactorLimit_Increment(&o->send.limit)) {
+        // wait for fd
+        o->wait_events |= BREACTOR_WRITE;
+        BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+        return;
+    }
+    
+#ifdef BADVPN_LINUX
+    if (o->send.batch_size > 0) {
+        do_send_batch(o);
+        return;
+    }
+#endif
+    
+    ASSERT(o->send.busy)
+    
+    // convert destination address
+    struct sys_addr sysaddr;
+    addr_socket_to_sys(&sysaddr, o->send.remote_addr);
+    
+    struct iovec iov;
+    iov.iov_base = (uint8_t *)o->send.busy_data;
+    iov.iov_len = o->send.busy_data_len;
+    
+    union send_control cdata;
     
-    msg.msg_controllen = controllen;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &sysaddr.addr.generic;
+    msg.msg_namelen = sysaddr.len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = &cdata;
+    msg.msg_controllen = 0;
+    
+    add_send_pktinfo(o, &msg);
     
     if (msg.msg_controllen == 0) {
         msg.msg_control = NULL;
@@ -344,16 +420,7 @@ static void do_send (BDatagram *o)
         BLog(BLOG_ERROR, "send sent too little");
     }
     
-    // if recv wasn't started yet, start it
-    if (!o->recv.started) {
-        // set recv started
-        o->recv.started = 1;
-        
-        // continue receiving
-        if (o->recv.inited && o->recv.busy) {
-            BPending_Set(&o->recv.job);
-        }
-    }
+    start_recv(o);
     
     // set not busy
     o->send.busy = 0;
@@ -362,6 +429,233 @@ static void do_send (BDatagram *o)
     PacketPassInterface_Done(&o->send.iface);
 }
 
+#ifdef BADVPN_LINUX
+
+static int do_send_gso (BDatagram *o, struct sys_addr *sysaddr, struct iovec *iovs, int num)
+{
+    ASSERT(num > 0)
+    
+    // return value 1 means the packets were sent, 0 means GSO can't be used for them
+    // and nothing was done, -1 means we're waiting for the fd or an error was reported
+    
+#ifdef UDP_SEGMENT
+    if (!o->send.batch_gso || num < 2 || num > BDATAGRAM_GSO_MAX_SEGMENTS) {
+        return 0;
+    }
+    
+    if (o->send.remote_addr.type != BADDR_TYPE_IPV4 && o->send.remote_addr.type != BADDR_TYPE_IPV6) {
+        return 0;
+    }
+    
+    // the kernel splits the data into segments of the size of the first packet,
+    // so all packets must have that size, except the last one which may be smaller;
+    // an empty last packet would produce no segment and be lost
+    size_t segment_size = iovs[0].iov_len;
+    size_t total = segment_size;
+    for (int i = 1; i < num; i++) {
+        if (iovs[i].iov_len == 0 || iovs[i].iov_len > segment_size || (iovs[i].iov_len < segment_size && i < num - 1)) {
+            return 0;
+        }
+        total += iovs[i].iov_len;
+    }
+    
+    if (segment_size == 0 || total > BDATAGRAM_GSO_MAX_BYTES) {
+        return 0;
+    }
+    
+    union send_control cdata;
+    
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &sysaddr->addr.generic;
+    msg.msg_namelen = sysaddr->len;
+    msg.msg_iov = iovs;
+    msg.msg_iovlen = num;
+    msg.msg_control = &cdata;
+    msg.msg_controllen = 0;
+    
+    add_send_pktinfo(o, &msg);
+    
+    struct cmsghdr *cmsg = (struct cmsghdr *)((uint8_t *)msg.msg_control + msg.msg_controllen);
+    memset(cmsg, 0, CMSG_SPACE(sizeof(uint16_t)));
+    cmsg->cmsg_level = IPPROTO_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t gso_size = segment_size;
+    memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+    msg.msg_controllen += CMSG_SPACE(sizeof(uint16_t));
+    
+    // send
+    int bytes = sendmsg(o->fd, &msg, 0);
+    if (bytes < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // wait for fd
+            o->wait_events |= BREACTOR_WRITE;
+            BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+            return -1;
+        }
+        
+        if (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP) {
+            BLog(BLOG_INFO, "UDP GSO not usable, sending packets separately");
+            o->send.batch_gso = 0;
+            return 0;
+        }
+        
+        report_error(o);
+        return -1;
+    }
+    
+    if (bytes < total) {
+        BLog(BLOG_ERROR, "send sent too little");
+    }
+    
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+static void do_send_batch (BDatagram *o)
+{
+    ASSERT(o->send.batch_size > 0)
+    ASSERT(send_pending(o))
+    ASSERT(o->send.have_addrs)
+    
+    struct iovec *iovs = o->send.batch_iovs + o->send.batch_first;
+    int num = o->send.batch_count;
+    
+    // a packet which didn't fit into the batch is sent last, from the sender's buffer
+    if (o->send.busy) {
+        iovs[num].iov_base = (uint8_t *)o->send.busy_data;
+        iovs[num].iov_len = o->send.busy_data_len;
+        num++;
+    }
+    
+    // convert destination address
+    struct sys_addr sysaddr;
+    addr_socket_to_sys(&sysaddr, o->send.remote_addr);
+    
+    int sent;
+    
+    // try sending all packets with a single GSO send
+    int gso_res = do_send_gso(o, &sysaddr, iovs, num);
+    if (gso_res < 0) {
+        return;
+    }
+    
+    if (gso_res > 0) {
+        sent = num;
+    } else {
+        union send_control cdata;
+        
+        struct msghdr control_msg;
+        memset(&control_msg, 0, sizeof(control_msg));
+        control_msg.msg_control = &cdata;
+        control_msg.msg_controllen = 0;
+        
+        add_send_pktinfo(o, &control_msg);
+        
+        // all packets share the destination and control data
+        struct mmsghdr *msgs = o->send.batch_msgs;
+        for (int i = 0; i < num; i++) {
+            memset(&msgs[i], 0, sizeof(msgs[i]));
+            msgs[i].msg_hdr.msg_name = &sysaddr.addr.generic;
+            msgs[i].msg_hdr.msg_namelen = sysaddr.len;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = (control_msg.msg_controllen > 0 ? &cdata : NULL);
+            msgs[i].msg_hdr.msg_controllen = control_msg.msg_controllen;
+        }
+        
+        // send
+        sent = sendmmsg(o->fd, msgs, num, 0);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // wait for fd
+                o->wait_events |= BREACTOR_WRITE;
+                BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+                return;
+            }
+            
+            report_error(o);
+            return;
+        }
+        
+        ASSERT(sent > 0)
+        ASSERT(sent <= num)
+        
+        for (int i = 0; i < sent; i++) {
+            if (msgs[i].msg_len < iovs[i].iov_len) {
+                BLog(BLOG_ERROR, "send sent too little");
+            }
+        }
+    }
+    
+    start_recv(o);
+    
+    if (sent < num) {
+        // the busy packet is last, so only batched packets were sent
+        ASSERT(sent < o->send.batch_count || (o->send.busy && sent == o->send.batch_count))
+        
+        // remove sent packets from the batch
+        o->send.batch_first += sent;
+        o->send.batch_count -= sent;
+        if (o->send.batch_count == 0) {
+            o->send.batch_first = 0;
+            o->send.batch_used = 0;
+        }
+        
+        // continue sending
+        BPending_Set(&o->send.job);
+        return;
+    }
+    
+    // batch is empty
+    o->send.batch_first = 0;
+    o->send.batch_count = 0;
+    o->send.batch_used = 0;
+    
+    if (o->send.busy) {
+        // set not busy
+        o->send.busy = 0;
+        
+        // done
+        PacketPassInterface_Done(&o->send.iface);
+    }
+}
+
+#endif
+
+static void read_recv_addrs (BDatagram *o, struct msghdr *msg, struct sys_addr *sysaddr)
+{
+    // read returned address
+    sysaddr->len = msg->msg_namelen;
+    addr_sys_to_socket(&o->recv.remote_addr, *sysaddr);
+    
+    // read returned local address
+    BIPAddr_InitInvalid(&o->recv.local_addr);
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+#ifdef BADVPN_FREEBSD
+        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVDSTADDR) {
+            struct in_addr *addrinfo = (struct in_addr *)CMSG_DATA(cmsg);
+            BIPAddr_InitIPv4(&o->recv.local_addr, addrinfo->s_addr);
+        }
+#else
+        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+            struct in_pktinfo *pktinfo = (struct in_pktinfo *)CMSG_DATA(cmsg);
+            BIPAddr_InitIPv4(&o->recv.local_addr, pktinfo->ipi_addr.s_addr);
+        }
+#endif
+        else if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO) {
+            struct in6_pktinfo *pktinfo = (struct in6_pktinfo *)CMSG_DATA(cmsg);
+            BIPAddr_InitIPv6(&o->recv.local_addr, pktinfo->ipi6_addr.s6_addr);
+        }
+    }
+    
+    // set have addresses
+    o->recv.have_addrs = 1;
+}
+
 static void do_recv (BDatagram *o)
 {
     DebugError_AssertNoError(&o->d_err);
@@ -369,28 +663,51 @@ static void do_recv (BDatagram *o)
     ASSERT(o->recv.busy)
     ASSERT(o->recv.started)
     
+#ifdef BADVPN_LINUX
+    // deliver packets remaining from a batch receive
+    while (o->recv.batch_pos < o->recv.batch_end) {
+        if (deliver_batched(o)) {
+            return;
+        }
+    }
+#endif
+    
     // limit
     if (!BReactorLimit_Increment(&o->recv.limit)) {
+#ifdef BADVPN_LINUX
+        // datagrams are arriving faster than we receive them one by one; start
+        // receiving them in batches
+        if (o->recv.batch_max_packets > 1 && !o->recv.batch_buf) {
+            alloc_recv_batch(o);
+        }
+#endif
+        
         // wait for fd
         o->wait_events |= BREACTOR_READ;
         BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
         return;
     }
     
+#ifdef BADVPN_LINUX
+    // larger datagrams than fit into the batch slots have been seen; make the slots larger
+    if (o->recv.batch_buf && recv_batch_slot_size(o) > o->recv.batch_slot_size) {
+        free_recv_batch(o);
+        alloc_recv_batch(o);
+    }
+    
+    if (o->recv.batch_buf) {
+        do_recv_batch(o);
+        return;
+    }
+#endif
+    
     struct sys_addr sysaddr;
     
     struct iovec iov;
     iov.iov_base = o->recv.busy_data;
     iov.iov_len = o->recv.mtu;
     
-    union {
-#ifdef BADVPN_FREEBSD
-        char in[CMSG_SPACE(sizeof(struct in_addr))];
-#else
-        char in[CMSG_SPACE(sizeof(struct in_pktinfo))];
-#endif
-        char in6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
-    } cdata;
+    union recv_control cdata;
     
     struct msghdr msg;
     memset(&msg, 0, sizeof(msg));
@@ -419,40 +736,186 @@ static void do_recv (BDatagram *o)
     ASSERT(bytes >= 0)
     ASSERT(bytes <= o->recv.mtu)
     
-    // read returned address
-    sysaddr.len = msg.msg_namelen;
-    addr_sys_to_socket(&o->recv.remote_addr, sysaddr);
+#ifdef BADVPN_LINUX
+    // remember the largest datagram, to size batch slots for it
+    o->recv.batch_max_len = bmax_int(o->recv.batch_max_len, bytes);
+#endif
     
-    // read returned local address
-    BIPAddr_InitInvalid(&o->recv.local_addr);
-    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-#ifdef BADVPN_FREEBSD
-        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVDSTADDR) {
-            struct in_addr *addrinfo = (struct in_addr *)CMSG_DATA(cmsg);
-            BIPAddr_InitIPv4(&o->recv.local_addr, addrinfo->s_addr);
-        }
-#else
-        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
-            struct in_pktinfo *pktinfo = (struct in_pktinfo *)CMSG_DATA(cmsg);
-            BIPAddr_InitIPv4(&o->recv.local_addr, pktinfo->ipi_addr.s_addr);
+    // read addresses
+    read_recv_addrs(o, &msg, &sysaddr);
+    
+    // set not busy
+    o->recv.busy = 0;
+    
+    // done
+    PacketRecvInterface_Done(&o->recv.iface, bytes);
+}
+
+#ifdef BADVPN_LINUX
+
+static int recv_batch_slot_size (BDatagram *o)
+{
+    // the largest datagram seen so far, rounded up, but no more than the MTU
+    if (o->recv.batch_max_len > o->recv.mtu - RECV_BATCH_SLOT_ALIGN) {
+        return o->recv.mtu;
+    }
+    
+    return (o->recv.batch_max_len / RECV_BATCH_SLOT_ALIGN + 1) * RECV_BATCH_SLOT_ALIGN;
+}
+
+static void alloc_recv_batch (BDatagram *o)
+{
+    ASSERT(o->recv.batch_max_packets > 1)
+    ASSERT(!o->recv.batch_buf)
+    
+    int slot_size = recv_batch_slot_size(o);
+    int num_slots = bmin_int(o->recv.batch_max_packets - 1, o->recv.batch_size / slot_size);
+    if (num_slots == 0) {
+        return;
+    }
+    
+    // the first packet of a batch is received into the receiver's buffer
+    if (!(o->recv.batch_slots = (struct BDatagram_recv_slot *)BAllocArray(num_slots + 1, sizeof(o->recv.batch_slots[0])))) {
+        goto fail0;
+    }
+    if (!(o->recv.batch_msgs = (struct mmsghdr *)BAllocArray(num_slots + 1, sizeof(o->recv.batch_msgs[0])))) {
+        goto fail1;
+    }
+    if (!(o->recv.batch_buf = (uint8_t *)BAllocArray(num_slots, slot_size))) {
+        goto fail2;
+    }
+    
+    o->recv.batch_num_slots = num_slots;
+    o->recv.batch_slot_size = slot_size;
+    
+    return;
+    
+fail2:
+    BFree(o->recv.batch_msgs);
+fail1:
+    BFree(o->recv.batch_slots);
+fail0:
+    BLog(BLOG_ERROR, "failed to allocate receive batch, receiving without batching");
+    o->recv.batch_max_packets = 0;
+}
+
+static void free_recv_batch (BDatagram *o)
+{
+    if (o->recv.batch_buf) {
+        BFree(o->recv.batch_buf);
+        BFree(o->recv.batch_msgs);
+        BFree(o->recv.batch_slots);
+        o->recv.batch_buf = NULL;
+    }
+}
+
+static void do_recv_batch (BDatagram *o)
+{
+    ASSERT(o->recv.batch_buf)
+    ASSERT(o->recv.batch_pos == o->recv.batch_end)
+    
+    int num = o->recv.batch_num_slots + 1;
+    
+    for (int i = 0; i < num; i++) {
+        struct BDatagram_recv_slot *slot = &o->recv.batch_slots[i];
+        if (i == 0) {
+            slot->iov.iov_base = o->recv.busy_data;
+            slot->iov.iov_len = o->recv.mtu;
+        } else {
+            slot->iov.iov_base = o->recv.batch_buf + (size_t)(i - 1) * o->recv.batch_slot_size;
+            slot->iov.iov_len = o->recv.batch_slot_size;
         }
-#endif
-        else if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO) {
-            struct in6_pktinfo *pktinfo = (struct in6_pktinfo *)CMSG_DATA(cmsg);
-            BIPAddr_InitIPv6(&o->recv.local_addr, pktinfo->ipi6_addr.s6_addr);
+        
+        struct msghdr *msg = &o->recv.batch_msgs[i].msg_hdr;
+        memset(msg, 0, sizeof(*msg));
+        msg->msg_name = &slot->addr.addr.generic;
+        msg->msg_namelen = sizeof(slot->addr.addr);
+        msg->msg_iov = &slot->iov;
+        msg->msg_iovlen = 1;
+        msg->msg_control = &slot->cdata;
+        msg->msg_controllen = sizeof(slot->cdata);
+    }
+    
+    // recv as many packets as there are, up to the number of slots; with MSG_TRUNC,
+    // the lengths reported are those of the datagrams, even if they didn't fit
+    int res = recvmmsg(o->fd, o->recv.batch_msgs, num, MSG_TRUNC, NULL);
+    if (res < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // wait for fd
+            o->wait_events |= BREACTOR_READ;
+            BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, o->wait_events);
+            return;
         }
+        
+        BLog(BLOG_ERROR, "recv failed");
+        report_error(o);
+        return;
     }
     
-    // set have addresses
-    o->recv.have_addrs = 1;
+    ASSERT(res > 0)
+    ASSERT(res <= num)
+    
+    // remember the largest datagram, to size batch slots for it
+    for (int i = 0; i < res; i++) {
+        o->recv.batch_max_len = bmax_int(o->recv.batch_max_len, bmin_int(o->recv.batch_msgs[i].msg_len, o->recv.mtu));
+    }
+    
+    // like recvmsg(), pass on the part of a too large datagram that fits
+    int bytes = bmin_int(o->recv.batch_msgs[0].msg_len, o->recv.mtu);
+    
+    // read addresses
+    read_recv_addrs(o, &o->recv.batch_msgs[0].msg_hdr, &o->recv.batch_slots[0].addr);
+    
+    // remember further packets, to be delivered on the following receive operations
+    o->recv.batch_pos = 1;
+    o->recv.batch_end = res;
+    
+    // set not busy
+    o->recv.busy = 0;
+    
+    // done
+    PacketRecvInterface_Done(&o->recv.iface, bytes);
+}
+
+static int deliver_batched (BDatagram *o)
+{
+    ASSERT(o->recv.batch_pos < o->recv.batch_end)
+    
+    int i = o->recv.batch_pos++;
+    
+    if (o->recv.batch_pos == o->recv.batch_end) {
+        o->recv.batch_pos = 0;
+        o->recv.batch_end = 0;
+    }
+    
+    // drop the datagram if it was larger than its slot; the slots will be made larger
+    // before the next batch receive
+    if (o->recv.batch_msgs[i].msg_len > o->recv.batch_slots[i].iov.iov_len) {
+        BLog(BLOG_INFO, "dropping datagram larger than the batch slot size");
+        return 0;
+    }
+    
+    int bytes = o->recv.batch_msgs[i].msg_len;
+    ASSERT(bytes >= 0)
+    ASSERT(bytes <= o->recv.batch_slot_size)
+    
+    // copy packet
+    memcpy(o->recv.busy_data, o->recv.batch_slots[i].iov.iov_base, bytes);
+    
+    // read addresses
+    read_recv_addrs(o, &o->recv.batch_msgs[i].msg_hdr, &o->recv.batch_slots[i].addr);
     
     // set not busy
     o->recv.busy = 0;
     
     // done
     PacketRecvInterface_Done(&o->recv.iface, bytes);
+    
+    return 1;
 }
 
+#endif
+
 static void fd_handler (BDatagram *o, int events)
 {
     DebugObject_Access(&o->d_obj);
@@ -465,9 +928,9 @@ static void fd_handler (BDatagram *o, int events)
     int have_send = 0;
     int have_recv = 0;
     
-    if ((events & BREACTOR_WRITE) || ((events & (BREACTOR_ERROR|BREACTOR_HUP)) && o->send.inited && o->send.busy && o->send.have_addrs)) {
+    if ((events & BREACTOR_WRITE) || ((events & (BREACTOR_ERROR|BREACTOR_HUP)) && o->send.inited && send_pending(o) && o->send.have_addrs)) {
         ASSERT(o->send.inited)
-        ASSERT(o->send.busy)
+        ASSERT(send_pending(o))
         ASSERT(o->send.have_addrs)
         
         have_send = 1;
@@ -505,7 +968,7 @@ static void send_job_handler (BDatagram *o)
     DebugObject_Access(&o->d_obj);
     DebugError_AssertNoError(&o->d_err);
     ASSERT(o->send.inited)
-    ASSERT(o->send.busy)
+    ASSERT(send_pending(o))
     ASSERT(o->send.have_addrs)
     
     do_send(o);
@@ -533,6 +996,33 @@ static void send_if_handler_send (BDatagram *o, uint8_t *data, int data_len)
     ASSERT(data_len >= 0)
     ASSERT(data_len <= o->send.mtu)
     
+    // if there's room, copy the packet into the batch and let the sender continue;
+    // the batch is sent once the jobs scheduled in the meantime have run
+    if (o->send.batch_size > 0 && o->send.batch_first + o->send.batch_count < o->send.batch_max_packets &&
+        data_len <= o->send.batch_size - o->send.batch_used
+    ) {
+        uint8_t *dest = o->send.batch_buf + o->send.batch_used;
+        memcpy(dest, data, data_len);
+        
+        struct iovec *iov = &o->send.batch_iovs[o->send.batch_first + o->send.batch_count];
+        iov->iov_base = dest;
+        iov->iov_len = data_len;
+        
+        o->send.batch_used += data_len;
+        o->send.batch_count++;
+        
+        // set job, unless it's already set; setting it again would move it ahead of the
+        // jobs which will submit further packets. If we're waiting for the fd, the
+        // batch is sent when it becomes writable.
+        if (o->send.have_addrs && !BPending_IsSet(&o->send.job) && !(o->wait_events & BREACTOR_WRITE)) {
+            BPending_Set(&o->send.job);
+        }
+        
+        // done
+        PacketPassInterface_Done(&o->send.iface);
+        return;
+    }
+    
     // remember data
     o->send.busy_data = data;
     o->send.busy_data_len = data_len;
@@ -685,16 +1175,7 @@ int BDatagram_Bind (BDatagram *o, BAddr addr)
         return 0;
     }
     
-    // if recv wasn't started yet, start it
-    if (!o->recv.started) {
-        // set recv started
-        o->recv.started = 1;
-        
-        // continue receiving
-        if (o->recv.inited && o->recv.busy) {
-            BPending_Set(&o->recv.job);
-        }
-    }
+    start_recv(o);
     
     return 1;
 }
@@ -715,7 +1196,7 @@ void BDatagram_SetSendAddrs (BDatagram *o, BAddr remote_addr, BIPAddr local_addr
         o->send.have_addrs = 1;
         
         // start sending
-        if (o->send.inited && o->send.busy) {
+        if (o->send.inited && send_pending(o)) {
             BPending_Set(&o->send.job);
         }
     }
@@ -772,10 +1253,70 @@ void BDatagram_SendAsync_Init (BDatagram *o, int mtu)
     // set not busy
     o->send.busy = 0;
     
+    // set no batching
+    o->send.batch_size = 0;
+    o->send.batch_first = 0;
+    o->send.batch_count = 0;
+    o->send.batch_used = 0;
+    
     // set inited
     o->send.inited = 1;
 }
 
+int BDatagram_SendAsync_InitBatch (BDatagram *o, int mtu, int batch_size, int batch_max_packets)
+{
+    DebugObject_Access(&o->d_obj);
+    DebugError_AssertNoError(&o->d_err);
+    ASSERT(!o->send.inited)
+    ASSERT(mtu >= 0)
+    ASSERT(batch_size > 0)
+    ASSERT(batch_max_packets > 0)
+    
+#ifdef BADVPN_LINUX
+    // allocate batch buffer
+    uint8_t *batch_buf = (uint8_t *)BAlloc(batch_size);
+    if (!batch_buf) {
+        BLog(BLOG_ERROR, "BAlloc failed");
+        goto fail0;
+    }
+    
+    // allocate iovecs and message headers, with room for a packet not fitting into the batch
+    struct iovec *batch_iovs = (struct iovec *)BAllocArray(batch_max_packets + 1, sizeof(struct iovec));
+    if (!batch_iovs) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
+        goto fail1;
+    }
+    struct mmsghdr *batch_msgs = (struct mmsghdr *)BAllocArray(batch_max_packets + 1, sizeof(struct mmsghdr));
+    if (!batch_msgs) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
+        goto fail2;
+    }
+    
+    BDatagram_SendAsync_Init(o, mtu);
+    
+    // set batching
+    o->send.batch_size = batch_size;
+    o->send.batch_max_packets = batch_max_packets;
+    o->send.batch_buf = batch_buf;
+    o->send.batch_iovs = batch_iovs;
+    o->send.batch_msgs = batch_msgs;
+    o->send.batch_gso = 1;
+    
+    return 1;
+    
+fail2:
+    BFree(batch_iovs);
+fail1:
+    BFree(batch_buf);
+fail0:
+    return 0;
+#else
+    BDatagram_SendAsync_Init(o, mtu);
+    
+    return 1;
+#endif
+}
+
 void BDatagram_SendAsync_Free (BDatagram *o)
 {
     DebugObject_Access(&o->d_obj);
@@ -791,6 +1332,13 @@ void BDatagram_SendAsync_Free (BDatagram *o)
     // free interface
     PacketPassInterface_Free(&o->send.iface);
     
+    // free batch
+    if (o->send.batch_size > 0) {
+        BFree(o->send.batch_msgs);
+        BFree(o->send.batch_iovs);
+        BFree(o->send.batch_buf);
+    }
+    
     // set not inited
     o->send.inited = 0;
 }
@@ -822,10 +1370,34 @@ void BDatagram_RecvAsync_Init (BDatagram *o, int mtu)
     // set not busy
     o->recv.busy = 0;
     
+    // set no batching
+    o->recv.batch_max_packets = 0;
+    o->recv.batch_max_len = 0;
+    o->recv.batch_buf = NULL;
+    o->recv.batch_pos = 0;
+    o->recv.batch_end = 0;
+    
     // set inited
     o->recv.inited = 1;
 }
 
+void BDatagram_RecvAsync_InitBatch (BDatagram *o, int mtu, int batch_size, int batch_max_packets)
+{
+    ASSERT(batch_size > 0)
+    ASSERT(batch_max_packets > 0)
+    
+    BDatagram_RecvAsync_Init(o, mtu);
+    
+#ifdef BADVPN_LINUX
+    // set the batch limits; the buffer is allocated when it's first needed, with slots
+    // sized for the largest datagram received by then
+    if (mtu > 0) {
+        o->recv.batch_size = batch_size;
+        o->recv.batch_max_packets = batch_max_packets;
+    }
+#endif
+}
+
 void BDatagram_RecvAsync_Free (BDatagram *o)
 {
     DebugObject_Access(&o->d_obj);
@@ -841,6 +1413,11 @@ void BDatagram_RecvAsync_Free (BDatagram *o)
     // free interface
     PacketRecvInterface_Free(&o->recv.iface);
     
+#ifdef BADVPN_LINUX
+    // free batch
+    free_recv_batch(o);
+#endif
+    
     // set not inited
     o->recv.inited = 0;
 }
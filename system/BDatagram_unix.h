@@ -32,6 +32,8 @@
 
 #define BDATAGRAM_SEND_LIMIT 2
 #define BDATAGRAM_RECV_LIMIT 2
+#define BDATAGRAM_GSO_MAX_SEGMENTS 64
+#define BDATAGRAM_GSO_MAX_BYTES 65507
 
 struct BDatagram_s {
     BReactor *reactor;
@@ -52,6 +54,15 @@ struct BDatagram_s {
         int busy;
         const uint8_t *busy_data;
         int busy_data_len;
+        int batch_size;
+        int batch_max_packets;
+        uint8_t *batch_buf;
+        struct iovec *batch_iovs;
+        struct mmsghdr *batch_msgs;
+        int batch_used;
+        int batch_first;
+        int batch_count;
+        int batch_gso;
     } send;
     struct {
         BReactorLimit limit;
@@ -65,6 +76,16 @@ struct BDatagram_s {
         BPending job;
         int busy;
         uint8_t *busy_data;
+        int batch_size;
+        int batch_max_packets;
+        int batch_max_len;
+        int batch_num_slots;
+        int batch_slot_size;
+        uint8_t *batch_buf;
+        struct BDatagram_recv_slot *batch_slots;
+        struct mmsghdr *batch_msgs;
+        int batch_pos;
+        int batch_end;
     } recv;
     DebugError d_err;
     DebugObject d_obj;
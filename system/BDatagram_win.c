@@ -671,6 +671,17 @@ void BDatagram_SendAsync_Init (BDatagram *o, int mtu)
     o->send.inited = 1;
 }
 
+int BDatagram_SendAsync_InitBatch (BDatagram *o, int mtu, int batch_size, int batch_max_packets)
+{
+    ASSERT(batch_size > 0)
+    ASSERT(batch_max_packets > 0)
+    
+    // batching isn't implemented here
+    BDatagram_SendAsync_Init(o, mtu);
+    
+    return 1;
+}
+
 void BDatagram_SendAsync_Free (BDatagram *o)
 {
     DebugObject_Access(&o->d_obj);
@@ -723,6 +734,15 @@ void BDatagram_RecvAsync_Init (BDatagram *o, int mtu)
     o->recv.inited = 1;
 }
 
+void BDatagram_RecvAsync_InitBatch (BDatagram *o, int mtu, int batch_size, int batch_max_packets)
+{
+    ASSERT(batch_size > 0)
+    ASSERT(batch_max_packets > 0)
+    
+    // batching isn't implemented here
+    BDatagram_RecvAsync_Init(o, mtu);
+}
+
 void BDatagram_RecvAsync_Free (BDatagram *o)
 {
     DebugObject_Access(&o->d_obj);
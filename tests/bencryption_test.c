@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <misc/debug.h>
+#include <base/DebugObject.h>
+#include <security/BEncryption.h>
+
+#define NUM_PACKETS 8
+#define MAX_LEN 300
+
+uint8_t key[BENCRYPTION_MAX_KEY_SIZE];
+uint8_t nonces[NUM_PACKETS][BENCRYPTION_AEAD_NONCE_SIZE];
+uint8_t plain[NUM_PACKETS][MAX_LEN];
+uint8_t cipher[NUM_PACKETS][MAX_LEN];
+uint8_t tags[NUM_PACKETS][BENCRYPTION_AEAD_TAG_SIZE];
+uint8_t decrypted[NUM_PACKETS][MAX_LEN];
+struct BEncryption_aead_packet packets[NUM_PACKETS];
+
+static int packet_len (int i)
+{
+    return (i * 41) % MAX_LEN;
+}
+
+static void decrypt_all (BEncryption *dec)
+{
+    for (int i = 0; i < NUM_PACKETS; i++) {
+        packets[i].nonce = nonces[i];
+        packets[i].in = cipher[i];
+        packets[i].out = decrypted[i];
+        packets[i].len = packet_len(i);
+        packets[i].tag = tags[i];
+        packets[i].valid = -1;
+    }
+    
+    BEncryption_AeadDecryptBatch(dec, packets, NUM_PACKETS);
+}
+
+static void test_cipher (int cipher_num)
+{
+    BEncryption enc;
+    BEncryption dec;
+    
+    for (int i = 0; i < BENCRYPTION_MAX_KEY_SIZE; i++) {
+        key[i] = 3 * i;
+    }
+    
+    BEncryption_Init(&enc, BENCRYPTION_MODE_ENCRYPT, cipher_num, key);
+    BEncryption_Init(&dec, BENCRYPTION_MODE_DECRYPT, cipher_num, key);
+    
+    // encrypt a batch with distinct nonces, including an empty packet
+    for (int i = 0; i < NUM_PACKETS; i++) {
+        memset(nonces[i], 0, BENCRYPTION_AEAD_NONCE_SIZE);
+        nonces[i][BENCRYPTION_AEAD_NONCE_SIZE - 1] = i;
+        for (int j = 0; j < packet_len(i); j++) {
+            plain[i][j] = i + j;
+        }
+        packets[i].nonce = nonces[i];
+        packets[i].in = plain[i];
+        packets[i].out = cipher[i];
+        packets[i].len = packet_len(i);
+        packets[i].tag = tags[i];
+    }
+    BEncryption_AeadEncryptBatch(&enc, packets, NUM_PACKETS);
+    
+    // every packet comes back
+    decrypt_all(&dec);
+    for (int i = 0; i < NUM_PACKETS; i++) {
+        ASSERT_FORCE(packets[i].valid == 1)
+        ASSERT_FORCE(!memcmp(decrypted[i], plain[i], packet_len(i)))
+    }
+    
+    // single packets give the same result as a batch
+    uint8_t tag[BENCRYPTION_AEAD_TAG_SIZE];
+    uint8_t out[MAX_LEN];
+    BEncryption_AeadEncrypt(&enc, nonces[3], plain[3], out, packet_len(3), tag);
+    ASSERT_FORCE(!memcmp(out, cipher[3], packet_len(3)))
+    ASSERT_FORCE(!memcmp(tag, tags[3], BENCRYPTION_AEAD_TAG_SIZE))
+    ASSERT_FORCE(BEncryption_AeadDecrypt(&dec, nonces[3], cipher[3], out, packet_len(3), tags[3]))
+    ASSERT_FORCE(!memcmp(out, plain[3], packet_len(3)))
+    
+    // a tampered tag, ciphertext or nonce is rejected, and doesn't affect
+    // the packets after it
+    tags[2][5] ^= 1;
+    cipher[4][7] ^= 0x80;
+    nonces[6][0] ^= 1;
+    decrypt_all(&dec);
+    for (int i = 0; i < NUM_PACKETS; i++) {
+        ASSERT_FORCE(packets[i].valid == (i != 2 && i != 4 && i != 6))
+    }
+    tags[2][5] ^= 1;
+    cipher[4][7] ^= 0x80;
+    nonces[6][0] ^= 1;
+    ASSERT_FORCE(!BEncryption_AeadDecrypt(&dec, nonces[1], cipher[0], out, packet_len(0), tags[0]))
+    
+    // the object still works after rejecting packets
+    decrypt_all(&dec);
+    for (int i = 0; i < NUM_PACKETS; i++) {
+        ASSERT_FORCE(packets[i].valid == 1)
+    }
+    
+    BEncryption_Free(&dec);
+    BEncryption_Free(&enc);
+}
+
+static void test_aes_gcm_vector (void)
+{
+    // AES-128-GCM with zero key, nonce and one zero block, from the GCM specification
+    static const uint8_t expected_cipher[16] = {
+        0x03, 0x88, 0xda, 0xce, 0x60, 0xb6, 0xa3, 0x92, 0xf3, 0x28, 0xc2, 0xb9, 0x71, 0xb2, 0xfe, 0x78
+    };
+    static const uint8_t expected_tag[16] = {
+        0xab, 0x6e, 0x47, 0xd4, 0x2c, 0xec, 0x13, 0xbd, 0xf5, 0x3a, 0x67, 0xb2, 0x12, 0x57, 0xbd, 0xdf
+    };
+    
+    uint8_t zero_key[BENCRYPTION_CIPHER_AES_GCM_KEY_SIZE] = {0};
+    uint8_t nonce[BENCRYPTION_AEAD_NONCE_SIZE] = {0};
+    uint8_t in[16] = {0};
+    uint8_t out[16];
+    uint8_t tag[BENCRYPTION_AEAD_TAG_SIZE];
+    
+    BEncryption enc;
+    BEncryption_Init(&enc, BENCRYPTION_MODE_ENCRYPT, BENCRYPTION_CIPHER_AES_GCM, zero_key);
+    BEncryption_AeadEncrypt(&enc, nonce, in, out, sizeof(in), tag);
+    BEncryption_Free(&enc);
+    
+    ASSERT_FORCE(!memcmp(out, expected_cipher, sizeof(out)))
+    ASSERT_FORCE(!memcmp(tag, expected_tag, sizeof(tag)))
+}
+
+int main ()
+{
+    test_aes_gcm_vector();
+    
+    test_cipher(BENCRYPTION_CIPHER_AES_GCM);
+    test_cipher(BENCRYPTION_CIPHER_CHACHA20_POLY1305);
+    
+    printf("AEAD round trips and tamper checks passed\n");
+    
+    DebugObjectGlobal_Finish();
+    return 0;
+}
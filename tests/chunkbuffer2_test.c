@@ -4,6 +4,7 @@
 int main ()
 {
     struct ChunkBuffer2_block blocks[16];
+    struct ChunkBuffer2_packet packets[4];
     ChunkBuffer2 buf;
     ChunkBuffer2_Init(&buf, blocks, 16, 4 * sizeof(struct ChunkBuffer2_block));
     
@@ -12,6 +13,8 @@ int main ()
     ASSERT_FORCE(buf.output_dest == NULL)
     ASSERT_FORCE(buf.output_avail == -1)
     
+    ASSERT_FORCE(ChunkBuffer2_PeekPackets(&buf, packets, 4) == 0)
+    
     ChunkBuffer2_SubmitPacket(&buf, sizeof(struct ChunkBuffer2_block));
     
     ASSERT_FORCE(buf.input_dest == (uint8_t *)&blocks[3])
@@ -33,6 +36,17 @@ int main ()
     ASSERT_FORCE(buf.output_dest == (uint8_t *)&blocks[1])
     ASSERT_FORCE(buf.output_avail == 1 * sizeof(struct ChunkBuffer2_block))
     
+    ASSERT_FORCE(ChunkBuffer2_PeekPackets(&buf, packets, 4) == 3)
+    ASSERT_FORCE(packets[0].data == (uint8_t *)&blocks[1])
+    ASSERT_FORCE(packets[0].len == 1 * sizeof(struct ChunkBuffer2_block))
+    ASSERT_FORCE(packets[1].data == (uint8_t *)&blocks[3])
+    ASSERT_FORCE(packets[1].len == 8 * sizeof(struct ChunkBuffer2_block))
+    ASSERT_FORCE(packets[2].data == (uint8_t *)&blocks[12])
+    ASSERT_FORCE(packets[2].len == 4 * sizeof(struct ChunkBuffer2_block))
+    
+    ASSERT_FORCE(ChunkBuffer2_PeekPackets(&buf, packets, 2) == 2)
+    ASSERT_FORCE(packets[1].data == (uint8_t *)&blocks[3])
+    
     ChunkBuffer2_ConsumePacket(&buf);
     
     ASSERT_FORCE(buf.input_dest == (uint8_t *)&blocks[1])
@@ -54,6 +68,16 @@ int main ()
     ASSERT_FORCE(buf.output_dest == (uint8_t *)&blocks[12])
     ASSERT_FORCE(buf.output_avail == 4 * sizeof(struct ChunkBuffer2_block))
     
+    // the second packet continues at the beginning of the buffer
+    ASSERT_FORCE(ChunkBuffer2_PeekPackets(&buf, packets, 4) == 2)
+    ASSERT_FORCE(packets[0].data == (uint8_t *)&blocks[12])
+    ASSERT_FORCE(packets[0].len == 4 * sizeof(struct ChunkBuffer2_block))
+    ASSERT_FORCE(packets[1].data == (uint8_t *)&blocks[1])
+    ASSERT_FORCE(packets[1].len == 9 * sizeof(struct ChunkBuffer2_block))
+    
+    ASSERT_FORCE(ChunkBuffer2_PeekPackets(&buf, packets, 1) == 1)
+    ASSERT_FORCE(packets[0].data == (uint8_t *)&blocks[12])
+    
     ChunkBuffer2_ConsumePacket(&buf);
     
     ASSERT_FORCE(buf.input_dest == (uint8_t *)&blocks[11])
@@ -68,6 +92,12 @@ int main ()
     ASSERT_FORCE(buf.output_dest == (uint8_t *)&blocks[1])
     ASSERT_FORCE(buf.output_avail == 9 * sizeof(struct ChunkBuffer2_block))
     
+    ASSERT_FORCE(ChunkBuffer2_PeekPackets(&buf, packets, 4) == 2)
+    ASSERT_FORCE(packets[0].data == (uint8_t *)&blocks[1])
+    ASSERT_FORCE(packets[0].len == 9 * sizeof(struct ChunkBuffer2_block))
+    ASSERT_FORCE(packets[1].data == (uint8_t *)&blocks[11])
+    ASSERT_FORCE(packets[1].len == 1 * sizeof(struct ChunkBuffer2_block))
+    
     ChunkBuffer2_ConsumePacket(&buf);
     
     ASSERT_FORCE(buf.input_dest == (uint8_t *)&blocks[1])
@@ -82,5 +112,7 @@ int main ()
     ASSERT_FORCE(buf.output_dest == NULL)
     ASSERT_FORCE(buf.output_avail == -1)
     
+    ASSERT_FORCE(ChunkBuffer2_PeekPackets(&buf, packets, 4) == 0)
+    
     return 0;
 }
@@ -0,0 +1,266 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <misc/debug.h>
+#include <misc/dns_proto.h>
+#include <misc/read_write_int.h>
+#include <base/DebugObject.h>
+#include <system/BTime.h>
+#include <udpgw/DnsCache.h>
+
+// response to www.example.com A IN, with two answers and an OPT record;
+// the second answer's name is a label followed by a compression pointer
+static const uint8_t response[] = {
+    0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x01,
+    // question, at 12
+    3, 'W', 'w', 'w', 7, 'E', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'C', 'O', 'M', 0, 0x00, 0x01, 0x00, 0x01,
+    // answer, at 33
+    0xC0, 0x0C, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2C, 0x00, 0x04, 10, 0, 0, 1,
+    // answer, at 49
+    3, 'c', 'd', 'n', 0xC0, 0x0C, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3C, 0x00, 0x04, 10, 0, 0, 2,
+    // OPT, at 69, with a UDP size of 1232 and a TTL field smaller than the others
+    0, 0x00, 0x29, 0x04, 0xD0, 0x00, 0x00, 0x00, 0x05, 0x00, 0x00
+};
+
+#define QUESTION_END 33
+#define ANSWER1_POS 33
+#define ANSWER2_POS 49
+#define OPT_POS 69
+
+static const uint8_t expected_key[] = {
+    3, 'w', 'w', 'w', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0, 0x00, 0x01, 0x00, 0x01
+};
+
+static int build_query (uint8_t *out, uint16_t id, uint16_t type, int edns_size)
+{
+    static const uint8_t name[] = {3, 'w', 'w', 'w', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0};
+    
+    memset(out, 0, 12);
+    badvpn_write_be16(id, (char *)out);
+    badvpn_write_be16(0x0100, (char *)out + 2);
+    badvpn_write_be16(1, (char *)out + 4);
+    badvpn_write_be16((edns_size > 0), (char *)out + 10);
+    int len = 12;
+    
+    memcpy(out + len, name, sizeof(name));
+    len += sizeof(name);
+    badvpn_write_be16(type, (char *)out + len);
+    badvpn_write_be16(1, (char *)out + len + 2);
+    len += 4;
+    
+    if (edns_size > 0) {
+        static const uint8_t opt[] = {0, 0x00, 0x29, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+        memcpy(out + len, opt, sizeof(opt));
+        badvpn_write_be16(edns_size, (char *)out + len + 3);
+        len += sizeof(opt);
+    }
+    
+    return len;
+}
+
+static void test_parse_question (void)
+{
+    uint8_t msg[sizeof(response)];
+    uint8_t key[DNS_QUESTION_KEY_MAX_LEN];
+    int key_len;
+    int end;
+    
+    // the name is lowercased, type and class are appended
+    ASSERT_FORCE(dns_parse_question(response, sizeof(response), key, &key_len, &end))
+    ASSERT_FORCE(key_len == sizeof(expected_key))
+    ASSERT_FORCE(!memcmp(key, expected_key, key_len))
+    ASSERT_FORCE(end == QUESTION_END)
+    
+    // truncated anywhere in the question
+    for (int len = 0; len < QUESTION_END; len++) {
+        ASSERT_FORCE(!dns_parse_question(response, len, key, &key_len, &end))
+    }
+    
+    // more than one question
+    memcpy(msg, response, sizeof(msg));
+    badvpn_write_be16(2, (char *)msg + 4);
+    ASSERT_FORCE(!dns_parse_question(msg, sizeof(msg), key, &key_len, &end))
+    
+    // compression pointer in the question
+    memcpy(msg, response, sizeof(msg));
+    msg[12] = 0xC0;
+    ASSERT_FORCE(!dns_parse_question(msg, sizeof(msg), key, &key_len, &end))
+    
+    // label running past the end
+    memcpy(msg, response, sizeof(msg));
+    msg[12] = 63;
+    ASSERT_FORCE(!dns_parse_question(msg, 40, key, &key_len, &end))
+    
+    // name longer than allowed
+    uint8_t long_msg[12 + 5 * 64 + 1 + 4];
+    memcpy(long_msg, response, 12);
+    for (int i = 0; i < 5; i++) {
+        long_msg[12 + i * 64] = 63;
+        memset(long_msg + 12 + i * 64 + 1, 'a', 63);
+    }
+    memset(long_msg + 12 + 5 * 64, 0, 5);
+    ASSERT_FORCE(!dns_parse_question(long_msg, sizeof(long_msg), key, &key_len, &end))
+}
+
+static void test_skip_name (void)
+{
+    // uncompressed name
+    ASSERT_FORCE(dns_skip_name(response, sizeof(response), 12) == 29)
+    
+    // compression pointer alone, and after a label
+    ASSERT_FORCE(dns_skip_name(response, sizeof(response), ANSWER1_POS) == ANSWER1_POS + 2)
+    ASSERT_FORCE(dns_skip_name(response, sizeof(response), ANSWER2_POS) == ANSWER2_POS + 6)
+    
+    // root name
+    ASSERT_FORCE(dns_skip_name(response, sizeof(response), OPT_POS) == OPT_POS + 1)
+    
+    // truncated compression pointer, label and name
+    ASSERT_FORCE(dns_skip_name(response, ANSWER1_POS + 1, ANSWER1_POS) == -1)
+    ASSERT_FORCE(dns_skip_name(response, 14, 12) == -1)
+    ASSERT_FORCE(dns_skip_name(response, 28, 12) == -1)
+    ASSERT_FORCE(dns_skip_name(response, sizeof(response), sizeof(response)) == -1)
+    
+    // reserved label types
+    static const uint8_t bad1[] = {0x40, 0x00};
+    static const uint8_t bad2[] = {0x80, 0x00};
+    ASSERT_FORCE(dns_skip_name(bad1, sizeof(bad1), 0) == -1)
+    ASSERT_FORCE(dns_skip_name(bad2, sizeof(bad2), 0) == -1)
+}
+
+static void test_process_records (void)
+{
+    uint8_t msg[sizeof(response)];
+    memcpy(msg, response, sizeof(msg));
+    
+    // smallest TTL, ignoring OPT; nothing is changed
+    uint32_t ttl = UINT32_MAX;
+    ASSERT_FORCE(dns_process_records(msg, sizeof(msg), QUESTION_END, 3, &ttl, 0))
+    ASSERT_FORCE(ttl == 60)
+    ASSERT_FORCE(!memcmp(msg, response, sizeof(msg)))
+    
+    // TTLs are counted down, stopping at zero, and OPT is left alone
+    ASSERT_FORCE(dns_process_records(msg, sizeof(msg), QUESTION_END, 3, NULL, 100))
+    ASSERT_FORCE(badvpn_read_be32((char *)msg + ANSWER1_POS + 2 + 4) == 200)
+    ASSERT_FORCE(badvpn_read_be32((char *)msg + ANSWER2_POS + 6 + 4) == 0)
+    ASSERT_FORCE(badvpn_read_be32((char *)msg + OPT_POS + 1 + 4) == 5)
+    ASSERT_FORCE(!memcmp(msg + QUESTION_END + 2, response + QUESTION_END + 2, 4))
+    
+    // more records than there are, and truncated records
+    memcpy(msg, response, sizeof(msg));
+    ASSERT_FORCE(!dns_process_records(msg, sizeof(msg), QUESTION_END, 4, NULL, 0))
+    for (int len = QUESTION_END; len < sizeof(msg); len++) {
+        ASSERT_FORCE(!dns_process_records(msg, len, QUESTION_END, 3, NULL, 0))
+    }
+    
+    // record data running past the end
+    badvpn_write_be16(100, (char *)msg + ANSWER2_POS + 6 + 8);
+    ASSERT_FORCE(!dns_process_records(msg, sizeof(msg), QUESTION_END, 3, NULL, 0))
+}
+
+static void test_find_opt (void)
+{
+    uint8_t msg[sizeof(response)];
+    int opt_pos;
+    int opt_end;
+    
+    ASSERT_FORCE(dns_find_opt(response, sizeof(response), QUESTION_END, 3, &opt_pos, &opt_end))
+    ASSERT_FORCE(opt_pos == OPT_POS)
+    ASSERT_FORCE(opt_end == sizeof(response))
+    ASSERT_FORCE(dns_opt_udp_size(response, opt_pos) == 1232)
+    
+    // no OPT
+    ASSERT_FORCE(dns_find_opt(response, OPT_POS, QUESTION_END, 2, &opt_pos, &opt_end))
+    ASSERT_FORCE(opt_pos == -1)
+    
+    // OPT whose name isn't the root
+    memcpy(msg, response, sizeof(msg));
+    badvpn_write_be16(41, (char *)msg + ANSWER1_POS + 2);
+    ASSERT_FORCE(!dns_find_opt(msg, sizeof(msg), QUESTION_END, 3, &opt_pos, &opt_end))
+    
+    // sizes below the minimum count as the minimum
+    memcpy(msg, response, sizeof(msg));
+    badvpn_write_be16(100, (char *)msg + OPT_POS + 3);
+    ASSERT_FORCE(dns_opt_udp_size(msg, OPT_POS) == DNS_MAX_UDP_SIZE)
+}
+
+static void test_cache (void)
+{
+    DnsCache cache;
+    DnsCache_Init(&cache, 65536);
+    
+    uint8_t query[128];
+    uint8_t out[DNSCACHE_MAX_RESPONSE_SIZE];
+    int query_len;
+    int len;
+    
+    // nothing cached yet
+    query_len = build_query(query, 0x5678, 1, 0);
+    ASSERT_FORCE(DnsCache_Answer(&cache, query, query_len, out) == -1)
+    
+    DnsCache_Insert(&cache, response, sizeof(response));
+    
+    // a query with EDNS gets the OPT record, with its own ID and letter case
+    query_len = build_query(query, 0x5678, 1, 4096);
+    len = DnsCache_Answer(&cache, query, query_len, out);
+    ASSERT_FORCE(len == sizeof(response))
+    ASSERT_FORCE(badvpn_read_be16((char *)out) == 0x5678)
+    ASSERT_FORCE(!memcmp(out + 12, query + 12, QUESTION_END - 12))
+    ASSERT_FORCE(!memcmp(out + QUESTION_END, response + QUESTION_END, sizeof(response) - QUESTION_END))
+    
+    // a query without EDNS doesn't
+    query_len = build_query(query, 0x9ABC, 1, 0);
+    len = DnsCache_Answer(&cache, query, query_len, out);
+    ASSERT_FORCE(len == OPT_POS)
+    ASSERT_FORCE(badvpn_read_be16((char *)out) == 0x9ABC)
+    ASSERT_FORCE(badvpn_read_be16((char *)out + 10) == 0)
+    ASSERT_FORCE(!memcmp(out + QUESTION_END, response + QUESTION_END, OPT_POS - QUESTION_END))
+    
+    // other types aren't answered
+    query_len = build_query(query, 0x9ABC, 28, 0);
+    ASSERT_FORCE(DnsCache_Answer(&cache, query, query_len, out) == -1)
+    
+    // a response larger than 512 bytes is only returned to clients accepting it
+    uint8_t big[12 + 21 + 12 + 600];
+    memcpy(big, response, 12 + 21);
+    badvpn_write_be16(1, (char *)big + 6);
+    badvpn_write_be16(0, (char *)big + 10);
+    badvpn_write_be16(16, (char *)big + 12 + 17);
+    static const uint8_t txt_record[] = {0xC0, 0x0C, 0x00, 0x10, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2C, 0x02, 0x58};
+    memcpy(big + 33, txt_record, sizeof(txt_record));
+    memset(big + 45, 'x', 600);
+    DnsCache_Insert(&cache, big, sizeof(big));
+    
+    query_len = build_query(query, 1, 16, 0);
+    ASSERT_FORCE(DnsCache_Answer(&cache, query, query_len, out) == -1)
+    query_len = build_query(query, 1, 16, 1232);
+    ASSERT_FORCE(DnsCache_Answer(&cache, query, query_len, out) == sizeof(big))
+    
+    // responses to queries aren't cached, neither are malformed ones
+    uint8_t msg[sizeof(response)];
+    memcpy(msg, response, sizeof(msg));
+    badvpn_write_be16(0x0100, (char *)msg + 2);
+    badvpn_write_be16(28, (char *)msg + 12 + 17);
+    DnsCache_Insert(&cache, msg, sizeof(msg));
+    query_len = build_query(query, 1, 28, 0);
+    ASSERT_FORCE(DnsCache_Answer(&cache, query, query_len, out) == -1)
+    badvpn_write_be16(0x8180, (char *)msg + 2);
+    DnsCache_Insert(&cache, msg, sizeof(msg) - 1);
+    ASSERT_FORCE(DnsCache_Answer(&cache, query, query_len, out) == -1)
+    
+    DnsCache_Free(&cache);
+}
+
+int main ()
+{
+    BTime_Init();
+    
+    test_parse_question();
+    test_skip_name();
+    test_process_records();
+    test_find_opt();
+    test_cache();
+    
+    DebugObjectGlobal_Finish();
+    
+    return 0;
+}
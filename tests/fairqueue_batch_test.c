@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <misc/debug.h>
+#include <base/BLog.h>
+#include <base/DebugObject.h>
+#include <system/BTime.h>
+#include <system/BReactor.h>
+#include <flow/PacketPassFairQueue.h>
+
+#define NUM_FLOWS 2
+#define BATCH_SIZE 3
+#define NUM_BATCHES 4
+#define PACKET_LEN 10
+#define MTU 100
+
+struct source {
+    int index;
+    PacketPassFairQueueFlow qflow;
+    PacketPassInterface *input;
+    uint8_t data[BATCH_SIZE][PACKET_LEN];
+    struct PacketPassInterface_packet packets[BATCH_SIZE];
+    int batches_sent;
+    int batches_done;
+    int packets_sent;
+    int busy_calls;
+    int busy_handler_set;
+};
+
+BReactor reactor;
+PacketPassInterface output;
+BTimer output_timer;
+PacketPassFairQueue queue;
+struct source sources[NUM_FLOWS];
+uint8_t *output_data;
+int output_data_len;
+int num_output;
+int num_active;
+
+static void send_batch (struct source *s)
+{
+    // each packet carries its flow, batch and position within the batch
+    for (int j = 0; j < BATCH_SIZE; j++) {
+        memset(s->data[j], 0, PACKET_LEN);
+        s->data[j][0] = s->index;
+        s->data[j][1] = s->batches_sent;
+        s->data[j][2] = j;
+        s->packets[j].data = s->data[j];
+        s->packets[j].len = PACKET_LEN;
+    }
+    
+    PacketPassInterface_Sender_SendBatch(s->input, s->packets, BATCH_SIZE);
+    s->batches_sent++;
+}
+
+static void source_handler_done (struct source *s)
+{
+    // the batch is done once, after all of its packets went out
+    ASSERT_FORCE(s->batches_done < s->batches_sent)
+    s->batches_done++;
+    ASSERT_FORCE(s->packets_sent == s->batches_done * BATCH_SIZE)
+    
+    // the busy handler was called when the last packet was done
+    ASSERT_FORCE(s->busy_calls == s->batches_done)
+    
+    if (s->batches_sent < NUM_BATCHES) {
+        send_batch(s);
+        return;
+    }
+    
+    if (--num_active == 0) {
+        BReactor_Quit(&reactor, 0);
+    }
+}
+
+static void source_handler_busy (struct source *s)
+{
+    ASSERT_FORCE(s->busy_handler_set)
+    s->busy_handler_set = 0;
+    s->busy_calls++;
+    
+    // not called between the packets of a batch
+    ASSERT_FORCE(s->packets_sent % BATCH_SIZE == 0)
+    ASSERT_FORCE(s->packets_sent / BATCH_SIZE == s->batches_done + 1)
+}
+
+static void output_handler_send (void *unused, uint8_t *data, int data_len)
+{
+    output_data = data;
+    output_data_len = data_len;
+    
+    // complete the packet once pending jobs have run, like a real output would
+    BReactor_SetTimer(&reactor, &output_timer);
+}
+
+static void output_timer_handler (void *unused)
+{
+    ASSERT_FORCE(output_data_len == PACKET_LEN)
+    
+    int flow = output_data[0];
+    ASSERT_FORCE(flow >= 0)
+    ASSERT_FORCE(flow < NUM_FLOWS)
+    struct source *s = &sources[flow];
+    
+    // packets of a batch come out in order
+    ASSERT_FORCE(output_data[1] == s->packets_sent / BATCH_SIZE)
+    ASSERT_FORCE(output_data[2] == s->packets_sent % BATCH_SIZE)
+    
+    // flows take turns rather than sending whole batches, so no flow gets
+    // more than a packet ahead of another
+    for (int i = 0; i < NUM_FLOWS; i++) {
+        ASSERT_FORCE(s->packets_sent - sources[i].packets_sent <= 1)
+    }
+    num_output++;
+    
+    // a flow is busy while its packet is being sent, and between the
+    // packets of a batch once some of them have been sent
+    for (int i = 0; i < NUM_FLOWS; i++) {
+        int in_batch = (sources[i].packets_sent % BATCH_SIZE != 0);
+        ASSERT_FORCE(PacketPassFairQueueFlow_IsBusy(&sources[i].qflow) == (i == flow || in_batch))
+    }
+    
+    // ask to be told when the flow is no longer busy, at the start of a batch
+    if (s->packets_sent % BATCH_SIZE == 0) {
+        ASSERT_FORCE(!s->busy_handler_set)
+        PacketPassFairQueueFlow_SetBusyHandler(&s->qflow, (PacketPassFairQueue_handler_busy)source_handler_busy, s);
+        s->busy_handler_set = 1;
+    }
+    
+    s->packets_sent++;
+    
+    PacketPassInterface_Done(&output);
+}
+
+int main ()
+{
+    BLog_InitStdout();
+    
+    BTime_Init();
+    
+    if (!BReactor_Init(&reactor)) {
+        DEBUG("BReactor_Init failed");
+        goto fail0;
+    }
+    
+    PacketPassInterface_Init(&output, MTU, output_handler_send, NULL, BReactor_PendingGroup(&reactor));
+    BTimer_Init(&output_timer, 0, output_timer_handler, NULL);
+    
+    // without cancel, so that flows accept batches
+    if (!PacketPassFairQueue_Init(&queue, &output, BReactor_PendingGroup(&reactor), 0, 1)) {
+        DEBUG("PacketPassFairQueue_Init failed");
+        goto fail1;
+    }
+    
+    num_active = NUM_FLOWS;
+    for (int i = 0; i < NUM_FLOWS; i++) {
+        struct source *s = &sources[i];
+        s->index = i;
+        s->batches_sent = 0;
+        s->batches_done = 0;
+        s->packets_sent = 0;
+        s->busy_calls = 0;
+        s->busy_handler_set = 0;
+        
+        PacketPassFairQueueFlow_Init(&s->qflow, &queue);
+        s->input = PacketPassFairQueueFlow_GetInput(&s->qflow);
+        ASSERT_FORCE(PacketPassInterface_HasBatch(s->input))
+        PacketPassInterface_Sender_Init(s->input, (PacketPassInterface_handler_done)source_handler_done, s);
+        
+        send_batch(s);
+    }
+    
+    BReactor_Exec(&reactor);
+    
+    ASSERT_FORCE(num_output == NUM_FLOWS * NUM_BATCHES * BATCH_SIZE)
+    for (int i = 0; i < NUM_FLOWS; i++) {
+        ASSERT_FORCE(sources[i].batches_done == NUM_BATCHES)
+        ASSERT_FORCE(sources[i].busy_calls == NUM_BATCHES)
+    }
+    
+    printf("%d packets in %d batches per flow, interleaved and in order\n", num_output, NUM_BATCHES);
+    
+    for (int i = 0; i < NUM_FLOWS; i++) {
+        PacketPassFairQueueFlow_Free(&sources[i].qflow);
+    }
+    PacketPassFairQueue_Free(&queue);
+    BReactor_RemoveTimer(&reactor, &output_timer);
+    PacketPassInterface_Free(&output);
+    BReactor_Free(&reactor);
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return 0;
+    
+fail1:
+    PacketPassInterface_Free(&output);
+    BReactor_Free(&reactor);
+fail0:
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return 1;
+}
@@ -0,0 +1,215 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <misc/debug.h>
+#include <misc/byteorder.h>
+#include <base/BLog.h>
+#include <base/DebugObject.h>
+#include <system/BReactor.h>
+#include <security/BSecurity.h>
+#include <security/BEncryption.h>
+#include <threadwork/BThreadWork.h>
+#include <client/SPProtoEncoder.h>
+
+#define INPUT_MTU 200
+#define NUM_PACKETS 500
+#define REKEY_EVERY 7
+#define DIRECTION 1
+
+BReactor reactor;
+BThreadWorkDispatcher twd;
+SPProtoEncoder encoder;
+PacketRecvInterface input;
+struct spproto_security_params sp_params;
+uint8_t keys[2][16] = {"0123456789abcdef", "fedcba9876543210"};
+BEncryption decryptors[2];
+int cur_key;
+int rekey;
+int num_produced;
+int num_received;
+int num_rekeys_in_flight;
+uint64_t next_counter;
+uint8_t out_buf[INPUT_MTU + SPPROTO_AEAD_OVERHEAD];
+uint8_t plain_buf[INPUT_MTU];
+
+static int packet_len (int seq)
+{
+    return 4 + seq % (INPUT_MTU - 3);
+}
+
+static void input_handler_recv (void *unused, uint8_t *data)
+{
+    // without prefetching, a packet is only received for an output packet,
+    // and without encryption it is received directly into it
+    if (encoder.num_works == 1) {
+        ASSERT_FORCE(encoder.out_have)
+        if (!SPPROTO_HAVE_ENCRYPTION(sp_params)) {
+            ASSERT_FORCE(data == encoder.out + SPPROTO_HEADER_LEN(sp_params))
+        }
+    }
+    
+    // leave the encoder waiting after the last packet
+    if (num_produced == NUM_PACKETS) {
+        return;
+    }
+    
+    int seq = num_produced++;
+    int len = packet_len(seq);
+    memcpy(data, &seq, sizeof(seq));
+    for (int i = sizeof(seq); i < len; i++) {
+        data[i] = (uint8_t)(seq + i);
+    }
+    
+    PacketRecvInterface_Done(&input, len);
+}
+
+static void output_handler_done (void *unused, int data_len)
+{
+    uint8_t *plain = out_buf;
+    int plain_len = data_len;
+    
+    // decrypt with the key that was set when the packet was output
+    if (SPPROTO_HAVE_AEAD(sp_params)) {
+        plain_len = data_len - SPPROTO_AEAD_OVERHEAD;
+        uint8_t *nonce = out_buf;
+        uint8_t *ciphertext = nonce + BENCRYPTION_AEAD_NONCE_SIZE;
+        ASSERT_FORCE(plain_len >= 0)
+        
+        // nonces carry our direction and a counter that never repeats, even across keys
+        struct spproto_aead_nonce nonce_data;
+        memcpy(&nonce_data, nonce, sizeof(nonce_data));
+        ASSERT_FORCE(ltoh32(nonce_data.direction) == DIRECTION)
+        ASSERT_FORCE(ltoh64(nonce_data.counter) >= next_counter)
+        next_counter = ltoh64(nonce_data.counter) + 1;
+        
+        ASSERT_FORCE(BEncryption_AeadDecrypt(&decryptors[cur_key], nonce, ciphertext, plain_buf, plain_len, ciphertext + plain_len))
+        plain = plain_buf;
+    }
+    
+    // packets come out in the order they went in, none missing
+    int seq;
+    ASSERT_FORCE(plain_len == packet_len(num_received))
+    memcpy(&seq, plain, sizeof(seq));
+    ASSERT_FORCE(seq == num_received)
+    for (int i = sizeof(seq); i < plain_len; i++) {
+        ASSERT_FORCE(plain[i] == (uint8_t)(seq + i))
+    }
+    
+    if (++num_received == NUM_PACKETS) {
+        BReactor_Quit(&reactor, 0);
+        return;
+    }
+    
+    // change the key; packets already being encoded must be encoded again
+    if (rekey && num_received % REKEY_EVERY == 0) {
+        if (encoder.works_started > 0) {
+            num_rekeys_in_flight++;
+        }
+        cur_key = !cur_key;
+        SPProtoEncoder_SetEncryptionKey(&encoder, keys[cur_key], DIRECTION);
+    }
+    
+    PacketRecvInterface_Receiver_Recv(SPProtoEncoder_GetOutput(&encoder), out_buf);
+}
+
+static int test_encoder (int num_threads, int cipher, int do_rekey)
+{
+    sp_params.hash_mode = SPPROTO_HASH_MODE_NONE;
+    sp_params.encryption_mode = cipher;
+    sp_params.otp_mode = SPPROTO_OTP_MODE_NONE;
+    sp_params.otp_num = 0;
+    
+    cur_key = 0;
+    rekey = do_rekey;
+    num_produced = 0;
+    num_received = 0;
+    num_rekeys_in_flight = 0;
+    next_counter = 0;
+    
+    if (!BReactor_Init(&reactor)) {
+        DEBUG("BReactor_Init failed");
+        goto fail0;
+    }
+    
+    if (!BThreadWorkDispatcher_Init(&twd, &reactor, num_threads)) {
+        DEBUG("BThreadWorkDispatcher_Init failed");
+        goto fail1;
+    }
+    
+    PacketRecvInterface_Init(&input, INPUT_MTU, input_handler_recv, NULL, BReactor_PendingGroup(&reactor));
+    
+    if (!SPProtoEncoder_Init(&encoder, &input, sp_params, 1, BReactor_PendingGroup(&reactor), &twd)) {
+        DEBUG("SPProtoEncoder_Init failed");
+        goto fail2;
+    }
+    
+    // one work per thread plus one, or a single work without prefetching
+    ASSERT_FORCE(encoder.num_works == (num_threads > 0 ? num_threads + 1 : 1))
+    
+    if (SPPROTO_HAVE_ENCRYPTION(sp_params)) {
+        BEncryption_Init(&decryptors[0], BENCRYPTION_MODE_DECRYPT, cipher, keys[0]);
+        BEncryption_Init(&decryptors[1], BENCRYPTION_MODE_DECRYPT, cipher, keys[1]);
+        SPProtoEncoder_SetEncryptionKey(&encoder, keys[0], DIRECTION);
+    }
+    
+    PacketRecvInterface_Receiver_Init(SPProtoEncoder_GetOutput(&encoder), output_handler_done, NULL);
+    PacketRecvInterface_Receiver_Recv(SPProtoEncoder_GetOutput(&encoder), out_buf);
+    
+    BReactor_Exec(&reactor);
+    
+    ASSERT_FORCE(num_received == NUM_PACKETS)
+    
+    printf("%d packets in order with %d works, %d rekeys with packets being encoded\n", num_received, encoder.num_works, num_rekeys_in_flight);
+    
+    if (SPPROTO_HAVE_ENCRYPTION(sp_params)) {
+        BEncryption_Free(&decryptors[1]);
+        BEncryption_Free(&decryptors[0]);
+    }
+    SPProtoEncoder_Free(&encoder);
+    PacketRecvInterface_Free(&input);
+    BThreadWorkDispatcher_Free(&twd);
+    BReactor_Free(&reactor);
+    return 1;
+    
+fail2:
+    PacketRecvInterface_Free(&input);
+    BThreadWorkDispatcher_Free(&twd);
+fail1:
+    BReactor_Free(&reactor);
+fail0:
+    return 0;
+}
+
+int main ()
+{
+    BLog_InitStdout();
+    
+    if (!BSecurity_GlobalInitThreadSafe()) {
+        DEBUG("BSecurity_GlobalInitThreadSafe failed");
+        goto fail0;
+    }
+    
+    // encode in place, without prefetching
+    if (!test_encoder(0, SPPROTO_ENCRYPTION_MODE_NONE, 0) || !test_encoder(0, BENCRYPTION_CIPHER_AES_GCM, 1)) {
+        goto fail1;
+    }
+    
+    // encode in a ring of works, changing the key while packets are being encoded
+    if (!test_encoder(4, SPPROTO_ENCRYPTION_MODE_NONE, 0) || !test_encoder(4, BENCRYPTION_CIPHER_AES_GCM, 1)) {
+        goto fail1;
+    }
+    ASSERT_FORCE(num_rekeys_in_flight > 0)
+    
+    BSecurity_GlobalFreeThreadSafe();
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return 0;
+    
+fail1:
+    BSecurity_GlobalFreeThreadSafe();
+fail0:
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return 1;
+}
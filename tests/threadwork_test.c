@@ -13,6 +13,18 @@ BThreadWork tw2;
 BThreadWork tw3;
 int num_left;
 
+#define NUM_THREADS 4
+#define NUM_THREADED_WORKS 64
+#define NUM_THREADED_ROUNDS 3
+
+struct threaded_work {
+    BThreadWork tw;
+    int ran;
+    int done;
+} threaded_works[NUM_THREADED_WORKS];
+BPending round_job;
+int rounds_left;
+
 static void handler_done (void *user)
 {
     printf("work done\n");
@@ -36,6 +48,100 @@ static void work_func (void *user)
     }
 }
 
+static void threaded_work_func (void *user)
+{
+    struct threaded_work *w = user;
+    
+    ASSERT_FORCE(!w->ran)
+    w->ran = 1;
+}
+
+static void threaded_handler_done (void *user)
+{
+    struct threaded_work *w = user;
+    
+    // the work function has run, and the handler is called only once
+    ASSERT_FORCE(w->ran)
+    ASSERT_FORCE(!w->done)
+    w->done = 1;
+    
+    num_left--;
+    
+    if (num_left == 0) {
+        BPending_Set(&round_job);
+    }
+}
+
+static void start_round (void)
+{
+    for (int i = 0; i < NUM_THREADED_WORKS; i++) {
+        struct threaded_work *w = &threaded_works[i];
+        w->ran = 0;
+        w->done = 0;
+        BThreadWork_Init(&w->tw, &twd, threaded_handler_done, w, threaded_work_func, w);
+    }
+    
+    num_left = NUM_THREADED_WORKS;
+}
+
+static void round_job_handler (void *unused)
+{
+    for (int i = 0; i < NUM_THREADED_WORKS; i++) {
+        struct threaded_work *w = &threaded_works[i];
+        ASSERT_FORCE(w->ran)
+        ASSERT_FORCE(w->done)
+        BThreadWork_Free(&w->tw);
+    }
+    
+    printf("%d works done in %d threads\n", NUM_THREADED_WORKS, BThreadWorkDispatcher_NumThreads(&twd));
+    
+    if (--rounds_left == 0) {
+        BReactor_Quit(&reactor, 0);
+        return;
+    }
+    
+    // the threads are now waiting, and must be woken up for the next round
+    start_round();
+}
+
+static int test_threads (int affinity)
+{
+    if (!BReactor_Init(&reactor)) {
+        DEBUG("BReactor_Init failed");
+        goto fail0;
+    }
+    
+    if (!(affinity ?
+        BThreadWorkDispatcher_InitWithAffinity(&twd, &reactor, NUM_THREADS) :
+        BThreadWorkDispatcher_Init(&twd, &reactor, NUM_THREADS)
+    )) {
+        DEBUG("BThreadWorkDispatcher_Init failed");
+        goto fail1;
+    }
+    
+    ASSERT_FORCE(BThreadWorkDispatcher_UsingThreads(&twd))
+    ASSERT_FORCE(BThreadWorkDispatcher_NumThreads(&twd) == NUM_THREADS)
+    
+    BPending_Init(&round_job, BReactor_PendingGroup(&reactor), round_job_handler, NULL);
+    
+    rounds_left = NUM_THREADED_ROUNDS;
+    start_round();
+    
+    BReactor_Exec(&reactor);
+    
+    ASSERT_FORCE(rounds_left == 0)
+    
+    BPending_Free(&round_job);
+    BThreadWorkDispatcher_Free(&twd);
+    BReactor_Free(&reactor);
+    return 1;
+    
+fail1:
+    BReactor_Free(&reactor);
+fail0:
+    return 0;
+}
+
 static void dummy_works (int n)
 {
     for (int i = 0; i < n; i++) {
@@ -78,6 +184,17 @@ int main ()
     BThreadWork_Free(&tw2);
     BThreadWork_Free(&tw1);
     BThreadWorkDispatcher_Free(&twd);
+    BReactor_Free(&reactor);
+    
+    // dispatch works to several threads, with and without binding them to CPUs
+    if (!test_threads(0) || !test_threads(1)) {
+        goto fail1;
+    }
+    
+    BLog_Free();
+    DebugObjectGlobal_Finish();
+    return 0;
+    
 fail2:
     BReactor_Free(&reactor);
 fail1:
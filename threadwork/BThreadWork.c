@@ -27,6 +27,12 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifdef BADVPN_LINUX
+    #ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+    #endif
+#endif
+
 #include <stdint.h>
 #include <stddef.h>
 
@@ -34,9 +40,16 @@
     #include <unistd.h>
     #include <errno.h>
     #include <fcntl.h>
+    #ifdef BADVPN_LINUX
+        #include <sched.h>
+    #endif
+    #ifdef BADVPN_USE_EVENTFD
+        #include <sys/eventfd.h>
+    #endif
 #endif
 
 #include <misc/offset.h>
+#include <misc/balloc.h>
 #include <base/BLog.h>
 
 #include <generated/blog_channel_BThreadWork.h>
@@ -45,6 +58,21 @@
 
 #ifdef BADVPN_THREADWORK_USE_PTHREAD
 
+static void notify_write (BThreadWorkDispatcher *o)
+{
+    #ifdef BADVPN_USE_EVENTFD
+    uint64_t v = 1;
+    #else
+    uint8_t v = 0;
+    #endif
+    
+    int res = write(o->notify_fd[1], &v, sizeof(v));
+    if (res < 0) {
+        int error = errno;
+        ASSERT_FORCE(error == EAGAIN || error == EWOULDBLOCK)
+    }
+}
+
 static void * dispatcher_thread (struct BThreadWorkDispatcher_thread *t)
 {
     BThreadWorkDispatcher *o = t->d;
@@ -59,7 +87,9 @@ static void * dispatcher_thread (struct BThreadWorkDispatcher_thread *t)
         
         if (LinkedList1_IsEmpty(&o->pending_list)) {
             // wait for event
+            t->waiting = 1;
             ASSERT_FORCE(pthread_cond_wait(&t->new_cond, &o->mutex) == 0)
+            t->waiting = 0;
             continue;
         }
         
@@ -81,12 +111,11 @@ static void * dispatcher_thread (struct BThreadWorkDispatcher_thread *t)
         w->state = BTHREADWORK_STATE_FINISHED;
         ASSERT_FORCE(sem_post(&w->finished_sem) == 0)
         
-        // write to pipe
-        uint8_t b = 0;
-        int res = write(o->pipe[1], &b, sizeof(b));
-        if (res < 0) {
-            int error = errno;
-            ASSERT_FORCE(error == EAGAIN || error == EWOULDBLOCK)
+        // notify the event loop, unless it has yet to collect earlier finished works,
+        // in which case it will collect this one too
+        if (!o->notified) {
+            o->notified = 1;
+            notify_write(o);
         }
     }
     
@@ -104,6 +133,7 @@ static void dispatch_job (BThreadWorkDispatcher *o)
     
     // check for finished job
     if (LinkedList1_IsEmpty(&o->finished_list)) {
+        o->notified = 0;
         ASSERT_FORCE(pthread_mutex_unlock(&o->mutex) == 0)
         return;
     }
@@ -113,9 +143,11 @@ static void dispatch_job (BThreadWorkDispatcher *o)
     ASSERT(w->state == BTHREADWORK_STATE_FINISHED)
     LinkedList1_Remove(&o->finished_list, &w->list_node);
     
-    // schedule more
+    // schedule more, or have threads notify us of the next finished work
     if (!LinkedList1_IsEmpty(&o->finished_list)) {
         BPending_Set(&o->more_job);
+    } else {
+        o->notified = 0;
     }
     
     // set state forgotten
@@ -129,14 +161,18 @@ static void dispatch_job (BThreadWorkDispatcher *o)
     return;
 }
 
-static void pipe_fd_handler (BThreadWorkDispatcher *o, int events)
+static void notify_fd_handler (BThreadWorkDispatcher *o, int events)
 {
     ASSERT(o->num_threads > 0)
     DebugObject_Access(&o->d_obj);
     
-    // read data from pipe
+    // read notification
+    #ifdef BADVPN_USE_EVENTFD
+    uint64_t b;
+    #else
     uint8_t b[64];
-    int res = read(o->pipe[0], b, sizeof(b));
+    #endif
+    int res = read(o->notify_fd[0], &b, sizeof(b));
     if (res < 0) {
         int error = errno;
         ASSERT_FORCE(error == EAGAIN || error == EWOULDBLOCK)
@@ -157,6 +193,60 @@ static void more_job_handler (BThreadWorkDispatcher *o)
     return;
 }
 
+static int get_num_cpus (void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) {
+        BLog(BLOG_WARNING, "sysconf(_SC_NPROCESSORS_ONLN) failed, assuming one CPU");
+        return 1;
+    }
+    
+    return (n > BTHREADWORK_MAX_THREADS ? BTHREADWORK_MAX_THREADS : n);
+}
+
+static void bind_thread (struct BThreadWorkDispatcher_thread *t, int index)
+{
+    #ifdef BADVPN_LINUX
+    
+    // get the CPUs we may run on
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        BLog(BLOG_WARNING, "sched_getaffinity failed");
+        return;
+    }
+    
+    // pick one of them for this thread
+    int n = index % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed) || n-- > 0) {
+            continue;
+        }
+        
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        
+        if (pthread_setaffinity_np(t->thread, sizeof(set), &set) != 0) {
+            BLog(BLOG_WARNING, "pthread_setaffinity_np failed");
+        }
+        return;
+    }
+    
+    #else
+    
+    BLog(BLOG_WARNING, "binding threads to CPUs is not supported");
+    
+    #endif
+}
+
+static void close_notify_fds (BThreadWorkDispatcher *o)
+{
+    ASSERT_FORCE(close(o->notify_fd[0]) == 0)
+    if (o->notify_fd[1] != o->notify_fd[0]) {
+        ASSERT_FORCE(close(o->notify_fd[1]) == 0)
+    }
+}
+
 static void stop_threads (BThreadWorkDispatcher *o)
 {
     // set cancelling
@@ -197,19 +287,21 @@ static void work_job_handler (BThreadWork *o)
     return;
 }
 
-int BThreadWorkDispatcher_Init (BThreadWorkDispatcher *o, BReactor *reactor, int num_threads_hint)
+static int init_dispatcher (BThreadWorkDispatcher *o, BReactor *reactor, int num_threads_hint, int affinity)
 {
     // init arguments
     o->reactor = reactor;
     
+    #ifdef BADVPN_THREADWORK_USE_PTHREAD
+    
     if (num_threads_hint < 0) {
-        num_threads_hint = 2;
+        num_threads_hint = get_num_cpus();
     }
     if (num_threads_hint > BTHREADWORK_MAX_THREADS) {
         num_threads_hint = BTHREADWORK_MAX_THREADS;
     }
     
-    #ifdef BADVPN_THREADWORK_USE_PTHREAD
+    o->num_threads = 0;
     
     if (num_threads_hint > 0) {
         // init pending list
@@ -224,29 +316,51 @@ int BThreadWorkDispatcher_Init (BThreadWorkDispatcher *o, BReactor *reactor, int
             goto fail0;
         }
         
+        #ifdef BADVPN_USE_EVENTFD
+        
+        // init eventfd
+        if ((o->notify_fd[0] = eventfd(0, EFD_NONBLOCK)) < 0) {
+            BLog(BLOG_ERROR, "eventfd failed");
+            goto fail1;
+        }
+        o->notify_fd[1] = o->notify_fd[0];
+        
+        #else
+        
         // init pipe
-        if (pipe(o->pipe) < 0) {
+        if (pipe(o->notify_fd) < 0) {
             BLog(BLOG_ERROR, "pipe failed");
             goto fail1;
         }
         
         // set read end non-blocking
-        if (fcntl(o->pipe[0], F_SETFL, O_NONBLOCK) < 0) {
+        if (fcntl(o->notify_fd[0], F_SETFL, O_NONBLOCK) < 0) {
             BLog(BLOG_ERROR, "fcntl failed");
             goto fail2;
         }
         
         // set write end non-blocking
-        if (fcntl(o->pipe[1], F_SETFL, O_NONBLOCK) < 0) {
+        if (fcntl(o->notify_fd[1], F_SETFL, O_NONBLOCK) < 0) {
             BLog(BLOG_ERROR, "fcntl failed");
             goto fail2;
         }
         
+        #endif
+        
+        // set not notified
+        o->notified = 0;
+        
+        // allocate threads
+        if (!(o->threads = (struct BThreadWorkDispatcher_thread *)BAllocArray(num_threads_hint, sizeof(o->threads[0])))) {
+            BLog(BLOG_ERROR, "BAllocArray failed");
+            goto fail2;
+        }
+        
         // init BFileDescriptor
-        BFileDescriptor_Init(&o->bfd, o->pipe[0], (BFileDescriptor_handler)pipe_fd_handler, o);
+        BFileDescriptor_Init(&o->bfd, o->notify_fd[0], (BFileDescriptor_handler)notify_fd_handler, o);
         if (!BReactor_AddFileDescriptor(o->reactor, &o->bfd)) {
             BLog(BLOG_ERROR, "BReactor_AddFileDescriptor failed");
-            goto fail2;
+            goto fail3;
         }
         BReactor_SetFileDescriptorEvents(o->reactor, &o->bfd, BREACTOR_READ);
         
@@ -257,7 +371,6 @@ int BThreadWorkDispatcher_Init (BThreadWorkDispatcher *o, BReactor *reactor, int
         o->cancel = 0;
         
         // init threads
-        o->num_threads = 0;
         for (int i = 0; i < num_threads_hint; i++) {
             struct BThreadWorkDispatcher_thread *t = &o->threads[i];
             
@@ -267,20 +380,28 @@ int BThreadWorkDispatcher_Init (BThreadWorkDispatcher *o, BReactor *reactor, int
             // set no running work
             t->running_work = NULL;
             
+            // set not waiting
+            t->waiting = 0;
+            
             // init condition variable
             if (pthread_cond_init(&t->new_cond, NULL) != 0) {
                 BLog(BLOG_ERROR, "pthread_cond_init failed");
-                goto fail3;
+                goto fail4;
             }
             
             // init thread
             if (pthread_create(&t->thread, NULL, (void * (*) (void *))dispatcher_thread, t) != 0) {
                 BLog(BLOG_ERROR, "pthread_create failed");
                 ASSERT_FORCE(pthread_cond_destroy(&t->new_cond) == 0)
-                goto fail3;
+                goto fail4;
             }
-        
+            
             o->num_threads++;
+            
+            // bind thread to a CPU
+            if (affinity) {
+                bind_thread(t, i);
+            }
         }
     }
     
@@ -291,13 +412,14 @@ int BThreadWorkDispatcher_Init (BThreadWorkDispatcher *o, BReactor *reactor, int
     return 1;
     
     #ifdef BADVPN_THREADWORK_USE_PTHREAD
-fail3:
+fail4:
     stop_threads(o);
     BPending_Free(&o->more_job);
     BReactor_RemoveFileDescriptor(o->reactor, &o->bfd);
+fail3:
+    BFree(o->threads);
 fail2:
-    ASSERT_FORCE(close(o->pipe[0]) == 0)
-    ASSERT_FORCE(close(o->pipe[1]) == 0)
+    close_notify_fds(o);
 fail1:
     ASSERT_FORCE(pthread_mutex_destroy(&o->mutex) == 0)
 fail0:
@@ -305,6 +427,16 @@ fail0:
     #endif
 }
 
+int BThreadWorkDispatcher_Init (BThreadWorkDispatcher *o, BReactor *reactor, int num_threads_hint)
+{
+    return init_dispatcher(o, reactor, num_threads_hint, 0);
+}
+
+int BThreadWorkDispatcher_InitWithAffinity (BThreadWorkDispatcher *o, BReactor *reactor, int num_threads_hint)
+{
+    return init_dispatcher(o, reactor, num_threads_hint, 1);
+}
+
 void BThreadWorkDispatcher_Free (BThreadWorkDispatcher *o)
 {
     #ifdef BADVPN_THREADWORK_USE_PTHREAD
@@ -329,9 +461,11 @@ void BThreadWorkDispatcher_Free (BThreadWorkDispatcher *o)
         // free BFileDescriptor
         BReactor_RemoveFileDescriptor(o->reactor, &o->bfd);
         
-        // free pipe
-        ASSERT_FORCE(close(o->pipe[0]) == 0)
-        ASSERT_FORCE(close(o->pipe[1]) == 0)
+        // free threads
+        BFree(o->threads);
+        
+        // free notification fds
+        close_notify_fds(o);
         
         // free mutex
         ASSERT_FORCE(pthread_mutex_destroy(&o->mutex) == 0)
@@ -349,6 +483,15 @@ int BThreadWorkDispatcher_UsingThreads (BThreadWorkDispatcher *o)
     #endif
 }
 
+int BThreadWorkDispatcher_NumThreads (BThreadWorkDispatcher *o)
+{
+    #ifdef BADVPN_THREADWORK_USE_PTHREAD
+    return o->num_threads;
+    #else
+    return 0;
+    #endif
+}
+
 void BThreadWork_Init (BThreadWork *o, BThreadWorkDispatcher *d, BThreadWork_handler_done handler_done, void *user, BThreadWork_work_func work_func, void *work_func_user)
 {
     DebugObject_Access(&d->d_obj);
@@ -372,7 +515,9 @@ void BThreadWork_Init (BThreadWork *o, BThreadWorkDispatcher *d, BThreadWork_han
         ASSERT_FORCE(pthread_mutex_lock(&d->mutex) == 0)
         LinkedList1_Append(&d->pending_list, &o->list_node);
         for (int i = 0; i < d->num_threads; i++) {
-            if (!d->threads[i].running_work) {
+            // wake up a waiting thread; busy threads will find the work when they're done
+            if (d->threads[i].waiting) {
+                d->threads[i].waiting = 0;
                 ASSERT_FORCE(pthread_cond_signal(&d->threads[i].new_cond) == 0)
                 break;
             }
@@ -50,7 +50,7 @@
 #define BTHREADWORK_STATE_FINISHED 3
 #define BTHREADWORK_STATE_FORGOTTEN 4
 
-#define BTHREADWORK_MAX_THREADS 8
+#define BTHREADWORK_MAX_THREADS 64
 
 struct BThreadWork_s;
 struct BThreadWorkDispatcher_s;
@@ -74,6 +74,7 @@ typedef void (*BThreadWork_handler_done) (void *user);
 struct BThreadWorkDispatcher_thread {
     struct BThreadWorkDispatcher_s *d;
     struct BThreadWork_s *running_work;
+    int waiting;
     pthread_cond_t new_cond;
     pthread_t thread;
 };
@@ -85,12 +86,13 @@ typedef struct BThreadWorkDispatcher_s {
     LinkedList1 pending_list;
     LinkedList1 finished_list;
     pthread_mutex_t mutex;
-    int pipe[2];
+    int notify_fd[2];
+    int notified;
     BFileDescriptor bfd;
     BPending more_job;
     int cancel;
     int num_threads;
-    struct BThreadWorkDispatcher_thread threads[BTHREADWORK_MAX_THREADS];
+    struct BThreadWorkDispatcher_thread *threads;
     #endif
     DebugObject d_obj;
     DebugCounter d_ctr;
@@ -124,13 +126,27 @@ typedef struct BThreadWork_s {
  * @param o the object
  * @param reactor reactor we live in
  * @param num_threads_hint hint for the number of threads to use:
- *                         <0 - A choice will be made automatically, probably based on the number of CPUs.
+ *                         <0 - One thread per online CPU.
  *                         0 - No additional threads will be used, and computations will be performed directly
  *                             in the event loop in job handlers.
+ *                         >0 - This many threads, up to BTHREADWORK_MAX_THREADS.
  * @return 1 on success, 0 on failure
  */
 int BThreadWorkDispatcher_Init (BThreadWorkDispatcher *o, BReactor *reactor, int num_threads_hint) WARN_UNUSED;
 
+/**
+ * Initializes the work dispatcher, binding each thread to a single CPU.
+ * Thread i is bound to CPU (i mod number of CPUs). If binding is not supported
+ * on this system, or fails, the threads are left unbound.
+ * Otherwise behaves like {@link BThreadWorkDispatcher_Init}.
+ * 
+ * @param o the object
+ * @param reactor reactor we live in
+ * @param num_threads_hint as in {@link BThreadWorkDispatcher_Init}
+ * @return 1 on success, 0 on failure
+ */
+int BThreadWorkDispatcher_InitWithAffinity (BThreadWorkDispatcher *o, BReactor *reactor, int num_threads_hint) WARN_UNUSED;
+
 /**
  * Frees the work dispatcher.
  * There must be no {@link BThreadWork}'s with this dispatcher.
@@ -147,6 +163,13 @@ void BThreadWorkDispatcher_Free (BThreadWorkDispatcher *o);
  */
 int BThreadWorkDispatcher_UsingThreads (BThreadWorkDispatcher *o);
 
+/**
+ * Returns the number of threads being used for computations.
+ * 
+ * @return number of threads, or 0 if computations are done in the event loop
+ */
+int BThreadWorkDispatcher_NumThreads (BThreadWorkDispatcher *o);
+
 /**
  * Initializes the work.
  * 
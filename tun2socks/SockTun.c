@@ -27,27 +27,68 @@
 * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
-#ifndef WIN32_LEAN_AND_MEAN
-#define WIN32_LEAN_AND_MEAN
-#endif // !WIN32_LEAN_AND_MEAN
-
-#include <windows.h>
-#include <winsock2.h>
-#include <ws2tcpip.h>
-#include <iphlpapi.h>
-#include <stdlib.h>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 
-// Need to link with Ws2_32.lib
-#pragma comment (lib, "Ws2_32.lib")
+#include <string.h>
+#include <stdlib.h>
 
+#ifdef BADVPN_USE_WINAPI
+	#ifndef WIN32_LEAN_AND_MEAN
+	#define WIN32_LEAN_AND_MEAN
+	#endif // !WIN32_LEAN_AND_MEAN
+
+	#include <windows.h>
+	#include <winsock2.h>
+	#include <ws2tcpip.h>
+	#include <iphlpapi.h>
+
+	// Need to link with Ws2_32.lib
+	#pragma comment (lib, "Ws2_32.lib")
+#else
+	#include <unistd.h>
+	#include <errno.h>
+	#include <netdb.h>
+	#include <sys/types.h>
+	#include <sys/socket.h>
+	#include <sys/uio.h>
+	#include <misc/nonblocking.h>
+#endif
+
+#include <misc/balloc.h>
 #include <base/BLog.h>
 
-#include <tun2socks/socktun.h>
-
-void report_error(SockTun *obj)
-{
-	DEBUGERROR(&obj->d_err, obj->handler_error(obj->handler_error_user));
-}
+#include <tun2socks/SockTun.h>
+
+#include <generated/blog_channel_SockTun.h>
+
+#ifdef BADVPN_USE_WINAPI
+struct SockTun_send_entry {
+	SockTun *parent;
+	BReactorIOCPOverlapped olap;
+	WSABUF wsa_buf;
+	DWORD bytes_sent;
+	int busy;
+};
+#endif
+
+static void report_error(SockTun *obj);
+static void output_handler_recv(SockTun *obj, uint8_t *data);
+#ifdef BADVPN_USE_WINAPI
+static int init_send_queue(SockTun *obj);
+static void free_send_queue(SockTun *obj);
+#else
+static int read_packet(SockTun *obj, uint8_t *data);
+#endif
+#ifdef BADVPN_LINUX
+static int init_batch(SockTun *obj);
+static void free_batch(SockTun *obj);
+static void flush_send(SockTun *obj);
+static void send_job_handler(SockTun *obj);
+#endif
+
+#ifdef BADVPN_USE_WINAPI
 
 static void recv_olap_handler(SockTun *obj, int event, DWORD bytes)
 {
@@ -67,10 +108,360 @@ static void recv_olap_handler(SockTun *obj, int event, DWORD bytes)
 	ASSERT(bytes >= 0)
 	ASSERT(bytes <= obj->mtu)
 
+	// remember where to send packets to
+	obj->have_output_addr = 1;
+
 	// done
 	PacketRecvInterface_Done(&obj->output, bytes);
 }
 
+static void send_olap_handler(struct SockTun_send_entry *e, int event, DWORD bytes)
+{
+	SockTun *obj = e->parent;
+	DebugObject_Access(&obj->d_obj);
+	ASSERT(e->busy)
+	ASSERT(event == BREACTOR_IOCP_EVENT_SUCCEEDED || event == BREACTOR_IOCP_EVENT_FAILED)
+
+	// release entry
+	e->busy = 0;
+	obj->send_free[obj->send_free_count++] = (int)(e - obj->send_entries);
+
+	if (event == BREACTOR_IOCP_EVENT_FAILED) {
+		BLog(BLOG_ERROR, "write operation failed");
+	}
+	else {
+		ASSERT(bytes >= 0)
+		ASSERT(bytes <= e->wsa_buf.len)
+
+		if (bytes < e->wsa_buf.len) {
+			BLog(BLOG_ERROR, "write operation didn't write everything");
+		}
+	}
+
+	// let the user continue sending if we refused a packet
+	if (obj->send_blocked) {
+		obj->send_blocked = 0;
+		obj->handler_writable(obj->user);
+		return;
+	}
+}
+
+int init_send_queue(SockTun *obj)
+{
+	if (!(obj->send_entries = (struct SockTun_send_entry *)BAllocArray(SOCKTUN_SEND_QUEUE_SIZE, sizeof(obj->send_entries[0])))) {
+		goto fail0;
+	}
+	if (!(obj->send_slots = (uint8_t *)BAllocArray(SOCKTUN_SEND_QUEUE_SIZE, obj->mtu))) {
+		goto fail1;
+	}
+	if (!(obj->send_free = (int *)BAllocArray(SOCKTUN_SEND_QUEUE_SIZE, sizeof(obj->send_free[0])))) {
+		goto fail2;
+	}
+
+	for (int i = 0; i < SOCKTUN_SEND_QUEUE_SIZE; i++) {
+		struct SockTun_send_entry *e = &obj->send_entries[i];
+		e->parent = obj;
+		e->wsa_buf.buf = (char *)(obj->send_slots + (size_t)i * obj->mtu);
+		e->wsa_buf.len = 0;
+		e->busy = 0;
+		BReactorIOCPOverlapped_Init(&e->olap, obj->reactor, e, (BReactorIOCPOverlapped_handler)send_olap_handler);
+		obj->send_free[i] = SOCKTUN_SEND_QUEUE_SIZE - 1 - i;
+	}
+	obj->send_free_count = SOCKTUN_SEND_QUEUE_SIZE;
+	obj->send_blocked = 0;
+
+	return 1;
+
+fail2:
+	BFree(obj->send_slots);
+fail1:
+	BFree(obj->send_entries);
+fail0:
+	return 0;
+}
+
+void free_send_queue(SockTun *obj)
+{
+	for (int i = 0; i < SOCKTUN_SEND_QUEUE_SIZE; i++) {
+		struct SockTun_send_entry *e = &obj->send_entries[i];
+
+		// wait for writes in flight to finish
+		if (e->busy) {
+			BReactorIOCPOverlapped_Wait(&e->olap, NULL, NULL);
+		}
+
+		BReactorIOCPOverlapped_Free(&e->olap);
+	}
+
+	BFree(obj->send_free);
+	BFree(obj->send_slots);
+	BFree(obj->send_entries);
+}
+
+#else
+
+static void fd_handler(SockTun *obj, int events)
+{
+	DebugObject_Access(&obj->d_obj);
+	DebugError_AssertNoError(&obj->d_err);
+
+	if (events&(BREACTOR_ERROR|BREACTOR_HUP)) {
+		BLog(BLOG_WARNING, "device fd reports error?");
+	}
+
+	if (events&BREACTOR_READ) do {
+		ASSERT(obj->output_packet)
+
+		// try reading into the buffer
+		int bytes = read_packet(obj, obj->output_packet);
+		if (bytes == -1) {
+			// retry later
+			break;
+		}
+		if (bytes < 0) {
+			// report fatal error
+			report_error(obj);
+			return;
+		}
+
+		ASSERT_FORCE(bytes <= obj->mtu)
+
+		// remember where to send packets to
+		obj->have_output_addr = 1;
+
+		// set no output packet
+		obj->output_packet = NULL;
+
+		// update events
+		obj->poll_events &= ~BREACTOR_READ;
+		BReactor_SetFileDescriptorEvents(obj->reactor, &obj->bfd, obj->poll_events);
+
+		// inform receiver we finished the packet
+		PacketRecvInterface_Done(&obj->output, bytes);
+	} while (0);
+
+#ifdef BADVPN_LINUX
+	if (events&BREACTOR_WRITE) {
+		ASSERT(obj->send_count > 0)
+
+		// update events
+		obj->poll_events &= ~BREACTOR_WRITE;
+		BReactor_SetFileDescriptorEvents(obj->reactor, &obj->bfd, obj->poll_events);
+
+		// write out queued packets
+		flush_send(obj);
+
+		// let the user continue sending if we refused a packet
+		if (obj->send_blocked && obj->send_count < SOCKTUN_BATCH_SIZE) {
+			obj->send_blocked = 0;
+			obj->handler_writable(obj->user);
+			return;
+		}
+	}
+#endif
+}
+
+int read_packet(SockTun *obj, uint8_t *data)
+{
+	// returns the length of the packet read into data,
+	// -1 if there is no packet available or -2 on error
+
+#ifdef BADVPN_LINUX
+
+	// hand out packets left over from the last batch
+	if (obj->recv_pos < obj->recv_count) {
+		int i = obj->recv_pos++;
+		int bytes = obj->recv_msgs[i].msg_len;
+		memcpy(data, obj->recv_iovs[i].iov_base, bytes);
+		obj->output_addr = obj->recv_addrs[i];
+		return bytes;
+	}
+
+	// read a new batch; the first packet goes directly into data
+	obj->recv_iovs[0].iov_base = data;
+	for (int i = 0; i < SOCKTUN_BATCH_SIZE; i++) {
+		obj->recv_msgs[i].msg_hdr.msg_namelen = sizeof(obj->recv_addrs[i]);
+	}
+
+	int res = recvmmsg(obj->fd, obj->recv_msgs, SOCKTUN_BATCH_SIZE, MSG_DONTWAIT, NULL);
+	if (res <= 0) {
+		if (res == 0 || errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return -1;
+		}
+		BLog(BLOG_ERROR, "recvmmsg failed");
+		return -2;
+	}
+
+	obj->recv_count = res;
+	obj->recv_pos = 1;
+	obj->output_addr = obj->recv_addrs[0];
+
+	return obj->recv_msgs[0].msg_len;
+
+#else
+
+	socklen_t addr_len = sizeof(obj->output_addr);
+	int bytes = recvfrom(obj->fd, data, obj->mtu, 0, (struct sockaddr *)&obj->output_addr, &addr_len);
+	if (bytes < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return -1;
+		}
+		BLog(BLOG_ERROR, "recvfrom failed");
+		return -2;
+	}
+
+	return bytes;
+
+#endif
+}
+
+#endif
+
+#ifdef BADVPN_LINUX
+
+int init_batch(SockTun *obj)
+{
+	// allocate receive slots; the first packet of a batch
+	// is read into the receiver's buffer, so one less is needed
+	if (!(obj->recv_slots = (uint8_t *)BAllocArray(SOCKTUN_BATCH_SIZE - 1, obj->mtu))) {
+		goto fail0;
+	}
+	if (!(obj->recv_msgs = (struct mmsghdr *)BAllocArray(SOCKTUN_BATCH_SIZE, sizeof(obj->recv_msgs[0])))) {
+		goto fail1;
+	}
+	if (!(obj->recv_iovs = (struct iovec *)BAllocArray(SOCKTUN_BATCH_SIZE, sizeof(obj->recv_iovs[0])))) {
+		goto fail2;
+	}
+	if (!(obj->recv_addrs = (struct sockaddr_in *)BAllocArray(SOCKTUN_BATCH_SIZE, sizeof(obj->recv_addrs[0])))) {
+		goto fail3;
+	}
+
+	// allocate send slots
+	if (!(obj->send_slots = (uint8_t *)BAllocArray(SOCKTUN_BATCH_SIZE, obj->mtu))) {
+		goto fail4;
+	}
+	if (!(obj->send_msgs = (struct mmsghdr *)BAllocArray(SOCKTUN_BATCH_SIZE, sizeof(obj->send_msgs[0])))) {
+		goto fail5;
+	}
+	if (!(obj->send_iovs = (struct iovec *)BAllocArray(SOCKTUN_BATCH_SIZE, sizeof(obj->send_iovs[0])))) {
+		goto fail6;
+	}
+
+	memset(obj->recv_msgs, 0, SOCKTUN_BATCH_SIZE * sizeof(obj->recv_msgs[0]));
+	memset(obj->send_msgs, 0, SOCKTUN_BATCH_SIZE * sizeof(obj->send_msgs[0]));
+
+	for (int i = 0; i < SOCKTUN_BATCH_SIZE; i++) {
+		obj->recv_iovs[i].iov_base = (i == 0 ? NULL : obj->recv_slots + (size_t)(i - 1) * obj->mtu);
+		obj->recv_iovs[i].iov_len = obj->mtu;
+		obj->recv_msgs[i].msg_hdr.msg_iov = &obj->recv_iovs[i];
+		obj->recv_msgs[i].msg_hdr.msg_iovlen = 1;
+		obj->recv_msgs[i].msg_hdr.msg_name = &obj->recv_addrs[i];
+
+		obj->send_iovs[i].iov_base = obj->send_slots + (size_t)i * obj->mtu;
+		obj->send_msgs[i].msg_hdr.msg_iov = &obj->send_iovs[i];
+		obj->send_msgs[i].msg_hdr.msg_iovlen = 1;
+		obj->send_msgs[i].msg_hdr.msg_name = &obj->output_addr;
+		obj->send_msgs[i].msg_hdr.msg_namelen = sizeof(obj->output_addr);
+	}
+
+	// set no received or queued packets
+	obj->recv_count = 0;
+	obj->recv_pos = 0;
+	obj->send_count = 0;
+	obj->send_blocked = 0;
+
+	// init send job
+	BPending_Init(&obj->send_job, BReactor_PendingGroup(obj->reactor), (BPending_handler)send_job_handler, obj);
+
+	return 1;
+
+fail6:
+	BFree(obj->send_msgs);
+fail5:
+	BFree(obj->send_slots);
+fail4:
+	BFree(obj->recv_addrs);
+fail3:
+	BFree(obj->recv_iovs);
+fail2:
+	BFree(obj->recv_msgs);
+fail1:
+	BFree(obj->recv_slots);
+fail0:
+	return 0;
+}
+
+void free_batch(SockTun *obj)
+{
+	BPending_Free(&obj->send_job);
+	BFree(obj->send_iovs);
+	BFree(obj->send_msgs);
+	BFree(obj->send_slots);
+	BFree(obj->recv_addrs);
+	BFree(obj->recv_iovs);
+	BFree(obj->recv_msgs);
+	BFree(obj->recv_slots);
+}
+
+void flush_send(SockTun *obj)
+{
+	ASSERT(obj->send_count > 0)
+	ASSERT(!(obj->poll_events & BREACTOR_WRITE))
+
+	int sent = 0;
+	while (sent < obj->send_count) {
+		int res = sendmmsg(obj->fd, obj->send_msgs + sent, obj->send_count - sent, 0);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				// socket buffer is full, continue when it's writable
+				break;
+			}
+			// a malformed packet fails on its own, skip it and send the rest
+			BLog(BLOG_DEBUG, "sendmmsg failed, dropping packet");
+			res = 1;
+		}
+		sent += res;
+	}
+
+	// move unsent packets to the front of the queue; swap
+	// the slots rather than copying the data
+	int left = obj->send_count - sent;
+	for (int i = 0; i < left; i++) {
+		struct iovec tmp = obj->send_iovs[i];
+		obj->send_iovs[i] = obj->send_iovs[sent + i];
+		obj->send_iovs[sent + i] = tmp;
+	}
+	obj->send_count = left;
+
+	BPending_Unset(&obj->send_job);
+
+	if (left > 0) {
+		BLog(BLOG_DEBUG, "socket buffer full, %d packets queued", left);
+
+		// wait for the socket to become writable
+		obj->poll_events |= BREACTOR_WRITE;
+		BReactor_SetFileDescriptorEvents(obj->reactor, &obj->bfd, obj->poll_events);
+	}
+}
+
+void send_job_handler(SockTun *obj)
+{
+	DebugObject_Access(&obj->d_obj);
+	ASSERT(obj->send_count > 0)
+
+	flush_send(obj);
+}
+
+#endif
+
+void report_error(SockTun *obj)
+{
+	DEBUGERROR(&obj->d_err, obj->handler_error(obj->user));
+}
+
 void output_handler_recv(SockTun *obj, uint8_t *data)
 {
 	DebugObject_Access(&obj->d_obj);
@@ -78,12 +469,15 @@ void output_handler_recv(SockTun *obj, uint8_t *data)
 	ASSERT(data)
 	ASSERT(!obj->output_packet)
 
+#ifdef BADVPN_USE_WINAPI
+
 	memset(&obj->recv_olap.olap, 0, sizeof(obj->recv_olap.olap));
 	memset(&obj->wsa_buf, 0, sizeof(obj->wsa_buf));
 
 	// read
 	obj->wsa_buf.buf = data;
 	obj->wsa_buf.len = obj->mtu;
+	obj->output_addr_size = sizeof(obj->output_addr);
 	BOOL res = WSARecvFrom(obj->device, &obj->wsa_buf, 
 		1, &obj->wsa_bytes_recv, 
 		&obj->wsa_flags, (SOCKADDR *) &obj->output_addr, 
@@ -96,23 +490,64 @@ void output_handler_recv(SockTun *obj, uint8_t *data)
 	}
 
 	obj->output_packet = obj->wsa_buf.buf;
+
+#else
+
+	// attempt read
+	int bytes = read_packet(obj, data);
+	if (bytes == -1) {
+		// retry later in fd_handler
+		// remember packet
+		obj->output_packet = data;
+		// update events
+		obj->poll_events |= BREACTOR_READ;
+		BReactor_SetFileDescriptorEvents(obj->reactor, &obj->bfd, obj->poll_events);
+		return;
+	}
+	if (bytes < 0) {
+		// report fatal error
+		report_error(obj);
+		return;
+	}
+
+	ASSERT_FORCE(bytes <= obj->mtu)
+
+	// remember where to send packets to
+	obj->have_output_addr = 1;
+
+	PacketRecvInterface_Done(&obj->output, bytes);
+
+#endif
 }
 
-int SockTun_Init(SockTun *obj, BReactor *reactor, char *tun_service_name, int mtu, SockTun_handler_error handler_error, void *handler_error_user)
+int SockTun_Init(SockTun *obj, BReactor *reactor, const char *tun_service_name, int mtu, SockTun_handler_error handler_error, SockTun_handler_writable handler_writable, void *user)
 {
 	// Init arguments
 	obj->mtu = mtu;
 	obj->reactor = reactor;
 	obj->handler_error = handler_error;
-	obj->handler_error_user = handler_error_user;
-
-	WSADATA wsaData;
-	int iResult;
+	obj->handler_writable = handler_writable;
+	obj->user = user;
 
-	SOCKET SSocket = INVALID_SOCKET;
+	// set no tunnel peer address
+	memset(&obj->output_addr, 0, sizeof(obj->output_addr));
+	obj->have_output_addr = 0;
 
 	struct addrinfo *result = NULL;
 	struct addrinfo hints;
+	int iResult;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_protocol = IPPROTO_UDP;
+	hints.ai_flags = AI_PASSIVE;
+
+#ifdef BADVPN_USE_WINAPI
+
+	WSADATA wsaData;
+
+	SOCKET SSocket = INVALID_SOCKET;
 
 	// Initialize Winsock
 	iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
@@ -121,12 +556,6 @@ int SockTun_Init(SockTun *obj, BReactor *reactor, char *tun_service_name, int mt
 		return 0;
 	}
 
-	ZeroMemory(&hints, sizeof(hints));
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_DGRAM;
-	hints.ai_protocol = IPPROTO_UDP;
-	hints.ai_flags = AI_PASSIVE;
-
 	// Resolve the server address and port
 	iResult = getaddrinfo(NULL, (PCSTR)tun_service_name, &hints, &result);
 	if (iResult != 0) {
@@ -164,76 +593,301 @@ int SockTun_Init(SockTun *obj, BReactor *reactor, char *tun_service_name, int mt
 	// Associate socket with IOCP
 	if (!CreateIoCompletionPort((HANDLE)SSocket, BReactor_GetIOCPHandle(reactor), 0, 0)) {
 		BLog(BLOG_ERROR, "CreateIoCompletionPort failed");
-		CloseHandle((HANDLE)SSocket);
+		closesocket(SSocket);
+		WSACleanup();
 		return 0;
 	}
 
 	obj->device = SSocket;
+	obj->wsa_flags = 0;
 
-	// init send olap
-	BReactorIOCPOverlapped_Init(&obj->send_olap, reactor, obj, NULL);
+	// init send queue
+	if (!init_send_queue(obj)) {
+		BLog(BLOG_ERROR, "init_send_queue failed");
+		closesocket(SSocket);
+		WSACleanup();
+		return 0;
+	}
 
 	// init recv olap
 	BReactorIOCPOverlapped_Init(&obj->recv_olap, obj->reactor, obj, (BReactorIOCPOverlapped_handler)recv_olap_handler);
 
+#else
+
+	// Resolve the server address and port
+	iResult = getaddrinfo(NULL, tun_service_name, &hints, &result);
+	if (iResult != 0) {
+		BLog(BLOG_ERROR, "getaddrinfo failed with error: %s", gai_strerror(iResult));
+		goto fail0;
+	}
+
+	// Create a socket for server
+	if ((obj->fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol)) < 0) {
+		BLog(BLOG_ERROR, "socket failed");
+		freeaddrinfo(result);
+		goto fail0;
+	}
+
+	// Setup the UDP listening socket
+	if (bind(obj->fd, result->ai_addr, result->ai_addrlen) < 0) {
+		BLog(BLOG_ERROR, "bind failed");
+		freeaddrinfo(result);
+		goto fail1;
+	}
+
+	freeaddrinfo(result);
+
+	// set non-blocking
+	if (!badvpn_set_nonblocking(obj->fd)) {
+		BLog(BLOG_ERROR, "cannot set non-blocking");
+		goto fail1;
+	}
+
+	BLog(BLOG_INFO, "UDP socket binded to %s", tun_service_name);
+
+#ifdef BADVPN_LINUX
+	// init batched I/O
+	if (!init_batch(obj)) {
+		BLog(BLOG_ERROR, "init_batch failed");
+		goto fail1;
+	}
+#else
+	// allocate send buffer
+	if (!(obj->send_buf = (uint8_t *)BAlloc(obj->mtu))) {
+		BLog(BLOG_ERROR, "BAlloc failed");
+		goto fail1;
+	}
+#endif
+
+	// init file descriptor object
+	BFileDescriptor_Init(&obj->bfd, obj->fd, (BFileDescriptor_handler)fd_handler, obj);
+	if (!BReactor_AddFileDescriptor(obj->reactor, &obj->bfd)) {
+		BLog(BLOG_ERROR, "BReactor_AddFileDescriptor failed");
+		goto fail2;
+	}
+	obj->poll_events = 0;
+
+#endif
+
 	// init output
 	PacketRecvInterface_Init(&obj->output, obj->mtu, (PacketRecvInterface_handler_recv)output_handler_recv, obj, BReactor_PendingGroup(obj->reactor));
 
 	// set no output packet
 	obj->output_packet = NULL;
 
+#ifndef NDEBUG
+	obj->d_writing = 0;
+#endif
+
 	DebugError_Init(&obj->d_err, BReactor_PendingGroup(obj->reactor));
 	DebugObject_Init(&obj->d_obj);
 
 	return 1;
+
+#ifndef BADVPN_USE_WINAPI
+fail2:
+#ifdef BADVPN_LINUX
+	free_batch(obj);
+#else
+	BFree(obj->send_buf);
+#endif
+fail1:
+	ASSERT_FORCE(close(obj->fd) == 0)
+fail0:
+	return 0;
+#endif
 }
 
-void SockTun_Send(SockTun *obj, uint8_t *data, int data_len) 
+void SockTun_Free(SockTun *obj)
+{
+	DebugObject_Free(&obj->d_obj);
+	DebugError_Free(&obj->d_err);
+
+	// free output
+	PacketRecvInterface_Free(&obj->output);
+
+#ifdef BADVPN_USE_WINAPI
+
+	// cancel I/O
+	ASSERT_FORCE(CancelIo((HANDLE)obj->device))
+
+	// wait receiving to finish
+	if (obj->output_packet) {
+		BLog(BLOG_DEBUG, "waiting for receiving to finish");
+		BReactorIOCPOverlapped_Wait(&obj->recv_olap, NULL, NULL);
+	}
+
+	// free recv olap
+	BReactorIOCPOverlapped_Free(&obj->recv_olap);
+
+	// free send queue, waiting for writes in flight
+	free_send_queue(obj);
+
+	// close socket
+	closesocket(obj->device);
+	WSACleanup();
+
+#else
+
+	// free BFileDescriptor
+	BReactor_RemoveFileDescriptor(obj->reactor, &obj->bfd);
+
+#ifdef BADVPN_LINUX
+	// free batched I/O, dropping any queued packets
+	free_batch(obj);
+#else
+	// free send buffer
+	BFree(obj->send_buf);
+#endif
+
+	// close socket
+	ASSERT_FORCE(close(obj->fd) == 0)
+
+#endif
+}
+
+int SockTun_Send(SockTun *obj, uint8_t *data, int data_len) 
+{
+	DebugObject_Access(&obj->d_obj);
+	ASSERT(data_len >= 0)
+	ASSERT(data_len <= obj->mtu)
+
+	uint8_t *out;
+	if (!SockTun_StartPacket(obj, &out)) {
+		return 0;
+	}
+
+	memcpy(out, data, data_len);
+
+	SockTun_EndPacket(obj, data_len);
+
+	return 1;
+}
+
+int SockTun_StartPacket(SockTun *obj, uint8_t **data)
 {
 	DebugObject_Access(&obj->d_obj);
 	DebugError_AssertNoError(&obj->d_err);
+	ASSERT(!obj->d_writing)
+
+#ifdef BADVPN_USE_WINAPI
+
+	// refuse packet if all writes are in flight
+	if (obj->send_free_count == 0) {
+		obj->send_blocked = 1;
+		return 0;
+	}
+
+	// provide the buffer of the next free entry
+	*data = (uint8_t *)obj->send_entries[obj->send_free[obj->send_free_count - 1]].wsa_buf.buf;
+
+#elif defined(BADVPN_LINUX)
+
+	// refuse packet if the queue is full and waiting for the socket
+	if (obj->send_count == SOCKTUN_BATCH_SIZE) {
+		ASSERT(obj->poll_events & BREACTOR_WRITE)
+		obj->send_blocked = 1;
+		return 0;
+	}
+
+	// provide the next queue slot
+	*data = (uint8_t *)obj->send_iovs[obj->send_count].iov_base;
+
+#else
+
+	*data = obj->send_buf;
+
+#endif
+
+#ifndef NDEBUG
+	obj->d_writing = 1;
+#endif
+
+	return 1;
+}
+
+void SockTun_EndPacket(SockTun *obj, int data_len)
+{
+	DebugObject_Access(&obj->d_obj);
+	DebugError_AssertNoError(&obj->d_err);
+	ASSERT(obj->d_writing)
 	ASSERT(data_len >= 0)
 	ASSERT(data_len <= obj->mtu)
 
+#ifndef NDEBUG
+	obj->d_writing = 0;
+#endif
+
+	// we don't know where to send until the tunnel sends us something
+	if (!obj->have_output_addr) {
+		BLog(BLOG_DEBUG, "no tunnel peer yet, dropping packet");
+		return;
+	}
+
+#ifdef BADVPN_USE_WINAPI
+
 	// ignore frames without an Ethernet header, or we get errors in WriteFile
 	if (data_len < 14) {
 		return;
 	}
 
-	memset(&obj->send_olap.olap, 0, sizeof(obj->send_olap.olap));
-	memset(&obj->wsa_buf, 0, sizeof(obj->wsa_buf));
+	// take the entry written to
+	ASSERT(obj->send_free_count > 0)
+	struct SockTun_send_entry *e = &obj->send_entries[obj->send_free[--obj->send_free_count]];
+	ASSERT(!e->busy)
+
+	memset(&e->olap.olap, 0, sizeof(e->olap.olap));
 
 	// write
-	obj->wsa_buf.buf = data;
-	obj->wsa_buf.len = data_len;
+	e->wsa_buf.len = data_len;
 	BOOL res = WSASendTo(
-		obj->device, &obj->wsa_buf,
-		1, &obj->wsa_bytes_sent,
-		obj->wsa_flags, (SOCKADDR *) &obj->output_addr,
-		obj->output_addr_size, &obj->send_olap.olap,
+		obj->device, &e->wsa_buf,
+		1, &e->bytes_sent,
+		0, (SOCKADDR *) &obj->output_addr,
+		sizeof(obj->output_addr), &e->olap.olap,
 		NULL);
-	int err = GetLastError();
-	if (res != 0 && GetLastError() != ERROR_IO_PENDING) {
-		BLog(BLOG_ERROR, "WriteFile failed (%u)", GetLastError());
+	if (res != 0 && WSAGetLastError() != WSA_IO_PENDING) {
+		BLog(BLOG_ERROR, "WSASendTo failed (%u)", WSAGetLastError());
+		obj->send_free[obj->send_free_count++] = (int)(e - obj->send_entries);
 		return;
 	}
 
-	// wait
-	int succeeded;
-	DWORD bytes;
-	BReactorIOCPOverlapped_Wait(&obj->send_olap, &succeeded, &bytes);
+	// completion is reported to send_olap_handler
+	e->busy = 1;
 
-	if (!succeeded) {
-		BLog(BLOG_ERROR, "write operation failed");
+#elif defined(BADVPN_LINUX)
+
+	// queue packet
+	ASSERT(obj->send_count < SOCKTUN_BATCH_SIZE)
+	obj->send_iovs[obj->send_count].iov_len = data_len;
+	obj->send_count++;
+
+	if (obj->poll_events & BREACTOR_WRITE) {
+		// queue will be written when the socket is writable
+	}
+	else if (obj->send_count == SOCKTUN_BATCH_SIZE) {
+		// queue is full, write it out now
+		flush_send(obj);
+	}
+	else if (!BPending_IsSet(&obj->send_job)) {
+		// write queued packets once the current job is done
+		BPending_Set(&obj->send_job);
 	}
-	else {
-		ASSERT(bytes >= 0)
-		ASSERT(bytes <= data_len)
 
-		if (bytes < data_len) {
-			BLog(BLOG_ERROR, "write operation didn't write everything");
+#else
+
+	int bytes = sendto(obj->fd, obj->send_buf, data_len, 0, (struct sockaddr *)&obj->output_addr, sizeof(obj->output_addr));
+	if (bytes < 0) {
+		// the socket buffer may be full or the peer may be gone; act like
+		// the packet was accepted, the same as a lossy link would
+		BLog(BLOG_DEBUG, "sendto failed");
+	} else {
+		if (bytes != data_len) {
+			BLog(BLOG_WARNING, "written %d expected %d", bytes, data_len);
 		}
 	}
+
+#endif
 }
 
 int SockTun_GetMTU(SockTun *obj)
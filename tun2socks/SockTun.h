@@ -27,12 +27,29 @@
 * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#ifndef BADVPN_TUN2SOCKS_SOCKTUN_H
+#define BADVPN_TUN2SOCKS_SOCKTUN_H
+
+#include <stdint.h>
+
+#ifndef BADVPN_USE_WINAPI
+#include <netinet/in.h>
+#endif
+
 #include <misc/debug.h>
 #include <misc/debugerror.h>
 #include <base/DebugObject.h>
 #include <system/BReactor.h>
 #include <flow/PacketRecvInterface.h>
 
+// maximum number of packets received or sent in one system call,
+// where recvmmsg/sendmmsg are available
+#define SOCKTUN_BATCH_SIZE 32
+
+// maximum number of packet writes in flight, where writes
+// complete asynchronously (IOCP)
+#define SOCKTUN_SEND_QUEUE_SIZE 64
+
 /**
 * Handler called when an error occurs on the device.
 * The object must be destroyed from the job context of this
@@ -42,30 +59,64 @@
 */
 typedef void(*SockTun_handler_error) (void *used);
 
+/**
+* Handler called when the device can accept packets again after
+* {@link SockTun_Send} refused one because the send queue was full.
+*
+* @param user as in {@link SockTun_Init}
+*/
+typedef void(*SockTun_handler_writable) (void *user);
+
+struct SockTun_send_entry;
+
 typedef struct {
 	BReactor *reactor;
 	SockTun_handler_error handler_error;
-	void *handler_error_user;
+	SockTun_handler_writable handler_writable;
+	void *user;
 	int mtu;
 	PacketRecvInterface output;
 	uint8_t *output_packet;
+	struct sockaddr_in output_addr;
+	int have_output_addr;
 
 #ifdef BADVPN_USE_WINAPI
 	SOCKET device;
-	struct sockaddr_in output_addr;
-	BReactorIOCPOverlapped send_olap;
 	BReactorIOCPOverlapped recv_olap;
+	struct SockTun_send_entry *send_entries;
+	uint8_t *send_slots;
+	int *send_free;
+	int send_free_count;
+	int send_blocked;
 
 	int output_addr_size;
 	WSABUF wsa_buf;
 	DWORD wsa_flags;
 	DWORD wsa_bytes_recv;
-	DWORD wsa_bytes_sent;
 #else
-	int close_fd;
 	int fd;
 	BFileDescriptor bfd;
 	int poll_events;
+#ifdef BADVPN_LINUX
+	uint8_t *recv_slots;
+	struct mmsghdr *recv_msgs;
+	struct iovec *recv_iovs;
+	struct sockaddr_in *recv_addrs;
+	int recv_count;
+	int recv_pos;
+	uint8_t *send_slots;
+	struct mmsghdr *send_msgs;
+	struct iovec *send_iovs;
+	int send_count;
+	int send_blocked;
+	BPending send_job;
+#else
+	uint8_t *send_buf;
+#endif
+#endif
+
+#ifndef NDEBUG
+	int d_writing;
 #endif
 
 	DebugError d_err;
@@ -74,26 +125,68 @@ typedef struct {
 
 /**
  * Initializes the sock tunnel device.
- * Setup a winsock server to recieve data from tunnel
+ * Setup a UDP socket to recieve data from tunnel. Packets are sent back
+ * to the address the last packet was received from.
  *
  * @param o the object
  * @param BReactor {@link BReactor} we live in
  * @param the service name or port to recieve tunnel data 
  * @param mtu of the tunnel
  * @param handler_error error handler function
- * @param handler_error_user value passed to error handler
+ * @param handler_writable handler called when a full send queue has room again
+ * @param user value passed to handlers
+ * @return 1 on success, 0 on failure
  */
-int SockTun_Init(SockTun *obj, BReactor *ss, char *tun_service_name, int mtu, SockTun_handler_error handler_error, void *handler_error_user);
+int SockTun_Init(SockTun *obj, BReactor *ss, const char *tun_service_name, int mtu, SockTun_handler_error handler_error, SockTun_handler_writable handler_writable, void *user) WARN_UNUSED;
+
+/**
+* Frees the sock tunnel device.
+*
+* @param o the object
+*/
+void SockTun_Free(SockTun *obj);
 
 /**
 * Sends a packet to the device.
 * Any errors will be reported via a job.
+* The packet is copied and queued; queued packets are written without
+* blocking, together where batching is available. If the queue is full,
+* the packet is refused and the writable handler will be called once
+* there is room again.
+* The object must be in not writing state.
 *
 * @param o the object
 * @param data packet to send
 * @param data_len length of packet. Must be >=0 and <=MTU, as reported by {@link BTap_GetMTU}.
+* @return 1 if the packet was accepted, 0 if the send queue is full
 */
-void SockTun_Send(SockTun *obj, uint8_t *data, int data_len);
+int SockTun_Send(SockTun *obj, uint8_t *data, int data_len);
+
+/**
+* Attempts to provide a memory location in the send queue for writing
+* a packet, so that it can be assembled in place instead of being copied
+* by {@link SockTun_Send}.
+* The object must be in not writing state.
+* On success, the object enters writing state. On failure, the writable
+* handler will be called once there is room again.
+*
+* @param o the object
+* @param data on success, the memory location will be stored here.
+*             It will have space for MTU bytes.
+* @return 1 on success, 0 if the send queue is full
+*/
+int SockTun_StartPacket(SockTun *obj, uint8_t **data) WARN_UNUSED;
+
+/**
+* Submits a packet written to the memory location provided by
+* {@link SockTun_StartPacket}.
+* The object must be in writing state.
+* The object enters not writing state.
+*
+* @param o the object
+* @param data_len length of the packet that was written. Must be >=0 and <=MTU.
+*/
+void SockTun_EndPacket(SockTun *obj, int data_len);
 
 /**
 * Returns the device's maximum transmission unit (including any protocol headers).
@@ -110,4 +203,6 @@ int SockTun_GetMTU(SockTun *o);
 * @param o the object
 * @return output interface
 */
-PacketRecvInterface * SockTun_GetOutput(SockTun *o);
\ No newline at end of file
+PacketRecvInterface * SockTun_GetOutput(SockTun *o);
+
+#endif
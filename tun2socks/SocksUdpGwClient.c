@@ -26,131 +26,157 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdarg.h>
+
 #include <misc/debug.h>
+#include <misc/balloc.h>
 #include <base/BLog.h>
 
 #include <tun2socks/SocksUdpGwClient.h>
 
 #include <generated/blog_channel_SocksUdpGwClient.h>
 
-static void free_socks (SocksUdpGwClient *o);
-static void try_connect (SocksUdpGwClient *o);
-static void reconnect_timer_handler (SocksUdpGwClient *o);
-static void socks_client_handler (SocksUdpGwClient *o, int event);
-static void udpgw_handler_servererror (SocksUdpGwClient *o);
-static void udpgw_handler_received (SocksUdpGwClient *o, BAddr local_addr, BAddr remote_addr, const uint8_t *data, int data_len);
+static void link_logfunc (struct SocksUdpGwClient_link *link);
+static void link_log (struct SocksUdpGwClient_link *link, int level, const char *fmt, ...);
+static void free_socks (struct SocksUdpGwClient_link *link);
+static void try_connect (struct SocksUdpGwClient_link *link);
+static void reconnect_timer_handler (struct SocksUdpGwClient_link *link);
+static void socks_client_handler (struct SocksUdpGwClient_link *link, int event);
+static void udpgw_handler_servererror (struct SocksUdpGwClient_link *link);
+static void udpgw_handler_received (struct SocksUdpGwClient_link *link, BAddr local_addr, BAddr remote_addr, const uint8_t *data, int data_len);
+static struct SocksUdpGwClient_link * choose_link (SocksUdpGwClient *o, BAddr local_addr, BAddr remote_addr);
 
-static void free_socks (SocksUdpGwClient *o)
+static void link_logfunc (struct SocksUdpGwClient_link *link)
 {
-    ASSERT(o->have_socks)
+    BLog_Append("link %d: ", link->index);
+}
+
+static void link_log (struct SocksUdpGwClient_link *link, int level, const char *fmt, ...)
+{
+    va_list vl;
+    va_start(vl, fmt);
+    BLog_LogViaFuncVarArg((BLog_logfunc)link_logfunc, link, BLOG_CURRENT_CHANNEL, level, fmt, vl);
+    va_end(vl);
+}
+
+static void free_socks (struct SocksUdpGwClient_link *link)
+{
+    ASSERT(link->have_socks)
     
     // disconnect udpgw client from SOCKS
-    if (o->socks_up) {
-        UdpGwClient_DisconnectServer(&o->udpgw_client);
+    if (link->socks_up) {
+        UdpGwClient_DisconnectServer(&link->udpgw_client);
     }
     
     // free SOCKS client
-    BSocksClient_Free(&o->socks_client);
+    BSocksClient_Free(&link->socks_client);
     
     // set have no SOCKS
-    o->have_socks = 0;
+    link->have_socks = 0;
+    
+    // set SOCKS not up, so that flows are not chosen to go to this link
+    link->socks_up = 0;
 }
 
-static void try_connect (SocksUdpGwClient *o)
+static void try_connect (struct SocksUdpGwClient_link *link)
 {
-    ASSERT(!o->have_socks)
-    ASSERT(!BTimer_IsRunning(&o->reconnect_timer))
+    SocksUdpGwClient *o = link->parent;
+    ASSERT(!link->have_socks)
+    ASSERT(!BTimer_IsRunning(&link->reconnect_timer))
     
     // init SOCKS client
-    if (!BSocksClient_Init(&o->socks_client, o->socks_server_addr, o->auth_info, o->num_auth_info, o->remote_udpgw_addr, (BSocksClient_handler)socks_client_handler, o, o->reactor)) {
-        BLog(BLOG_ERROR, "BSocksClient_Init failed");
+    if (!BSocksClient_Init(&link->socks_client, o->socks_server_addr, o->auth_info, o->num_auth_info, o->remote_udpgw_addr, (BSocksClient_handler)socks_client_handler, link, o->reactor, NULL)) {
+        link_log(link, BLOG_ERROR, "BSocksClient_Init failed");
         goto fail0;
     }
     
     // set have SOCKS
-    o->have_socks = 1;
+    link->have_socks = 1;
     
     // set SOCKS not up
-    o->socks_up = 0;
+    link->socks_up = 0;
     
     return;
     
 fail0:
     // set reconnect timer
-    BReactor_SetTimer(o->reactor, &o->reconnect_timer);
+    BReactor_SetTimer(o->reactor, &link->reconnect_timer);
 }
 
-static void reconnect_timer_handler (SocksUdpGwClient *o)
+static void reconnect_timer_handler (struct SocksUdpGwClient_link *link)
 {
-    DebugObject_Access(&o->d_obj);
-    ASSERT(!o->have_socks)
+    DebugObject_Access(&link->parent->d_obj);
+    ASSERT(!link->have_socks)
     
     // try connecting
-    try_connect(o);
+    try_connect(link);
 }
 
-static void socks_client_handler (SocksUdpGwClient *o, int event)
+static void socks_client_handler (struct SocksUdpGwClient_link *link, int event)
 {
+    SocksUdpGwClient *o = link->parent;
     DebugObject_Access(&o->d_obj);
-    ASSERT(o->have_socks)
+    ASSERT(link->have_socks)
     
     switch (event) {
         case BSOCKSCLIENT_EVENT_UP: {
-            ASSERT(!o->socks_up)
+            ASSERT(!link->socks_up)
             
-            BLog(BLOG_INFO, "SOCKS up");
+            link_log(link, BLOG_INFO, "SOCKS up");
             
             // connect udpgw client to SOCKS
-            if (!UdpGwClient_ConnectServer(&o->udpgw_client, BSocksClient_GetSendInterface(&o->socks_client), BSocksClient_GetRecvInterface(&o->socks_client))) {
-                BLog(BLOG_ERROR, "UdpGwClient_ConnectServer failed");
+            if (!UdpGwClient_ConnectServer(&link->udpgw_client, BSocksClient_GetSendInterface(&link->socks_client), BSocksClient_GetRecvInterface(&link->socks_client))) {
+                link_log(link, BLOG_ERROR, "UdpGwClient_ConnectServer failed");
                 goto fail0;
             }
             
             // set SOCKS up
-            o->socks_up = 1;
+            link->socks_up = 1;
             
             return;
             
         fail0:
             // free SOCKS
-            free_socks(o);
+            free_socks(link);
             
             // set reconnect timer
-            BReactor_SetTimer(o->reactor, &o->reconnect_timer);
+            BReactor_SetTimer(o->reactor, &link->reconnect_timer);
         } break;
         
         case BSOCKSCLIENT_EVENT_ERROR:
         case BSOCKSCLIENT_EVENT_ERROR_CLOSED: {
-            BLog(BLOG_INFO, "SOCKS error");
+            link_log(link, BLOG_INFO, "SOCKS error");
             
             // free SOCKS
-            free_socks(o);
+            free_socks(link);
             
             // set reconnect timer
-            BReactor_SetTimer(o->reactor, &o->reconnect_timer);
+            BReactor_SetTimer(o->reactor, &link->reconnect_timer);
         } break;
         
         default: ASSERT(0);
     }
 }
 
-static void udpgw_handler_servererror (SocksUdpGwClient *o)
+static void udpgw_handler_servererror (struct SocksUdpGwClient_link *link)
 {
+    SocksUdpGwClient *o = link->parent;
     DebugObject_Access(&o->d_obj);
-    ASSERT(o->have_socks)
-    ASSERT(o->socks_up)
+    ASSERT(link->have_socks)
+    ASSERT(link->socks_up)
     
-    BLog(BLOG_ERROR, "client reports server error");
+    link_log(link, BLOG_ERROR, "client reports server error");
     
     // free SOCKS
-    free_socks(o);
+    free_socks(link);
     
     // set reconnect timer
-    BReactor_SetTimer(o->reactor, &o->reconnect_timer);
+    BReactor_SetTimer(o->reactor, &link->reconnect_timer);
 }
 
-static void udpgw_handler_received (SocksUdpGwClient *o, BAddr local_addr, BAddr remote_addr, const uint8_t *data, int data_len)
+static void udpgw_handler_received (struct SocksUdpGwClient_link *link, BAddr local_addr, BAddr remote_addr, const uint8_t *data, int data_len)
 {
+    SocksUdpGwClient *o = link->parent;
     DebugObject_Access(&o->d_obj);
     
     // submit to user
@@ -158,12 +184,44 @@ static void udpgw_handler_received (SocksUdpGwClient *o, BAddr local_addr, BAddr
     return;
 }
 
-int SocksUdpGwClient_Init (SocksUdpGwClient *o, int udp_mtu, int max_connections, int send_buffer_size, btime_t keepalive_time,
+static struct SocksUdpGwClient_link * choose_link (SocksUdpGwClient *o, BAddr local_addr, BAddr remote_addr)
+{
+    if (o->num_links == 1) {
+        return &o->links[0];
+    }
+    
+    // pin the flow to a link by its addresses
+    int index = UdpGwClient_HashAddrs(local_addr, remote_addr) % o->num_links;
+    
+    // keep the flow on a link which is up and carries it, even if the flow was
+    // moved there while the hashed link was down; moving it back would give it
+    // a new source port at the udpgw server and break replies
+    for (int i = 0; i < o->num_links; i++) {
+        struct SocksUdpGwClient_link *link = &o->links[(index + i) % o->num_links];
+        if (link->socks_up && UdpGwClient_IsCarrying(&link->udpgw_client, local_addr, remote_addr)) {
+            return link;
+        }
+    }
+    
+    // otherwise use the hashed link, or while it is down, the next one which is up
+    for (int i = 0; i < o->num_links; i++) {
+        struct SocksUdpGwClient_link *link = &o->links[(index + i) % o->num_links];
+        if (link->socks_up) {
+            return link;
+        }
+    }
+    
+    return &o->links[index];
+}
+
+int SocksUdpGwClient_Init (SocksUdpGwClient *o, int udp_mtu, int max_connections, int num_links, int send_buffer_size, btime_t keepalive_time,
                            BAddr socks_server_addr, const struct BSocksClient_auth_info *auth_info, size_t num_auth_info,
                            BAddr remote_udpgw_addr, btime_t reconnect_time, BReactor *reactor, void *user,
                            SocksUdpGwClient_handler_received handler_received)
 {
     // see asserts in UdpGwClient_Init
+    ASSERT(num_links > 0)
+    ASSERT(max_connections >= num_links)
     ASSERT(!BAddr_IsInvalid(&socks_server_addr))
     ASSERT(remote_udpgw_addr.type == BADDR_TYPE_IPV4 || remote_udpgw_addr.type == BADDR_TYPE_IPV6)
     
@@ -177,26 +235,53 @@ int SocksUdpGwClient_Init (SocksUdpGwClient *o, int udp_mtu, int max_connections
     o->user = user;
     o->handler_received = handler_received;
     
-    // init udpgw client
-    if (!UdpGwClient_Init(&o->udpgw_client, udp_mtu, max_connections, send_buffer_size, keepalive_time, o->reactor, o,
-                          (UdpGwClient_handler_servererror)udpgw_handler_servererror,
-                          (UdpGwClient_handler_received)udpgw_handler_received
-    )) {
+    // allocate links
+    if (!(o->links = (struct SocksUdpGwClient_link *)BAllocArray(num_links, sizeof(o->links[0])))) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
         goto fail0;
     }
     
-    // init reconnect timer
-    BTimer_Init(&o->reconnect_timer, reconnect_time, (BTimer_handler)reconnect_timer_handler, o);
-    
-    // set have no SOCKS
-    o->have_socks = 0;
+    for (o->num_links = 0; o->num_links < num_links; o->num_links++) {
+        struct SocksUdpGwClient_link *link = &o->links[o->num_links];
+        link->parent = o;
+        link->index = o->num_links;
+        
+        // split the connections among the links, giving the remainder to
+        // the first links, so that they add up to max_connections
+        int link_max_connections = max_connections / num_links + (o->num_links < max_connections % num_links);
+        
+        // init udpgw client
+        if (!UdpGwClient_Init(&link->udpgw_client, udp_mtu, link_max_connections, send_buffer_size, keepalive_time, o->reactor, link,
+                              (UdpGwClient_handler_servererror)udpgw_handler_servererror,
+                              (UdpGwClient_handler_received)udpgw_handler_received
+        )) {
+            goto fail1;
+        }
+        
+        // init reconnect timer
+        BTimer_Init(&link->reconnect_timer, reconnect_time, (BTimer_handler)reconnect_timer_handler, link);
+        
+        // set have no SOCKS
+        link->have_socks = 0;
+        
+        // set SOCKS not up
+        link->socks_up = 0;
+    }
     
     // try connecting
-    try_connect(o);
+    for (int i = 0; i < o->num_links; i++) {
+        try_connect(&o->links[i]);
+    }
     
     DebugObject_Init(&o->d_obj);
     return 1;
     
+fail1:
+    while (o->num_links > 0) {
+        o->num_links--;
+        UdpGwClient_Free(&o->links[o->num_links].udpgw_client);
+    }
+    BFree(o->links);
 fail0:
     return 0;
 }
@@ -205,16 +290,23 @@ void SocksUdpGwClient_Free (SocksUdpGwClient *o)
 {
     DebugObject_Free(&o->d_obj);
     
-    // free SOCKS
-    if (o->have_socks) {
-        free_socks(o);
+    for (int i = 0; i < o->num_links; i++) {
+        struct SocksUdpGwClient_link *link = &o->links[i];
+        
+        // free SOCKS
+        if (link->have_socks) {
+            free_socks(link);
+        }
+        
+        // free reconnect timer
+        BReactor_RemoveTimer(o->reactor, &link->reconnect_timer);
+        
+        // free udpgw client
+        UdpGwClient_Free(&link->udpgw_client);
     }
     
-    // free reconnect timer
-    BReactor_RemoveTimer(o->reactor, &o->reconnect_timer);
-    
-    // free udpgw client
-    UdpGwClient_Free(&o->udpgw_client);
+    // free links
+    BFree(o->links);
 }
 
 void SocksUdpGwClient_SubmitPacket (SocksUdpGwClient *o, BAddr local_addr, BAddr remote_addr, int is_dns, const uint8_t *data, int data_len)
@@ -222,7 +314,8 @@ void SocksUdpGwClient_SubmitPacket (SocksUdpGwClient *o, BAddr local_addr, BAddr
     DebugObject_Access(&o->d_obj);
     // see asserts in UdpGwClient_SubmitPacket
     
+    struct SocksUdpGwClient_link *link = choose_link(o, local_addr, remote_addr);
+    
     // submit to udpgw client
-    UdpGwClient_SubmitPacket(&o->udpgw_client, local_addr, remote_addr, is_dns, data, data_len);
+    UdpGwClient_SubmitPacket(&link->udpgw_client, local_addr, remote_addr, is_dns, data, data_len);
 }
-
@@ -37,6 +37,8 @@
 
 typedef void (*SocksUdpGwClient_handler_received) (void *user, BAddr local_addr, BAddr remote_addr, const uint8_t *data, int data_len);
 
+struct SocksUdpGwClient_link;
+
 typedef struct {
     int udp_mtu;
     BAddr socks_server_addr;
@@ -46,15 +48,22 @@ typedef struct {
     BReactor *reactor;
     void *user;
     SocksUdpGwClient_handler_received handler_received;
+    struct SocksUdpGwClient_link *links;
+    int num_links;
+    DebugObject d_obj;
+} SocksUdpGwClient;
+
+struct SocksUdpGwClient_link {
+    SocksUdpGwClient *parent;
+    int index;
     UdpGwClient udpgw_client;
     BTimer reconnect_timer;
     int have_socks;
     BSocksClient socks_client;
     int socks_up;
-    DebugObject d_obj;
-} SocksUdpGwClient;
+};
 
-int SocksUdpGwClient_Init (SocksUdpGwClient *o, int udp_mtu, int max_connections, int send_buffer_size, btime_t keepalive_time,
+int SocksUdpGwClient_Init (SocksUdpGwClient *o, int udp_mtu, int max_connections, int num_links, int send_buffer_size, btime_t keepalive_time,
                            BAddr socks_server_addr, const struct BSocksClient_auth_info *auth_info, size_t num_auth_info,
                            BAddr remote_udpgw_addr, btime_t reconnect_time, BReactor *reactor, void *user,
                            SocksUdpGwClient_handler_received handler_received) WARN_UNUSED;
@@ -0,0 +1,594 @@
+/*
+ * Copyright (C) Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include <misc/offset.h>
+#include <misc/balloc.h>
+#include <misc/byteorder.h>
+#include <base/BLog.h>
+
+#include <tun2socks/SocksUdpRelay.h>
+
+#include <generated/blog_channel_SocksUdpRelay.h>
+
+static int addr_comparator (void *unused, BAddr *v1, BAddr *v2);
+static int addr_header_size (BAddr addr);
+static int write_addr_header (BAddr addr, uint8_t *out);
+static int parse_addr_header (const uint8_t *data, int data_len, BAddr *out_addr);
+static int encrypt_start (SocksUdpRelay *o, uint8_t *iv);
+static int encrypt_packet (SocksUdpRelay *o, uint8_t *data, int data_len);
+static int decrypt_packet (SocksUdpRelay *o, const uint8_t *data, int data_len, uint8_t *out);
+static struct SocksUdpRelay_flow * find_flow (SocksUdpRelay *o, BAddr local_addr);
+static struct SocksUdpRelay_flow * flow_init (SocksUdpRelay *o, BAddr local_addr, BAddr first_remote_addr, const uint8_t *first_data, int first_data_len);
+static void flow_free (struct SocksUdpRelay_flow *flow);
+static void flow_touch (struct SocksUdpRelay_flow *flow);
+static void flow_send (struct SocksUdpRelay_flow *flow, BAddr remote_addr, const uint8_t *data, int data_len);
+static void flow_first_job_handler (struct SocksUdpRelay_flow *flow);
+static void flow_dgram_handler_event (struct SocksUdpRelay_flow *flow, int event);
+static void flow_recv_if_handler_send (struct SocksUdpRelay_flow *flow, uint8_t *data, int data_len);
+static void idle_timer_handler (SocksUdpRelay *o);
+
+static int addr_comparator (void *unused, BAddr *v1, BAddr *v2)
+{
+    return BAddr_CompareOrder(v1, v2);
+}
+
+static int addr_header_size (BAddr addr)
+{
+    switch (addr.type) {
+        case BADDR_TYPE_IPV4:
+            return sizeof(struct socks_request_header) + sizeof(struct socks_addr_ipv4);
+        case BADDR_TYPE_IPV6:
+            return sizeof(struct socks_request_header) + sizeof(struct socks_addr_ipv6);
+        default:
+            ASSERT(0);
+            return 0;
+    }
+}
+
+static int write_addr_header (BAddr addr, uint8_t *out)
+{
+    struct socks_request_header header;
+    int len = sizeof(header);
+    
+    switch (addr.type) {
+        case BADDR_TYPE_IPV4: {
+            header.atyp = hton8(SOCKS_ATYP_IPV4);
+            struct socks_addr_ipv4 addr4;
+            addr4.addr = addr.ipv4.ip;
+            addr4.port = addr.ipv4.port;
+            memcpy(out + len, &addr4, sizeof(addr4));
+            len += sizeof(addr4);
+        } break;
+        case BADDR_TYPE_IPV6: {
+            header.atyp = hton8(SOCKS_ATYP_IPV6);
+            struct socks_addr_ipv6 addr6;
+            memcpy(addr6.addr, addr.ipv6.ip, sizeof(addr6.addr));
+            addr6.port = addr.ipv6.port;
+            memcpy(out + len, &addr6, sizeof(addr6));
+            len += sizeof(addr6);
+        } break;
+        default:
+            ASSERT(0);
+    }
+    memcpy(out, &header, sizeof(header));
+    
+    return len;
+}
+
+static int parse_addr_header (const uint8_t *data, int data_len, BAddr *out_addr)
+{
+    struct socks_request_header header;
+    if (data_len < sizeof(header)) {
+        return -1;
+    }
+    memcpy(&header, data, sizeof(header));
+    int len = sizeof(header);
+    
+    switch (ntoh8(header.atyp)) {
+        case SOCKS_ATYP_IPV4: {
+            struct socks_addr_ipv4 addr4;
+            if (data_len - len < sizeof(addr4)) {
+                return -1;
+            }
+            memcpy(&addr4, data + len, sizeof(addr4));
+            BAddr_InitIPv4(out_addr, addr4.addr, addr4.port);
+            len += sizeof(addr4);
+        } break;
+        case SOCKS_ATYP_IPV6: {
+            struct socks_addr_ipv6 addr6;
+            if (data_len - len < sizeof(addr6)) {
+                return -1;
+            }
+            memcpy(&addr6, data + len, sizeof(addr6));
+            BAddr_InitIPv6(out_addr, addr6.addr, addr6.port);
+            len += sizeof(addr6);
+        } break;
+        default:
+            return -1;
+    }
+    
+    return len;
+}
+
+static int encrypt_start (SocksUdpRelay *o, uint8_t *iv)
+{
+    // each datagram starts with its own random IV, or salt for AEAD ciphers
+    if (!random_iv((char *)iv, ss_crypto_info.iv_size)) {
+        BLog(BLOG_ERROR, "random_iv failed");
+        return 0;
+    }
+    
+    return encryptor_Init(o->cipher_ctx, (const char *)iv);
+}
+
+static int encrypt_packet (SocksUdpRelay *o, uint8_t *data, int data_len)
+{
+    if (ss_crypto_info.is_aead) {
+        // the datagram is sealed as a whole under a zero nonce
+        uint8_t nonce[SS_AEAD_NONCE_SIZE];
+        memset(nonce, 0, sizeof(nonce));
+        
+        return aead_encrypt(o->cipher_ctx, nonce, data, data_len, data);
+    }
+    
+    return encrypt(o->cipher_ctx, data, data_len, data);
+}
+
+static int decrypt_packet (SocksUdpRelay *o, const uint8_t *data, int data_len, uint8_t *out)
+{
+    int iv_size = ss_crypto_info.iv_size;
+    
+    if (data_len < iv_size + (ss_crypto_info.is_aead ? SS_AEAD_TAG_SIZE : 0)) {
+        return -1;
+    }
+    
+    if (!decryptor_Init(o->cipher_ctx, (const char *)data)) {
+        return -1;
+    }
+    
+    if (ss_crypto_info.is_aead) {
+        uint8_t nonce[SS_AEAD_NONCE_SIZE];
+        memset(nonce, 0, sizeof(nonce));
+        
+        return aead_decrypt(o->cipher_ctx, nonce, data + iv_size, data_len - iv_size, out);
+    }
+    
+    return decrypt(o->cipher_ctx, (uint8_t *)data + iv_size, data_len - iv_size, out);
+}
+
+static struct SocksUdpRelay_flow * find_flow (SocksUdpRelay *o, BAddr local_addr)
+{
+    BAVLNode *tree_node = BAVL_LookupExact(&o->flows_tree, &local_addr);
+    if (!tree_node) {
+        return NULL;
+    }
+    
+    return UPPER_OBJECT(tree_node, struct SocksUdpRelay_flow, flows_tree_node);
+}
+
+static struct SocksUdpRelay_flow * flow_init (SocksUdpRelay *o, BAddr local_addr, BAddr first_remote_addr, const uint8_t *first_data, int first_data_len)
+{
+    ASSERT(o->num_flows < o->max_flows)
+    ASSERT(!find_flow(o, local_addr))
+    
+    // allocate structure
+    struct SocksUdpRelay_flow *flow = (struct SocksUdpRelay_flow *)BAlloc(sizeof(*flow));
+    if (!flow) {
+        BLog(BLOG_ERROR, "BAlloc failed");
+        goto fail0;
+    }
+    
+    // init arguments
+    flow->parent = o;
+    flow->local_addr = local_addr;
+    flow->first_remote_addr = first_remote_addr;
+    flow->first_data_len = first_data_len;
+    
+    // copy the first packet, the caller's buffer may be reused before it is sent
+    if (!(flow->first_data = (uint8_t *)BAlloc(first_data_len))) {
+        BLog(BLOG_ERROR, "BAlloc failed");
+        goto fail1;
+    }
+    memcpy(flow->first_data, first_data, first_data_len);
+    
+    // init first job, which sends the first packet once the send buffer is ready
+    BPending_Init(&flow->first_job, BReactor_PendingGroup(o->reactor), (BPending_handler)flow_first_job_handler, flow);
+    BPending_Set(&flow->first_job);
+    
+    // init dgram
+    if (!BDatagram_Init(&flow->dgram, o->server_addr.type, o->reactor, flow, (BDatagram_handler)flow_dgram_handler_event)) {
+        BLog(BLOG_ERROR, "BDatagram_Init failed");
+        goto fail2;
+    }
+    
+    // send to the server
+    BIPAddr ipaddr;
+    BIPAddr_InitInvalid(&ipaddr);
+    BDatagram_SetSendAddrs(&flow->dgram, o->server_addr, ipaddr);
+    
+    // init dgram interfaces
+    BDatagram_SendAsync_Init(&flow->dgram, o->dgram_mtu);
+    BDatagram_RecvAsync_Init(&flow->dgram, o->dgram_mtu);
+    
+    // init send writer
+    BufferWriter_Init(&flow->send_writer, o->dgram_mtu, BReactor_PendingGroup(o->reactor));
+    
+    // init send buffer
+    if (!PacketBuffer_Init(&flow->send_buffer, BufferWriter_GetOutput(&flow->send_writer), BDatagram_SendAsync_GetIf(&flow->dgram), o->send_buffer_size, BReactor_PendingGroup(o->reactor))) {
+        BLog(BLOG_ERROR, "PacketBuffer_Init failed");
+        goto fail3;
+    }
+    
+    // init receive interface
+    PacketPassInterface_Init(&flow->recv_if, o->dgram_mtu, (PacketPassInterface_handler_send)flow_recv_if_handler_send, flow, BReactor_PendingGroup(o->reactor));
+    
+    // init receive buffer
+    if (!SinglePacketBuffer_Init(&flow->recv_buffer, BDatagram_RecvAsync_GetIf(&flow->dgram), &flow->recv_if, BReactor_PendingGroup(o->reactor))) {
+        BLog(BLOG_ERROR, "SinglePacketBuffer_Init failed");
+        goto fail4;
+    }
+    
+    // insert to flows tree
+    ASSERT_EXECUTE(BAVL_Insert(&o->flows_tree, &flow->flows_tree_node, NULL))
+    
+    // flows are kept in order of last use; start the idle timer for the
+    // first flow, it is moved forward as needed when it expires
+    flow->last_use_time = btime_gettime();
+    if (LinkedList1_IsEmpty(&o->flows_list)) {
+        BReactor_SetTimerAbsolute(o->reactor, &o->idle_timer, btime_add(flow->last_use_time, o->idle_timeout));
+    }
+    LinkedList1_Append(&o->flows_list, &flow->flows_list_node);
+    
+    // increment number of flows
+    o->num_flows++;
+    
+    return flow;
+    
+fail4:
+    PacketPassInterface_Free(&flow->recv_if);
+    PacketBuffer_Free(&flow->send_buffer);
+fail3:
+    BufferWriter_Free(&flow->send_writer);
+    BDatagram_RecvAsync_Free(&flow->dgram);
+    BDatagram_SendAsync_Free(&flow->dgram);
+    BDatagram_Free(&flow->dgram);
+fail2:
+    BPending_Free(&flow->first_job);
+    BFree(flow->first_data);
+fail1:
+    BFree(flow);
+fail0:
+    return NULL;
+}
+
+static void flow_free (struct SocksUdpRelay_flow *flow)
+{
+    SocksUdpRelay *o = flow->parent;
+    
+    // decrement number of flows
+    o->num_flows--;
+    
+    // remove from flows list
+    LinkedList1_Remove(&o->flows_list, &flow->flows_list_node);
+    
+    // remove from flows tree
+    BAVL_Remove(&o->flows_tree, &flow->flows_tree_node);
+    
+    // free receive buffer
+    SinglePacketBuffer_Free(&flow->recv_buffer);
+    
+    // free receive interface
+    PacketPassInterface_Free(&flow->recv_if);
+    
+    // free send buffer
+    PacketBuffer_Free(&flow->send_buffer);
+    
+    // free send writer
+    BufferWriter_Free(&flow->send_writer);
+    
+    // free dgram interfaces
+    BDatagram_RecvAsync_Free(&flow->dgram);
+    BDatagram_SendAsync_Free(&flow->dgram);
+    
+    // free dgram
+    BDatagram_Free(&flow->dgram);
+    
+    // free first job
+    BPending_Free(&flow->first_job);
+    
+    // free first packet if it wasn't sent
+    BFree(flow->first_data);
+    
+    // free structure
+    BFree(flow);
+}
+
+static void flow_touch (struct SocksUdpRelay_flow *flow)
+{
+    SocksUdpRelay *o = flow->parent;
+    
+    // move to the end of the flows list
+    flow->last_use_time = btime_gettime();
+    LinkedList1_Remove(&o->flows_list, &flow->flows_list_node);
+    LinkedList1_Append(&o->flows_list, &flow->flows_list_node);
+}
+
+static void flow_send (struct SocksUdpRelay_flow *flow, BAddr remote_addr, const uint8_t *data, int data_len)
+{
+    SocksUdpRelay *o = flow->parent;
+    ASSERT(data_len >= 0)
+    ASSERT(data_len <= o->udp_mtu)
+    
+    // check that the datagram fits, including the AEAD tag
+    int iv_size = ss_crypto_info.iv_size;
+    int header_len = addr_header_size(remote_addr);
+    int tag_size = (ss_crypto_info.is_aead ? SS_AEAD_TAG_SIZE : 0);
+    if (data_len > o->dgram_mtu - iv_size - header_len - tag_size) {
+        BLog(BLOG_ERROR, "packet is too large");
+        return;
+    }
+    
+    // get buffer location
+    uint8_t *out;
+    if (!BufferWriter_StartPacket(&flow->send_writer, &out)) {
+        BLog(BLOG_ERROR, "out of buffer");
+        return;
+    }
+    
+    // write IV and set up the cipher for this packet
+    if (!encrypt_start(o, out)) {
+        BLog(BLOG_ERROR, "failed to set up encryption");
+        goto drop;
+    }
+    
+    // write address and payload
+    int plain_len = write_addr_header(remote_addr, out + iv_size);
+    ASSERT(plain_len == header_len)
+    memcpy(out + iv_size + plain_len, data, data_len);
+    plain_len += data_len;
+    
+    // encrypt in place
+    int len = encrypt_packet(o, out + iv_size, plain_len);
+    if (len < 0) {
+        BLog(BLOG_ERROR, "failed to encrypt packet");
+        goto drop;
+    }
+    ASSERT(len == plain_len + tag_size)
+    
+    // submit packet to buffer
+    BufferWriter_EndPacket(&flow->send_writer, iv_size + len);
+    return;
+    
+drop:
+    // drop the packet without sending anything
+    BufferWriter_CancelPacket(&flow->send_writer);
+}
+
+static void flow_first_job_handler (struct SocksUdpRelay_flow *flow)
+{
+    DebugObject_Access(&flow->parent->d_obj);
+    
+    flow_send(flow, flow->first_remote_addr, flow->first_data, flow->first_data_len);
+    
+    // free first packet
+    BFree(flow->first_data);
+    flow->first_data = NULL;
+}
+
+static void flow_dgram_handler_event (struct SocksUdpRelay_flow *flow, int event)
+{
+    DebugObject_Access(&flow->parent->d_obj);
+    
+    BLog(BLOG_INFO, "flow dgram error");
+    
+    flow_free(flow);
+}
+
+static void flow_recv_if_handler_send (struct SocksUdpRelay_flow *flow, uint8_t *data, int data_len)
+{
+    SocksUdpRelay *o = flow->parent;
+    DebugObject_Access(&o->d_obj);
+    ASSERT(data_len >= 0)
+    ASSERT(data_len <= o->dgram_mtu)
+    
+    // only the server may send to the flow's socket
+    BAddr source_addr;
+    BIPAddr local_addr;
+    if (!BDatagram_GetLastReceiveAddrs(&flow->dgram, &source_addr, &local_addr) || !BAddr_Compare(&source_addr, &o->server_addr)) {
+        BLog(BLOG_WARNING, "dropping packet not from the server");
+        PacketPassInterface_Done(&flow->recv_if);
+        return;
+    }
+    
+    // accept the packet; the flow may be freed by the user
+    PacketPassInterface_Done(&flow->recv_if);
+    
+    // decrypt
+    int plain_len = decrypt_packet(o, data, data_len, o->plain_buf);
+    if (plain_len < 0) {
+        BLog(BLOG_WARNING, "failed to decrypt packet from server");
+        return;
+    }
+    
+    // parse remote address
+    BAddr remote_addr;
+    int header_len = parse_addr_header(o->plain_buf, plain_len, &remote_addr);
+    if (header_len < 0) {
+        BLog(BLOG_WARNING, "bad address in packet from server");
+        return;
+    }
+    
+    // the device can only deliver a reply of the flow's address family
+    if (remote_addr.type != flow->local_addr.type) {
+        BLog(BLOG_WARNING, "address family of packet from server doesn't match flow");
+        return;
+    }
+    
+    int payload_len = plain_len - header_len;
+    if (payload_len > o->udp_mtu) {
+        BLog(BLOG_WARNING, "packet from server is too large");
+        return;
+    }
+    
+    // keep the flow alive
+    flow_touch(flow);
+    
+    // submit to user
+    o->handler_received(o->user, flow->local_addr, remote_addr, o->plain_buf + header_len, payload_len);
+    return;
+}
+
+static void idle_timer_handler (SocksUdpRelay *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    btime_t now = btime_gettime();
+    
+    // free flows which have been idle too long; they are at the front
+    LinkedList1Node *node;
+    while (node = LinkedList1_GetFirst(&o->flows_list)) {
+        struct SocksUdpRelay_flow *flow = UPPER_OBJECT(node, struct SocksUdpRelay_flow, flows_list_node);
+        
+        btime_t expire_time = btime_add(flow->last_use_time, o->idle_timeout);
+        if (expire_time > now) {
+            // wait for the oldest remaining flow
+            BReactor_SetTimerAbsolute(o->reactor, &o->idle_timer, expire_time);
+            break;
+        }
+        
+        BLog(BLOG_DEBUG, "freeing idle flow");
+        
+        flow_free(flow);
+    }
+}
+
+int SocksUdpRelay_Init (SocksUdpRelay *o, int udp_mtu, int max_flows, btime_t idle_timeout, int send_buffer_size,
+                        BAddr server_addr, BReactor *reactor, void *user,
+                        SocksUdpRelay_handler_received handler_received)
+{
+    ASSERT(udp_mtu >= 0)
+    ASSERT(max_flows > 0)
+    ASSERT(idle_timeout > 0)
+    ASSERT(send_buffer_size > 0)
+    ASSERT(server_addr.type == BADDR_TYPE_IPV4 || server_addr.type == BADDR_TYPE_IPV6)
+    
+    // init arguments
+    o->udp_mtu = udp_mtu;
+    o->max_flows = max_flows;
+    o->idle_timeout = idle_timeout;
+    o->send_buffer_size = send_buffer_size;
+    o->server_addr = server_addr;
+    o->reactor = reactor;
+    o->user = user;
+    o->handler_received = handler_received;
+    
+    // compute datagram MTU
+    o->dgram_mtu = SS_MAX_IV_SIZE + SOCKSUDPRELAY_MAX_ADDR_HEADER + udp_mtu + SS_AEAD_TAG_SIZE;
+    
+    // init cipher context
+    if (!(o->cipher_ctx = cryptor_new())) {
+        BLog(BLOG_ERROR, "cryptor_new failed");
+        goto fail0;
+    }
+    
+    // allocate buffer for plaintext
+    if (!(o->plain_buf = (uint8_t *)BAlloc(o->dgram_mtu))) {
+        BLog(BLOG_ERROR, "BAlloc failed");
+        goto fail1;
+    }
+    
+    // init flows tree
+    BAVL_Init(&o->flows_tree, OFFSET_DIFF(struct SocksUdpRelay_flow, local_addr, flows_tree_node), (BAVL_comparator)addr_comparator, NULL);
+    
+    // init flows list
+    LinkedList1_Init(&o->flows_list);
+    
+    // set zero flows
+    o->num_flows = 0;
+    
+    // init idle timer
+    BTimer_Init(&o->idle_timer, 0, (BTimer_handler)idle_timer_handler, o);
+    
+    DebugObject_Init(&o->d_obj);
+    return 1;
+    
+fail1:
+    cryptor_free(o->cipher_ctx);
+fail0:
+    return 0;
+}
+
+void SocksUdpRelay_Free (SocksUdpRelay *o)
+{
+    DebugObject_Free(&o->d_obj);
+    
+    // free flows
+    LinkedList1Node *node;
+    while (node = LinkedList1_GetFirst(&o->flows_list)) {
+        struct SocksUdpRelay_flow *flow = UPPER_OBJECT(node, struct SocksUdpRelay_flow, flows_list_node);
+        flow_free(flow);
+    }
+    
+    // free idle timer
+    BReactor_RemoveTimer(o->reactor, &o->idle_timer);
+    
+    // free plaintext buffer
+    BFree(o->plain_buf);
+    
+    // free cipher context
+    cryptor_free(o->cipher_ctx);
+}
+
+void SocksUdpRelay_SubmitPacket (SocksUdpRelay *o, BAddr local_addr, BAddr remote_addr, const uint8_t *data, int data_len)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(local_addr.type == BADDR_TYPE_IPV4 || local_addr.type == BADDR_TYPE_IPV6)
+    ASSERT(remote_addr.type == local_addr.type)
+    ASSERT(data_len >= 0)
+    ASSERT(data_len <= o->udp_mtu)
+    
+    // find flow
+    struct SocksUdpRelay_flow *flow = find_flow(o, local_addr);
+    
+    if (!flow) {
+        // if there are too many flows, free the least recently used one
+        if (o->num_flows == o->max_flows) {
+            LinkedList1Node *node = LinkedList1_GetFirst(&o->flows_list);
+            ASSERT(node)
+            flow_free(UPPER_OBJECT(node, struct SocksUdpRelay_flow, flows_list_node));
+        }
+        
+        // create new flow; it sends the packet
+        flow_init(o, local_addr, remote_addr, data, data_len);
+        return;
+    }
+    
+    flow_touch(flow);
+    
+    flow_send(flow, remote_addr, data, data_len);
+}
@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Relay for UDP packets which sends each packet to the Shadowsocks server as
+ * an encrypted datagram, as an alternative to udpgw over a TCP connection.
+ */
+
+#ifndef BADVPN_TUN2SOCKS_SOCKSUDPRELAY_H
+#define BADVPN_TUN2SOCKS_SOCKSUDPRELAY_H
+
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <misc/socks_proto.h>
+#include <structure/BAVL.h>
+#include <structure/LinkedList1.h>
+#include <base/DebugObject.h>
+#include <cryptoman/cryptoman.h>
+#include <system/BReactor.h>
+#include <system/BDatagram.h>
+#include <flow/BufferWriter.h>
+#include <flow/PacketBuffer.h>
+#include <flow/SinglePacketBuffer.h>
+
+// largest address header in front of the payload
+#define SOCKSUDPRELAY_MAX_ADDR_HEADER (sizeof(struct socks_request_header) + sizeof(struct socks_addr_ipv6))
+
+typedef void (*SocksUdpRelay_handler_received) (void *user, BAddr local_addr, BAddr remote_addr, const uint8_t *data, int data_len);
+
+struct SocksUdpRelay_flow;
+
+/**
+ * UDP relay to a Shadowsocks server.
+ * Each flow, identified by the local address of the packets, gets its own UDP
+ * socket, so that the server can tell flows apart and replies can be mapped
+ * back. A flow may send to any number of remote addresses; the remote address
+ * travels in front of the payload inside each encrypted datagram.
+ * Flows which have been idle for the idle timeout are freed, and if there are
+ * too many flows, the least recently used one is freed to make room.
+ */
+typedef struct {
+    int udp_mtu;
+    int max_flows;
+    btime_t idle_timeout;
+    int send_buffer_size;
+    BAddr server_addr;
+    BReactor *reactor;
+    void *user;
+    SocksUdpRelay_handler_received handler_received;
+    int dgram_mtu;
+    EVP_CIPHER_CTX *cipher_ctx;
+    uint8_t *plain_buf;
+    BAVL flows_tree;
+    LinkedList1 flows_list;
+    int num_flows;
+    BTimer idle_timer;
+    DebugObject d_obj;
+} SocksUdpRelay;
+
+struct SocksUdpRelay_flow {
+    SocksUdpRelay *parent;
+    BAddr local_addr;
+    btime_t last_use_time;
+    BAVLNode flows_tree_node;
+    LinkedList1Node flows_list_node;
+    BAddr first_remote_addr;
+    uint8_t *first_data;
+    int first_data_len;
+    BPending first_job;
+    BDatagram dgram;
+    BufferWriter send_writer;
+    PacketBuffer send_buffer;
+    PacketPassInterface recv_if;
+    SinglePacketBuffer recv_buffer;
+};
+
+/**
+ * Initializes the relay.
+ * The cipher must have been set up with cryptoman_Init.
+ * 
+ * @param o the object
+ * @param udp_mtu maximum payload size of packets. Must be >=0.
+ * @param max_flows maximum number of flows. Must be >0.
+ * @param idle_timeout time after which an idle flow is freed, in milliseconds. Must be >0.
+ * @param send_buffer_size number of packets buffered for sending, per flow. Must be >0.
+ * @param server_addr address of the server. Must be IPv4 or IPv6.
+ * @param reactor reactor we live in
+ * @param user value passed to handlers
+ * @param handler_received handler called when a packet arrives for a flow
+ * @return 1 on success, 0 on failure
+ */
+int SocksUdpRelay_Init (SocksUdpRelay *o, int udp_mtu, int max_flows, btime_t idle_timeout, int send_buffer_size,
+                        BAddr server_addr, BReactor *reactor, void *user,
+                        SocksUdpRelay_handler_received handler_received) WARN_UNUSED;
+
+/**
+ * Frees the relay.
+ * 
+ * @param o the object
+ */
+void SocksUdpRelay_Free (SocksUdpRelay *o);
+
+/**
+ * Sends a packet to the server, creating a flow for its local address if needed.
+ * 
+ * @param o the object
+ * @param local_addr local address. Must be IPv4 or IPv6.
+ * @param remote_addr remote address. Must be of the same type as local_addr.
+ * @param data payload
+ * @param data_len payload length. Must be >=0 and <=udp_mtu.
+ */
+void SocksUdpRelay_SubmitPacket (SocksUdpRelay *o, BAddr local_addr, BAddr remote_addr, const uint8_t *data, int data_len);
+
+#endif
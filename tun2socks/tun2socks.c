@@ -53,8 +53,8 @@
 #include <system/BSignal.h>
 #include <system/BAddr.h>
 #include <system/BNetwork.h>
-#include <flow/SinglePacketBuffer.h>
 #include <socksclient/BSocksClient.h>
+#include <threadwork/BThreadWork.h>
 #include <lwip/init.h>
 #include <lwip/ip_addr.h>
 #include <lwip/priv/tcp_priv.h>
@@ -64,6 +64,7 @@
 #include <lwip/nd6.h>
 #include <lwip/ip6_frag.h>
 #include <tun2socks/SocksUdpGwClient.h>
+#include <tun2socks/SocksUdpRelay.h>
 #include <tun2socks/SockTun.h>
 
 #ifndef BADVPN_USE_WINAPI
@@ -111,10 +112,14 @@ struct {
     char *password;
     char *password_file;
     int append_source_to_username;
-    char *udpgw_remote_server_addr;
+    const char *udpgw_remote_server_addr;
     int udpgw_max_connections;
+    int udpgw_num_connections;
     int udpgw_connection_buffer_size;
     int udpgw_transparent_dns;
+    int udp_relay;
+    int crypto_threads;
+    int crypto_threads_affinity;
 } options;
 
 // TCP client
@@ -126,7 +131,8 @@ struct tcp_client {
     BAddr remote_addr;
     struct tcp_pcb *pcb;
     int client_closed;
-    uint8_t buf[TCP_WND];
+    struct relay_buf *buf;
+    int buf_start;
     int buf_used;
     char *socks_username;
     BSocksClient socks_client;
@@ -134,13 +140,47 @@ struct tcp_client {
     int socks_closed;
     StreamPassInterface *socks_send_if;
     StreamRecvInterface *socks_recv_if;
-    uint8_t socks_recv_buf[CLIENT_SOCKS_RECV_BUF_SIZE];
+    struct relay_buf *socks_recv_buf;
+    int socks_recv_buf_start;
     int socks_recv_buf_used;
-    int socks_recv_buf_sent;
+    int socks_recv_bulk;
+    int socks_recv_receiving;
     int socks_recv_waiting;
     int socks_recv_tcp_pending;
 };
 
+// block of client structures allocated together, so that accepting
+// a connection doesn't need a memory allocation of its own
+struct client_slab {
+    LinkedList1Node slabs_list_node;
+    struct tcp_client clients[CLIENT_SLAB_SIZE];
+};
+
+// number of size classes of relay buffers
+#define RELAY_BUF_NUM_CLASSES 3
+
+// buffer for relaying data between a client and SOCKS, used as a ring.
+// Clients only hold buffers while they have data in flight, and
+// released buffers are kept in a pool for each size class.
+// Data from SOCKS is passed to lwIP without copying, so if the client is
+// closed while some of it has not been acknowledged, the buffer is
+// detached from the client and released once lwIP is done with it.
+struct relay_buf {
+    LinkedList1Node free_list_node;
+    int size_class;
+    int size;
+    int linger_pending;
+    uint8_t data[];
+};
+
+// buffer that packets from the device are read into, and passed
+// to lwIP as a custom pbuf referencing the data without copying
+struct device_read_slot {
+    struct pbuf_custom pbuf;
+    LinkedList1Node free_list_node;
+    uint8_t *data;
+};
+
 // IP address of netif
 BIPAddr netif_ipaddr;
 
@@ -173,17 +213,26 @@ int quitting;
 SockTun tunnel;
 #define device_mtu SockTun_GetMTU(&tunnel)
 
-// device write buffer
-uint8_t *device_write_buf;
-
 // device reading
-SinglePacketBuffer device_read_buffer;
-PacketPassInterface device_read_interface;
+PacketRecvInterface *device_read_if;
+struct device_read_slot *device_read_slots;
+uint8_t *device_read_slots_data;
+LinkedList1 device_read_free_slots;
+int device_read_num_free_slots;
+struct device_read_slot *device_read_cur_slot;
+uint8_t *device_read_copy_buf;
+BPending device_read_job;
 
 // udpgw client
 SocksUdpGwClient udpgw_client;
 int udp_mtu;
 
+// UDP relay
+SocksUdpRelay udp_relay;
+
+// thread work dispatcher, for encrypting SOCKS traffic in threads
+BThreadWorkDispatcher twd;
+
 // TCP timer
 BTimer tcp_timer;
 int tcp_timer_mod4;
@@ -207,6 +256,19 @@ LinkedList1 tcp_clients;
 // number of clients
 int num_clients;
 
+// slabs of client structures, and unused clients in them
+LinkedList1 client_slabs;
+LinkedList1 client_free_list;
+
+// sizes of relay buffers in each size class, ascending
+static const int relay_buf_class_sizes[RELAY_BUF_NUM_CLASSES] = {
+    CLIENT_SOCKS_RECV_BUF_SIZE_IDLE, TCP_WND, CLIENT_SOCKS_RECV_BUF_SIZE
+};
+
+// pooled relay buffers of each size class
+LinkedList1 relay_buf_free_lists[RELAY_BUF_NUM_CLASSES];
+int relay_buf_num_free[RELAY_BUF_NUM_CLASSES];
+
 static void terminate (void);
 static void print_help (const char *name);
 static void print_version (void);
@@ -217,7 +279,13 @@ static BAddr baddr_from_lwip (const ip_addr_t *ip_addr, uint16_t port_hostorder)
 static void lwip_init_job_hadler_socktun(void *unused);
 static void tcp_timer_handler (void *unused);
 static void device_error_handler (void *unused);
-static void device_read_handler_send (void *unused, uint8_t *data, int data_len);
+static void device_writable_handler (void *unused);
+static int device_read_init (int mtu);
+static void device_read_free (void);
+static void device_read_start (void);
+static void device_read_handler_done (void *unused, int data_len);
+static void device_read_job_handler (void *unused);
+static void device_read_slot_free_func (struct pbuf *p);
 static int process_device_udp_packet (uint8_t *data, int data_len);
 static err_t netif_init_func (struct netif *netif);
 static err_t netif_output_func (struct netif *netif, struct pbuf *p, const ip4_addr_t *ipaddr);
@@ -239,13 +307,44 @@ static err_t client_recv_func (void *arg, struct tcp_pcb *tpcb, struct pbuf *p,
 static void client_socks_handler (struct tcp_client *client, int event);
 static void client_send_to_socks (struct tcp_client *client);
 static void client_socks_send_handler_done (struct tcp_client *client, int data_len);
-static void client_socks_recv_initiate (struct tcp_client *client);
+static int client_socks_recv_initiate (struct tcp_client *client);
 static void client_socks_recv_handler_done (struct tcp_client *client, int data_len);
 static int client_socks_recv_send_out (struct tcp_client *client);
 static err_t client_sent_func (void *arg, struct tcp_pcb *tpcb, u16_t len);
+static void client_slab_init (void);
+static void client_slab_free (void);
+static struct tcp_client * client_slab_alloc (void);
+static void client_slab_release (struct tcp_client *client);
+static void relay_buf_pool_init (void);
+static void relay_buf_pool_free (void);
+static struct relay_buf * relay_buf_alloc (int size);
+static void relay_buf_release (struct relay_buf *rb);
+static void client_linger_socks_recv_buf (struct tcp_client *client);
+static void linger_err_func (void *arg, err_t err);
+static err_t linger_sent_func (void *arg, struct tcp_pcb *tpcb, u16_t len);
 static void udpgw_client_handler_received (void *unused, BAddr local_addr, BAddr remote_addr, const uint8_t *data, int data_len);
 
+void tun2socks_InitConfig(struct tun2socks_config *config)
+{
+	config->udpgw_remote_server_addr = NULL;
+	config->udpgw_max_connections = DEFAULT_UDPGW_MAX_CONNECTIONS;
+	config->udpgw_num_connections = DEFAULT_UDPGW_NUM_CONNECTIONS;
+	config->udpgw_connection_buffer_size = DEFAULT_UDPGW_CONNECTION_BUFFER_SIZE;
+	config->udpgw_transparent_dns = 0;
+	config->udp_relay = 0;
+	config->crypto_threads = 0;
+	config->crypto_threads_affinity = 0;
+}
+
 void tun2socks_Init(const char *tun_service_name, const char  *vlan_addr, const char *vlan_netmask, int mtu, const char *socks_server_address, const char *crypto_method, const char *socks_server_password)
+{
+	struct tun2socks_config config;
+	tun2socks_InitConfig(&config);
+
+	tun2socks_InitWithConfig(tun_service_name, vlan_addr, vlan_netmask, mtu, socks_server_address, crypto_method, socks_server_password, &config);
+}
+
+void tun2socks_InitWithConfig(const char *tun_service_name, const char  *vlan_addr, const char *vlan_netmask, int mtu, const char *socks_server_address, const char *crypto_method, const char *socks_server_password, const struct tun2socks_config *config)
 {
 	// open standard streams
 	open_standard_streams();
@@ -287,6 +386,46 @@ void tun2socks_Init(const char *tun_service_name, const char  *vlan_addr, const
 		return;
 	}
 
+	// take settings from config
+	options.udpgw_remote_server_addr = config->udpgw_remote_server_addr;
+	options.udpgw_max_connections = config->udpgw_max_connections;
+	options.udpgw_num_connections = config->udpgw_num_connections;
+	options.udpgw_connection_buffer_size = config->udpgw_connection_buffer_size;
+	options.udpgw_transparent_dns = config->udpgw_transparent_dns;
+	options.udp_relay = config->udp_relay;
+	options.crypto_threads = config->crypto_threads;
+	options.crypto_threads_affinity = config->crypto_threads_affinity;
+
+	if (options.udp_relay && options.udpgw_remote_server_addr) {
+		BLog(BLOG_ERROR, "UDP relay and udpgw cannot both be used");
+		return;
+	}
+
+	if (options.udpgw_remote_server_addr) {
+		// check udpgw settings
+		if (options.udpgw_num_connections <= 0 || options.udpgw_max_connections < options.udpgw_num_connections || options.udpgw_connection_buffer_size <= 0) {
+			BLog(BLOG_ERROR, "udpgw connection settings are invalid");
+			return;
+		}
+
+		// copy remote udpgw server address, the parser wants a writable string
+		size_t udpgw_addr_len = strlen(options.udpgw_remote_server_addr);
+		char *udpgw_addr_str = (char *)BAlloc(udpgw_addr_len + 1);
+		if (!udpgw_addr_str) {
+			BLog(BLOG_ERROR, "BAlloc failed");
+			return;
+		}
+		memcpy(udpgw_addr_str, options.udpgw_remote_server_addr, udpgw_addr_len + 1);
+
+		// resolve remote udpgw server address
+		int udpgw_addr_ok = BAddr_Parse2(&udpgw_remote_server_addr, udpgw_addr_str, NULL, 0, 0);
+		BFree(udpgw_addr_str);
+		if (!udpgw_addr_ok) {
+			BLog(BLOG_ERROR, "remote udpgw server addr: BAddr_Parse2 failed");
+			return;
+		}
+	}
+
 	// init shadowsocks
 	BLog(BLOG_INFO, "Shadowsocks enabled");
 	if (!cryptoman_Init(crypto_method, socks_server_password))
@@ -301,7 +440,7 @@ void tun2socks_Init(const char *tun_service_name, const char  *vlan_addr, const
 	// init reactor
 	if (!BReactor_Init(&ss)) {
 		BLog(BLOG_ERROR, "BReactor_Init failed");
-		goto fail1;
+		goto fail1a;
 	}
 
 	// set not quitting
@@ -313,8 +452,20 @@ void tun2socks_Init(const char *tun_service_name, const char  *vlan_addr, const
 		goto fail2;
 	}
 
-	// init winsock as a tun device
-	SockTun_Init(&tunnel, &ss, tun_service_name, mtu, device_error_handler, NULL);
+	// init thread work dispatcher
+	if (!(options.crypto_threads_affinity ?
+		BThreadWorkDispatcher_InitWithAffinity(&twd, &ss, options.crypto_threads) :
+		BThreadWorkDispatcher_Init(&twd, &ss, options.crypto_threads)
+	)) {
+		BLog(BLOG_ERROR, "BThreadWorkDispatcher_Init failed");
+		goto fail3;
+	}
+
+	// init UDP socket as a tun device
+	if (!SockTun_Init(&tunnel, &ss, tun_service_name, mtu, device_error_handler, device_writable_handler, NULL)) {
+		BLog(BLOG_ERROR, "SockTun_Init failed");
+		goto fail3a;
+	}
 
 	// NOTE: the order of the following is important:
 	// first device writing must evaluate,
@@ -322,14 +473,13 @@ void tun2socks_Init(const char *tun_service_name, const char  *vlan_addr, const
 	// then device reading (so it can pass received packets to lwip).
 
 	// init device reading
-	PacketPassInterface_Init(&device_read_interface, mtu, device_read_handler_send, NULL, BReactor_PendingGroup(&ss));
-	if (!SinglePacketBuffer_Init(&device_read_buffer, SockTun_GetOutput(&tunnel), &device_read_interface, BReactor_PendingGroup(&ss))) {
-		BLog(BLOG_ERROR, "SinglePacketBuffer_Init failed");
+	if (!device_read_init(mtu)) {
+		BLog(BLOG_ERROR, "device_read_init failed");
 		goto fail4;
 	}
 
-	if (options.udpgw_remote_server_addr) {
-		// compute maximum UDP payload size we need to pass through udpgw
+	if (options.udpgw_remote_server_addr || options.udp_relay) {
+		// compute maximum UDP payload size we need to pass through
 		udp_mtu = mtu - (int)(sizeof(struct ipv4_header) + sizeof(struct udp_header));
 		if (options.netif_ip6addr) {
 			int udp_ip6_mtu = mtu - (int)(sizeof(struct ipv6_header) + sizeof(struct udp_header));
@@ -340,7 +490,9 @@ void tun2socks_Init(const char *tun_service_name, const char  *vlan_addr, const
 		if (udp_mtu < 0) {
 			udp_mtu = 0;
 		}
+	}
 
+	if (options.udpgw_remote_server_addr) {
 		// make sure our UDP payloads aren't too large for udpgw
 		int udpgw_mtu = udpgw_compute_mtu(udp_mtu);
 		if (udpgw_mtu < 0 || udpgw_mtu > PACKETPROTO_MAXPAYLOAD) {
@@ -349,7 +501,7 @@ void tun2socks_Init(const char *tun_service_name, const char  *vlan_addr, const
 		}
 
 		// init udpgw client
-		if (!SocksUdpGwClient_Init(&udpgw_client, udp_mtu, DEFAULT_UDPGW_MAX_CONNECTIONS, options.udpgw_connection_buffer_size, UDPGW_KEEPALIVE_TIME,
+		if (!SocksUdpGwClient_Init(&udpgw_client, udp_mtu, options.udpgw_max_connections, options.udpgw_num_connections, options.udpgw_connection_buffer_size, UDPGW_KEEPALIVE_TIME,
 			socks_server_addr, socks_auth_info, socks_num_auth_info,
 			udpgw_remote_server_addr, UDPGW_RECONNECT_TIME, &ss, NULL, udpgw_client_handler_received
 		)) {
@@ -358,16 +510,20 @@ void tun2socks_Init(const char *tun_service_name, const char  *vlan_addr, const
 		}
 	}
 
+	if (options.udp_relay) {
+		// init UDP relay to the SOCKS server
+		if (!SocksUdpRelay_Init(&udp_relay, udp_mtu, UDP_RELAY_MAX_FLOWS, UDP_RELAY_IDLE_TIMEOUT, UDP_RELAY_FLOW_BUFFER_SIZE,
+			socks_server_addr, &ss, NULL, udpgw_client_handler_received
+		)) {
+			BLog(BLOG_ERROR, "SocksUdpRelay_Init failed");
+			goto fail4b;
+		}
+	}
+
 	// init lwip init job
 	BPending_Init(&lwip_init_job, BReactor_PendingGroup(&ss), lwip_init_job_hadler_socktun, NULL);
 	BPending_Set(&lwip_init_job);
 
-	// init device write buffer
-	if (!(device_write_buf = (uint8_t *)BAlloc(mtu))) {
-		BLog(BLOG_ERROR, "BAlloc failed");
-		goto fail5;
-	}
-
 	// init TCP timer
 	// it won't trigger before lwip is initialized, becuase the lwip init is a job
 	BTimer_Init(&tcp_timer, TCP_TMR_INTERVAL, tcp_timer_handler, NULL);
@@ -387,23 +543,65 @@ void tun2socks_Init(const char *tun_service_name, const char  *vlan_addr, const
 	// init number of clients
 	num_clients = 0;
 
+	// init client slabs
+	client_slab_init();
+
+	// init relay buffer pools
+	relay_buf_pool_init();
+
 	// enter event loop
 	BLog(BLOG_NOTICE, "entering event loop");
 	BReactor_Exec(&ss);
 
-fail5:
+	// free clients
+	LinkedList1Node *node;
+	while (node = LinkedList1_GetFirst(&tcp_clients)) {
+		struct tcp_client *client = UPPER_OBJECT(node, struct tcp_client, list_node);
+		client_murder(client);
+	}
+
+	// free listener
+	if (listener_ip6) {
+		tcp_close(listener_ip6);
+	}
+	if (listener) {
+		tcp_close(listener);
+	}
+
+	// free netif
+	if (have_netif) {
+		netif_remove(&the_netif);
+	}
+
+	// free relay buffer pools
+	relay_buf_pool_free();
+
+	// free client slabs
+	client_slab_free();
+
+	BReactor_RemoveTimer(&ss, &tcp_timer);
+
 	BPending_Free(&lwip_init_job);
+	if (options.udp_relay) {
+		SocksUdpRelay_Free(&udp_relay);
+	}
+fail4b:
 	if (options.udpgw_remote_server_addr) {
 		SocksUdpGwClient_Free(&udpgw_client);
 	}
 fail4a:
-	SinglePacketBuffer_Free(&device_read_buffer);
+	device_read_free();
 fail4:
-	PacketPassInterface_Free(&device_read_interface);
+	SockTun_Free(&tunnel);
+fail3a:
+	BThreadWorkDispatcher_Free(&twd);
 fail3:
 	BSignal_Finish();
 fail2:
 	BReactor_Free(&ss);
+fail1a:
+	// free pooled cipher contexts, after everything using them
+	cryptoman_Free();
 fail1:
 	BFree(password_file_contents);
 	BLog(BLOG_NOTICE, "exiting");
@@ -452,8 +650,12 @@ void print_help (const char *name)
         "        [--append-source-to-username]\n"
         "        [--udpgw-remote-server-addr <addr>]\n"
         "        [--udpgw-max-connections <number>]\n"
+        "        [--udpgw-connections <number>]\n"
         "        [--udpgw-connection-buffer-size <number>]\n"
         "        [--udpgw-transparent-dns]\n"
+        "        [--udp-relay]\n"
+        "        [--crypto-threads <number>]\n"
+        "        [--crypto-threads-affinity]\n"
         "Address format is a.b.c.d:port (IPv4) or [addr]:port (IPv6).\n",
         name
     );
@@ -492,8 +694,12 @@ int parse_arguments (int argc, char *argv[])
     options.append_source_to_username = 0;
     options.udpgw_remote_server_addr = NULL;
     options.udpgw_max_connections = DEFAULT_UDPGW_MAX_CONNECTIONS;
+    options.udpgw_num_connections = DEFAULT_UDPGW_NUM_CONNECTIONS;
     options.udpgw_connection_buffer_size = DEFAULT_UDPGW_CONNECTION_BUFFER_SIZE;
     options.udpgw_transparent_dns = 0;
+    options.udp_relay = 0;
+    options.crypto_threads = 0;
+    options.crypto_threads_affinity = 0;
     
     int i;
     for (i = 1; i < argc; i++) {
@@ -657,6 +863,17 @@ int parse_arguments (int argc, char *argv[])
             }
             i++;
         }
+        else if (!strcmp(arg, "--udpgw-connections")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.udpgw_num_connections = atoi(argv[i + 1])) <= 0) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
         else if (!strcmp(arg, "--udpgw-connection-buffer-size")) {
             if (1 >= argc - i) {
                 fprintf(stderr, "%s: requires an argument\n", arg);
@@ -671,6 +888,20 @@ int parse_arguments (int argc, char *argv[])
         else if (!strcmp(arg, "--udpgw-transparent-dns")) {
             options.udpgw_transparent_dns = 1;
         }
+        else if (!strcmp(arg, "--udp-relay")) {
+            options.udp_relay = 1;
+        }
+        else if (!strcmp(arg, "--crypto-threads")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            options.crypto_threads = atoi(argv[i + 1]);
+            i++;
+        }
+        else if (!strcmp(arg, "--crypto-threads-affinity")) {
+            options.crypto_threads_affinity = 1;
+        }
         else {
             fprintf(stderr, "unknown option: %s\n", arg);
             return 0;
@@ -708,6 +939,16 @@ int parse_arguments (int argc, char *argv[])
         }
     }
     
+    if (options.udpgw_num_connections > options.udpgw_max_connections) {
+        fprintf(stderr, "--udpgw-connections cannot be larger than --udpgw-max-connections\n");
+        return 0;
+    }
+    
+    if (options.udp_relay && options.udpgw_remote_server_addr) {
+        fprintf(stderr, "--udp-relay and --udpgw-remote-server-addr cannot both be given\n");
+        return 0;
+    }
+    
     return 1;
 }
 
@@ -851,48 +1092,184 @@ void device_error_handler (void *unused)
     return;
 }
 
-void device_read_handler_send (void *unused, uint8_t *data, int data_len)
+void device_writable_handler (void *unused)
+{
+    if (quitting) {
+        return;
+    }
+    
+    BLog(BLOG_DEBUG, "device: writable");
+    
+    // output TCP segments which were refused while the device's send queue was full
+    tcp_txnow();
+}
+
+int device_read_init (int mtu)
+{
+    // allocate slots
+    if (!(device_read_slots = (struct device_read_slot *)BAllocArray(DEVICE_READ_NUM_SLOTS, sizeof(device_read_slots[0])))) {
+        goto fail0;
+    }
+    if (!(device_read_slots_data = (uint8_t *)BAllocArray(DEVICE_READ_NUM_SLOTS, mtu))) {
+        goto fail1;
+    }
+    
+    // allocate buffer for reading when all slots are held by lwIP
+    if (!(device_read_copy_buf = (uint8_t *)BAlloc(mtu))) {
+        goto fail2;
+    }
+    
+    // init free slots list
+    LinkedList1_Init(&device_read_free_slots);
+    for (int i = 0; i < DEVICE_READ_NUM_SLOTS; i++) {
+        struct device_read_slot *slot = &device_read_slots[i];
+        slot->pbuf.custom_free_function = device_read_slot_free_func;
+        slot->data = device_read_slots_data + (size_t)i * mtu;
+        LinkedList1_Append(&device_read_free_slots, &slot->free_list_node);
+    }
+    device_read_num_free_slots = DEVICE_READ_NUM_SLOTS;
+    
+    // init receiving
+    device_read_if = SockTun_GetOutput(&tunnel);
+    PacketRecvInterface_Receiver_Init(device_read_if, device_read_handler_done, NULL);
+    
+    // init job for receiving the next packet
+    BPending_Init(&device_read_job, BReactor_PendingGroup(&ss), device_read_job_handler, NULL);
+    
+    // start receiving
+    device_read_start();
+    
+    return 1;
+    
+fail2:
+    BFree(device_read_slots_data);
+fail1:
+    BFree(device_read_slots);
+fail0:
+    return 0;
+}
+
+void device_read_free (void)
+{
+    BPending_Free(&device_read_job);
+    
+    BFree(device_read_copy_buf);
+    
+    // return the slot being read into
+    if (device_read_cur_slot) {
+        LinkedList1_Append(&device_read_free_slots, &device_read_cur_slot->free_list_node);
+        device_read_num_free_slots++;
+    }
+    
+    // lwIP may still hold slots, e.g. in IP reassembly, and will
+    // reference them until it is reinitialized; keep them valid then
+    if (device_read_num_free_slots == DEVICE_READ_NUM_SLOTS) {
+        BFree(device_read_slots_data);
+        BFree(device_read_slots);
+    } else {
+        BLog(BLOG_WARNING, "device read: %d slots still in use by lwIP, not freeing",
+             DEVICE_READ_NUM_SLOTS - device_read_num_free_slots);
+    }
+}
+
+void device_read_start (void)
+{
+    uint8_t *buf;
+    
+    // read into a free slot if there is one, else into the copy buffer
+    LinkedList1Node *node = LinkedList1_GetFirst(&device_read_free_slots);
+    if (node) {
+        device_read_cur_slot = UPPER_OBJECT(node, struct device_read_slot, free_list_node);
+        LinkedList1_Remove(&device_read_free_slots, node);
+        device_read_num_free_slots--;
+        buf = device_read_cur_slot->data;
+    } else {
+        device_read_cur_slot = NULL;
+        buf = device_read_copy_buf;
+    }
+    
+    PacketRecvInterface_Receiver_Recv(device_read_if, buf);
+}
+
+void device_read_handler_done (void *unused, int data_len)
 {
     ASSERT(!quitting)
     ASSERT(data_len >= 0)
     
     BLog(BLOG_DEBUG, "device: received packet");
     
-    // accept packet
-    PacketPassInterface_Done(&device_read_interface);
+    struct device_read_slot *slot = device_read_cur_slot;
+    uint8_t *data = (slot ? slot->data : device_read_copy_buf);
+    device_read_cur_slot = NULL;
+    
+    // receive the next packet from a job set before processing this one, so that
+    // jobs set while processing it, which may still use the data, run first
+    BPending_Set(&device_read_job);
     
     // process UDP directly
     if (process_device_udp_packet(data, data_len)) {
-        return;
+        goto out;
     }
     
     // obtain pbuf
     if (data_len > UINT16_MAX) {
         BLog(BLOG_WARNING, "device read: packet too large");
-        return;
+        goto out;
     }
-    struct pbuf *p = pbuf_alloc(PBUF_RAW, data_len, PBUF_POOL);
-    if (!p) {
-        BLog(BLOG_WARNING, "device read: pbuf_alloc failed");
-        return;
+    struct pbuf *p;
+    if (slot) {
+        // reference the slot; it is returned to us when lwIP frees the pbuf
+        p = pbuf_alloced_custom(PBUF_RAW, data_len, PBUF_REF, &slot->pbuf, slot->data, SockTun_GetMTU(&tunnel));
+        ASSERT(p)
+        slot = NULL;
+    } else {
+        p = pbuf_alloc(PBUF_RAW, data_len, PBUF_POOL);
+        if (!p) {
+            BLog(BLOG_WARNING, "device read: pbuf_alloc failed");
+            goto out;
+        }
+        
+        // write packet to pbuf
+        ASSERT_FORCE(pbuf_take(p, data, data_len) == ERR_OK)
     }
     
-    // write packet to pbuf
-    ASSERT_FORCE(pbuf_take(p, data, data_len) == ERR_OK)
-    
     // pass pbuf to input
     if (the_netif.input(p, &the_netif) != ERR_OK) {
         BLog(BLOG_WARNING, "device read: input failed");
         pbuf_free(p);
     }
+    
+out:
+    // return slot if it wasn't passed to lwIP
+    if (slot) {
+        LinkedList1_Append(&device_read_free_slots, &slot->free_list_node);
+        device_read_num_free_slots++;
+    }
+}
+
+void device_read_job_handler (void *unused)
+{
+    ASSERT(!quitting)
+    
+    // receive next packet
+    device_read_start();
+}
+
+void device_read_slot_free_func (struct pbuf *p)
+{
+    struct device_read_slot *slot = UPPER_OBJECT(p, struct device_read_slot, pbuf.pbuf);
+    
+    // return slot to free list
+    LinkedList1_Append(&device_read_free_slots, &slot->free_list_node);
+    device_read_num_free_slots++;
 }
 
 int process_device_udp_packet (uint8_t *data, int data_len)
 {
     ASSERT(data_len >= 0)
     
-    // do nothing if we don't have udpgw
-    if (!options.udpgw_remote_server_addr) {
+    // do nothing if we don't forward UDP
+    if (!options.udpgw_remote_server_addr && !options.udp_relay) {
         goto fail;
     }
     
@@ -993,12 +1370,17 @@ int process_device_udp_packet (uint8_t *data, int data_len)
     
     // check payload length
     if (data_len > udp_mtu) {
-        BLog(BLOG_ERROR, "packet is too large, cannot send to udpgw");
+        BLog(BLOG_ERROR, "packet is too large, cannot forward");
         goto fail;
     }
     
-    // submit packet to udpgw
-    SocksUdpGwClient_SubmitPacket(&udpgw_client, local_addr, remote_addr, is_dns, data, data_len);
+    if (options.udp_relay) {
+        // submit packet to UDP relay
+        SocksUdpRelay_SubmitPacket(&udp_relay, local_addr, remote_addr, data, data_len);
+    } else {
+        // submit packet to udpgw
+        SocksUdpGwClient_SubmitPacket(&udpgw_client, local_addr, remote_addr, is_dns, data, data_len);
+    }
     
     return 1;
     
@@ -1030,42 +1412,38 @@ err_t netif_output_ip6_func (struct netif *netif, struct pbuf *p, const ip6_addr
 
 err_t common_netif_output (struct netif *netif, struct pbuf *p)
 {
-    SYNC_DECL
-    
     BLog(BLOG_DEBUG, "device write: send packet");
     
     if (quitting) {
         return ERR_OK;
     }
     
-    // if there is just one chunk, send it directly, else via buffer
-    if (!p->next) {
-        if (p->len > device_mtu) {
-            BLog(BLOG_WARNING, "netif func output: no space left");
-            goto out;
-        }
-        
-		SYNC_FROMHERE
-		SockTun_Send(&tunnel, (uint8_t *)p->payload, p->len);
-        SYNC_COMMIT
-    } else {
-        int len = 0;
-        do {
-            if (p->len > device_mtu - len) {
-                BLog(BLOG_WARNING, "netif func output: no space left");
-                goto out;
-            }
-            memcpy(device_write_buf + len, p->payload, p->len);
-            len += p->len;
-        } while (p = p->next);
-        
-		SYNC_FROMHERE
-		SockTun_Send(&tunnel, device_write_buf, len);
-        SYNC_COMMIT
+    if (p->tot_len > device_mtu) {
+        BLog(BLOG_WARNING, "netif func output: no space left");
+        goto out;
     }
     
+    // SockTun doesn't complete sends via jobs, so there is nothing to
+    // synchronize with; doing so would only force the device's write
+    // queue out after every packet
+    uint8_t *out;
+    if (!SockTun_StartPacket(&tunnel, &out)) {
+        goto full;
+    }
+    
+    // gather the pbuf chain directly into the device's send queue
+    ASSERT_EXECUTE(pbuf_copy_partial(p, out, p->tot_len, 0) == p->tot_len)
+    
+    SockTun_EndPacket(&tunnel, p->tot_len);
+    
 out:
     return ERR_OK;
+    
+full:
+    // the device's send queue is full; lwIP will keep the segment and
+    // we retry it from device_writable_handler
+    BLog(BLOG_DEBUG, "netif func output: device send queue full");
+    return ERR_MEM;
 }
 
 err_t netif_input_func (struct pbuf *p, struct netif *inp)
@@ -1113,9 +1491,9 @@ err_t listener_accept_func (void *arg, struct tcp_pcb *newpcb, err_t err)
     ASSERT(err == ERR_OK)
     
     // allocate client structure
-    struct tcp_client *client = (struct tcp_client *)malloc(sizeof(*client));
+    struct tcp_client *client = client_slab_alloc();
     if (!client) {
-        BLog(BLOG_ERROR, "listener accept: malloc failed");
+        BLog(BLOG_ERROR, "listener accept: client_slab_alloc failed");
         goto fail0;
     }
     client->socks_username = NULL;
@@ -1135,7 +1513,8 @@ err_t listener_accept_func (void *arg, struct tcp_pcb *newpcb, err_t err)
     
     // init SOCKS
     if (!BSocksClient_Init(&client->socks_client, socks_server_addr, socks_auth_info, socks_num_auth_info,
-                           addr, (BSocksClient_handler)client_socks_handler, client, &ss)) {
+                           addr, (BSocksClient_handler)client_socks_handler, client, &ss,
+                           (BThreadWorkDispatcher_UsingThreads(&twd) ? &twd : NULL))) {
         BLog(BLOG_ERROR, "listener accept: BSocksClient_Init failed");
         goto fail1;
     }
@@ -1164,8 +1543,10 @@ err_t listener_accept_func (void *arg, struct tcp_pcb *newpcb, err_t err)
     tcp_err(client->pcb, client_err_func);
     tcp_recv(client->pcb, client_recv_func);
     
-    // setup buffer
+    // setup buffers; they are allocated when there is data
+    client->buf = NULL;
     client->buf_used = 0;
+    client->socks_recv_buf = NULL;
     
     // set SOCKS not up, not closed
     client->socks_up = 0;
@@ -1183,7 +1564,7 @@ err_t listener_accept_func (void *arg, struct tcp_pcb *newpcb, err_t err)
 fail1:
     SYNC_BREAK
     free(client->socks_username);
-    free(client);
+    client_slab_release(client);
 fail0:
     return ERR_MEM;
 }
@@ -1213,6 +1594,11 @@ void client_free_client (struct tcp_client *client)
 {
     ASSERT(!client->client_closed)
     
+    // lwIP keeps sending queued data after closing, unless it resets the
+    // connection because we haven't confirmed all received data
+    int linger = client->socks_up && client->socks_recv_tcp_pending > 0 &&
+                 client->buf_used == 0 && !client->pcb->refused_data;
+    
     // remove callbacks
     tcp_err(client->pcb, NULL);
     tcp_recv(client->pcb, NULL);
@@ -1224,6 +1610,10 @@ void client_free_client (struct tcp_client *client)
         client_log(client, BLOG_ERROR, "tcp_close failed (%d)", err);
         client_abort_pcb(client);
     }
+    else if (linger) {
+        // the pcb still references data in our buffer
+        client_linger_socks_recv_buf(client);
+    }
     
     client_handle_freed_client(client);
 }
@@ -1278,7 +1668,7 @@ void client_free_socks (struct tcp_client *client)
     client->socks_closed = 1;
     
     // if we have data to be sent to the client and we can send it, keep sending
-    if (client->socks_up && (client->socks_recv_buf_used >= 0 || client->socks_recv_tcp_pending > 0) && !client->client_closed) {
+    if (client->socks_up && (client->socks_recv_buf_used > 0 || client->socks_recv_tcp_pending > 0) && !client->client_closed) {
         client_log(client, BLOG_INFO, "waiting until buffered data is sent to client");
     } else {
         if (!client->client_closed) {
@@ -1335,9 +1725,17 @@ void client_dealloc (struct tcp_client *client)
         DEAD_KILL_WITH(client->dead_aborted, -1);
     }
     
+    // release buffers
+    if (client->buf) {
+        relay_buf_release(client->buf);
+    }
+    if (client->socks_recv_buf) {
+        relay_buf_release(client->socks_recv_buf);
+    }
+    
     // free memory
     free(client->socks_username);
-    free(client);
+    client_slab_release(client);
 }
 
 void client_err_func (void *arg, err_t err)
@@ -1366,15 +1764,32 @@ err_t client_recv_func (void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t e
     } else {
         ASSERT(p->tot_len > 0)
         
+        // get a buffer if we don't have one
+        if (!client->buf) {
+            ASSERT(client->buf_used == 0)
+            
+            if (!(client->buf = relay_buf_alloc(TCP_WND))) {
+                client_log(client, BLOG_ERROR, "failed to allocate buffer");
+                DEAD_LEAVE2(client->dead_aborted)
+                return ERR_MEM;
+            }
+            client->buf_start = 0;
+        }
+        
         // check if we have enough buffer
-        if (p->tot_len > sizeof(client->buf) - client->buf_used) {
+        if (p->tot_len > client->buf->size - client->buf_used) {
             client_log(client, BLOG_ERROR, "no buffer for data !?!");
             DEAD_LEAVE2(client->dead_aborted)
             return ERR_MEM;
         }
         
-        // copy data to buffer
-        ASSERT_EXECUTE(pbuf_copy_partial(p, client->buf + client->buf_used, p->tot_len, 0) == p->tot_len)
+        // copy data to buffer, wrapping around its end
+        int write_pos = (client->buf_start + client->buf_used) % client->buf->size;
+        int first_len = bmin_int(p->tot_len, client->buf->size - write_pos);
+        ASSERT_EXECUTE(pbuf_copy_partial(p, client->buf->data + write_pos, first_len, 0) == first_len)
+        if (first_len < p->tot_len) {
+            ASSERT_EXECUTE(pbuf_copy_partial(p, client->buf->data, p->tot_len - first_len, first_len) == p->tot_len - first_len)
+        }
         client->buf_used += p->tot_len;
         
         // free pbuff
@@ -1421,7 +1836,10 @@ void client_socks_handler (struct tcp_client *client, int event)
             // init receiving
             client->socks_recv_if = BSocksClient_GetRecvInterface(&client->socks_client);
             StreamRecvInterface_Receiver_Init(client->socks_recv_if, (StreamRecvInterface_handler_done)client_socks_recv_handler_done, client);
-            client->socks_recv_buf_used = -1;
+            client->socks_recv_buf_used = 0;
+            client->socks_recv_bulk = 0;
+            client->socks_recv_receiving = 0;
+            client->socks_recv_waiting = 0;
             client->socks_recv_tcp_pending = 0;
             if (!client->client_closed) {
                 tcp_sent(client->pcb, client_sent_func);
@@ -1437,7 +1855,10 @@ void client_socks_handler (struct tcp_client *client, int event)
             
             // start receiving data if client is still up
             if (!client->client_closed) {
-                client_socks_recv_initiate(client);
+                if (!client_socks_recv_initiate(client)) {
+                    client_free_socks(client);
+                    return;
+                }
             }
         } break;
         
@@ -1460,8 +1881,10 @@ void client_send_to_socks (struct tcp_client *client)
     ASSERT(client->socks_up)
     ASSERT(client->buf_used > 0)
     
-    // schedule sending
-    StreamPassInterface_Sender_Send(client->socks_send_if, client->buf, client->buf_used);
+    // schedule sending the data up to the end of the buffer;
+    // the rest is sent after the buffer wraps around
+    int send_len = bmin_int(client->buf_used, client->buf->size - client->buf_start);
+    StreamPassInterface_Sender_Send(client->socks_send_if, client->buf->data + client->buf_start, send_len);
 }
 
 void client_socks_send_handler_done (struct tcp_client *client, int data_len)
@@ -1471,11 +1894,18 @@ void client_socks_send_handler_done (struct tcp_client *client, int data_len)
     ASSERT(client->buf_used > 0)
     ASSERT(data_len > 0)
     ASSERT(data_len <= client->buf_used)
+    ASSERT(data_len <= client->buf->size - client->buf_start)
     
     // remove sent data from buffer
-    memmove(client->buf, client->buf + data_len, client->buf_used - data_len);
+    client->buf_start = (client->buf_start + data_len) % client->buf->size;
     client->buf_used -= data_len;
     
+    // release the buffer once it's empty
+    if (client->buf_used == 0) {
+        relay_buf_release(client->buf);
+        client->buf = NULL;
+    }
+    
     if (!client->client_closed) {
         // confirm sent data
         tcp_recved(client->pcb, data_len);
@@ -1483,7 +1913,7 @@ void client_socks_send_handler_done (struct tcp_client *client, int data_len)
     
     if (client->buf_used > 0) {
         // send any further data
-        StreamPassInterface_Sender_Send(client->socks_send_if, client->buf, client->buf_used);
+        client_send_to_socks(client);
     }
     else if (client->client_closed) {
         // client was closed we've sent everything we had buffered; we're done with it
@@ -1493,42 +1923,94 @@ void client_socks_send_handler_done (struct tcp_client *client, int data_len)
     }
 }
 
-void client_socks_recv_initiate (struct tcp_client *client)
+int client_socks_recv_initiate (struct tcp_client *client)
 {
     ASSERT(!client->client_closed)
     ASSERT(!client->socks_closed)
     ASSERT(client->socks_up)
-    ASSERT(client->socks_recv_buf_used == -1)
+    ASSERT(!client->socks_recv_receiving)
     
-    StreamRecvInterface_Receiver_Recv(client->socks_recv_if, client->socks_recv_buf, sizeof(client->socks_recv_buf));
+    // return value 0 means no buffer could be allocated and nothing
+    // was done, 1 means receiving was started
+    
+    // get a buffer if we don't have one; a small one is enough while the
+    // client is mostly idle, a large one is used once a transfer fills it
+    if (!client->socks_recv_buf) {
+        ASSERT(client->socks_recv_tcp_pending == 0)
+        ASSERT(client->socks_recv_buf_used == 0)
+        
+        int size = (client->socks_recv_bulk ? CLIENT_SOCKS_RECV_BUF_SIZE : CLIENT_SOCKS_RECV_BUF_SIZE_IDLE);
+        if (!(client->socks_recv_buf = relay_buf_alloc(size))) {
+            client_log(client, BLOG_ERROR, "failed to allocate buffer");
+            return 0;
+        }
+    }
+    
+    int buf_size = client->socks_recv_buf->size;
+    int buf_held = client->socks_recv_tcp_pending + client->socks_recv_buf_used;
+    ASSERT(buf_held < buf_size)
+    
+    // if the buffer is empty, receive into its beginning to get as much as possible
+    if (buf_held == 0) {
+        client->socks_recv_buf_start = 0;
+    }
+    
+    // receive into the free space up to the end of the buffer
+    int write_pos = (client->socks_recv_buf_start + buf_held) % buf_size;
+    int write_len = bmin_int(buf_size - buf_held, buf_size - write_pos);
+    
+    StreamRecvInterface_Receiver_Recv(client->socks_recv_if, client->socks_recv_buf->data + write_pos, write_len);
+    
+    // set receiving
+    client->socks_recv_receiving = 1;
+    
+    return 1;
 }
 
 void client_socks_recv_handler_done (struct tcp_client *client, int data_len)
 {
     ASSERT(data_len > 0)
-    ASSERT(data_len <= sizeof(client->socks_recv_buf))
+    ASSERT(data_len <= client->socks_recv_buf->size - client->socks_recv_tcp_pending - client->socks_recv_buf_used)
     ASSERT(!client->socks_closed)
     ASSERT(client->socks_up)
-    ASSERT(client->socks_recv_buf_used == -1)
+    ASSERT(client->socks_recv_receiving)
+    
+    // set not receiving
+    client->socks_recv_receiving = 0;
     
     // if client was closed, stop receiving
     if (client->client_closed) {
         return;
     }
     
-    // set amount of data in buffer
-    client->socks_recv_buf_used = data_len;
-    client->socks_recv_buf_sent = 0;
-    client->socks_recv_waiting = 0;
-
-    // send to client
-    if (client_socks_recv_send_out(client) < 0) {
-        return;
+    // if a large buffer only got a little data after it was drained, the
+    // transfer is over; move the data to a small buffer and release it
+    if (client->socks_recv_buf->size > CLIENT_SOCKS_RECV_BUF_SIZE_IDLE && data_len <= CLIENT_SOCKS_RECV_BUF_SIZE_IDLE &&
+        client->socks_recv_tcp_pending == 0 && client->socks_recv_buf_used == 0
+    ) {
+        struct relay_buf *rb = relay_buf_alloc(CLIENT_SOCKS_RECV_BUF_SIZE_IDLE);
+        if (rb) {
+            memcpy(rb->data, client->socks_recv_buf->data + client->socks_recv_buf_start, data_len);
+            relay_buf_release(client->socks_recv_buf);
+            client->socks_recv_buf = rb;
+            client->socks_recv_buf_start = 0;
+            client->socks_recv_bulk = 0;
+        }
     }
     
-    // continue receiving if needed
-    if (client->socks_recv_buf_used == -1) {
-        client_socks_recv_initiate(client);
+    // add received data to the buffer
+    client->socks_recv_buf_used += data_len;
+    
+    // send to client, unless we're still waiting for it to confirm data
+    if (!client->socks_recv_waiting) {
+        if (client_socks_recv_send_out(client) < 0) {
+            return;
+        }
+    }
+    
+    // continue receiving if there is space
+    if (client->socks_recv_tcp_pending + client->socks_recv_buf_used < client->socks_recv_buf->size) {
+        ASSERT_EXECUTE(client_socks_recv_initiate(client))
     }
 }
 
@@ -1537,19 +2019,26 @@ int client_socks_recv_send_out (struct tcp_client *client)
     ASSERT(!client->client_closed)
     ASSERT(client->socks_up)
     ASSERT(client->socks_recv_buf_used > 0)
-    ASSERT(client->socks_recv_buf_sent < client->socks_recv_buf_used)
     ASSERT(!client->socks_recv_waiting)
     
     // return value -1 means tcp_abort() was done,
     // 0 means it wasn't and the client (pcb) is still up
     
+    int buf_size = client->socks_recv_buf->size;
+    
     do {
-        int to_write = bmin_int(client->socks_recv_buf_used - client->socks_recv_buf_sent, tcp_sndbuf(client->pcb));
+        // queue a segment of data up to the end of the buffer; the data is not
+        // copied and stays in the buffer until the client acknowledges it.
+        // Without copying, each segment takes two entries of the send queue,
+        // so write one segment at a time to make progress until it fills up.
+        int write_pos = (client->socks_recv_buf_start + client->socks_recv_tcp_pending) % buf_size;
+        int to_write = bmin_int(client->socks_recv_buf_used, buf_size - write_pos);
+        to_write = bmin_int(to_write, bmin_int(tcp_sndbuf(client->pcb), tcp_mss(client->pcb)));
         if (to_write == 0) {
             break;
         }
         
-        err_t err = tcp_write(client->pcb, client->socks_recv_buf + client->socks_recv_buf_sent, to_write, TCP_WRITE_FLAG_COPY);
+        err_t err = tcp_write(client->pcb, client->socks_recv_buf->data + write_pos, to_write, 0);
         if (err != ERR_OK) {
             if (err == ERR_MEM) {
                 break;
@@ -1561,9 +2050,9 @@ int client_socks_recv_send_out (struct tcp_client *client)
             return -1;
         }
         
-        client->socks_recv_buf_sent += to_write;
+        client->socks_recv_buf_used -= to_write;
         client->socks_recv_tcp_pending += to_write;
-    } while (client->socks_recv_buf_sent < client->socks_recv_buf_used);
+    } while (client->socks_recv_buf_used > 0);
     
     // start sending now
     err_t err = tcp_output(client->pcb);
@@ -1575,7 +2064,7 @@ int client_socks_recv_send_out (struct tcp_client *client)
     }
     
     // more data to queue?
-    if (client->socks_recv_buf_sent < client->socks_recv_buf_used) {
+    if (client->socks_recv_buf_used > 0) {
         if (client->socks_recv_tcp_pending == 0) {
             client_log(client, BLOG_ERROR, "can't queue data, but all data was confirmed !?!");
             
@@ -1585,12 +2074,8 @@ int client_socks_recv_send_out (struct tcp_client *client)
         
         // set waiting, continue in client_sent_func
         client->socks_recv_waiting = 1;
-        return 0;
     }
     
-    // everything was queued
-    client->socks_recv_buf_used = -1;
-    
     return 0;
 }
 
@@ -1605,13 +2090,13 @@ err_t client_sent_func (void *arg, struct tcp_pcb *tpcb, u16_t len)
     
     DEAD_ENTER(client->dead_aborted)
     
-    // decrement pending
+    // release confirmed data from the buffer
+    client->socks_recv_buf_start = (client->socks_recv_buf_start + len) % client->socks_recv_buf->size;
     client->socks_recv_tcp_pending -= len;
     
     // continue queuing
-    if (client->socks_recv_buf_used > 0) {
-        ASSERT(client->socks_recv_waiting)
-        ASSERT(client->socks_recv_buf_sent < client->socks_recv_buf_used)
+    if (client->socks_recv_waiting) {
+        ASSERT(client->socks_recv_buf_used > 0)
         
         // set not waiting
         client->socks_recv_waiting = 0;
@@ -1623,22 +2108,36 @@ err_t client_sent_func (void *arg, struct tcp_pcb *tpcb, u16_t len)
         
         // we just queued some data, so it can't have been confirmed yet
         ASSERT(client->socks_recv_tcp_pending > 0)
-        
-        // continue receiving if needed
-        if (client->socks_recv_buf_used == -1 && !client->socks_closed) {
+    }
+    
+    // if the buffer was drained and we aren't receiving into it, it was full;
+    // release it so that a large buffer is used from now on
+    if (client->socks_recv_tcp_pending == 0 && client->socks_recv_buf_used == 0 && !client->socks_recv_receiving) {
+        relay_buf_release(client->socks_recv_buf);
+        client->socks_recv_buf = NULL;
+        client->socks_recv_bulk = 1;
+    }
+    
+    if (!client->socks_closed) {
+        // continue receiving if we aren't already and there is space now
+        if (!client->socks_recv_receiving && (!client->socks_recv_buf ||
+            client->socks_recv_tcp_pending + client->socks_recv_buf_used < client->socks_recv_buf->size)
+        ) {
             SYNC_DECL
             SYNC_FROMHERE
-            client_socks_recv_initiate(client);
+            if (!client_socks_recv_initiate(client)) {
+                client_free_socks(client);
+            }
             SYNC_COMMIT
         }
-    } else {    
+    } else {
         // have we sent everything after SOCKS was closed?
-        if (client->socks_closed && client->socks_recv_tcp_pending == 0) {
+        if (client->socks_recv_tcp_pending == 0 && client->socks_recv_buf_used == 0) {
             client_log(client, BLOG_INFO, "removing after SOCKS went down");
             client_free_client(client);
         }
     }
-    
+
 out:
     DEAD_LEAVE2(client->dead_aborted)
     
@@ -1646,13 +2145,160 @@ out:
     return (DEAD_KILLED > 0) ? ERR_ABRT : ERR_OK;
 }
 
+void client_slab_init (void)
+{
+    LinkedList1_Init(&client_slabs);
+    LinkedList1_Init(&client_free_list);
+}
+
+void client_slab_free (void)
+{
+    LinkedList1Node *node;
+    while (node = LinkedList1_GetFirst(&client_slabs)) {
+        LinkedList1_Remove(&client_slabs, node);
+        BFree(UPPER_OBJECT(node, struct client_slab, slabs_list_node));
+    }
+}
+
+struct tcp_client * client_slab_alloc (void)
+{
+    // allocate a new slab if all clients are in use
+    if (LinkedList1_IsEmpty(&client_free_list)) {
+        struct client_slab *slab = (struct client_slab *)BAlloc(sizeof(*slab));
+        if (!slab) {
+            return NULL;
+        }
+        LinkedList1_Append(&client_slabs, &slab->slabs_list_node);
+        
+        for (int i = 0; i < CLIENT_SLAB_SIZE; i++) {
+            LinkedList1_Append(&client_free_list, &slab->clients[i].list_node);
+        }
+    }
+    
+    // take a client; while unused, clients are linked
+    // into the free list by their list_node
+    LinkedList1Node *node = LinkedList1_GetFirst(&client_free_list);
+    LinkedList1_Remove(&client_free_list, node);
+    
+    return UPPER_OBJECT(node, struct tcp_client, list_node);
+}
+
+void client_slab_release (struct tcp_client *client)
+{
+    // put it in front so that it's reused while still in cache
+    LinkedList1_Prepend(&client_free_list, &client->list_node);
+}
+
+void relay_buf_pool_init (void)
+{
+    for (int i = 0; i < RELAY_BUF_NUM_CLASSES; i++) {
+        LinkedList1_Init(&relay_buf_free_lists[i]);
+        relay_buf_num_free[i] = 0;
+    }
+}
+
+void relay_buf_pool_free (void)
+{
+    for (int i = 0; i < RELAY_BUF_NUM_CLASSES; i++) {
+        LinkedList1Node *node;
+        while (node = LinkedList1_GetFirst(&relay_buf_free_lists[i])) {
+            LinkedList1_Remove(&relay_buf_free_lists[i], node);
+            BFree(UPPER_OBJECT(node, struct relay_buf, free_list_node));
+        }
+        relay_buf_num_free[i] = 0;
+    }
+}
+
+struct relay_buf * relay_buf_alloc (int size)
+{
+    // find the smallest size class the buffer fits in
+    int c = 0;
+    while (relay_buf_class_sizes[c] < size) {
+        c++;
+        ASSERT(c < RELAY_BUF_NUM_CLASSES)
+    }
+    
+    // reuse a pooled buffer if there is one
+    LinkedList1Node *node = LinkedList1_GetFirst(&relay_buf_free_lists[c]);
+    if (node) {
+        LinkedList1_Remove(&relay_buf_free_lists[c], node);
+        relay_buf_num_free[c]--;
+        return UPPER_OBJECT(node, struct relay_buf, free_list_node);
+    }
+    
+    struct relay_buf *rb = (struct relay_buf *)BAlloc(sizeof(*rb) + relay_buf_class_sizes[c]);
+    if (!rb) {
+        return NULL;
+    }
+    rb->size_class = c;
+    rb->size = relay_buf_class_sizes[c];
+    
+    return rb;
+}
+
+void relay_buf_release (struct relay_buf *rb)
+{
+    int c = rb->size_class;
+    
+    // keep the buffer for reuse unless the pool is full
+    if (relay_buf_num_free[c] < RELAY_BUF_POOL_SIZE) {
+        LinkedList1_Prepend(&relay_buf_free_lists[c], &rb->free_list_node);
+        relay_buf_num_free[c]++;
+    } else {
+        BFree(rb);
+    }
+}
+
+void client_linger_socks_recv_buf (struct tcp_client *client)
+{
+    ASSERT(client->socks_recv_tcp_pending > 0)
+    
+    struct relay_buf *buf = client->socks_recv_buf;
+    buf->linger_pending = client->socks_recv_tcp_pending;
+    
+    // hand the buffer over to the closed pcb
+    tcp_arg(client->pcb, buf);
+    tcp_err(client->pcb, linger_err_func);
+    tcp_sent(client->pcb, linger_sent_func);
+    
+    client->socks_recv_buf = NULL;
+}
+
+void linger_err_func (void *arg, err_t err)
+{
+    struct relay_buf *buf = (struct relay_buf *)arg;
+    
+    // the pcb was freed along with any references to the buffer
+    relay_buf_release(buf);
+}
+
+err_t linger_sent_func (void *arg, struct tcp_pcb *tpcb, u16_t len)
+{
+    struct relay_buf *buf = (struct relay_buf *)arg;
+    ASSERT(len > 0)
+    ASSERT(len <= buf->linger_pending)
+    
+    buf->linger_pending -= len;
+    
+    // release the buffer once all data in it was confirmed
+    if (buf->linger_pending == 0) {
+        tcp_arg(tpcb, NULL);
+        tcp_err(tpcb, NULL);
+        tcp_sent(tpcb, NULL);
+        relay_buf_release(buf);
+    }
+    
+    return ERR_OK;
+}
+
 void udpgw_client_handler_received (void *unused, BAddr local_addr, BAddr remote_addr, const uint8_t *data, int data_len)
 {
-    ASSERT(options.udpgw_remote_server_addr)
+    ASSERT(options.udpgw_remote_server_addr || options.udp_relay)
     ASSERT(local_addr.type == BADDR_TYPE_IPV4 || local_addr.type == BADDR_TYPE_IPV6)
     ASSERT(local_addr.type == remote_addr.type)
     ASSERT(data_len >= 0)
     
+    uint8_t *out;
     int packet_length = 0;
     
     switch (local_addr.type) {
@@ -1689,9 +2335,12 @@ void udpgw_client_handler_received (void *unused, BAddr local_addr, BAddr remote
             udph.checksum = udp_checksum(&udph, data, data_len, iph.source_address, iph.destination_address);
             
             // write packet
-            memcpy(device_write_buf, &iph, sizeof(iph));
-            memcpy(device_write_buf + sizeof(iph), &udph, sizeof(udph));
-            memcpy(device_write_buf + sizeof(iph) + sizeof(udph), data, data_len);
+            if (!SockTun_StartPacket(&tunnel, &out)) {
+                goto full;
+            }
+            memcpy(out, &iph, sizeof(iph));
+            memcpy(out + sizeof(iph), &udph, sizeof(udph));
+            memcpy(out + sizeof(iph) + sizeof(udph), data, data_len);
             packet_length = sizeof(iph) + sizeof(udph) + data_len;
         } break;
         
@@ -1730,13 +2379,20 @@ void udpgw_client_handler_received (void *unused, BAddr local_addr, BAddr remote
             udph.checksum = udp_ip6_checksum(&udph, data, data_len, iph.source_address, iph.destination_address);
             
             // write packet
-            memcpy(device_write_buf, &iph, sizeof(iph));
-            memcpy(device_write_buf + sizeof(iph), &udph, sizeof(udph));
-            memcpy(device_write_buf + sizeof(iph) + sizeof(udph), data, data_len);
+            if (!SockTun_StartPacket(&tunnel, &out)) {
+                goto full;
+            }
+            memcpy(out, &iph, sizeof(iph));
+            memcpy(out + sizeof(iph), &udph, sizeof(udph));
+            memcpy(out + sizeof(iph) + sizeof(udph), data, data_len);
             packet_length = sizeof(iph) + sizeof(udph) + data_len;
         } break;
     }
     
     // submit packet
-	SockTun_Send(&tunnel, device_write_buf, packet_length);
+    SockTun_EndPacket(&tunnel, packet_length);
+    return;
+    
+full:
+    BLog(BLOG_WARNING, "UDP: device send queue full, dropping packet");
 }
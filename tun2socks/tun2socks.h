@@ -27,12 +27,31 @@
 // name of the program
 #define PROGRAM_NAME "tun2socks"
 
-// size of temporary buffer for passing data from the SOCKS server to TCP for sending
-#define CLIENT_SOCKS_RECV_BUF_SIZE 8192
+// size of ring buffer for data from the SOCKS server; the data is passed to TCP
+// without copying and stays in the buffer until the client acknowledges it, so
+// this limits the amount of data in flight to the client
+#define CLIENT_SOCKS_RECV_BUF_SIZE 32768
+
+// size of buffer for data from the SOCKS server while a client is mostly idle;
+// it is replaced with one of CLIENT_SOCKS_RECV_BUF_SIZE once a transfer fills it
+#define CLIENT_SOCKS_RECV_BUF_SIZE_IDLE 2048
+
+// number of unused relay buffers of each size kept for reuse
+#define RELAY_BUF_POOL_SIZE 64
+
+// number of client structures allocated at once
+#define CLIENT_SLAB_SIZE 64
+
+// number of buffers packets from the device are read into and passed
+// to lwIP without copying; when lwIP holds all of them, packets are copied
+#define DEVICE_READ_NUM_SLOTS 64
 
 // maximum number of udpgw connections
 #define DEFAULT_UDPGW_MAX_CONNECTIONS 256
 
+// number of parallel connections to the udpgw server which flows are spread over
+#define DEFAULT_UDPGW_NUM_CONNECTIONS 1
+
 // udpgw per-connection send buffer size, in number of packets
 #define DEFAULT_UDPGW_CONNECTION_BUFFER_SIZE 8
 
@@ -42,7 +61,39 @@
 // udpgw keepalive sending interval
 #define UDPGW_KEEPALIVE_TIME 10000
 
+// maximum number of flows of the UDP relay
+#define UDP_RELAY_MAX_FLOWS 256
+
+// time after which an idle UDP relay flow is freed
+#define UDP_RELAY_IDLE_TIMEOUT 60000
+
+// UDP relay per-flow send buffer size, in number of packets
+#define UDP_RELAY_FLOW_BUFFER_SIZE 8
+
 // option to override the destination addresses to give the SOCKS server
 //#define OVERRIDE_DEST_ADDR "10.111.0.2:2000"
 
+// settings beyond those passed to tun2socks_Init; initialize with
+// tun2socks_InitConfig before changing individual fields
+struct tun2socks_config {
+    // udpgw server address as seen from the SOCKS server, or NULL to not forward UDP via udpgw
+    const char *udpgw_remote_server_addr;
+    // maximum number of udpgw connections, at least udpgw_num_connections
+    int udpgw_max_connections;
+    // number of parallel connections to the udpgw server
+    int udpgw_num_connections;
+    // udpgw per-connection send buffer size, in number of packets
+    int udpgw_connection_buffer_size;
+    // whether to make udpgw forward DNS queries to its own DNS server
+    int udpgw_transparent_dns;
+    // whether to relay UDP to the SOCKS server as Shadowsocks datagrams; not with udpgw
+    int udp_relay;
+    // number of threads encrypting SOCKS traffic; 0 for none, negative for one per CPU
+    int crypto_threads;
+    // whether to bind each of the crypto threads to its own CPU
+    int crypto_threads_affinity;
+};
+
+void tun2socks_InitConfig(struct tun2socks_config *config);
 void tun2socks_Init(const char *tun_service_name, const char  *vlan_addr, const char *vlan_netmask, int mtu, const char *socks_server_addr, const char *crypto_method, const char *socks_server_password);
+void tun2socks_InitWithConfig(const char *tun_service_name, const char  *vlan_addr, const char *vlan_netmask, int mtu, const char *socks_server_addr, const char *crypto_method, const char *socks_server_password, const struct tun2socks_config *config);
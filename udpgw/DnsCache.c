@@ -0,0 +1,274 @@
+/*
+ * Copyright (C) Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include <misc/balloc.h>
+#include <misc/offset.h>
+#include <misc/compare.h>
+#include <misc/byteorder.h>
+#include <misc/read_write_int.h>
+#include <system/BTime.h>
+
+#include <udpgw/DnsCache.h>
+
+struct DnsCache_entry {
+    struct DnsCache_key key;
+    btime_t insert_time;
+    btime_t expire_time;
+    size_t size;
+    int response_len;
+    int opt_pos;
+    int opt_end;
+    BAVLNode tree_node;
+    LinkedList1Node list_node;
+    uint8_t data[];
+};
+
+static int key_comparator (void *unused, struct DnsCache_key *k1, struct DnsCache_key *k2);
+static void remove_entry (DnsCache *o, struct DnsCache_entry *e);
+
+static int key_comparator (void *unused, struct DnsCache_key *k1, struct DnsCache_key *k2)
+{
+    int c = B_COMPARE(k1->len, k2->len);
+    if (c) {
+        return c;
+    }
+    int r = memcmp(k1->data, k2->data, k1->len);
+    return B_COMPARE(r, 0);
+}
+
+static void remove_entry (DnsCache *o, struct DnsCache_entry *e)
+{
+    ASSERT(o->size >= e->size)
+    
+    BAVL_Remove(&o->entries_tree, &e->tree_node);
+    LinkedList1_Remove(&o->entries_list, &e->list_node);
+    o->size -= e->size;
+    BFree(e);
+}
+
+void DnsCache_Init (DnsCache *o, size_t max_size)
+{
+    o->max_size = max_size;
+    o->size = 0;
+    
+    // init entries tree
+    BAVL_Init(&o->entries_tree, OFFSET_DIFF(struct DnsCache_entry, key, tree_node), (BAVL_comparator)key_comparator, NULL);
+    
+    // init entries list, least recently used first
+    LinkedList1_Init(&o->entries_list);
+    
+    DebugObject_Init(&o->d_obj);
+}
+
+void DnsCache_Free (DnsCache *o)
+{
+    DebugObject_Free(&o->d_obj);
+    
+    // free entries
+    LinkedList1Node *node;
+    while (node = LinkedList1_GetFirst(&o->entries_list)) {
+        remove_entry(o, UPPER_OBJECT(node, struct DnsCache_entry, list_node));
+    }
+    ASSERT(o->size == 0)
+}
+
+int DnsCache_Answer (DnsCache *o, const uint8_t *query, int query_len, uint8_t *out)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(query_len >= 0)
+    
+    // must be a standard query without any records besides EDNS
+    if (query_len < sizeof(struct dns_header)) {
+        return -1;
+    }
+    struct dns_header header;
+    memcpy(&header, query, sizeof(header));
+    uint16_t flags = ntoh16(header.flags);
+    if ((flags & (DNS_FLAG_QR | DNS_OPCODE_MASK)) || header.ancount != 0 || header.nscount != 0) {
+        return -1;
+    }
+    
+    // build key
+    uint8_t key_data[DNSCACHE_MAX_KEY_LEN];
+    struct DnsCache_key key;
+    int question_end;
+    if (!dns_parse_question(query, query_len, key_data, &key.len, &question_end)) {
+        return -1;
+    }
+    key.data = key_data;
+    
+    // find out if the client uses EDNS, and how large a response it accepts
+    int query_opt_pos;
+    int query_opt_end;
+    if (!dns_find_opt(query, query_len, question_end, ntoh16(header.arcount), &query_opt_pos, &query_opt_end)) {
+        return -1;
+    }
+    int max_response_len = (query_opt_pos >= 0 ? dns_opt_udp_size(query, query_opt_pos) : DNS_MAX_UDP_SIZE);
+    
+    // look up entry
+    BAVLNode *tree_node = BAVL_LookupExact(&o->entries_tree, &key);
+    if (!tree_node) {
+        return -1;
+    }
+    struct DnsCache_entry *e = UPPER_OBJECT(tree_node, struct DnsCache_entry, tree_node);
+    
+    // drop it if it has expired
+    btime_t now = btime_gettime();
+    if (now >= e->expire_time) {
+        remove_entry(o, e);
+        return -1;
+    }
+    
+    const uint8_t *response = e->data + e->key.len;
+    struct dns_header resp_header;
+    memcpy(&resp_header, response, sizeof(resp_header));
+    
+    // copy response; the OPT record is left out if the client didn't use EDNS
+    int out_len;
+    if (e->opt_pos >= 0 && query_opt_pos < 0) {
+        out_len = e->response_len - (e->opt_end - e->opt_pos);
+        if (out_len > max_response_len) {
+            return -1;
+        }
+        memcpy(out, response, e->opt_pos);
+        memcpy(out + e->opt_pos, response + e->opt_end, e->response_len - e->opt_end);
+        resp_header.arcount = hton16(ntoh16(resp_header.arcount) - 1);
+        memcpy(out + offsetof(struct dns_header, arcount), &resp_header.arcount, sizeof(resp_header.arcount));
+    } else {
+        out_len = e->response_len;
+        if (out_len > max_response_len) {
+            return -1;
+        }
+        memcpy(out, response, e->response_len);
+    }
+    
+    // use the query's ID, and its question which may differ in letter case;
+    // it has the same length as the response's since the keys are equal
+    memcpy(out, query, sizeof(header.id));
+    memcpy(out + sizeof(struct dns_header), query + sizeof(struct dns_header), question_end - sizeof(struct dns_header));
+    
+    // count down TTLs by the time spent in the cache
+    int num_records = (int)ntoh16(resp_header.ancount) + ntoh16(resp_header.nscount) + ntoh16(resp_header.arcount);
+    uint32_t age = (now - e->insert_time) / 1000;
+    if (age > 0) {
+        ASSERT_EXECUTE(dns_process_records(out, out_len, question_end, num_records, NULL, age))
+    }
+    
+    // move to end of list
+    LinkedList1_Remove(&o->entries_list, &e->list_node);
+    LinkedList1_Append(&o->entries_list, &e->list_node);
+    
+    return out_len;
+}
+
+void DnsCache_Insert (DnsCache *o, const uint8_t *response, int response_len)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(response_len >= 0)
+    
+    if (response_len < sizeof(struct dns_header) || response_len > DNSCACHE_MAX_RESPONSE_SIZE) {
+        return;
+    }
+    
+    // must be a complete response to a standard query, either positive or NXDOMAIN
+    struct dns_header header;
+    memcpy(&header, response, sizeof(header));
+    uint16_t flags = ntoh16(header.flags);
+    int rcode = (flags & DNS_RCODE_MASK);
+    if (!(flags & DNS_FLAG_QR) || (flags & (DNS_OPCODE_MASK | DNS_FLAG_TC)) || (rcode != DNS_RCODE_NOERROR && rcode != DNS_RCODE_NXDOMAIN)) {
+        return;
+    }
+    
+    // build key
+    uint8_t key_data[DNSCACHE_MAX_KEY_LEN];
+    int key_len;
+    int question_end;
+    if (!dns_parse_question(response, response_len, key_data, &key_len, &question_end)) {
+        return;
+    }
+    
+    // find the smallest TTL; responses without any records aren't cached
+    int num_records = (int)ntoh16(header.ancount) + ntoh16(header.nscount) + ntoh16(header.arcount);
+    uint32_t ttl = UINT32_MAX;
+    if (!dns_process_records((uint8_t *)response, response_len, question_end, num_records, &ttl, 0) || ttl == UINT32_MAX || ttl == 0) {
+        return;
+    }
+    
+    // find the OPT record, to be able to leave it out for clients without EDNS
+    int opt_pos;
+    int opt_end;
+    if (!dns_find_opt(response, response_len, question_end, num_records, &opt_pos, &opt_end)) {
+        return;
+    }
+    if (ttl > DNSCACHE_MAX_TTL) {
+        ttl = DNSCACHE_MAX_TTL;
+    }
+    
+    // check the entry fits into the budget at all
+    size_t size = sizeof(struct DnsCache_entry) + key_len + response_len;
+    if (size > o->max_size) {
+        return;
+    }
+    
+    // remove any existing entry
+    struct DnsCache_key key;
+    key.data = key_data;
+    key.len = key_len;
+    BAVLNode *tree_node = BAVL_LookupExact(&o->entries_tree, &key);
+    if (tree_node) {
+        remove_entry(o, UPPER_OBJECT(tree_node, struct DnsCache_entry, tree_node));
+    }
+    
+    // make room by removing least recently used entries
+    while (o->size > o->max_size - size) {
+        remove_entry(o, UPPER_OBJECT(LinkedList1_GetFirst(&o->entries_list), struct DnsCache_entry, list_node));
+    }
+    
+    // allocate entry
+    struct DnsCache_entry *e = (struct DnsCache_entry *)BAlloc(size);
+    if (!e) {
+        return;
+    }
+    
+    // fill in entry
+    memcpy(e->data, key_data, key_len);
+    memcpy(e->data + key_len, response, response_len);
+    e->key.data = e->data;
+    e->key.len = key_len;
+    e->insert_time = btime_gettime();
+    e->expire_time = btime_add(e->insert_time, (btime_t)ttl * 1000);
+    e->size = size;
+    e->response_len = response_len;
+    e->opt_pos = opt_pos;
+    e->opt_end = opt_end;
+    
+    // insert to tree and list
+    ASSERT_EXECUTE(BAVL_Insert(&o->entries_tree, &e->tree_node, NULL))
+    LinkedList1_Append(&o->entries_list, &e->list_node);
+    o->size += size;
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Cache of DNS responses, keyed by the question.
+ */
+
+#ifndef BADVPN_UDPGW_DNSCACHE_H
+#define BADVPN_UDPGW_DNSCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <misc/dns_proto.h>
+#include <structure/BAVL.h>
+#include <structure/LinkedList1.h>
+#include <base/DebugObject.h>
+
+// largest response which is cached
+#define DNSCACHE_MAX_RESPONSE_SIZE 4096
+
+// responses are not cached for longer than this, in seconds
+#define DNSCACHE_MAX_TTL 3600
+
+// key is the lowercased question name followed by the type and class
+#define DNSCACHE_MAX_KEY_LEN DNS_QUESTION_KEY_MAX_LEN
+
+struct DnsCache_key {
+    const uint8_t *data;
+    int len;
+};
+
+/**
+ * Cache of DNS responses.
+ * Responses are stored under their question (name, type and class), and are
+ * returned for queries with the same question, with the query ID and the record
+ * TTLs adjusted. The response's OPT record is only returned to queries which have
+ * one too, and responses larger than the client accepts aren't returned. Entries expire after the smallest TTL in the response, and the
+ * least recently used entries are dropped to stay within the memory budget.
+ */
+typedef struct {
+    size_t max_size;
+    size_t size;
+    BAVL entries_tree;
+    LinkedList1 entries_list;
+    DebugObject d_obj;
+} DnsCache;
+
+/**
+ * Initializes the cache.
+ * 
+ * @param o the object
+ * @param max_size memory budget in bytes, including bookkeeping
+ */
+void DnsCache_Init (DnsCache *o, size_t max_size);
+
+/**
+ * Frees the cache.
+ * 
+ * @param o the object
+ */
+void DnsCache_Free (DnsCache *o);
+
+/**
+ * Looks for a cached response to a query, and writes it out if found.
+ * 
+ * @param o the object
+ * @param query the query message
+ * @param query_len length of the query. Must be >=0.
+ * @param out where to write the response. Must have space for
+ *            DNSCACHE_MAX_RESPONSE_SIZE bytes.
+ * @return length of the response written, or -1 if there is none
+ */
+int DnsCache_Answer (DnsCache *o, const uint8_t *query, int query_len, uint8_t *out);
+
+/**
+ * Adds a response to the cache, if it is cacheable. Any existing response to the
+ * same question is replaced.
+ * 
+ * @param o the object
+ * @param response the response message
+ * @param response_len length of the response. Must be >=0.
+ */
+void DnsCache_Insert (DnsCache *o, const uint8_t *response, int response_len);
+
+#endif
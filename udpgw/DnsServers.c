@@ -0,0 +1,407 @@
+/*
+ * Copyright (C) Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Pool of upstream DNS servers from the resolver configuration, with health
+ * tracking and latency-based selection.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef BADVPN_USE_WINAPI
+#include <sys/stat.h>
+#endif
+
+#include <misc/memref.h>
+#include <misc/ipaddr.h>
+#include <misc/ipaddr6.h>
+#include <misc/byteorder.h>
+#include <misc/read_file.h>
+#include <misc/string_begins_with.h>
+#include <base/BLog.h>
+
+#include <udpgw/DnsServers.h>
+
+#include <generated/blog_channel_DnsServers.h>
+
+#define DNS_PORT 53
+
+static void check_timer_handler (DnsServers *o);
+static int file_changed (DnsServers *o);
+static void load_config (DnsServers *o);
+static int parse_config (const uint8_t *data, size_t len, struct DnsServers_server *servers);
+static int parse_server_addr (MemRef str, BAddr *out_addr);
+static struct DnsServers_server * find_server (DnsServers *o, BAddr addr);
+static int server_is_up (struct DnsServers_server *s, btime_t now);
+static void log_servers (DnsServers *o);
+
+static void check_timer_handler (DnsServers *o)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    // reload the configuration if the file changed
+    if (file_changed(o)) {
+        load_config(o);
+    }
+    
+    // check again later
+    BReactor_SetTimer(o->reactor, &o->check_timer);
+}
+
+static int file_changed (DnsServers *o)
+{
+#ifndef BADVPN_USE_WINAPI
+    struct stat st;
+    int have_file_id = (stat(o->path, &st) == 0);
+    
+    if (have_file_id == o->have_file_id && (!have_file_id || (
+        o->file_dev == st.st_dev && o->file_ino == st.st_ino &&
+        o->file_mtime == st.st_mtime && o->file_size == st.st_size
+    ))) {
+        return 0;
+    }
+    
+    o->have_file_id = have_file_id;
+    if (have_file_id) {
+        o->file_dev = st.st_dev;
+        o->file_ino = st.st_ino;
+        o->file_mtime = st.st_mtime;
+        o->file_size = st.st_size;
+    }
+    
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+static void load_config (DnsServers *o)
+{
+    struct DnsServers_server servers[DNSSERVERS_MAX_SERVERS];
+    int num_servers = 0;
+    
+    // read servers from the file
+    uint8_t *data;
+    size_t len;
+    if (read_file(o->path, &data, &len)) {
+        num_servers = parse_config(data, len, servers);
+        free(data);
+    } else {
+        BLog(BLOG_WARNING, "failed to read %s", o->path);
+    }
+    
+    // with no servers, use the local one like the system resolver
+    if (num_servers == 0) {
+        BAddr_InitIPv4(&servers[0].addr, hton32(UINT32_C(0x7f000001)), hton16(DNS_PORT));
+        num_servers = 1;
+    }
+    
+    // keep what we know about servers which were already there
+    for (int i = 0; i < num_servers; i++) {
+        struct DnsServers_server *old = find_server(o, servers[i].addr);
+        if (old) {
+            servers[i] = *old;
+        } else {
+            servers[i].have_rtt = 0;
+            servers[i].srtt8 = 0;
+            servers[i].num_failures = 0;
+            servers[i].down_until = 0;
+            servers[i].last_chosen = 0;
+        }
+    }
+    
+    // check if anything changed
+    int changed = (num_servers != o->num_servers);
+    for (int i = 0; !changed && i < num_servers; i++) {
+        changed = !BAddr_Compare(&servers[i].addr, &o->servers[i].addr);
+    }
+    
+    memcpy(o->servers, servers, num_servers * sizeof(servers[0]));
+    o->num_servers = num_servers;
+    
+    if (changed) {
+        log_servers(o);
+    }
+}
+
+static int parse_config (const uint8_t *data, size_t len, struct DnsServers_server *servers)
+{
+    int num_servers = 0;
+    MemRef rest = MemRef_Make((const char *)data, len);
+    
+    while (rest.len > 0) {
+        // cut off the next line
+        MemRef line = rest;
+        size_t nl_pos;
+        if (MemRef_FindChar(rest, '\n', &nl_pos)) {
+            line = MemRef_SubTo(rest, nl_pos);
+            rest = MemRef_SubFrom(rest, nl_pos + 1);
+        } else {
+            rest = MemRef_SubFrom(rest, rest.len);
+        }
+        
+        // look for "nameserver <address>"
+        size_t kw_len = data_begins_with(line.ptr, line.len, "nameserver");
+        if (kw_len == 0 || kw_len == line.len || (line.ptr[kw_len] != ' ' && line.ptr[kw_len] != '\t')) {
+            continue;
+        }
+        
+        // skip whitespace before the address
+        size_t start = kw_len;
+        while (start < line.len && (line.ptr[start] == ' ' || line.ptr[start] == '\t')) {
+            start++;
+        }
+        
+        // the address ends at whitespace or a comment
+        size_t end = start;
+        while (end < line.len && line.ptr[end] != ' ' && line.ptr[end] != '\t' && line.ptr[end] != '\r' &&
+               line.ptr[end] != '#' && line.ptr[end] != ';') {
+            end++;
+        }
+        
+        MemRef addr_str = MemRef_Sub(line, start, end - start);
+        
+        BAddr addr;
+        if (!parse_server_addr(addr_str, &addr)) {
+            BLog(BLOG_WARNING, "ignoring name server %.*s", (int)addr_str.len, addr_str.ptr);
+            continue;
+        }
+        
+        if (num_servers == DNSSERVERS_MAX_SERVERS) {
+            BLog(BLOG_WARNING, "too many name servers, ignoring the rest");
+            break;
+        }
+        
+        servers[num_servers++].addr = addr;
+    }
+    
+    return num_servers;
+}
+
+static int parse_server_addr (MemRef str, BAddr *out_addr)
+{
+    uint32_t addr4;
+    if (ipaddr_parse_ipv4_addr(str, &addr4)) {
+        BAddr_InitIPv4(out_addr, addr4, hton16(DNS_PORT));
+        return 1;
+    }
+    
+    struct ipv6_addr addr6;
+    if (ipaddr6_parse_ipv6_addr(str, &addr6)) {
+        BAddr_InitIPv6(out_addr, addr6.bytes, hton16(DNS_PORT));
+        return 1;
+    }
+    
+    return 0;
+}
+
+static struct DnsServers_server * find_server (DnsServers *o, BAddr addr)
+{
+    for (int i = 0; i < o->num_servers; i++) {
+        if (BAddr_Compare(&o->servers[i].addr, &addr)) {
+            return &o->servers[i];
+        }
+    }
+    
+    return NULL;
+}
+
+static int server_is_up (struct DnsServers_server *s, btime_t now)
+{
+    return (s->num_failures < DNSSERVERS_MAX_FAILURES || now >= s->down_until);
+}
+
+static void log_servers (DnsServers *o)
+{
+    char str[DNSSERVERS_MAX_SERVERS * (BADDR_MAX_PRINT_LEN + 1)];
+    size_t pos = 0;
+    
+    for (int i = 0; i < o->num_servers; i++) {
+        if (i > 0) {
+            str[pos++] = ' ';
+        }
+        BAddr_Print(&o->servers[i].addr, str + pos);
+        pos += strlen(str + pos);
+    }
+    str[pos] = '\0';
+    
+    BLog(BLOG_INFO, "using DNS servers: %s", str);
+}
+
+void DnsServers_Init (DnsServers *o, BReactor *reactor, const char *path)
+{
+    ASSERT(path)
+    
+    // init arguments
+    o->reactor = reactor;
+    o->path = path;
+    
+    // no servers yet
+    o->num_servers = 0;
+    
+    // init check timer
+    BTimer_Init(&o->check_timer, DNSSERVERS_CHECK_INTERVAL, (BTimer_handler)check_timer_handler, o);
+    
+#ifndef BADVPN_USE_WINAPI
+    // load configuration
+    o->have_file_id = 0;
+    file_changed(o);
+    load_config(o);
+    
+    // start checking for changes
+    BReactor_SetTimer(o->reactor, &o->check_timer);
+#endif
+    
+    DebugObject_Init(&o->d_obj);
+}
+
+void DnsServers_Free (DnsServers *o)
+{
+    DebugObject_Free(&o->d_obj);
+    
+    // free check timer
+    BReactor_RemoveTimer(o->reactor, &o->check_timer);
+}
+
+int DnsServers_Select (DnsServers *o, BAddr *out_addr)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    if (o->num_servers == 0) {
+        return 0;
+    }
+    
+    btime_t now = btime_gettime();
+    
+    // choose the fastest server which is up, preferring ones which haven't been
+    // measured, or not recently; if all are down, choose the one which comes back first
+    struct DnsServers_server *best = NULL;
+    for (int i = 0; i < o->num_servers; i++) {
+        struct DnsServers_server *s = &o->servers[i];
+        if (!server_is_up(s, now)) {
+            continue;
+        }
+        if (!s->have_rtt || now - s->last_chosen >= DNSSERVERS_PROBE_INTERVAL) {
+            best = s;
+            break;
+        }
+        if (!best || s->srtt8 < best->srtt8) {
+            best = s;
+        }
+    }
+    
+    if (!best) {
+        best = &o->servers[0];
+        for (int i = 1; i < o->num_servers; i++) {
+            if (o->servers[i].down_until < best->down_until) {
+                best = &o->servers[i];
+            }
+        }
+    }
+    
+    best->last_chosen = now;
+    
+    *out_addr = best->addr;
+    return 1;
+}
+
+int DnsServers_IsUsable (DnsServers *o, BAddr addr)
+{
+    DebugObject_Access(&o->d_obj);
+    
+    struct DnsServers_server *s = find_server(o, addr);
+    
+    return (s && server_is_up(s, btime_gettime()));
+}
+
+void DnsServers_ReportAnswer (DnsServers *o, BAddr addr, btime_t rtt)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(rtt >= 0)
+    
+    struct DnsServers_server *s = find_server(o, addr);
+    if (!s) {
+        return;
+    }
+    
+    if (s->num_failures >= DNSSERVERS_MAX_FAILURES) {
+        char str[BADDR_MAX_PRINT_LEN];
+        BAddr_Print(&s->addr, str);
+        BLog(BLOG_NOTICE, "DNS server %s is up", str);
+    }
+    
+    // update the smoothed response time, in eighths of a millisecond
+    if (!s->have_rtt) {
+        s->srtt8 = 8 * rtt;
+        s->have_rtt = 1;
+    } else {
+        s->srtt8 += rtt - s->srtt8 / 8;
+    }
+    
+    s->num_failures = 0;
+}
+
+void DnsServers_ReportFailure (DnsServers *o, BAddr addr, btime_t timeout)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(timeout >= 0)
+    
+    struct DnsServers_server *s = find_server(o, addr);
+    if (!s) {
+        return;
+    }
+    
+    // count the failure as a slow answer
+    if (!s->have_rtt) {
+        s->srtt8 = 8 * timeout;
+        s->have_rtt = 1;
+    } else {
+        s->srtt8 += timeout - s->srtt8 / 8;
+    }
+    
+    // failures of queries sent before the server went down don't count
+    btime_t now = btime_gettime();
+    if (!server_is_up(s, now)) {
+        return;
+    }
+    
+    s->num_failures++;
+    
+    // after enough failures, avoid the server for a while
+    if (s->num_failures >= DNSSERVERS_MAX_FAILURES) {
+        btime_t down_time = DNSSERVERS_MAX_DOWN_TIME;
+        int shift = s->num_failures - DNSSERVERS_MAX_FAILURES;
+        if (shift < 8 && (DNSSERVERS_DOWN_TIME << shift) < DNSSERVERS_MAX_DOWN_TIME) {
+            down_time = DNSSERVERS_DOWN_TIME << shift;
+        }
+        s->down_until = btime_add(now, down_time);
+        
+        char str[BADDR_MAX_PRINT_LEN];
+        BAddr_Print(&s->addr, str);
+        BLog(BLOG_WARNING, "DNS server %s is down for %d ms", str, (int)down_time);
+    }
+}
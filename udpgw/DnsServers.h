@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) Ambroz Bizjak <ambrop7@gmail.com>
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @section DESCRIPTION
+ * 
+ * Pool of upstream DNS servers from the resolver configuration, with health
+ * tracking and latency-based selection.
+ */
+
+#ifndef BADVPN_UDPGW_DNSSERVERS_H
+#define BADVPN_UDPGW_DNSSERVERS_H
+
+#include <stdint.h>
+
+#include <misc/debug.h>
+#include <system/BAddr.h>
+#include <system/BTime.h>
+#include <system/BReactor.h>
+#include <base/DebugObject.h>
+
+// maximum number of servers used from the configuration
+#define DNSSERVERS_MAX_SERVERS 8
+
+// how often the configuration file is checked for changes, in milliseconds
+#define DNSSERVERS_CHECK_INTERVAL 2000
+
+// number of consecutive failures after which a server is considered down
+#define DNSSERVERS_MAX_FAILURES 3
+
+// how long a server is avoided after going down, in milliseconds; doubled
+// with each further failure, up to the maximum
+#define DNSSERVERS_DOWN_TIME 5000
+#define DNSSERVERS_MAX_DOWN_TIME 60000
+
+// a server which hasn't been chosen for this long, in milliseconds, gets the
+// next query, so that its response time is measured again
+#define DNSSERVERS_PROBE_INTERVAL 10000
+
+struct DnsServers_server {
+    BAddr addr;
+    int have_rtt;
+    btime_t srtt8;
+    int num_failures;
+    btime_t down_until;
+    btime_t last_chosen;
+};
+
+/**
+ * Pool of upstream DNS servers.
+ * The servers are read from a resolv.conf style file, which is reloaded when
+ * it changes. The user reports answers and failures of queries sent to the
+ * servers, and queries are directed to the server with the lowest smoothed
+ * response time which is not down. Servers whose response time is unknown,
+ * or which haven't been chosen for DNSSERVERS_PROBE_INTERVAL, are preferred
+ * so that each server gets measured, and measured again now and then.
+ */
+typedef struct {
+    BReactor *reactor;
+    const char *path;
+    BTimer check_timer;
+    int have_file_id;
+    uint64_t file_dev;
+    uint64_t file_ino;
+    int64_t file_mtime;
+    int64_t file_size;
+    struct DnsServers_server servers[DNSSERVERS_MAX_SERVERS];
+    int num_servers;
+    DebugObject d_obj;
+} DnsServers;
+
+/**
+ * Initializes the pool and loads the configuration.
+ * If the configuration has no servers, the local server (127.0.0.1) is used,
+ * like the system resolver does. On Windows, there is no configuration and
+ * the pool stays empty.
+ * 
+ * @param o the object
+ * @param reactor reactor we live in
+ * @param path path to the configuration file. Must remain valid until the
+ *             object is freed.
+ */
+void DnsServers_Init (DnsServers *o, BReactor *reactor, const char *path);
+
+/**
+ * Frees the pool.
+ * 
+ * @param o the object
+ */
+void DnsServers_Free (DnsServers *o);
+
+/**
+ * Chooses the server to send a new query to.
+ * 
+ * @param o the object
+ * @param out_addr the address of the server is returned here
+ * @return 1 on success, 0 if there are no servers
+ */
+int DnsServers_Select (DnsServers *o, BAddr *out_addr);
+
+/**
+ * Checks whether queries can still be sent to a server previously returned
+ * by {@link DnsServers_Select}, i.e. whether it is still configured and not down.
+ * 
+ * @param o the object
+ * @param addr address of the server
+ * @return 1 if the server is usable, 0 if not
+ */
+int DnsServers_IsUsable (DnsServers *o, BAddr addr);
+
+/**
+ * Reports that a server answered a query.
+ * Servers which are no longer configured are ignored.
+ * 
+ * @param o the object
+ * @param addr address of the server
+ * @param rtt time between sending the query and receiving the answer,
+ *            in milliseconds. Must be >=0.
+ */
+void DnsServers_ReportAnswer (DnsServers *o, BAddr addr, btime_t rtt);
+
+/**
+ * Reports that a server did not answer a query, because the query timed out
+ * or was rejected.
+ * Servers which are no longer configured are ignored.
+ * 
+ * @param o the object
+ * @param addr address of the server
+ * @param timeout counted as the response time of the server, in milliseconds.
+ *                Must be >=0.
+ */
+void DnsServers_ReportFailure (DnsServers *o, BAddr addr, btime_t timeout);
+
+#endif
@@ -47,6 +47,7 @@
 #include <structure/LinkedList1.h>
 #include <structure/BAVL.h>
 #include <base/BLog.h>
+#include <base/BMutex.h>
 #include <system/BReactor.h>
 #include <system/BNetwork.h>
 #include <system/BConnection.h>
@@ -59,21 +60,50 @@
 #include <flow/SinglePacketBuffer.h>
 
 #ifndef BADVPN_USE_WINAPI
+#include <pthread.h>
 #include <base/BLog_syslog.h>
-#include <arpa/nameser.h>
-#include <resolv.h>
+#include <system/BThreadSignal.h>
 #endif
 
 #include <udpgw/udpgw.h>
+#include <udpgw/DnsCache.h>
+#include <udpgw/DnsServers.h>
 
 #include <generated/blog_channel_udpgw.h>
 
 #define LOGGER_STDOUT 1
 #define LOGGER_SYSLOG 2
 
-#define DNS_UPDATE_TIME 2000
+struct worker;
+
+struct listener {
+    struct worker *worker;
+    BListener listener;
+};
+
+struct worker {
+    int index;
+    BReactor reactor;
+    #ifndef BADVPN_USE_WINAPI
+    BThreadSignal quit_signal;
+    pthread_t thread;
+    #endif
+    struct listener listeners[MAX_LISTEN_ADDRS];
+    int num_listeners;
+    LinkedList1 clients_list;
+    int local_udp_port_start;
+    int local_udp_num_ports;
+    int local_udp_ip6_port_start;
+    int local_udp_ip6_num_ports;
+    BAVL port_groups_tree;
+    DnsServers dns_servers;
+    LinkedList1 dns_pending_list;
+    BTimer dns_timeout_timer;
+    DnsCache dns_cache;
+};
 
 struct client {
+    struct worker *worker;
     BConnection con;
     BAddr addr;
     BTimer disconnect_timer;
@@ -81,6 +111,9 @@ struct client {
     PacketPassInterface recv_if;
     PacketPassFairQueue send_queue;
     PacketStreamSender send_sender;
+    BufferWriter *dns_send_if;
+    PacketProtoFlow dns_send_ppflow;
+    PacketPassFairQueueFlow dns_send_qflow;
     BAVL connections_tree;
     LinkedList1 connections_list;
     int num_connections;
@@ -88,11 +121,27 @@ struct client {
     LinkedList1Node clients_list_node;
 };
 
+struct port_group {
+    BAddr key;
+    int num_ports;
+    int first_free;
+    LinkedList1 connections_list;
+    BAVLNode tree_node;
+    uint8_t port_used[];
+};
+
+struct dns_query {
+    uint16_t id;
+    int key_len;
+    uint8_t key[DNS_QUESTION_KEY_MAX_LEN];
+};
+
 struct connection {
     struct client *client;
     uint16_t conid;
     BAddr addr;
     BAddr orig_addr;
+    int dns;
     const uint8_t *first_data;
     int first_data_len;
     btime_t last_use_time;
@@ -105,12 +154,19 @@ struct connection {
         struct {
             BDatagram udp_dgram;
             int local_port_index;
+            struct port_group *port_group;
+            LinkedList1Node port_group_list_node;
             BufferWriter udp_send_writer;
             PacketBuffer udp_send_buffer;
             SinglePacketBuffer udp_recv_buffer;
             PacketPassInterface udp_recv_if;
             BAVLNode connections_tree_node;
             LinkedList1Node connections_list_node;
+            int dns_pending;
+            btime_t dns_query_time;
+            LinkedList1Node dns_pending_list_node;
+            struct dns_query *dns_queries;
+            int dns_queries_next;
         };
         struct {
             LinkedList1Node closing_connections_list_node;
@@ -140,6 +196,9 @@ struct {
     int local_udp_ip6_num_ports;
     char *local_udp_ip6_addr;
     int unique_local_ports;
+    int num_threads;
+    int dns_cache_size;
+    char *resolv_conf;
 } options;
 
 // MTUs
@@ -156,19 +215,16 @@ BAddr local_udp_addr;
 // local UDP/IPv6 port range, if options.local_udp_ip6_num_ports>=0
 BAddr local_udp_ip6_addr;
 
-// DNS forwarding
-BAddr dns_addr;
-btime_t last_dns_update_time;
+// workers; each has its own reactor, listeners, clients, share of the
+// local UDP ports, and local ports in use grouped by remote address (or
+// IP address with unique_local_ports) with each group listing its
+// connections least recently used first. The first worker runs in the
+// main thread, others in their own threads.
+struct worker *workers;
+int num_workers;
 
-// reactor
-BReactor ss;
-
-// listeners
-BListener listeners[MAX_LISTEN_ADDRS];
-int num_listeners;
-
-// clients
-LinkedList1 clients_list;
+// number of clients of all workers
+BMutex num_clients_mutex;
 int num_clients;
 
 static void print_help (const char *name);
@@ -176,7 +232,13 @@ static void print_version (void);
 static int parse_arguments (int argc, char *argv[]);
 static int process_arguments (void);
 static void signal_handler (void *unused);
-static void listener_handler (BListener *listener);
+static int worker_init (struct worker *w, int index);
+static void worker_free (struct worker *w);
+#ifndef BADVPN_USE_WINAPI
+static void * worker_thread (void *arg);
+static void worker_quit_signal_handler (BThreadSignal *quit_signal);
+#endif
+static void listener_handler (struct listener *listener);
 static void client_free (struct client *client);
 static void client_logfunc (struct client *client);
 static void client_log (struct client *client, int level, const char *fmt, ...);
@@ -184,10 +246,18 @@ static void client_disconnect_timer_handler (struct client *client);
 static void client_connection_handler (struct client *client, int event);
 static void client_decoder_handler_error (struct client *client);
 static void client_recv_if_handler_send (struct client *client, uint8_t *data, int data_len);
-static int get_local_num_ports (int addr_type);
-static BAddr get_local_addr (int addr_type);
-static uint8_t * build_port_usage_array_and_find_least_used_connection (BAddr remote_addr, struct connection **out_con);
-static void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr orig_addr, const uint8_t *data, int data_len);
+static int client_answer_dns_from_cache (struct client *client, uint16_t conid, BAddr orig_addr, const uint8_t *data, int data_len);
+static int write_client_header (uint8_t *out, uint8_t flags, uint16_t conid, BAddr orig_addr);
+static int get_local_num_ports (struct worker *w, int addr_type);
+static BAddr get_local_addr (struct worker *w, int addr_type);
+static BAddr port_group_key (BAddr remote_addr);
+static struct port_group * port_group_get (struct worker *w, BAddr remote_addr);
+static void port_group_maybe_free (struct worker *w, struct port_group *group);
+static void port_group_add (struct port_group *group, struct connection *con, int port_index);
+static void port_group_remove (struct connection *con);
+static void port_group_touch (struct connection *con);
+static struct connection * port_group_find_idle (struct port_group *group);
+static void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr orig_addr, int dns, const uint8_t *data, int data_len);
 static void connection_free (struct connection *con);
 static void connection_logfunc (struct connection *con);
 static void connection_log (struct connection *con, int level, const char *fmt, ...);
@@ -201,7 +271,14 @@ static void connection_dgram_handler_event (struct connection *con, int event);
 static void connection_udp_recv_if_handler_send (struct connection *con, uint8_t *data, int data_len);
 static struct connection * find_connection (struct client *client, uint16_t conid);
 static int uint16_comparator (void *unused, uint16_t *v1, uint16_t *v2);
-static void maybe_update_dns (void);
+static int addr_comparator (void *unused, BAddr *v1, BAddr *v2);
+static void connection_dns_query_sent (struct connection *con);
+static void connection_dns_answer_received (struct connection *con);
+static void connection_dns_pending_remove (struct connection *con);
+static void connection_dns_add_query (struct connection *con, const uint8_t *data, int data_len);
+static int connection_dns_take_query (struct connection *con, const uint8_t *data, int data_len);
+static int connection_dns_from_server (struct connection *con);
+static void worker_dns_timeout_timer_handler (struct worker *w);
 
 int main (int argc, char **argv)
 {
@@ -281,57 +358,73 @@ int main (int argc, char **argv)
     // init time
     BTime_Init();
     
-    // init DNS forwarding
-    BAddr_InitNone(&dns_addr);
-    last_dns_update_time = INT64_MIN;
-    maybe_update_dns();
-    
-    // init reactor
-    if (!BReactor_Init(&ss)) {
-        BLog(BLOG_ERROR, "BReactor_Init failed");
+    // init number of clients
+    if (!BMutex_Init(&num_clients_mutex)) {
+        BLog(BLOG_ERROR, "BMutex_Init failed");
         goto fail1;
     }
+    num_clients = 0;
     
-    // setup signal handler
-    if (!BSignal_Init(&ss, signal_handler, NULL)) {
-        BLog(BLOG_ERROR, "BSignal_Init failed");
+    // allocate workers
+    if (!(workers = (struct worker *)BAllocArray(options.num_threads, sizeof(workers[0])))) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
         goto fail2;
     }
     
-    // initialize listeners
-    num_listeners = 0;
-    while (num_listeners < num_listen_addrs) {
-        if (!BListener_Init(&listeners[num_listeners], listen_addrs[num_listeners], &ss, &listeners[num_listeners], (BListener_handler)listener_handler)) {
-            BLog(BLOG_ERROR, "Listener_Init failed");
+    // init workers
+    num_workers = 0;
+    while (num_workers < options.num_threads) {
+        if (!worker_init(&workers[num_workers], num_workers)) {
+            BLog(BLOG_ERROR, "worker_init failed");
             goto fail3;
         }
-        num_listeners++;
+        num_workers++;
     }
     
-    // init clients list
-    LinkedList1_Init(&clients_list);
-    num_clients = 0;
+    // setup signal handler, in the reactor of the first worker
+    if (!BSignal_Init(&workers[0].reactor, signal_handler, NULL)) {
+        BLog(BLOG_ERROR, "BSignal_Init failed");
+        goto fail3;
+    }
+    
+    #ifndef BADVPN_USE_WINAPI
+    // start threads of the other workers; they inherit the signal mask
+    // set up by BSignal_Init so signals are only handled here
+    int num_started = 1;
+    while (num_started < num_workers) {
+        if (pthread_create(&workers[num_started].thread, NULL, worker_thread, &workers[num_started]) != 0) {
+            BLog(BLOG_ERROR, "pthread_create failed");
+            goto fail4;
+        }
+        num_started++;
+    }
+    #endif
     
     // enter event loop
     BLog(BLOG_NOTICE, "entering event loop");
-    BReactor_Exec(&ss);
+    BReactor_Exec(&workers[0].reactor);
     
-    // free clients
-    while (!LinkedList1_IsEmpty(&clients_list)) {
-        struct client *client = UPPER_OBJECT(LinkedList1_GetFirst(&clients_list), struct client, clients_list_node);
-        client_free(client);
-    }
-fail3:
-    // free listeners
-    while (num_listeners > 0) {
-        num_listeners--;
-        BListener_Free(&listeners[num_listeners]);
+    #ifndef BADVPN_USE_WINAPI
+fail4:
+    // stop the other workers
+    for (int i = 1; i < num_started; i++) {
+        BThreadSignal_Thread_Signal(&workers[i].quit_signal);
+        ASSERT_FORCE(pthread_join(workers[i].thread, NULL) == 0)
     }
+    #endif
+    
     // finish signal handling
     BSignal_Finish();
+fail3:
+    // free workers
+    while (num_workers > 0) {
+        num_workers--;
+        worker_free(&workers[num_workers]);
+    }
+    BFree(workers);
 fail2:
-    // free reactor
-    BReactor_Free(&ss);
+    ASSERT(num_clients == 0)
+    BMutex_Free(&num_clients_mutex);
 fail1:
     // free logger
     BLog(BLOG_NOTICE, "exiting");
@@ -367,6 +460,11 @@ void print_help (const char *name)
         "        [--local-udp-addrs <addr> <num_ports>]\n"
         "        [--local-udp-ip6-addrs <addr> <num_ports>]\n"
         "        [--unique-local-ports]\n"
+        #ifndef BADVPN_USE_WINAPI
+        "        [--threads <number>]\n"
+        #endif
+        "        [--dns-cache-size <bytes / 0>]\n"
+        "        [--resolv-conf <file>]\n"
         "Address format is a.b.c.d:port (IPv4) or [addr]:port (IPv6).\n",
         name
     );
@@ -402,6 +500,9 @@ int parse_arguments (int argc, char *argv[])
     options.local_udp_num_ports = -1;
     options.local_udp_ip6_num_ports = -1;
     options.unique_local_ports = 0;
+    options.num_threads = 1;
+    options.dns_cache_size = DEFAULT_DNS_CACHE_SIZE;
+    options.resolv_conf = DEFAULT_RESOLV_CONF;
     
     int i;
     for (i = 1; i < argc; i++) {
@@ -563,6 +664,38 @@ int parse_arguments (int argc, char *argv[])
         else if (!strcmp(arg, "--unique-local-ports")) {
             options.unique_local_ports = 1;
         }
+        #ifndef BADVPN_USE_WINAPI
+        else if (!strcmp(arg, "--threads")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.num_threads = atoi(argv[i + 1])) <= 0 || options.num_threads > MAX_THREADS) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        #endif
+        else if (!strcmp(arg, "--dns-cache-size")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            if ((options.dns_cache_size = atoi(argv[i + 1])) < 0) {
+                fprintf(stderr, "%s: wrong argument\n", arg);
+                return 0;
+            }
+            i++;
+        }
+        else if (!strcmp(arg, "--resolv-conf")) {
+            if (1 >= argc - i) {
+                fprintf(stderr, "%s: requires an argument\n", arg);
+                return 0;
+            }
+            options.resolv_conf = argv[i + 1];
+            i++;
+        }
         else {
             fprintf(stderr, "unknown option: %s\n", arg);
             return 0;
@@ -598,6 +731,10 @@ int process_arguments (void)
             BLog(BLOG_ERROR, "local udp addr: must be an IPv4 address");
             return 0;
         }
+        if (options.num_threads > 1 && options.local_udp_num_ports < options.num_threads) {
+            BLog(BLOG_ERROR, "local udp addr: each thread needs at least one port");
+            return 0;
+        }
     }
     
     // resolve local UDP/IPv6 address
@@ -610,6 +747,10 @@ int process_arguments (void)
             BLog(BLOG_ERROR, "local udp ip6 addr: must be an IPv6 address");
             return 0;
         }
+        if (options.num_threads > 1 && options.local_udp_ip6_num_ports < options.num_threads) {
+            BLog(BLOG_ERROR, "local udp ip6 addr: each thread needs at least one port");
+            return 0;
+        }
     }
     
     return 1;
@@ -619,13 +760,162 @@ void signal_handler (void *unused)
 {
     BLog(BLOG_NOTICE, "termination requested");
     
+    // exit event loop; the other workers are stopped after it returns
+    BReactor_Quit(&workers[0].reactor, 1);
+}
+
+int worker_init (struct worker *w, int index)
+{
+    w->index = index;
+    
+    // init reactor
+    if (!BReactor_Init(&w->reactor)) {
+        BLog(BLOG_ERROR, "BReactor_Init failed");
+        goto fail0;
+    }
+    
+    #ifndef BADVPN_USE_WINAPI
+    // init quit signal
+    if (!BThreadSignal_Init(&w->quit_signal, &w->reactor, worker_quit_signal_handler)) {
+        BLog(BLOG_ERROR, "BThreadSignal_Init failed");
+        goto fail1;
+    }
+    #endif
+    
+    // initialize listeners; with multiple workers, each one listens on
+    // its own socket and the kernel spreads connections among them
+    w->num_listeners = 0;
+    while (w->num_listeners < num_listen_addrs) {
+        struct listener *l = &w->listeners[w->num_listeners];
+        l->worker = w;
+        
+        struct BLisCon_from from = BLisCon_from_addr(listen_addrs[w->num_listeners]);
+        #ifndef BADVPN_USE_WINAPI
+        if (options.num_threads > 1) {
+            from = BLisCon_from_addr_reuse_port(listen_addrs[w->num_listeners]);
+        }
+        #endif
+        
+        if (!BListener_InitFrom(&l->listener, from, &w->reactor, l, (BListener_handler)listener_handler)) {
+            BLog(BLOG_ERROR, "Listener_Init failed");
+            goto fail2;
+        }
+        w->num_listeners++;
+    }
+    
+    // take a share of the local UDP port ranges, so that workers never
+    // use the same local port for the same remote address
+    w->local_udp_num_ports = -1;
+    if (options.local_udp_num_ports >= 0) {
+        w->local_udp_port_start = (int)((int64_t)options.local_udp_num_ports * index / options.num_threads);
+        w->local_udp_num_ports = (int)((int64_t)options.local_udp_num_ports * (index + 1) / options.num_threads) - w->local_udp_port_start;
+    }
+    w->local_udp_ip6_num_ports = -1;
+    if (options.local_udp_ip6_num_ports >= 0) {
+        w->local_udp_ip6_port_start = (int)((int64_t)options.local_udp_ip6_num_ports * index / options.num_threads);
+        w->local_udp_ip6_num_ports = (int)((int64_t)options.local_udp_ip6_num_ports * (index + 1) / options.num_threads) - w->local_udp_ip6_port_start;
+    }
+    
+    // init clients list
+    LinkedList1_Init(&w->clients_list);
+    
+    // init port groups tree
+    BAVL_Init(&w->port_groups_tree, OFFSET_DIFF(struct port_group, key, tree_node), (BAVL_comparator)addr_comparator, NULL);
+    
+    // init DNS servers
+    DnsServers_Init(&w->dns_servers, &w->reactor, options.resolv_conf);
+    
+    // init list of unanswered DNS queries and their timer
+    LinkedList1_Init(&w->dns_pending_list);
+    BTimer_Init(&w->dns_timeout_timer, 0, (BTimer_handler)worker_dns_timeout_timer_handler, w);
+    
+    // init DNS cache
+    DnsCache_Init(&w->dns_cache, options.dns_cache_size);
+    
+    return 1;
+    
+fail2:
+    while (w->num_listeners > 0) {
+        w->num_listeners--;
+        BListener_Free(&w->listeners[w->num_listeners].listener);
+    }
+    #ifndef BADVPN_USE_WINAPI
+    BThreadSignal_Free(&w->quit_signal);
+fail1:
+    #endif
+    BReactor_Free(&w->reactor);
+fail0:
+    return 0;
+}
+
+void worker_free (struct worker *w)
+{
+    // free clients
+    while (!LinkedList1_IsEmpty(&w->clients_list)) {
+        struct client *client = UPPER_OBJECT(LinkedList1_GetFirst(&w->clients_list), struct client, clients_list_node);
+        client_free(client);
+    }
+    ASSERT(BAVL_IsEmpty(&w->port_groups_tree))
+    
+    // free DNS cache
+    DnsCache_Free(&w->dns_cache);
+    
+    // free DNS timeout timer
+    ASSERT(LinkedList1_IsEmpty(&w->dns_pending_list))
+    BReactor_RemoveTimer(&w->reactor, &w->dns_timeout_timer);
+    
+    // free DNS servers
+    DnsServers_Free(&w->dns_servers);
+    
+    // free listeners
+    while (w->num_listeners > 0) {
+        w->num_listeners--;
+        BListener_Free(&w->listeners[w->num_listeners].listener);
+    }
+    
+    #ifndef BADVPN_USE_WINAPI
+    // free quit signal
+    BThreadSignal_Free(&w->quit_signal);
+    #endif
+    
+    // free reactor
+    BReactor_Free(&w->reactor);
+}
+
+#ifndef BADVPN_USE_WINAPI
+
+void * worker_thread (void *arg)
+{
+    struct worker *w = (struct worker *)arg;
+    
+    BReactor_Exec(&w->reactor);
+    
+    return NULL;
+}
+
+void worker_quit_signal_handler (BThreadSignal *quit_signal)
+{
+    struct worker *w = UPPER_OBJECT(quit_signal, struct worker, quit_signal);
+    
     // exit event loop
-    BReactor_Quit(&ss, 1);
+    BReactor_Quit(&w->reactor, 0);
 }
 
-void listener_handler (BListener *listener)
+#endif
+
+void listener_handler (struct listener *listener)
 {
-    if (num_clients == options.max_clients) {
+    struct worker *w = listener->worker;
+    
+    // count the client against the limit for all workers
+    BMutex_Lock(&num_clients_mutex);
+    int limit_reached = (num_clients == options.max_clients);
+    if (!limit_reached) {
+        num_clients++;
+    }
+    BMutex_Unlock(&num_clients_mutex);
+    
+    if (limit_reached) {
         BLog(BLOG_ERROR, "maximum number of clients reached");
         goto fail0;
     }
@@ -634,13 +924,14 @@ void listener_handler (BListener *listener)
     struct client *client = (struct client *)malloc(sizeof(*client));
     if (!client) {
         BLog(BLOG_ERROR, "malloc failed");
-        goto fail0;
+        goto fail1;
     }
+    client->worker = w;
     
     // accept client
-    if (!BConnection_Init(&client->con, BConnection_source_listener(listener, &client->addr), &ss, client, (BConnection_handler)client_connection_handler)) {
+    if (!BConnection_Init(&client->con, BConnection_source_listener(&listener->listener, &client->addr), &w->reactor, client, (BConnection_handler)client_connection_handler)) {
         BLog(BLOG_ERROR, "BConnection_Init failed");
-        goto fail1;
+        goto fail2;
     }
     
     // limit socket send buffer, else our scheduling is pointless
@@ -656,27 +947,38 @@ void listener_handler (BListener *listener)
     
     // init disconnect timer
     BTimer_Init(&client->disconnect_timer, CLIENT_DISCONNECT_TIMEOUT, (BTimer_handler)client_disconnect_timer_handler, client);
-    BReactor_SetTimer(&ss, &client->disconnect_timer);
+    BReactor_SetTimer(&w->reactor, &client->disconnect_timer);
     
     // init recv interface
-    PacketPassInterface_Init(&client->recv_if, udpgw_mtu, (PacketPassInterface_handler_send)client_recv_if_handler_send, client, BReactor_PendingGroup(&ss));
+    PacketPassInterface_Init(&client->recv_if, udpgw_mtu, (PacketPassInterface_handler_send)client_recv_if_handler_send, client, BReactor_PendingGroup(&w->reactor));
     
     // init recv decoder
-    if (!PacketProtoDecoder_Init(&client->recv_decoder, BConnection_RecvAsync_GetIf(&client->con), &client->recv_if, BReactor_PendingGroup(&ss), client,
+    if (!PacketProtoDecoder_Init(&client->recv_decoder, BConnection_RecvAsync_GetIf(&client->con), &client->recv_if, BReactor_PendingGroup(&w->reactor), client,
         (PacketProtoDecoder_handler_error)client_decoder_handler_error
     )) {
         BLog(BLOG_ERROR, "PacketProtoDecoder_Init failed");
-        goto fail2;
+        goto fail3;
     }
     
     // init send sender
-    PacketStreamSender_Init(&client->send_sender, BConnection_SendAsync_GetIf(&client->con), pp_mtu, BReactor_PendingGroup(&ss));
+    PacketStreamSender_Init(&client->send_sender, BConnection_SendAsync_GetIf(&client->con), pp_mtu, BReactor_PendingGroup(&w->reactor));
     
     // init send queue
-    if (!PacketPassFairQueue_Init(&client->send_queue, PacketStreamSender_GetInput(&client->send_sender), BReactor_PendingGroup(&ss), 0, 1)) {
+    if (!PacketPassFairQueue_Init(&client->send_queue, PacketStreamSender_GetInput(&client->send_sender), BReactor_PendingGroup(&w->reactor), 0, 1)) {
         BLog(BLOG_ERROR, "PacketPassFairQueue_Init failed");
-        goto fail3;
+        goto fail4;
+    }
+    
+    // init DNS answers send queue flow
+    PacketPassFairQueueFlow_Init(&client->dns_send_qflow, &client->send_queue);
+    
+    // init DNS answers send PacketProtoFlow; answers are limited in size
+    int dns_mtu = sizeof(struct udpgw_header) + sizeof(struct udpgw_addr_ipv6) + DNSCACHE_MAX_RESPONSE_SIZE;
+    if (!PacketProtoFlow_Init(&client->dns_send_ppflow, dns_mtu, CLIENT_DNS_CACHE_BUFFER_SIZE, PacketPassFairQueueFlow_GetInput(&client->dns_send_qflow), BReactor_PendingGroup(&w->reactor))) {
+        BLog(BLOG_ERROR, "PacketProtoFlow_Init failed");
+        goto fail5;
     }
+    client->dns_send_if = PacketProtoFlow_GetInput(&client->dns_send_ppflow);
     
     // init connections tree
     BAVL_Init(&client->connections_tree, OFFSET_DIFF(struct connection, conid, connections_tree_node), (BAVL_comparator)uint16_comparator, NULL);
@@ -691,24 +993,30 @@ void listener_handler (BListener *listener)
     LinkedList1_Init(&client->closing_connections_list);
     
     // insert to clients list
-    LinkedList1_Append(&clients_list, &client->clients_list_node);
-    num_clients++;
+    LinkedList1_Append(&w->clients_list, &client->clients_list_node);
     
     client_log(client, BLOG_INFO, "connected");
     
     return;
     
-fail3:
+fail5:
+    PacketPassFairQueueFlow_Free(&client->dns_send_qflow);
+    PacketPassFairQueue_Free(&client->send_queue);
+fail4:
     PacketStreamSender_Free(&client->send_sender);
     PacketProtoDecoder_Free(&client->recv_decoder);
-fail2:
+fail3:
     PacketPassInterface_Free(&client->recv_if);
-    BReactor_RemoveTimer(&ss, &client->disconnect_timer);
+    BReactor_RemoveTimer(&w->reactor, &client->disconnect_timer);
     BConnection_RecvAsync_Free(&client->con);
     BConnection_SendAsync_Free(&client->con);
     BConnection_Free(&client->con);
-fail1:
+fail2:
     free(client);
+fail1:
+    BMutex_Lock(&num_clients_mutex);
+    num_clients--;
+    BMutex_Unlock(&num_clients_mutex);
 fail0:
     return;
 }
@@ -731,8 +1039,16 @@ void client_free (struct client *client)
     }
     
     // remove from clients list
-    LinkedList1_Remove(&clients_list, &client->clients_list_node);
+    LinkedList1_Remove(&client->worker->clients_list, &client->clients_list_node);
+    BMutex_Lock(&num_clients_mutex);
     num_clients--;
+    BMutex_Unlock(&num_clients_mutex);
+    
+    // free DNS answers send PacketProtoFlow
+    PacketProtoFlow_Free(&client->dns_send_ppflow);
+    
+    // free DNS answers send queue flow
+    PacketPassFairQueueFlow_Free(&client->dns_send_qflow);
     
     // free send queue
     PacketPassFairQueue_Free(&client->send_queue);
@@ -747,7 +1063,7 @@ void client_free (struct client *client)
     PacketPassInterface_Free(&client->recv_if);
     
     // free disconnect timer
-    BReactor_RemoveTimer(&ss, &client->disconnect_timer);
+    BReactor_RemoveTimer(&client->worker->reactor, &client->disconnect_timer);
     
     // free connection interfaces
     BConnection_RecvAsync_Free(&client->con);
@@ -825,7 +1141,7 @@ void client_recv_if_handler_send (struct client *client, uint8_t *data, int data
     uint16_t conid = ltoh16(header.conid);
     
     // reset disconnect timer
-    BReactor_SetTimer(&ss, &client->disconnect_timer);
+    BReactor_SetTimer(&client->worker->reactor, &client->disconnect_timer);
     
     // if this is keepalive, ignore any payload
     if ((flags & UDPGW_CLIENT_FLAG_KEEPALIVE)) {
@@ -863,12 +1179,19 @@ void client_recv_if_handler_send (struct client *client, uint8_t *data, int data
         return;
     }
     
+    // answer DNS from the cache if possible, without going through a connection
+    if ((flags & UDPGW_CLIENT_FLAG_DNS) && client_answer_dns_from_cache(client, conid, orig_addr, data, data_len)) {
+        return;
+    }
+    
     // find connection
     struct connection *con = find_connection(client, conid);
     ASSERT(!con || !con->closing)
     
-    // if connection exists, close it if needed
-    if (con && ((flags & UDPGW_CLIENT_FLAG_REBIND) || !BAddr_Compare(&con->orig_addr, &orig_addr))) {
+    // if connection exists, close it if needed; this includes DNS connections
+    // whose server went down, so that retries go to another server
+    if (con && ((flags & UDPGW_CLIENT_FLAG_REBIND) || !BAddr_Compare(&con->orig_addr, &orig_addr) ||
+        (con->dns && !DnsServers_IsUsable(&client->worker->dns_servers, con->addr)))) {
         connection_log(con, BLOG_DEBUG, "close old");
         connection_close(con);
         con = NULL;
@@ -885,105 +1208,246 @@ void client_recv_if_handler_send (struct client *client, uint8_t *data, int data
         
         // if this is DNS, replace actual address, but keep still remember the orig_addr
         BAddr addr = orig_addr;
+        int dns = 0;
         if ((flags & UDPGW_CLIENT_FLAG_DNS)) {
-            maybe_update_dns();
-            if (dns_addr.type == BADDR_TYPE_NONE) {
+            if (!DnsServers_Select(&client->worker->dns_servers, &addr)) {
                 client_log(client, BLOG_WARNING, "received DNS packet, but no DNS server available");
             } else {
                 client_log(client, BLOG_DEBUG, "received DNS");
-                addr = dns_addr;
+                dns = 1;
             }
         }
         
         // create new connection
-        connection_init(client, conid, addr, orig_addr, data, data_len);
+        connection_init(client, conid, addr, orig_addr, dns, data, data_len);
     } else {
         // submit packet to existing connection
         connection_send_to_udp(con, data, data_len);
     }
 }
 
-int get_local_num_ports (int addr_type)
+int client_answer_dns_from_cache (struct client *client, uint16_t conid, BAddr orig_addr, const uint8_t *data, int data_len)
+{
+    ASSERT(data_len >= 0)
+    
+    if (options.dns_cache_size == 0) {
+        return 0;
+    }
+    
+    // look for a cached response
+    uint8_t answer[DNSCACHE_MAX_RESPONSE_SIZE];
+    int answer_len = DnsCache_Answer(&client->worker->dns_cache, data, data_len, answer);
+    if (answer_len < 0) {
+        return 0;
+    }
+    
+    // get buffer location; if there is no space, let the query go to the server
+    uint8_t *out;
+    if (!BufferWriter_StartPacket(client->dns_send_if, &out)) {
+        client_log(client, BLOG_WARNING, "out of DNS cache buffer");
+        return 0;
+    }
+    
+    client_log(client, BLOG_DEBUG, "answered DNS from cache");
+    
+    // write header and address
+    int out_pos = write_client_header(out, 0, conid, orig_addr);
+    
+    // write answer
+    memcpy(out + out_pos, answer, answer_len);
+    out_pos += answer_len;
+    
+    // submit written message
+    BufferWriter_EndPacket(client->dns_send_if, out_pos);
+    
+    return 1;
+}
+
+int write_client_header (uint8_t *out, uint8_t flags, uint16_t conid, BAddr orig_addr)
+{
+    int out_pos = 0;
+    
+    if (orig_addr.type == BADDR_TYPE_IPV6) {
+        flags |= UDPGW_CLIENT_FLAG_IPV6;
+    }
+    
+    // write header
+    struct udpgw_header header;
+    header.flags = htol8(flags);
+    header.conid = htol16(conid);
+    memcpy(out + out_pos, &header, sizeof(header));
+    out_pos += sizeof(header);
+    
+    // write address
+    switch (orig_addr.type) {
+        case BADDR_TYPE_IPV4: {
+            struct udpgw_addr_ipv4 addr_ipv4;
+            addr_ipv4.addr_ip = orig_addr.ipv4.ip;
+            addr_ipv4.addr_port = orig_addr.ipv4.port;
+            memcpy(out + out_pos, &addr_ipv4, sizeof(addr_ipv4));
+            out_pos += sizeof(addr_ipv4);
+        } break;
+        case BADDR_TYPE_IPV6: {
+            struct udpgw_addr_ipv6 addr_ipv6;
+            memcpy(addr_ipv6.addr_ip, orig_addr.ipv6.ip, sizeof(addr_ipv6.addr_ip));
+            addr_ipv6.addr_port = orig_addr.ipv6.port;
+            memcpy(out + out_pos, &addr_ipv6, sizeof(addr_ipv6));
+            out_pos += sizeof(addr_ipv6);
+        } break;
+    }
+    
+    return out_pos;
+}
+
+int get_local_num_ports (struct worker *w, int addr_type)
 {
     switch (addr_type) {
-        case BADDR_TYPE_IPV4: return options.local_udp_num_ports;
-        case BADDR_TYPE_IPV6: return options.local_udp_ip6_num_ports;
+        case BADDR_TYPE_IPV4: return w->local_udp_num_ports;
+        case BADDR_TYPE_IPV6: return w->local_udp_ip6_num_ports;
         default: ASSERT(0); return 0;
     }
 }
 
-BAddr get_local_addr (int addr_type)
+BAddr get_local_addr (struct worker *w, int addr_type)
 {
-    ASSERT(get_local_num_ports(addr_type) >= 0)
+    ASSERT(get_local_num_ports(w, addr_type) >= 0)
     
+    // get the first local address of the worker's share
+    BAddr addr;
+    int port_start;
     switch (addr_type) {
-        case BADDR_TYPE_IPV4: return local_udp_addr;
-        case BADDR_TYPE_IPV6: return local_udp_ip6_addr;
+        case BADDR_TYPE_IPV4: addr = local_udp_addr; port_start = w->local_udp_port_start; break;
+        case BADDR_TYPE_IPV6: addr = local_udp_ip6_addr; port_start = w->local_udp_ip6_port_start; break;
         default: ASSERT(0); return BAddr_MakeNone();
     }
+    
+    BAddr_SetPort(&addr, hton16(ntoh16(BAddr_GetPort(&addr)) + (uint16_t)port_start));
+    return addr;
+}
+
+BAddr port_group_key (BAddr remote_addr)
+{
+    // with unique local ports, all remote ports of an IP address share a group
+    if (options.unique_local_ports) {
+        BAddr_SetPort(&remote_addr, 0);
+    }
+    
+    return remote_addr;
 }
 
-uint8_t * build_port_usage_array_and_find_least_used_connection (BAddr remote_addr, struct connection **out_con)
+struct port_group * port_group_get (struct worker *w, BAddr remote_addr)
 {
     ASSERT(remote_addr.type == BADDR_TYPE_IPV4 || remote_addr.type == BADDR_TYPE_IPV6)
-    ASSERT(get_local_num_ports(remote_addr.type) >= 0)
+    ASSERT(get_local_num_ports(w, remote_addr.type) >= 0)
+    
+    BAddr key = port_group_key(remote_addr);
     
-    int local_num_ports = get_local_num_ports(remote_addr.type);
+    // look for an existing group
+    BAVLNode *tree_node = BAVL_LookupExact(&w->port_groups_tree, &key);
+    if (tree_node) {
+        return UPPER_OBJECT(tree_node, struct port_group, tree_node);
+    }
+    
+    int num_ports = get_local_num_ports(w, remote_addr.type);
     
-    // allocate port usage array
-    uint8_t *port_usage = (uint8_t *)BAllocSize(bsize_fromint(local_num_ports));
-    if (!port_usage) {
+    // allocate structure along with the port usage array
+    bsize_t size = bsize_add(bsize_fromsize(sizeof(struct port_group)), bsize_fromint(num_ports));
+    struct port_group *group = (struct port_group *)BAllocSize(size);
+    if (!group) {
         return NULL;
     }
     
-    // zero array
-    memset(port_usage, 0, local_num_ports);
+    // init group
+    group->key = key;
+    group->num_ports = num_ports;
+    group->first_free = 0;
+    LinkedList1_Init(&group->connections_list);
+    memset(group->port_used, 0, num_ports);
+    
+    // insert to port groups tree
+    ASSERT_EXECUTE(BAVL_Insert(&w->port_groups_tree, &group->tree_node, NULL))
+    
+    return group;
+}
+
+void port_group_maybe_free (struct worker *w, struct port_group *group)
+{
+    if (!LinkedList1_IsEmpty(&group->connections_list)) {
+        return;
+    }
+    
+    // remove from port groups tree
+    BAVL_Remove(&w->port_groups_tree, &group->tree_node);
     
-    struct connection *least_con = NULL;
+    // free structure
+    BFree(group);
+}
+
+void port_group_add (struct port_group *group, struct connection *con, int port_index)
+{
+    ASSERT(port_index >= 0)
+    ASSERT(port_index < group->num_ports)
+    ASSERT(!group->port_used[port_index])
+    
+    // mark port used
+    group->port_used[port_index] = 1;
+    while (group->first_free < group->num_ports && group->port_used[group->first_free]) {
+        group->first_free++;
+    }
     
-    // flag inappropriate ports (those with the same remote address)
-    for (LinkedList1Node *ln = LinkedList1_GetFirst(&clients_list); ln; ln = LinkedList1Node_Next(ln)) {
-        struct client *client = UPPER_OBJECT(ln, struct client, clients_list_node);
+    // add connection as most recently used
+    con->local_port_index = port_index;
+    con->port_group = group;
+    LinkedList1_Append(&group->connections_list, &con->port_group_list_node);
+}
+
+void port_group_remove (struct connection *con)
+{
+    struct port_group *group = con->port_group;
+    ASSERT(group)
+    ASSERT(group->port_used[con->local_port_index])
+    
+    // mark port free
+    group->port_used[con->local_port_index] = 0;
+    if (con->local_port_index < group->first_free) {
+        group->first_free = con->local_port_index;
+    }
+    
+    // remove connection
+    LinkedList1_Remove(&group->connections_list, &con->port_group_list_node);
+    con->port_group = NULL;
+    
+    port_group_maybe_free(con->client->worker, group);
+}
+
+void port_group_touch (struct connection *con)
+{
+    struct port_group *group = con->port_group;
+    
+    // move connection to the most recently used end
+    if (group) {
+        LinkedList1_Remove(&group->connections_list, &con->port_group_list_node);
+        LinkedList1_Append(&group->connections_list, &con->port_group_list_node);
+    }
+}
+
+struct connection * port_group_find_idle (struct port_group *group)
+{
+    // find the least recently used connection with nothing to send to its client
+    for (LinkedList1Node *ln = LinkedList1_GetFirst(&group->connections_list); ln; ln = LinkedList1Node_Next(ln)) {
+        struct connection *con = UPPER_OBJECT(ln, struct connection, port_group_list_node);
+        ASSERT(con->port_group == group)
+        ASSERT(!con->closing)
         
-        for (LinkedList1Node *ln2 = LinkedList1_GetFirst(&client->connections_list); ln2; ln2 = LinkedList1Node_Next(ln2)) {
-            struct connection *con = UPPER_OBJECT(ln2, struct connection, connections_list_node);
-            ASSERT(con->client == client)
-            ASSERT(!con->closing)
-            
-            if (con->addr.type != remote_addr.type || con->local_port_index < 0) {
-                continue;
-            }
-            ASSERT(con->local_port_index < local_num_ports)
-            
-            if (options.unique_local_ports) {
-                BIPAddr ip1;
-                BIPAddr ip2;
-                BAddr_GetIPAddr(&con->addr, &ip1);
-                BAddr_GetIPAddr(&remote_addr, &ip2);
-                if (!BIPAddr_Compare(&ip1, &ip2)) {
-                    continue;
-                }
-            } else {
-                if (!BAddr_Compare(&con->addr, &remote_addr)) {
-                    continue;
-                }
-            }
-            
-            port_usage[con->local_port_index] = 1;
-            
-            if (!PacketPassFairQueueFlow_IsBusy(&con->send_qflow)) {
-                if (!least_con || con->last_use_time < least_con->last_use_time) {
-                    least_con = con;
-                }
-            }
+        if (!PacketPassFairQueueFlow_IsBusy(&con->send_qflow)) {
+            return con;
         }
     }
     
-    *out_con = least_con;
-    return port_usage;
+    return NULL;
 }
 
-void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr orig_addr, const uint8_t *data, int data_len)
+void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr orig_addr, int dns, const uint8_t *data, int data_len)
 {
     ASSERT(client->num_connections < options.max_connections_for_client)
     ASSERT(!find_connection(client, conid))
@@ -993,6 +1457,8 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
     ASSERT(data_len >= 0)
     ASSERT(data_len <= options.udp_mtu)
     
+    struct worker *w = client->worker;
+    
     // allocate structure
     struct connection *con = (struct connection *)malloc(sizeof(*con));
     if (!con) {
@@ -1005,9 +1471,24 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
     con->conid = conid;
     con->addr = addr;
     con->orig_addr = orig_addr;
+    con->dns = dns;
+    con->dns_pending = 0;
+    con->dns_queries = NULL;
     con->first_data = data;
     con->first_data_len = data_len;
     
+    // allocate unanswered DNS queries, to match responses with them before caching
+    if (dns && options.dns_cache_size > 0) {
+        if (!(con->dns_queries = (struct dns_query *)BAllocArray(CONNECTION_DNS_MAX_QUERIES, sizeof(con->dns_queries[0])))) {
+            client_log(client, BLOG_ERROR, "BAllocArray failed");
+            goto fail0a;
+        }
+        for (int i = 0; i < CONNECTION_DNS_MAX_QUERIES; i++) {
+            con->dns_queries[i].key_len = 0;
+        }
+        con->dns_queries_next = 0;
+    }
+    
     // set last use time
     con->last_use_time = btime_gettime();
     
@@ -1015,35 +1496,35 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
     con->closing = 0;
     
     // init first job
-    BPending_Init(&con->first_job, BReactor_PendingGroup(&ss), (BPending_handler)connection_first_job_handler, con);
+    BPending_Init(&con->first_job, BReactor_PendingGroup(&w->reactor), (BPending_handler)connection_first_job_handler, con);
     BPending_Set(&con->first_job);
     
     // init send queue flow
     PacketPassFairQueueFlow_Init(&con->send_qflow, &client->send_queue);
     
     // init send PacketProtoFlow
-    if (!PacketProtoFlow_Init(&con->send_ppflow, udpgw_mtu, CONNECTION_CLIENT_BUFFER_SIZE, PacketPassFairQueueFlow_GetInput(&con->send_qflow), BReactor_PendingGroup(&ss))) {
+    if (!PacketProtoFlow_Init(&con->send_ppflow, udpgw_mtu, CONNECTION_CLIENT_BUFFER_SIZE, PacketPassFairQueueFlow_GetInput(&con->send_qflow), BReactor_PendingGroup(&w->reactor))) {
         client_log(client, BLOG_ERROR, "PacketProtoFlow_Init failed");
         goto fail1;
     }
     con->send_if = PacketProtoFlow_GetInput(&con->send_ppflow);
     
     // init UDP dgram
-    if (!BDatagram_Init(&con->udp_dgram, addr.type, &ss, con, (BDatagram_handler)connection_dgram_handler_event)) {
+    if (!BDatagram_Init(&con->udp_dgram, addr.type, &w->reactor, con, (BDatagram_handler)connection_dgram_handler_event)) {
         client_log(client, BLOG_ERROR, "BDatagram_Init failed");
         goto fail2;
     }
     
     con->local_port_index = -1;
+    con->port_group = NULL;
     
-    int local_num_ports = get_local_num_ports(addr.type);
+    int local_num_ports = get_local_num_ports(w, addr.type);
     
     if (local_num_ports >= 0) {
-        // build port usage array, find least used connection
-        struct connection *least_con;
-        uint8_t *port_usage = build_port_usage_array_and_find_least_used_connection(addr, &least_con);
-        if (!port_usage) {
-            client_log(client, BLOG_ERROR, "build_port_usage_array failed");
+        // get group of connections with the same remote addr
+        struct port_group *group = port_group_get(w, addr);
+        if (!group) {
+            client_log(client, BLOG_ERROR, "port_group_get failed");
             goto failed;
         }
         
@@ -1054,12 +1535,12 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
         }
         
         // get starting local address
-        BAddr local_addr = get_local_addr(addr.type);
+        BAddr local_addr = get_local_addr(w, addr.type);
         
         // try different ports
-        for (int i = 0; i < local_num_ports; i++) {
+        for (int i = group->first_free; i < local_num_ports; i++) {
             // skip inappropriate ports
-            if (port_usage[i]) {
+            if (group->port_used[i]) {
                 continue;
             }
             
@@ -1067,12 +1548,13 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
             BAddr_SetPort(&bind_addr, hton16(ntoh16(BAddr_GetPort(&bind_addr)) + (uint16_t)i));
             if (BDatagram_Bind(&con->udp_dgram, bind_addr)) {
                 // remember which port we're using
-                con->local_port_index = i;
+                port_group_add(group, con, i);
                 goto cont;
             }
         }
         
         // try closing an unused connection with the same remote addr
+        struct connection *least_con = port_group_find_idle(group);
         if (!least_con) {
             goto failed;
         }
@@ -1086,22 +1568,29 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
         
         BLog(BLOG_INFO, "closing connection for its remote address");
         
-        // close the offending connection
+        // close the offending connection; this frees the group
+        // if it was the last connection in it
         connection_close(least_con);
+        if (!(group = port_group_get(w, addr))) {
+            client_log(client, BLOG_ERROR, "port_group_get failed");
+            goto failed;
+        }
         
         // try binding to its port
         BAddr bind_addr = local_addr;
         BAddr_SetPort(&bind_addr, hton16(ntoh16(BAddr_GetPort(&bind_addr)) + (uint16_t)i));
         if (BDatagram_Bind(&con->udp_dgram, bind_addr)) {
             // remember which port we're using
-            con->local_port_index = i;
+            port_group_add(group, con, i);
             goto cont;
         }
         
     failed:
         client_log(client, BLOG_WARNING, "failed to bind to any local address; proceeding regardless");
+        if (group) {
+            port_group_maybe_free(w, group);
+        }
     cont:;
-        BFree(port_usage);
     }
     
     // set UDP dgram send address
@@ -1110,23 +1599,26 @@ void connection_init (struct client *client, uint16_t conid, BAddr addr, BAddr o
     BDatagram_SetSendAddrs(&con->udp_dgram, addr, ipaddr);
     
     // init UDP dgram interfaces
-    BDatagram_SendAsync_Init(&con->udp_dgram, options.udp_mtu);
-    BDatagram_RecvAsync_Init(&con->udp_dgram, options.udp_mtu);
+    if (!BDatagram_SendAsync_InitBatch(&con->udp_dgram, options.udp_mtu, CONNECTION_UDP_SEND_BATCH_SIZE, CONNECTION_UDP_SEND_BATCH_PACKETS)) {
+        client_log(client, BLOG_ERROR, "BDatagram_SendAsync_InitBatch failed");
+        goto fail3;
+    }
+    BDatagram_RecvAsync_InitBatch(&con->udp_dgram, options.udp_mtu, CONNECTION_UDP_RECV_BATCH_SIZE, CONNECTION_UDP_RECV_BATCH_PACKETS);
     
     // init UDP writer
-    BufferWriter_Init(&con->udp_send_writer, options.udp_mtu, BReactor_PendingGroup(&ss));
+    BufferWriter_Init(&con->udp_send_writer, options.udp_mtu, BReactor_PendingGroup(&w->reactor));
     
     // init UDP buffer
-    if (!PacketBuffer_Init(&con->udp_send_buffer, BufferWriter_GetOutput(&con->udp_send_writer), BDatagram_SendAsync_GetIf(&con->udp_dgram), CONNECTION_UDP_BUFFER_SIZE, BReactor_PendingGroup(&ss))) {
+    if (!PacketBuffer_Init(&con->udp_send_buffer, BufferWriter_GetOutput(&con->udp_send_writer), BDatagram_SendAsync_GetIf(&con->udp_dgram), CONNECTION_UDP_BUFFER_SIZE, BReactor_PendingGroup(&w->reactor))) {
         client_log(client, BLOG_ERROR, "PacketBuffer_Init failed");
         goto fail4;
     }
     
     // init UDP recv interface
-    PacketPassInterface_Init(&con->udp_recv_if, options.udp_mtu, (PacketPassInterface_handler_send)connection_udp_recv_if_handler_send, con, BReactor_PendingGroup(&ss));
+    PacketPassInterface_Init(&con->udp_recv_if, options.udp_mtu, (PacketPassInterface_handler_send)connection_udp_recv_if_handler_send, con, BReactor_PendingGroup(&w->reactor));
     
     // init UDP recv buffer
-    if (!SinglePacketBuffer_Init(&con->udp_recv_buffer, BDatagram_RecvAsync_GetIf(&con->udp_dgram), &con->udp_recv_if, BReactor_PendingGroup(&ss))) {
+    if (!SinglePacketBuffer_Init(&con->udp_recv_buffer, BDatagram_RecvAsync_GetIf(&con->udp_dgram), &con->udp_recv_if, BReactor_PendingGroup(&w->reactor))) {
         client_log(client, BLOG_ERROR, "SinglePacketBuffer_Init failed");
         goto fail5;
     }
@@ -1151,12 +1643,20 @@ fail4:
     BufferWriter_Free(&con->udp_send_writer);
     BDatagram_RecvAsync_Free(&con->udp_dgram);
     BDatagram_SendAsync_Free(&con->udp_dgram);
+fail3:
+    if (con->port_group) {
+        port_group_remove(con);
+    }
     BDatagram_Free(&con->udp_dgram);
 fail2:
     PacketProtoFlow_Free(&con->send_ppflow);
 fail1:
     PacketPassFairQueueFlow_Free(&con->send_qflow);
     BPending_Free(&con->first_job);
+    if (con->dns_queries) {
+        BFree(con->dns_queries);
+    }
+fail0a:
     free(con);
 fail0:
     return;
@@ -1218,6 +1718,16 @@ void connection_log (struct connection *con, int level, const char *fmt, ...)
 
 void connection_free_udp (struct connection *con)
 {
+    // forget unanswered DNS query
+    if (con->dns_pending) {
+        connection_dns_pending_remove(con);
+    }
+    
+    // free unanswered DNS queries
+    if (con->dns_queries) {
+        BFree(con->dns_queries);
+    }
+    
     // free UDP receive buffer
     SinglePacketBuffer_Free(&con->udp_recv_buffer);
     
@@ -1234,6 +1744,11 @@ void connection_free_udp (struct connection *con)
     BDatagram_RecvAsync_Free(&con->udp_dgram);
     BDatagram_SendAsync_Free(&con->udp_dgram);
     
+    // release local port
+    if (con->port_group) {
+        port_group_remove(con);
+    }
+    
     // free UDP dgram
     BDatagram_Free(&con->udp_dgram);
 }
@@ -1263,36 +1778,9 @@ void connection_send_to_client (struct connection *con, uint8_t flags, const uin
         connection_log(con, BLOG_ERROR, "out of client buffer");
         return;
     }
-    int out_pos = 0;
     
-    if (con->orig_addr.type == BADDR_TYPE_IPV6) {
-        flags |= UDPGW_CLIENT_FLAG_IPV6;
-    }
-    
-    // write header
-    struct udpgw_header header;
-    header.flags = htol8(flags);
-    header.conid = htol16(con->conid);
-    memcpy(out + out_pos, &header, sizeof(header));
-    out_pos += sizeof(header);
-    
-    // write address
-    switch (con->orig_addr.type) {
-        case BADDR_TYPE_IPV4: {
-            struct udpgw_addr_ipv4 addr_ipv4;
-            addr_ipv4.addr_ip = con->orig_addr.ipv4.ip;
-            addr_ipv4.addr_port = con->orig_addr.ipv4.port;
-            memcpy(out + out_pos, &addr_ipv4, sizeof(addr_ipv4));
-            out_pos += sizeof(addr_ipv4);
-        } break;
-        case BADDR_TYPE_IPV6: {
-            struct udpgw_addr_ipv6 addr_ipv6;
-            memcpy(addr_ipv6.addr_ip, con->orig_addr.ipv6.ip, sizeof(addr_ipv6.addr_ip));
-            addr_ipv6.addr_port = con->orig_addr.ipv6.port;
-            memcpy(out + out_pos, &addr_ipv6, sizeof(addr_ipv6));
-            out_pos += sizeof(addr_ipv6);
-        } break;
-    }
+    // write header and address
+    int out_pos = write_client_header(out, flags, con->conid, con->orig_addr);
     
     // write message
     memcpy(out + out_pos, data, data_len);
@@ -1318,6 +1806,7 @@ int connection_send_to_udp (struct connection *con, const uint8_t *data, int dat
     // move connection to front
     LinkedList1_Remove(&client->connections_list, &con->connections_list_node);
     LinkedList1_Append(&client->connections_list, &con->connections_list_node);
+    port_group_touch(con);
     
     // get buffer location
     uint8_t *out;
@@ -1332,6 +1821,12 @@ int connection_send_to_udp (struct connection *con, const uint8_t *data, int dat
     // submit written message
     BufferWriter_EndPacket(&con->udp_send_writer, data_len);
     
+    // wait for the DNS server to answer
+    if (con->dns) {
+        connection_dns_query_sent(con);
+        connection_dns_add_query(con, data, data_len);
+    }
+    
     return 1;
 }
 
@@ -1390,6 +1885,11 @@ void connection_dgram_handler_event (struct connection *con, int event)
     
     connection_log(con, BLOG_INFO, "UDP error");
     
+    // the DNS server rejected the query
+    if (con->dns_pending) {
+        DnsServers_ReportFailure(&con->client->worker->dns_servers, con->addr, CONNECTION_DNS_TIMEOUT);
+    }
+    
     // close connection
     connection_close(con);
 }
@@ -1403,16 +1903,34 @@ void connection_udp_recv_if_handler_send (struct connection *con, uint8_t *data,
     
     connection_log(con, BLOG_DEBUG, "from UDP %d bytes", data_len);
     
+    // the socket isn't connected; DNS responses must come from the server queried
+    if (con->dns && !connection_dns_from_server(con)) {
+        connection_log(con, BLOG_WARNING, "dropping DNS response not from the server");
+        PacketPassInterface_Done(&con->udp_recv_if);
+        return;
+    }
+    
     // set last use time
     con->last_use_time = btime_gettime();
     
     // move connection to front
     LinkedList1_Remove(&client->connections_list, &con->connections_list_node);
     LinkedList1_Append(&client->connections_list, &con->connections_list_node);
+    port_group_touch(con);
     
     // accept packet
     PacketPassInterface_Done(&con->udp_recv_if);
     
+    if (con->dns) {
+        // measure the DNS server's response time
+        connection_dns_answer_received(con);
+        
+        // remember DNS response, if it answers a query sent to the server
+        if (connection_dns_take_query(con, data, data_len)) {
+            DnsCache_Insert(&client->worker->dns_cache, data, data_len);
+        }
+    }
+    
     // send packet to client
     connection_send_to_client(con, 0, data, data_len);
 }
@@ -1435,39 +1953,148 @@ int uint16_comparator (void *unused, uint16_t *v1, uint16_t *v2)
     return B_COMPARE(*v1, *v2);
 }
 
-void maybe_update_dns (void)
+int addr_comparator (void *unused, BAddr *v1, BAddr *v2)
 {
-#ifndef BADVPN_USE_WINAPI
-    btime_t now = btime_gettime();
-    if (now < btime_add(last_dns_update_time, DNS_UPDATE_TIME)) {
+    return BAddr_CompareOrder(v1, v2);
+}
+
+
+void connection_dns_query_sent (struct connection *con)
+{
+    ASSERT(!con->closing)
+    ASSERT(con->dns)
+    
+    struct worker *w = con->client->worker;
+    
+    // only the oldest unanswered query is timed
+    if (con->dns_pending) {
         return;
     }
-    last_dns_update_time = now;
-    BLog(BLOG_DEBUG, "update dns");
     
-    if (res_init() != 0) {
-        BLog(BLOG_ERROR, "res_init failed");
-        goto fail;
+    con->dns_pending = 1;
+    con->dns_query_time = btime_gettime();
+    
+    // queries are sent in time order, so the list stays sorted; the timer
+    // is running whenever the list is not empty
+    if (LinkedList1_IsEmpty(&w->dns_pending_list)) {
+        BReactor_SetTimerAbsolute(&w->reactor, &w->dns_timeout_timer, btime_add(con->dns_query_time, CONNECTION_DNS_TIMEOUT));
     }
+    LinkedList1_Append(&w->dns_pending_list, &con->dns_pending_list_node);
+}
+
+void connection_dns_answer_received (struct connection *con)
+{
+    ASSERT(!con->closing)
+    ASSERT(con->dns)
     
-    if (_res.nscount == 0) {
-        BLog(BLOG_ERROR, "no name servers available");
-        goto fail;
+    if (!con->dns_pending) {
+        return;
     }
     
-    BAddr addr;
-    BAddr_InitIPv4(&addr, _res.nsaddr_list[0].sin_addr.s_addr, hton16(53));
+    // report response time
+    btime_t rtt = btime_gettime() - con->dns_query_time;
+    DnsServers_ReportAnswer(&con->client->worker->dns_servers, con->addr, (rtt < 0) ? 0 : rtt);
     
-    if (!BAddr_Compare(&addr, &dns_addr)) {
-        char str[BADDR_MAX_PRINT_LEN];
-        BAddr_Print(&addr, str);
-        BLog(BLOG_INFO, "using DNS server %s", str);
+    connection_dns_pending_remove(con);
+}
+
+void connection_dns_pending_remove (struct connection *con)
+{
+    ASSERT(con->dns_pending)
+    
+    LinkedList1_Remove(&con->client->worker->dns_pending_list, &con->dns_pending_list_node);
+    con->dns_pending = 0;
+}
+
+void connection_dns_add_query (struct connection *con, const uint8_t *data, int data_len)
+{
+    ASSERT(!con->closing)
+    ASSERT(con->dns)
+    ASSERT(data_len >= 0)
+    
+    if (!con->dns_queries) {
+        return;
     }
     
-    dns_addr = addr;
-    return;
+    // replace the oldest query
+    struct dns_query *q = &con->dns_queries[con->dns_queries_next];
+    int question_end;
+    if (!dns_parse_question(data, data_len, q->key, &q->key_len, &question_end)) {
+        q->key_len = 0;
+        return;
+    }
+    memcpy(&q->id, data + offsetof(struct dns_header, id), sizeof(q->id));
     
-fail:
-    BAddr_InitNone(&dns_addr);
-#endif
+    con->dns_queries_next = (con->dns_queries_next + 1) % CONNECTION_DNS_MAX_QUERIES;
+}
+
+int connection_dns_take_query (struct connection *con, const uint8_t *data, int data_len)
+{
+    ASSERT(!con->closing)
+    ASSERT(con->dns)
+    ASSERT(data_len >= 0)
+    
+    if (!con->dns_queries) {
+        return 0;
+    }
+    
+    uint8_t key[DNS_QUESTION_KEY_MAX_LEN];
+    int key_len;
+    int question_end;
+    if (!dns_parse_question(data, data_len, key, &key_len, &question_end)) {
+        return 0;
+    }
+    uint16_t id;
+    memcpy(&id, data + offsetof(struct dns_header, id), sizeof(id));
+    
+    // find the query with the same ID and question, and forget it
+    for (int i = 0; i < CONNECTION_DNS_MAX_QUERIES; i++) {
+        struct dns_query *q = &con->dns_queries[i];
+        if (q->key_len == key_len && q->id == id && !memcmp(q->key, key, key_len)) {
+            q->key_len = 0;
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+int connection_dns_from_server (struct connection *con)
+{
+    ASSERT(!con->closing)
+    ASSERT(con->dns)
+    
+    BAddr remote_addr;
+    BIPAddr local_addr;
+    if (!BDatagram_GetLastReceiveAddrs(&con->udp_dgram, &remote_addr, &local_addr)) {
+        return 0;
+    }
+    
+    return BAddr_Compare(&remote_addr, &con->addr);
+}
+
+void worker_dns_timeout_timer_handler (struct worker *w)
+{
+    btime_t now = btime_gettime();
+    
+    // report queries which weren't answered in time
+    LinkedList1Node *node;
+    while (node = LinkedList1_GetFirst(&w->dns_pending_list)) {
+        struct connection *con = UPPER_OBJECT(node, struct connection, dns_pending_list_node);
+        ASSERT(!con->closing)
+        ASSERT(con->dns_pending)
+        
+        btime_t expire_time = btime_add(con->dns_query_time, CONNECTION_DNS_TIMEOUT);
+        if (expire_time > now) {
+            // wait for the next query to expire
+            BReactor_SetTimerAbsolute(&w->reactor, &w->dns_timeout_timer, expire_time);
+            return;
+        }
+        
+        connection_log(con, BLOG_INFO, "DNS server did not answer");
+        
+        DnsServers_ReportFailure(&w->dns_servers, con->addr, CONNECTION_DNS_TIMEOUT);
+        
+        connection_dns_pending_remove(con);
+    }
 }
@@ -39,6 +39,14 @@
 // connection buffer size for sending to UDP, in packets
 #define CONNECTION_UDP_BUFFER_SIZE 1
 
+// batch buffer for sending to UDP, in bytes and packets
+#define CONNECTION_UDP_SEND_BATCH_SIZE 16384
+#define CONNECTION_UDP_SEND_BATCH_PACKETS 16
+
+// batch buffer for receiving from UDP, in bytes and packets
+#define CONNECTION_UDP_RECV_BATCH_SIZE 131072
+#define CONNECTION_UDP_RECV_BATCH_PACKETS 16
+
 // maximum number of clients
 #define DEFAULT_MAX_CLIENTS 3
 
@@ -50,3 +58,22 @@
 
 // SO_SNDBFUF socket option for clients, 0 to not set
 #define CLIENT_DEFAULT_SOCKET_SEND_BUFFER 1048576
+
+// default DNS cache size of each worker, in bytes
+#define DEFAULT_DNS_CACHE_SIZE 1048576
+
+// client buffer size for DNS answers from the cache, in packets
+#define CLIENT_DNS_CACHE_BUFFER_SIZE 8
+
+// default resolver configuration with the upstream DNS servers
+#define DEFAULT_RESOLV_CONF "/etc/resolv.conf"
+
+// how long to wait for a DNS server to answer before counting a failure
+#define CONNECTION_DNS_TIMEOUT 2000
+
+// number of unanswered queries remembered for each DNS connection; only
+// responses matching one of them are cached
+#define CONNECTION_DNS_MAX_QUERIES 8
+
+// maximum number of worker threads
+#define MAX_THREADS 64
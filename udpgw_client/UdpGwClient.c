@@ -31,43 +31,77 @@
 
 #include <misc/offset.h>
 #include <misc/byteorder.h>
-#include <misc/compare.h>
+#include <misc/balloc.h>
+#include <misc/hashfun.h>
 #include <base/BLog.h>
 
 #include <udpgw_client/UdpGwClient.h>
 
 #include <generated/blog_channel_UdpGwClient.h>
 
-static int uint16_comparator (void *unused, uint16_t *v1, uint16_t *v2);
-static int conaddr_comparator (void *unused, struct UdpGwClient_conaddr *v1, struct UdpGwClient_conaddr *v2);
+static int addr_write_key (BAddr addr, uint8_t *out);
+static size_t conaddr_hash (struct UdpGwClient_conaddr *conaddr);
+static int conaddr_equal (struct UdpGwClient_conaddr *v1, struct UdpGwClient_conaddr *v2);
 static void free_server (UdpGwClient *o);
 static void decoder_handler_error (UdpGwClient *o);
 static void recv_interface_handler_send (UdpGwClient *o, uint8_t *data, int data_len);
+static void recv_interface_handler_send_batch (UdpGwClient *o, struct PacketPassInterface_packet *packets, int num_packets);
+static void process_received_packet (UdpGwClient *o, uint8_t *data, int data_len);
 static void send_monitor_handler (UdpGwClient *o);
 static void keepalive_if_handler_done (UdpGwClient *o);
 static struct UdpGwClient_connection * find_connection_by_conaddr (UdpGwClient *o, struct UdpGwClient_conaddr conaddr);
 static struct UdpGwClient_connection * find_connection_by_conid (UdpGwClient *o, uint16_t conid);
-static uint16_t find_unused_conid (UdpGwClient *o);
+static uint16_t alloc_conid (UdpGwClient *o);
+static void release_conid (UdpGwClient *o, uint16_t conid);
 static void connection_init (UdpGwClient *o, struct UdpGwClient_conaddr conaddr, uint8_t flags, const uint8_t *data, int data_len);
 static void connection_free (struct UdpGwClient_connection *con);
 static void connection_first_job_handler (struct UdpGwClient_connection *con);
 static void connection_send (struct UdpGwClient_connection *con, uint8_t flags, const uint8_t *data, int data_len);
 static struct UdpGwClient_connection * reuse_connection (UdpGwClient *o, struct UdpGwClient_conaddr conaddr);
 
-static int uint16_comparator (void *unused, uint16_t *v1, uint16_t *v2)
+static int addr_write_key (BAddr addr, uint8_t *out)
 {
-    return B_COMPARE(*v1, *v2);
+    int len = 0;
+    
+    out[len++] = addr.type;
+    
+    switch (addr.type) {
+        case BADDR_TYPE_IPV4: {
+            memcpy(out + len, &addr.ipv4.ip, sizeof(addr.ipv4.ip));
+            len += sizeof(addr.ipv4.ip);
+            memcpy(out + len, &addr.ipv4.port, sizeof(addr.ipv4.port));
+            len += sizeof(addr.ipv4.port);
+        } break;
+        case BADDR_TYPE_IPV6: {
+            memcpy(out + len, addr.ipv6.ip, sizeof(addr.ipv6.ip));
+            len += sizeof(addr.ipv6.ip);
+            memcpy(out + len, &addr.ipv6.port, sizeof(addr.ipv6.port));
+            len += sizeof(addr.ipv6.port);
+        } break;
+    }
+    
+    return len;
 }
 
-static int conaddr_comparator (void *unused, struct UdpGwClient_conaddr *v1, struct UdpGwClient_conaddr *v2)
+static size_t conaddr_hash (struct UdpGwClient_conaddr *conaddr)
 {
-    int r = BAddr_CompareOrder(&v1->remote_addr, &v2->remote_addr);
-    if (r) {
-        return r;
-    }
-    return BAddr_CompareOrder(&v1->local_addr, &v2->local_addr);
+    uint8_t key[2 * (1 + 16 + 2)];
+    int len = 0;
+    
+    len += addr_write_key(conaddr->local_addr, key + len);
+    len += addr_write_key(conaddr->remote_addr, key + len);
+    
+    return badvpn_djb2_hash_bin(key, len);
+}
+
+static int conaddr_equal (struct UdpGwClient_conaddr *v1, struct UdpGwClient_conaddr *v2)
+{
+    return (BAddr_Compare(&v1->remote_addr, &v2->remote_addr) && BAddr_Compare(&v1->local_addr, &v2->local_addr));
 }
 
+#include "UdpGwClient_hash.h"
+#include <structure/CHash_impl.h>
+
 static void free_server (UdpGwClient *o)
 {
     // disconnect send connector
@@ -99,12 +133,31 @@ static void recv_interface_handler_send (UdpGwClient *o, uint8_t *data, int data
 {
     DebugObject_Access(&o->d_obj);
     ASSERT(o->have_server)
-    ASSERT(data_len >= 0)
-    ASSERT(data_len <= o->udpgw_mtu)
     
     // accept packet
     PacketPassInterface_Done(&o->recv_if);
     
+    process_received_packet(o, data, data_len);
+}
+
+static void recv_interface_handler_send_batch (UdpGwClient *o, struct PacketPassInterface_packet *packets, int num_packets)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(o->have_server)
+    
+    // accept packets; their data stays valid until we return
+    PacketPassInterface_Done(&o->recv_if);
+    
+    for (int i = 0; i < num_packets; i++) {
+        process_received_packet(o, packets[i].data, packets[i].len);
+    }
+}
+
+static void process_received_packet (UdpGwClient *o, uint8_t *data, int data_len)
+{
+    ASSERT(data_len >= 0)
+    ASSERT(data_len <= o->udpgw_mtu)
+    
     // check header
     if (data_len < sizeof(struct udpgw_header)) {
         BLog(BLOG_ERROR, "missing header");
@@ -197,39 +250,42 @@ static void keepalive_if_handler_done (UdpGwClient *o)
 
 static struct UdpGwClient_connection * find_connection_by_conaddr (UdpGwClient *o, struct UdpGwClient_conaddr conaddr)
 {
-    BAVLNode *tree_node = BAVL_LookupExact(&o->connections_tree_by_conaddr, &conaddr);
-    if (!tree_node) {
-        return NULL;
-    }
+    UdpGwClient__HashRef ref = UdpGwClient__Hash_Lookup(&o->connections_hash_by_conaddr, 0, &conaddr);
     
-    return UPPER_OBJECT(tree_node, struct UdpGwClient_connection, connections_tree_by_conaddr_node);
+    return ref.ptr;
 }
 
 static struct UdpGwClient_connection * find_connection_by_conid (UdpGwClient *o, uint16_t conid)
 {
-    BAVLNode *tree_node = BAVL_LookupExact(&o->connections_tree_by_conid, &conid);
-    if (!tree_node) {
+    if (conid >= o->max_connections) {
         return NULL;
     }
     
-    return UPPER_OBJECT(tree_node, struct UdpGwClient_connection, connections_tree_by_conid_node);
+    return o->connections_by_conid[conid];
 }
 
-static uint16_t find_unused_conid (UdpGwClient *o)
+static uint16_t alloc_conid (UdpGwClient *o)
 {
     ASSERT(o->num_connections < o->max_connections)
     
-    while (1) {
-        if (!find_connection_by_conid(o, o->next_conid)) {
-            return o->next_conid;
-        }
-        
-        if (o->next_conid == o->max_connections - 1) {
-            o->next_conid = 0;
-        } else {
-            o->next_conid++;
-        }
-    }
+    // take the conid which has been free the longest, so that late packets
+    // for a closed connection are unlikely to reach a new one
+    uint16_t conid = o->free_conids[o->free_conids_start];
+    o->free_conids_start = (o->free_conids_start + 1) % o->max_connections;
+    ASSERT(!o->connections_by_conid[conid])
+    
+    return conid;
+}
+
+static void release_conid (UdpGwClient *o, uint16_t conid)
+{
+    ASSERT(o->num_connections < o->max_connections)
+    ASSERT(!o->connections_by_conid[conid])
+    
+    // append to the end of the free queue; the number of free conids
+    // before this one is max_connections - num_connections - 1
+    int num_free = o->max_connections - o->num_connections - 1;
+    o->free_conids[(o->free_conids_start + num_free) % o->max_connections] = conid;
 }
 
 static void connection_init (UdpGwClient *o, struct UdpGwClient_conaddr conaddr, uint8_t flags, const uint8_t *data, int data_len)
@@ -250,11 +306,20 @@ static void connection_init (UdpGwClient *o, struct UdpGwClient_conaddr conaddr,
     con->client = o;
     con->conaddr = conaddr;
     con->first_flags = flags;
-    con->first_data = data;
     con->first_data_len = data_len;
     
+    // copy the first packet, the caller's buffer may be reused before it is sent
+    if (!(con->first_data = (uint8_t *)BAlloc(data_len))) {
+        BLog(BLOG_ERROR, "BAlloc failed");
+        goto fail1;
+    }
+    memcpy(con->first_data, data, data_len);
+    
     // allocate conid
-    con->conid = find_unused_conid(o);
+    con->conid = alloc_conid(o);
+    
+    // set used in this server session
+    con->session = o->server_session;
     
     // init first job
     BPending_Init(&con->first_job, BReactor_PendingGroup(o->reactor), (BPending_handler)connection_first_job_handler, con);
@@ -266,15 +331,16 @@ static void connection_init (UdpGwClient *o, struct UdpGwClient_conaddr conaddr,
     // init PacketProtoFlow
     if (!PacketProtoFlow_Init(&con->send_ppflow, o->udpgw_mtu, o->send_buffer_size, PacketPassFairQueueFlow_GetInput(&con->send_qflow), BReactor_PendingGroup(o->reactor))) {
         BLog(BLOG_ERROR, "PacketProtoFlow_Init failed");
-        goto fail1;
+        goto fail2;
     }
     con->send_if = PacketProtoFlow_GetInput(&con->send_ppflow);
     
-    // insert to connections tree by conaddr
-    ASSERT_EXECUTE(BAVL_Insert(&o->connections_tree_by_conaddr, &con->connections_tree_by_conaddr_node, NULL))
+    // insert to connections hash by conaddr
+    UdpGwClient__HashRef ref = {con, con};
+    ASSERT_EXECUTE(UdpGwClient__Hash_Insert(&o->connections_hash_by_conaddr, 0, ref, NULL))
     
-    // insert to connections tree by conid
-    ASSERT_EXECUTE(BAVL_Insert(&o->connections_tree_by_conid, &con->connections_tree_by_conid_node, NULL))
+    // insert to connections table by conid
+    o->connections_by_conid[con->conid] = con;
     
     // insert to connections list
     LinkedList1_Append(&o->connections_list, &con->connections_list_node);
@@ -284,9 +350,12 @@ static void connection_init (UdpGwClient *o, struct UdpGwClient_conaddr conaddr,
     
     return;
     
-fail1:
+fail2:
     PacketPassFairQueueFlow_Free(&con->send_qflow);
     BPending_Free(&con->first_job);
+    release_conid(o, con->conid);
+    BFree(con->first_data);
+fail1:
     free(con);
 fail0:
     return;
@@ -303,11 +372,15 @@ static void connection_free (struct UdpGwClient_connection *con)
     // remove from connections list
     LinkedList1_Remove(&o->connections_list, &con->connections_list_node);
     
-    // remove from connections tree by conid
-    BAVL_Remove(&o->connections_tree_by_conid, &con->connections_tree_by_conid_node);
+    // remove from connections table by conid
+    o->connections_by_conid[con->conid] = NULL;
     
-    // remove from connections tree by conaddr
-    BAVL_Remove(&o->connections_tree_by_conaddr, &con->connections_tree_by_conaddr_node);
+    // release conid
+    release_conid(o, con->conid);
+    
+    // remove from connections hash by conaddr
+    UdpGwClient__HashRef ref = {con, con};
+    UdpGwClient__Hash_Remove(&o->connections_hash_by_conaddr, 0, ref);
     
     // free PacketProtoFlow
     PacketProtoFlow_Free(&con->send_ppflow);
@@ -318,6 +391,9 @@ static void connection_free (struct UdpGwClient_connection *con)
     // free first job
     BPending_Free(&con->first_job);
     
+    // free first packet if it wasn't sent
+    BFree(con->first_data);
+    
     // free structure
     free(con);
 }
@@ -325,6 +401,10 @@ static void connection_free (struct UdpGwClient_connection *con)
 static void connection_first_job_handler (struct UdpGwClient_connection *con)
 {
     connection_send(con, UDPGW_CLIENT_FLAG_REBIND|con->first_flags, con->first_data, con->first_data_len);
+    
+    // free first packet
+    BFree(con->first_data);
+    con->first_data = NULL;
 }
 
 static void connection_send (struct UdpGwClient_connection *con, uint8_t flags, const uint8_t *data, int data_len)
@@ -387,14 +467,15 @@ static struct UdpGwClient_connection * reuse_connection (UdpGwClient *o, struct
     // get least recently used connection
     struct UdpGwClient_connection *con = UPPER_OBJECT(LinkedList1_GetFirst(&o->connections_list), struct UdpGwClient_connection, connections_list_node);
     
-    // remove from connections tree by conaddr
-    BAVL_Remove(&o->connections_tree_by_conaddr, &con->connections_tree_by_conaddr_node);
+    // remove from connections hash by conaddr
+    UdpGwClient__HashRef ref = {con, con};
+    UdpGwClient__Hash_Remove(&o->connections_hash_by_conaddr, 0, ref);
     
     // set new conaddr
     con->conaddr = conaddr;
     
-    // insert to connections tree by conaddr
-    ASSERT_EXECUTE(BAVL_Insert(&o->connections_tree_by_conaddr, &con->connections_tree_by_conaddr_node, NULL))
+    // insert to connections hash by conaddr
+    ASSERT_EXECUTE(UdpGwClient__Hash_Insert(&o->connections_hash_by_conaddr, 0, ref, NULL))
     
     return con;
 }
@@ -428,11 +509,30 @@ int UdpGwClient_Init (UdpGwClient *o, int udp_mtu, int max_connections, int send
     o->udpgw_mtu = udpgw_compute_mtu(o->udp_mtu);
     o->pp_mtu = o->udpgw_mtu + sizeof(struct packetproto_header);
     
-    // init connections tree by conaddr
-    BAVL_Init(&o->connections_tree_by_conaddr, OFFSET_DIFF(struct UdpGwClient_connection, conaddr, connections_tree_by_conaddr_node), (BAVL_comparator)conaddr_comparator, NULL);
+    // init connections hash by conaddr
+    if (!UdpGwClient__Hash_Init(&o->connections_hash_by_conaddr, o->max_connections)) {
+        BLog(BLOG_ERROR, "UdpGwClient__Hash_Init failed");
+        goto fail0;
+    }
+    
+    // init connections table by conid
+    if (!(o->connections_by_conid = (struct UdpGwClient_connection **)BAllocArray(o->max_connections, sizeof(o->connections_by_conid[0])))) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
+        goto fail1;
+    }
+    for (int i = 0; i < o->max_connections; i++) {
+        o->connections_by_conid[i] = NULL;
+    }
     
-    // init connections tree by conid
-    BAVL_Init(&o->connections_tree_by_conid, OFFSET_DIFF(struct UdpGwClient_connection, conid, connections_tree_by_conid_node), (BAVL_comparator)uint16_comparator, NULL);
+    // init free conids queue with all conids
+    if (!(o->free_conids = (uint16_t *)BAllocArray(o->max_connections, sizeof(o->free_conids[0])))) {
+        BLog(BLOG_ERROR, "BAllocArray failed");
+        goto fail2;
+    }
+    for (int i = 0; i < o->max_connections; i++) {
+        o->free_conids[i] = i;
+    }
+    o->free_conids_start = 0;
     
     // init connections list
     LinkedList1_Init(&o->connections_list);
@@ -440,9 +540,6 @@ int UdpGwClient_Init (UdpGwClient *o, int udp_mtu, int max_connections, int send
     // set zero connections
     o->num_connections = 0;
     
-    // set next conid
-    o->next_conid = 0;
-    
     // init send connector
     PacketPassConnector_Init(&o->send_connector, o->pp_mtu, BReactor_PendingGroup(o->reactor));
     
@@ -451,7 +548,7 @@ int UdpGwClient_Init (UdpGwClient *o, int udp_mtu, int max_connections, int send
     
     // init send queue
     if (!PacketPassFairQueue_Init(&o->send_queue, PacketPassInactivityMonitor_GetInput(&o->send_monitor), BReactor_PendingGroup(o->reactor), 0, 1)) {
-        goto fail0;
+        goto fail3;
     }
     
     // construct keepalive packet
@@ -472,12 +569,21 @@ int UdpGwClient_Init (UdpGwClient *o, int udp_mtu, int max_connections, int send
     // set have no server
     o->have_server = 0;
     
+    // init server session
+    o->server_session = 0;
+    
     DebugObject_Init(&o->d_obj);
     return 1;
     
-fail0:
+fail3:
     PacketPassInactivityMonitor_Free(&o->send_monitor);
     PacketPassConnector_Free(&o->send_connector);
+    BFree(o->free_conids);
+fail2:
+    BFree(o->connections_by_conid);
+fail1:
+    UdpGwClient__Hash_Free(&o->connections_hash_by_conaddr);
+fail0:
     return 0;
 }
 
@@ -510,6 +616,15 @@ void UdpGwClient_Free (UdpGwClient *o)
     
     // free send connector
     PacketPassConnector_Free(&o->send_connector);
+    
+    // free free conids queue
+    BFree(o->free_conids);
+    
+    // free connections table by conid
+    BFree(o->connections_by_conid);
+    
+    // free connections hash by conaddr
+    UdpGwClient__Hash_Free(&o->connections_hash_by_conaddr);
 }
 
 void UdpGwClient_SubmitPacket (UdpGwClient *o, BAddr local_addr, BAddr remote_addr, int is_dns, const uint8_t *data, int data_len)
@@ -549,11 +664,49 @@ void UdpGwClient_SubmitPacket (UdpGwClient *o, BAddr local_addr, BAddr remote_ad
         LinkedList1_Remove(&o->connections_list, &con->connections_list_node);
         LinkedList1_Append(&o->connections_list, &con->connections_list_node);
         
+        // set used in this server session
+        con->session = o->server_session;
+        
         // send packet to existing connection
         connection_send(con, flags, data, data_len);
     }
 }
 
+size_t UdpGwClient_HashAddrs (BAddr local_addr, BAddr remote_addr)
+{
+    ASSERT(local_addr.type == BADDR_TYPE_IPV4 || local_addr.type == BADDR_TYPE_IPV6)
+    ASSERT(remote_addr.type == BADDR_TYPE_IPV4 || remote_addr.type == BADDR_TYPE_IPV6)
+    
+    // use the opposite order than for the connections hash, so that users
+    // spreading connections by this hash don't make our buckets collide
+    uint8_t key[2 * (1 + 16 + 2)];
+    int len = 0;
+    
+    len += addr_write_key(remote_addr, key + len);
+    len += addr_write_key(local_addr, key + len);
+    
+    return badvpn_djb2_hash_bin(key, len);
+}
+
+int UdpGwClient_IsCarrying (UdpGwClient *o, BAddr local_addr, BAddr remote_addr)
+{
+    DebugObject_Access(&o->d_obj);
+    ASSERT(local_addr.type == BADDR_TYPE_IPV4 || local_addr.type == BADDR_TYPE_IPV6)
+    ASSERT(remote_addr.type == BADDR_TYPE_IPV4 || remote_addr.type == BADDR_TYPE_IPV6)
+    
+    // build conaddr
+    struct UdpGwClient_conaddr conaddr;
+    conaddr.local_addr = local_addr;
+    conaddr.remote_addr = remote_addr;
+    
+    // lookup connection
+    struct UdpGwClient_connection *con = find_connection_by_conaddr(o, conaddr);
+    
+    // a connection last used before the server was disconnected is not known
+    // to the current server, so it doesn't carry the flow anymore
+    return (con && con->session == o->server_session);
+}
+
 int UdpGwClient_ConnectServer (UdpGwClient *o, StreamPassInterface *send_if, StreamRecvInterface *recv_if)
 {
     DebugObject_Access(&o->d_obj);
@@ -561,6 +714,7 @@ int UdpGwClient_ConnectServer (UdpGwClient *o, StreamPassInterface *send_if, Str
     
     // init receive interface
     PacketPassInterface_Init(&o->recv_if, o->udpgw_mtu, (PacketPassInterface_handler_send)recv_interface_handler_send, o, BReactor_PendingGroup(o->reactor));
+    PacketPassInterface_EnableBatch(&o->recv_if, (PacketPassInterface_handler_send_batch)recv_interface_handler_send_batch);
     
     // init receive decoder
     if (!PacketProtoDecoder_Init(&o->recv_decoder, recv_if, &o->recv_if, BReactor_PendingGroup(o->reactor), o, (PacketProtoDecoder_handler_error)decoder_handler_error)) {
@@ -594,4 +748,8 @@ void UdpGwClient_DisconnectServer (UdpGwClient *o)
     
     // set have no server
     o->have_server = 0;
+    
+    // start a new server session, so that existing connections are known
+    // to be stale until they are used again
+    o->server_session++;
 }
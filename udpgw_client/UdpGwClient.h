@@ -29,12 +29,13 @@
 #ifndef BADVPN_UDPGW_CLIENT_UDPGWCLIENT_H
 #define BADVPN_UDPGW_CLIENT_UDPGWCLIENT_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include <protocol/udpgw_proto.h>
 #include <misc/debug.h>
 #include <misc/packed.h>
-#include <structure/BAVL.h>
+#include <structure/CHash.h>
 #include <structure/LinkedList1.h>
 #include <base/DebugObject.h>
 #include <system/BAddr.h>
@@ -49,6 +50,15 @@
 typedef void (*UdpGwClient_handler_servererror) (void *user);
 typedef void (*UdpGwClient_handler_received) (void *user, BAddr local_addr, BAddr remote_addr, const uint8_t *data, int data_len);
 
+struct UdpGwClient_connection;
+struct UdpGwClient_conaddr;
+
+typedef struct UdpGwClient_conaddr *UdpGwClient__hashkey;
+typedef int UdpGwClient__hasharg;
+
+#include "UdpGwClient_hash.h"
+#include <structure/CHash_decl.h>
+
 B_START_PACKED
 struct UdpGwClient__keepalive_packet {
     struct packetproto_header pp;
@@ -67,11 +77,12 @@ typedef struct {
     UdpGwClient_handler_received handler_received;
     int udpgw_mtu;
     int pp_mtu;
-    BAVL connections_tree_by_conaddr;
-    BAVL connections_tree_by_conid;
+    UdpGwClient__Hash connections_hash_by_conaddr;
+    struct UdpGwClient_connection **connections_by_conid;
+    uint16_t *free_conids;
+    int free_conids_start;
     LinkedList1 connections_list;
     int num_connections;
-    int next_conid;
     PacketPassFairQueue send_queue;
     PacketPassInactivityMonitor send_monitor;
     PacketPassConnector send_connector;
@@ -80,6 +91,7 @@ typedef struct {
     PacketPassFairQueueFlow keepalive_qflow;
     int keepalive_sending;
     int have_server;
+    unsigned int server_session;
     PacketStreamSender send_sender;
     PacketProtoDecoder recv_decoder;
     PacketPassInterface recv_if;
@@ -95,15 +107,15 @@ struct UdpGwClient_connection {
     UdpGwClient *client;
     struct UdpGwClient_conaddr conaddr;
     uint8_t first_flags;
-    const uint8_t *first_data;
+    uint8_t *first_data;
     int first_data_len;
     uint16_t conid;
+    unsigned int session;
     BPending first_job;
     BufferWriter *send_if;
     PacketProtoFlow send_ppflow;
     PacketPassFairQueueFlow send_qflow;
-    BAVLNode connections_tree_by_conaddr_node;
-    BAVLNode connections_tree_by_conid_node;
+    struct UdpGwClient_connection *hash_next;
     LinkedList1Node connections_list_node;
 };
 
@@ -112,6 +124,8 @@ int UdpGwClient_Init (UdpGwClient *o, int udp_mtu, int max_connections, int send
                       UdpGwClient_handler_received handler_received) WARN_UNUSED;
 void UdpGwClient_Free (UdpGwClient *o);
 void UdpGwClient_SubmitPacket (UdpGwClient *o, BAddr local_addr, BAddr remote_addr, int is_dns, const uint8_t *data, int data_len);
+int UdpGwClient_IsCarrying (UdpGwClient *o, BAddr local_addr, BAddr remote_addr);
+size_t UdpGwClient_HashAddrs (BAddr local_addr, BAddr remote_addr);
 int UdpGwClient_ConnectServer (UdpGwClient *o, StreamPassInterface *send_if, StreamRecvInterface *recv_if) WARN_UNUSED;
 void UdpGwClient_DisconnectServer (UdpGwClient *o);
 